@@ -2,14 +2,18 @@
 #define MBTILES_H
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <map>
+#include <memory>
 #include <unordered_map>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
+#include <functional>
 #include <optional>
 
 class sqlite3;
@@ -22,12 +26,47 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Connection settings applied by MBTiles::open(). Defaults match a plain
+// sqlite3_open(): read-write, no memory mapping, SQLite's page cache size.
+struct OpenOptions {
+    enum class TempStore {
+        DEFAULT,
+        FILE,
+        MEMORY,
+    };
+    enum class LockingMode {
+        NORMAL,
+        EXCLUSIVE,
+    };
+
+    bool read_only = false;
+    // Promise that nothing modifies the file while it is open (URI
+    // immutable=1): SQLite then skips file locking and change detection
+    // entirely. Implies read_only.
+    bool immutable = false;
+    // Bytes of the file to memory-map (PRAGMA mmap_size); 0 keeps the
+    // default of no mapping. Mapped pages are read without a copy into the
+    // page cache.
+    std::int64_t mmap_size = 0;
+    // PRAGMA cache_size: positive values are pages, negative values KiB;
+    // 0 keeps SQLite's default (2 MiB).
+    int cache_size = 0;
+    TempStore temp_store = TempStore::DEFAULT;
+    // EXCLUSIVE keeps the file lock after the first read, so later
+    // transactions skip lock/unlock system calls but other processes are
+    // shut out.
+    LockingMode locking_mode = LockingMode::NORMAL;
+};
+
 struct ExtractOptions {
     ExtractOptions(const std::string& output_directory = ".", 
         const std::string& pattern = "{z}/{x}/{y}.{ext}") : 
         output_directory(output_directory), pattern(pattern) {}
     std::string output_directory;
     std::string pattern;
+    // Threads writing tile files (0 = one per hardware thread). The archive
+    // is still read by a single iterator; 1 writes inline.
+    unsigned threads = 1;
 };
 
 struct GrayscaleOptions {
@@ -38,15 +77,183 @@ enum class Format {
     DEFAULT,
     JPG,
     PNG,
+    // Needs a build with libwebp; encoding throws otherwise.
+    WEBP,
+};
+
+// Settings for tiles the library encodes. Each codec reads the fields of its
+// own format.
+struct EncoderOptions {
+    int jpeg_quality = 90;  // 1-100
+    // zlib level 0-9 (-1 = backend default). The stb fallback always uses 8.
+    int png_compression = -1;
+    int webp_quality = 80;  // 0-100, ignored when lossless
+    bool webp_lossless = false;
+};
+
+// Library behind each tile format in this build, e.g. {"jpg", "libjpeg"}, or
+// "none" for formats that cannot be encoded.
+std::map<std::string, std::string> codecBackends();
+
+struct ImportOptions {
+    // Re-encode every tile into this format; DEFAULT stores the file bytes
+    // unchanged unless grayscale is set.
+    Format format = Format::DEFAULT;
+    EncoderOptions encoder;
+    bool grayscale = false;
+    bool compact_grayscale = false;
+    // The {y} in file names counts from the south (TMS) instead of the
+    // north (XYZ).
+    bool tms = false;
+    // Threads walking the directory, reading and re-encoding files (0 = one
+    // per hardware thread). Inserts go through a single writer.
+    unsigned threads = 0;
+};
+
+// What merge() does with a tile present both in the archive and in a
+// source (or in several sources).
+enum class MergeConflict {
+    REPLACE,    // the source merged last wins
+    IGNORE,     // the tile already there is kept
+    COMPOSITE,  // the source tile is alpha-blended over the one already there
+};
+
+struct MergeOptions {
+    MergeConflict conflict = MergeConflict::REPLACE;
+    // Encoding of composited tiles; DEFAULT keeps the archive's format.
+    Format format = Format::DEFAULT;
+    EncoderOptions encoder;
+    // Threads decoding, blending and encoding overlapping tiles under
+    // COMPOSITE (0 = one per hardware thread).
+    unsigned threads = 0;
 };
 
 struct ConvertOptions {
     std::vector<std::string> zoom_levels = {"0"};
     bool grayscale = false;
+    // With grayscale, hand the encoder a single gray channel (plus alpha for
+    // translucent PNG tiles) instead of RGBA. Smaller and faster to encode;
+    // decoders still see the same gray values.
+    bool compact_grayscale = false;
+    // Existing levels whose stored format already matches the output format
+    // are copied without decoding unless grayscale is set; `encoder` only
+    // applies to the levels that are resampled or recolored.
     Format format = Format::DEFAULT;
+    EncoderOptions encoder;
     bool run_extract = false;
+    // Walk the pyramid tile by tile in quadtree order instead of decoding
+    // whole zoom levels, so only the tiles on the current path stay in memory.
+    bool streaming = false;
+    // Ceiling in bytes for decoded tile pixels (0 = unlimited). Whole-level
+    // conversion switches to streaming when it would exceed the ceiling, and
+    // streaming fails early when even one quadtree path does not fit.
+    std::size_t memory_limit = 0;
+    // Worker threads for decoding, resampling and encoding (0 = one per
+    // hardware thread). Inserts always go through a single writer.
+    unsigned threads = 0;
+    // Store the output in the deduplicated MBTiles layout (map + images
+    // tables behind a tiles view), keeping each distinct blob once, and
+    // encode identical source pixels only once.
+    bool deduplicate = false;
+    // Write the result straight into this file instead of an in-memory
+    // database, so the output never has to fit in RAM and saveTo() is not
+    // needed. Empty keeps the in-memory behaviour.
+    std::string output_path;
 };
 
+// How rebuild() encodes regenerated tiles; match the options the archive
+// was converted with.
+struct RebuildOptions {
+    bool grayscale = false;
+    bool compact_grayscale = false;
+    Format format = Format::DEFAULT;
+    EncoderOptions encoder;
+    // Worker threads for decoding, resampling and encoding (0 = one per
+    // hardware thread).
+    unsigned threads = 0;
+};
+
+struct ViewerOptions {
+    std::string host = "0.0.0.0";
+    std::uint16_t port = 8080;
+    // Bytes of encoded tiles kept in memory across requests (0 disables the
+    // cache). Split evenly between the shards.
+    std::size_t cache_bytes = 64 * 1024 * 1024;
+    // Independently locked LRU partitions, so concurrent requests rarely
+    // contend on the same lock.
+    std::size_t cache_shards = 16;
+    // Cache-Control max-age in seconds for tile responses. Clients revalidate
+    // with If-None-Match once it expires and get a 304 when unchanged.
+    unsigned max_age = 0;
+    // HTTP worker threads (0 = httplib's default pool size).
+    std::size_t threads = 0;
+    // Idle seconds before a keep-alive connection is closed, and requests
+    // served on one connection before the server closes it.
+    unsigned keep_alive_timeout = 5;
+    std::size_t keep_alive_max_requests = 100;
+    // Socket read/write timeouts in seconds.
+    unsigned read_timeout = 5;
+    unsigned write_timeout = 5;
+    // Load the neighbours and children of requested tiles into the cache in
+    // the background. Needs the cache and an archive opened from a file.
+    bool prefetch = false;
+    // Low-priority prefetch threads, each with its own read connection, and
+    // predictions allowed to wait; the oldest are dropped first.
+    std::size_t prefetch_threads = 2;
+    std::size_t prefetch_queue = 512;
+    // MBTiles::serveTilesets() only: archives kept open at once, each with
+    // its own pool of read connections; the least recently used one is
+    // closed to make room.
+    std::size_t max_open_tilesets = 64;
+};
+
+// Upper bounds in seconds of the latency histogram buckets, growing 4x from
+// 1us; a last bucket takes anything slower.
+inline constexpr std::array<double, 12> kMetricBucketBounds = {
+    0.000001, 0.000004, 0.000016, 0.000064, 0.000256, 0.001024,
+    0.004096, 0.016384, 0.065536, 0.262144, 1.048576, 4.194304,
+};
+
+// Latency distribution of one pipeline stage.
+struct StageMetrics {
+    std::uint64_t count = 0;
+    double seconds = 0;  // total time spent in the stage
+    // Observations per bucket, not cumulative.
+    std::array<std::uint64_t, kMetricBucketBounds.size() + 1> buckets{};
+};
+
+// Counters of the library's pipeline stages since start-up or the last
+// resetMetrics(). The registry is process-wide: every archive and thread
+// feeds the same counters.
+struct Metrics {
+    StageMetrics sqlite_step;
+    StageMetrics decode_png;
+    StageMetrics decode_jpg;
+    StageMetrics decode_webp;
+    StageMetrics decode_other;
+    StageMetrics encode_png;
+    StageMetrics encode_jpg;
+    StageMetrics encode_webp;
+    StageMetrics resample;      // one downsample or upsample of a tile group
+    StageMetrics http_request;  // viewer tile requests
+    std::uint64_t tiles_read = 0;
+    std::uint64_t bytes_read = 0;
+    std::uint64_t tiles_written = 0;  // rows inserted and files extracted
+    std::uint64_t bytes_written = 0;
+    std::uint64_t cache_hits = 0;  // viewer tile cache
+    std::uint64_t cache_misses = 0;
+    std::uint64_t encode_cache_hits = 0;  // tiles convert() did not re-encode
+    std::uint64_t tiles_prefetched = 0;   // viewer tiles cached ahead of requests
+
+    // Work between two snapshots, e.g. of one call.
+    Metrics operator-(const Metrics &earlier) const;
+};
+
+Metrics metrics();
+void resetMetrics();
+// metrics() in the Prometheus text exposition format, as served on /metrics.
+std::string metricsPrometheus();
+
 void logInfo(const std::string &message);
 void logError(const std::string &message);
 void logWarn(const std::string &message);
@@ -83,8 +290,15 @@ class RGBAImage {
 
     void save(const std::filesystem::path& path) const;
 
-    std::vector<unsigned char> encodePng() const;
+    // `compression` is a zlib level 0-9, -1 for the backend default.
+    std::vector<unsigned char> encodePng(int compression = -1) const;
     std::vector<unsigned char> encodeJpg(int quality = 90) const;
+    // Throws when the library was built without libwebp.
+    std::vector<unsigned char> encodeWebp(int quality = 80, bool lossless = false) const;
+    // Encode the luma of the image without modifying it: PNG keeps a gray +
+    // alpha layout only when some pixel is translucent, JPEG is single channel.
+    std::vector<unsigned char> encodeGrayPng(int compression = -1) const;
+    std::vector<unsigned char> encodeGrayJpg(int quality = 90) const;
 
     void toGrayScale();
 
@@ -109,40 +323,210 @@ struct TileInfo {
     double lonMax() const;
 };
 
+// Borrowed view of a tile row. `data` points straight into SQLite's row
+// buffer, so it is only valid until the iterator advances or the callback
+// that received the view returns. Copy the bytes to keep them longer.
+struct TileView {
+    int zoom = 0;
+    int x = 0;
+    int y = 0;          // XYZ / Web Mercator Y
+    int tms_y = 0;      // TMS Y as stored in MBTiles DB
+    const std::byte *data = nullptr;
+    std::size_t size = 0;
+    std::string_view extension;   // "png", "jpg", "pbf", etc.
+};
+
+using TileViewCallback = std::function<void(const TileView &)>;
+
+struct TileCoord {
+    int zoom = 0;
+    int x = 0;
+    int y = 0;          // XYZ / Web Mercator Y
+};
+
 std::pair<double, double> tile2latlon(int zoom, int x, int y);
 std::pair<double, double> tile2latlon(const TileInfo& tile);
+// Inverse of tile2latlon(): the XYZ (x, y) of the tile containing the point,
+// clamped to the tile grid of `zoom`.
+std::pair<int, int> latlon2tile(int zoom, double lat, double lon);
+
+// Geographic box in degrees (WGS84). min_lon > max_lon crosses the antimeridian.
+struct LatLonBounds {
+    double min_lon = -180.0;
+    double min_lat = -85.0511287798;
+    double max_lon = 180.0;
+    double max_lat = 85.0511287798;
+};
+
+struct TileIteratorOptions {
+    // Inclusive zoom range; unset ends are open.
+    std::optional<int> min_zoom;
+    std::optional<int> max_zoom;
+    // Only tiles intersecting this box, turned into per-zoom column/row
+    // ranges so the (zoom, column, row) index does the filtering.
+    std::optional<LatLonBounds> bounds;
+    // Inclusive rowid range of the tiles table. Rowid ranges are contiguous
+    // B-tree scans, which is what MBTiles::shards() hands out.
+    std::optional<std::int64_t> first_rowid;
+    std::optional<std::int64_t> last_rowid;
+    // Only tiles with (tile_column + tile_row) % shard_count == shard_index;
+    // used when `tiles` is a view without stable rowids.
+    std::size_t shard_count = 1;
+    std::size_t shard_index = 0;
+    // Deliver tiles in (zoom, column, TMS row) order instead of storage order.
+    bool ordered = false;
+};
+
+// Upper bounds in bytes of the tile size histogram buckets, growing 4x from
+// 256 B; a last bucket takes anything larger.
+inline constexpr std::array<std::size_t, 8> kTileSizeBucketBounds = {
+    256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304,
+};
+
+struct ZoomStats {
+    int zoom = 0;
+    std::uint64_t tiles = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t min_size = 0;
+    std::uint64_t max_size = 0;
+    // Tiles per size bucket, not cumulative.
+    std::array<std::uint64_t, kTileSizeBucketBounds.size() + 1> size_buckets{};
+    // Inclusive XYZ extent of the tiles present.
+    int min_x = 0;
+    int max_x = 0;
+    int min_y = 0;
+    int max_y = 0;
+};
+
+struct StatsOptions {
+    // Read-only connections scanning rowid shards in parallel (0 = one per
+    // hardware thread). In-memory archives are always scanned on one.
+    unsigned threads = 0;
+    // Hash every blob to count duplicates; costs 24 bytes of memory per tile.
+    bool duplicates = true;
+    // Rewrite the minzoom, maxzoom and bounds metadata found stale.
+    bool update_metadata = false;
+};
+
+struct ArchiveStats {
+    std::vector<ZoomStats> zooms;  // ascending, levels with tiles only
+    std::uint64_t tiles = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t empty_tiles = 0;  // rows with an empty or NULL blob
+    // Distinct blobs, and the bytes a deduplicated layout would save; only
+    // counted with StatsOptions::duplicates.
+    std::optional<std::uint64_t> unique_blobs;
+    std::uint64_t duplicate_bytes = 0;
+    // Tiles per detected format ("png", "jpg", "webp", "pbf", "bin"), and
+    // those not matching the metadata `format`.
+    std::map<std::string, std::uint64_t> formats;
+    std::uint64_t format_mismatches = 0;
+    // Extent of the tiles at the deepest zoom, next to what metadata claims.
+    std::optional<LatLonBounds> tile_bounds;
+    std::optional<LatLonBounds> metadata_bounds;
+    std::optional<int> metadata_min_zoom;
+    std::optional<int> metadata_max_zoom;
+    // Metadata keys disagreeing with the tiles, rewritten when
+    // StatsOptions::update_metadata is set.
+    std::vector<std::string> stale_metadata;
+
+    double duplicateRatio() const {
+        return unique_blobs && tiles > 0 ? 1.0 - static_cast<double>(*unique_blobs) / static_cast<double>(tiles) : 0.0;
+    }
+};
 
 
 
 class TileIterator {
 public:
-    explicit TileIterator(sqlite3* db);
+    explicit TileIterator(sqlite3* db, TileIteratorOptions options = {});
+    TileIterator(TileIterator&& other) noexcept;
+    TileIterator& operator=(TileIterator&& other) noexcept;
+    TileIterator(const TileIterator&) = delete;
+    TileIterator& operator=(const TileIterator&) = delete;
     ~TileIterator();
 
     // Returns the next tile, or std::nullopt if done.
     // Throws on database error.
     std::optional<TileInfo> next();
 
+    // Same as next(), but without copying the blob: the returned view stays
+    // valid until the following call to next()/nextView().
+    std::optional<TileView> nextView();
+
 private:
     sqlite3* _db;
     sqlite3_stmt* _stmt = nullptr;
     bool _started = false;
     std::string _metadata_ext;
+    TileIteratorOptions _options;
+
+    void prepare();
+};
+
+class MBTiles;
+
+struct TileWriterOptions {
+    // Rows per transaction; larger batches amortise the commit cost.
+    std::size_t commit_interval = 16384;
+    // Tiles buffered for the writer thread before write() blocks.
+    std::size_t queue_capacity = 1024;
+};
+
+// Inserts tiles into an open archive from any number of threads. Tiles are
+// queued to a single writer thread that owns the connection and commits in
+// large transactions; a tile already stored at the same coordinates is
+// replaced. Leave the archive alone until finish() returns.
+class TileWriter {
+  public:
+    explicit TileWriter(MBTiles &archive, const TileWriterOptions &options = {});
+    TileWriter(const TileWriter &) = delete;
+    TileWriter &operator=(const TileWriter &) = delete;
+    // Finishes if finish() was not called; failures are only logged there.
+    ~TileWriter();
+
+    // Thread-safe; `y` is XYZ. Blocks while the queue is full and rethrows a
+    // writer failure.
+    void write(int zoom, int x, int y, std::vector<unsigned char> data);
+    // Waits for the queue to drain, commits, and returns the number of
+    // tiles written.
+    std::size_t finish();
+
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
 };
 
 class MBTiles {
   public:
     MBTiles();
-    MBTiles(const std::string& path);
+    MBTiles(const std::string& path, const OpenOptions& options = {});
     MBTiles(MBTiles&& other) noexcept;
     MBTiles& operator=(MBTiles&& other) noexcept;
     MBTiles(const MBTiles&) = delete;
     MBTiles& operator=(const MBTiles&) = delete;
     ~MBTiles();
-    void open(const std::string& path);
+    void open(const std::string& path, const OpenOptions& options = {});
     void close();
     size_t extract(const std::string& output_directory = ".", 
             const std::string& pattern = "{z}/{x}/{y}.{ext}") const;
+    size_t extract(const ExtractOptions& options) const;
+    // Same, also returning the metrics recorded during the call. Concurrent
+    // work elsewhere in the process is included.
+    size_t extract(const ExtractOptions& options, Metrics& stats) const;
+    // Inverse of extract(): adds every file below `directory` whose relative
+    // path matches `pattern` ({z}, {x}, {y} and {ext} placeholders) to this
+    // archive and returns the number of tiles imported. Existing tiles at
+    // the same coordinates are replaced.
+    size_t importDirectory(const std::string& directory, const std::string& pattern = "{z}/{x}/{y}.{ext}",
+            const ImportOptions& options = {});
+    // Adds the tiles of every archive in `sources`, in order, and returns
+    // the number of tiles written. Each source is attached and copied by
+    // zoom level inside SQLite, so blobs only pass through C++ when
+    // COMPOSITE has to blend two of them. The metadata `bounds`, `minzoom`
+    // and `maxzoom` are combined, and keys this archive lacks are taken from
+    // the sources.
+    std::size_t merge(const std::vector<std::string> &sources, const MergeOptions &options = {});
     std::map<std::string, std::string> metadata() const;
     const std::string& metadata(const std::string& key) const;
     std::vector<std::string> metadataKeys() const;
@@ -152,6 +536,18 @@ class MBTiles {
         bool overwrite_existing = true);
 
     TileIterator tiles() const;
+    TileIterator tiles(const TileIteratorOptions &options) const;
+    // Splits the archive into `count` disjoint iterator options that together
+    // cover every tile matching `base`. Each shard is meant for its own
+    // connection (one MBTiles per thread on the same file), so K scans can
+    // run at once.
+    std::vector<TileIteratorOptions> shards(std::size_t count, const TileIteratorOptions &base = {}) const;
+    // Streams every tile through `fn` without copying blobs; returns the
+    // number of tiles visited.
+    std::size_t forEachTile(const TileViewCallback &fn) const;
+    // Summarizes the archive in one pass over all tiles, sharded over
+    // StatsOptions::threads read-only connections.
+    ArchiveStats stats(const StatsOptions &options = {});
 
 
 
@@ -159,21 +555,76 @@ class MBTiles {
 
 
     void view(std::uint16_t port = 8080, std::string host = "0.0.0.0");
+    void view(const ViewerOptions &options);
+    // Tile endpoint only, for production use: no HTML pages, any tile
+    // extension matching the archive's format, and gzip-compressed vector
+    // tiles passed through with Content-Encoding: gzip.
+    void serve(const ViewerOptions &options);
+    // Serves many archives from one server: every `*.mbtiles` file of the
+    // directory `source`, named by its file stem, or the entries of a manifest
+    // file (one `path` or `name=path` per line). Tiles are routed as
+    // /{tileset}/{z}/{x}/{y}.{ext}, TileJSON as /{tileset}.json and the list
+    // of tilesets as /. Nothing is opened up front: an archive is opened on
+    // its first request and at most options.max_open_tilesets stay open.
+    static void serveTilesets(const std::string &source, const ViewerOptions &options,
+                              const OpenOptions &open_options = {});
 
     std::vector<int> zoomLevels() const;
     std::optional<int> minZoomLevel() const;
     std::optional<int> maxZoomLevel() const;
     std::optional<std::string> tileData(int zoom, int x, int y) const;
+    // Zero-copy variant of tileData(): invokes `fn` with a view of the blob
+    // while the row is still current. Returns false when the tile is missing.
+    bool tileDataView(int zoom, int x, int y, const TileViewCallback &fn) const;
+    // Fetches many tiles with as few B-tree walks as possible and invokes `fn`
+    // for each one found, in storage order (zoom, column, TMS row) rather than
+    // request order; missing coordinates are skipped. Returns the number of
+    // tiles delivered.
+    std::size_t tileDataBatch(const std::vector<TileCoord> &coords, const TileViewCallback &fn) const;
+    // Streams every tile of `zoom` with xmin <= x <= xmax and ymin <= y <= ymax
+    // (XYZ, inclusive) from one index range scan, in storage order.
+    std::size_t tilesInRange(int zoom, int xmin, int xmax, int ymin, int ymax, const TileViewCallback &fn) const;
 
     MBTiles convert(const ConvertOptions& options) const;
+    MBTiles convert(const ConvertOptions& options, Metrics& stats) const;
+    // Regenerates, in place, every tile derived from the given base tiles,
+    // which must all share one zoom and already hold their new content (a
+    // coordinate without a row counts as removed). Ancestors are downsampled
+    // level by level down to the first zoom missing from the archive, and
+    // descendants are upsampled up to the last contiguous zoom. Returns the
+    // number of tiles written.
+    std::size_t rebuild(const std::vector<TileCoord> &changed, const RebuildOptions &options = {});
+    // Coordinates at `zoom` whose blob differs from `previous`, including
+    // tiles present in only one of the two archives.
+    std::vector<TileCoord> changedTiles(const MBTiles &previous, int zoom) const;
     void saveTo(const std::string &path) const;
 
   private:
+    friend class TileWriter;
+
     std::string _name;
+    std::string _path;  // absolute path of the opened file; empty for in-memory archives
     sqlite3 *_db;
-
-    std::optional<int> queryZoomValue(const char *sql) const;
+    OpenOptions _open_options;
+
+    // Prepared statements owned by this connection, keyed by a copy of their
+    // SQL text, so callers may build the SQL at run time. Statements are
+    // reset and rebound on reuse and finalized in close(), so repeated
+    // lookups skip SQL parsing and planning. A statement still stepping (for
+    // example under a tileDataView() callback) is never handed out again; a
+    // nested caller gets a sibling from the same list. Like the connection
+    // itself, the cache is not safe for concurrent use from several threads.
+    mutable std::unordered_map<std::string, std::vector<sqlite3_stmt *>> _statements;
+
+    // Opens `path` with `options` and the extra SQLITE_OPEN_* `flags`; also
+    // used for the viewer's pooled read connections.
+    static sqlite3 *openConnection(const std::string &path, const OpenOptions &options, int flags = 0);
+    sqlite3_stmt *cachedStatement(std::string_view sql) const;
+    void finalizeStatements() noexcept;
+    std::optional<int> queryZoomValue(std::string_view sql) const;
+    bool tilesIsTable() const;
     std::optional<std::string> fetchTileBlob(int zoom, int x, int y) const;
+    void runServer(const ViewerOptions &options, bool viewer_pages);
 };
 
 // std::size_t extract(const std::string &mbtiles_path, const ExtractOptions &options = {});
@@ -197,11 +648,6 @@ class MBTiles {
 
 // std::vector<std::string> metadata_keys(const std::string &mbtiles_path);
 
-// struct ViewerOptions {
-//     std::string host = "0.0.0.0";
-//     std::uint16_t port = 8080;
-// };
-
 // void serve_viewer(const std::string &mbtiles_path, const ViewerOptions &options = {});
 
 }  // namespace mbtiles
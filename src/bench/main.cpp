@@ -0,0 +1,450 @@
+#include "CLI11.hpp"
+#include "httplib.h"
+#include "mbtiles.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct GeneratorOptions {
+    int min_zoom = 0;
+    int max_zoom = 5;
+    int tile_size = 256;
+    std::string format = "png";
+    // Share of tiles that repeat one of a few common blobs (ocean, empty land)
+    double duplication = 0.3;
+    std::size_t pbf_bytes = 4096;
+    unsigned seed = 1;
+};
+
+struct Result {
+    std::string name;
+    std::size_t ops = 0;
+    std::size_t bytes = 0;
+    double seconds = 0;
+    std::vector<double> latencies_us;
+    long peak_rss_kb = 0;
+};
+
+long peak_rss_kb(int who = RUSAGE_SELF) {
+    rusage usage{};
+    getrusage(who, &usage);
+    return usage.ru_maxrss;
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    const std::size_t index = std::min(values.size() - 1, static_cast<std::size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+double elapsed_us(Clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Times `fn` once per op and collects per-call latencies; `fn` returns the
+// bytes it processed.
+Result measure(const std::string &name, std::size_t ops, const std::function<std::size_t(std::size_t)> &fn) {
+    Result result;
+    result.name = name;
+    result.latencies_us.reserve(ops);
+    const auto start = Clock::now();
+    for (std::size_t i = 0; i < ops; ++i) {
+        const auto op_start = Clock::now();
+        result.bytes += fn(i);
+        result.latencies_us.push_back(elapsed_us(op_start));
+    }
+    result.ops = ops;
+    result.seconds = elapsed_us(start) / 1e6;
+    result.peak_rss_kb = peak_rss_kb();
+    return result;
+}
+
+void write_json(std::ostream &out, const GeneratorOptions &generator, const std::vector<Result> &results) {
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"archive\": {\"min_zoom\": " << generator.min_zoom << ", \"max_zoom\": " << generator.max_zoom
+        << ", \"tile_size\": " << generator.tile_size << ", \"format\": \"" << generator.format
+        << "\", \"duplication\": " << generator.duplication << "},\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        const double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+        out << "    {\"name\": \"" << r.name << "\", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+            << ", \"tiles_per_s\": " << r.ops / seconds << ", \"mb_per_s\": " << r.bytes / seconds / (1024.0 * 1024.0)
+            << ", \"p50_us\": " << percentile(r.latencies_us, 0.50)
+            << ", \"p99_us\": " << percentile(r.latencies_us, 0.99) << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// Noisy gradient so encoders see photo-like content rather than flat fills.
+mbtiles::RGBAImage synthetic_image(int size, std::uint32_t seed) {
+    mbtiles::RGBAImage image;
+    image.width = size;
+    image.height = size;
+    image.pixels.resize(static_cast<std::size_t>(size) * size * 4);
+    std::minstd_rand rng(seed);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            unsigned char *px = &image.pixels[(static_cast<std::size_t>(y) * size + x) * 4];
+            const unsigned noise = rng() & 31;
+            px[0] = static_cast<unsigned char>((x * 255 / size + seed) & 0xff) ^ noise;
+            px[1] = static_cast<unsigned char>((y * 255 / size + seed * 7) & 0xff) ^ noise;
+            px[2] = static_cast<unsigned char>(((x + y) * 127 / size + seed * 13) & 0xff);
+            px[3] = 255;
+        }
+    }
+    return image;
+}
+
+std::vector<unsigned char> synthetic_blob(const GeneratorOptions &options, std::uint32_t seed) {
+    if (options.format == "pbf") {
+        std::vector<unsigned char> blob(options.pbf_bytes);
+        std::minstd_rand rng(seed);
+        for (auto &byte : blob) {
+            byte = static_cast<unsigned char>(rng());
+        }
+        return blob;
+    }
+    const mbtiles::RGBAImage image = synthetic_image(options.tile_size, seed);
+    return options.format == "jpg" ? image.encodeJpg() : image.encodePng();
+}
+
+// Writes tiles for every level in [min_zoom, max_zoom] into `path`; with
+// `base_only`, just the deepest level (the input of a downsample).
+std::size_t generate_archive(const fs::path &path, const GeneratorOptions &options, bool base_only) {
+    fs::remove(path);
+    mbtiles::MBTiles archive(path.string());
+    mbtiles::TileWriter writer(archive);
+
+    std::mt19937 rng(options.seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::vector<std::vector<unsigned char>> common;
+    for (std::uint32_t i = 0; i < 4; ++i) {
+        common.push_back(synthetic_blob(options, 0x9e3779b9u + i));
+    }
+
+    for (int z = base_only ? options.max_zoom : options.min_zoom; z <= options.max_zoom; ++z) {
+        const int n = 1 << z;
+        for (int x = 0; x < n; ++x) {
+            for (int y = 0; y < n; ++y) {
+                if (coin(rng) < options.duplication) {
+                    writer.write(z, x, y, common[rng() % common.size()]);
+                } else {
+                    writer.write(z, x, y, synthetic_blob(options, static_cast<std::uint32_t>(rng())));
+                }
+            }
+        }
+    }
+    const std::size_t written = writer.finish();
+    archive.setMetadata({{"name", "bench"},
+                         {"format", options.format},
+                         {"minzoom", std::to_string(base_only ? options.max_zoom : options.min_zoom)},
+                         {"maxzoom", std::to_string(options.max_zoom)}});
+    return written;
+}
+
+// Runs view() in a child process so the load generator measures the server
+// the way clients see it, and so the server can be stopped by a signal.
+Result bench_http(const fs::path &path, std::uint16_t port, unsigned clients, std::size_t requests,
+                  const std::vector<mbtiles::TileCoord> &coords, const std::string &ext) {
+    std::cout.flush();
+    const pid_t child = fork();
+    if (child < 0) {
+        throw std::runtime_error("fork failed");
+    }
+    if (child == 0) {
+        // Keep the viewer's banner out of the JSON on stdout
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(1);
+        }
+        mbtiles::OpenOptions open;
+        open.read_only = true;
+        mbtiles::MBTiles archive(path.string(), open);
+        mbtiles::ViewerOptions options;
+        options.host = "127.0.0.1";
+        options.port = port;
+        options.keep_alive_max_requests = requests + 1;
+        archive.view(options);
+        _exit(0);
+    }
+
+    // Wait for the listener
+    bool ready = false;
+    for (int attempt = 0; attempt < 100 && !ready; ++attempt) {
+        httplib::Client probe("127.0.0.1", port);
+        ready = static_cast<bool>(probe.Get("/"));
+        if (!ready) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+    if (!ready) {
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        throw std::runtime_error("viewer did not start on port " + std::to_string(port));
+    }
+
+    std::vector<std::vector<double>> latencies(clients);
+    std::vector<std::size_t> bytes(clients, 0);
+    std::atomic<std::size_t> failures{0};
+    std::vector<std::thread> threads;
+    const std::size_t per_client = (requests + clients - 1) / clients;
+    const auto start = Clock::now();
+    for (unsigned c = 0; c < clients; ++c) {
+        threads.emplace_back([&, c] {
+            httplib::Client client("127.0.0.1", port);
+            client.set_keep_alive(true);
+            std::mt19937 rng(c + 1);
+            latencies[c].reserve(per_client);
+            for (std::size_t i = 0; i < per_client; ++i) {
+                const auto &tile = coords[rng() % coords.size()];
+                const std::string url = "/tiles/" + std::to_string(tile.zoom) + "/" + std::to_string(tile.x) + "/" +
+                                        std::to_string(tile.y) + "." + ext;
+                const auto op_start = Clock::now();
+                auto res = client.Get(url);
+                latencies[c].push_back(elapsed_us(op_start));
+                if (res && res->status == 200) {
+                    bytes[c] += res->body.size();
+                } else {
+                    ++failures;
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    Result result;
+    result.name = "http_view";
+    result.seconds = elapsed_us(start) / 1e6;
+    for (unsigned c = 0; c < clients; ++c) {
+        result.ops += latencies[c].size();
+        result.bytes += bytes[c];
+        result.latencies_us.insert(result.latencies_us.end(), latencies[c].begin(), latencies[c].end());
+    }
+
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+    // The server's own peak, not the load generator's
+    result.peak_rss_kb = peak_rss_kb(RUSAGE_CHILDREN);
+    if (failures > 0) {
+        std::cerr << "http_view: " << failures << " requests failed" << std::endl;
+    }
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    CLI::App app{"libmbtiles benchmarks"};
+
+    GeneratorOptions generator;
+    std::string work_dir = (fs::temp_directory_path() / "mbtiles-bench").string();
+    std::string json_path;
+    std::vector<std::string> only;
+    std::size_t ops = 2000;
+    unsigned threads = 0;
+    unsigned clients = 8;
+    std::size_t requests = 20000;
+    std::uint16_t port = 18080;
+
+    app.add_option("--min-zoom", generator.min_zoom, "Lowest zoom of the synthetic archive")->default_val(0);
+    app.add_option("--max-zoom", generator.max_zoom, "Highest zoom of the synthetic archive")->default_val(5);
+    app.add_option("--tile-size", generator.tile_size, "Raster tile width and height in pixels")->default_val(256);
+    app.add_option("--format", generator.format, "Tile format: png, jpg or pbf")
+        ->default_val("png")
+        ->check(CLI::IsMember({"png", "jpg", "pbf"}));
+    app.add_option("--duplication", generator.duplication, "Share of tiles repeating a common blob (0-1)")
+        ->default_val(0.3)
+        ->check(CLI::Range(0.0, 1.0));
+    app.add_option("--pbf-bytes", generator.pbf_bytes, "Blob size of synthetic vector tiles")->default_val(4096);
+    app.add_option("--seed", generator.seed, "Seed for the synthetic archive")->default_val(1);
+    app.add_option("--work-dir", work_dir, "Directory for the generated archives and extract output");
+    app.add_option("--ops", ops, "Operations per micro-benchmark")->default_val(2000);
+    app.add_option("-j,--threads", threads, "Threads for extract and convert (0 = all hardware threads)")
+        ->default_val(0);
+    app.add_option("--clients", clients, "Concurrent HTTP clients for the view() load test")->default_val(8);
+    app.add_option("--requests", requests, "Total HTTP requests for the view() load test")->default_val(20000);
+    app.add_option("--port", port, "Port for the view() load test")->default_val(18080);
+    app.add_option("--only", only,
+                   "Run only these benchmarks: tile_data, iterator_next, load_from_memory, encode_png, "
+                   "encode_jpg, to_grayscale, downsample_level, extract, http_view");
+    app.add_option("--json", json_path, "Write the JSON report here instead of stdout");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (generator.min_zoom < 0 || generator.max_zoom < generator.min_zoom || generator.max_zoom > 12) {
+        std::cerr << "Zoom span must satisfy 0 <= min-zoom <= max-zoom <= 12" << std::endl;
+        return 1;
+    }
+    if (clients == 0 || ops == 0) {
+        std::cerr << "--ops and --clients must be positive" << std::endl;
+        return 1;
+    }
+    auto enabled = [&](const std::string &name) {
+        return only.empty() || std::find(only.begin(), only.end(), name) != only.end();
+    };
+    const bool raster = generator.format != "pbf";
+
+    try {
+        mbtiles::Logger::set_level(mbtiles::LogLevel::ERROR);
+        fs::create_directories(work_dir);
+        const fs::path archive_path = fs::path(work_dir) / "bench.mbtiles";
+        const std::size_t tile_count = generate_archive(archive_path, generator, false);
+        std::cerr << "Generated " << tile_count << " tiles in " << archive_path << std::endl;
+
+        mbtiles::OpenOptions open;
+        open.read_only = true;
+        mbtiles::MBTiles archive(archive_path.string(), open);
+
+        std::vector<mbtiles::TileCoord> coords;
+        for (int z = generator.min_zoom; z <= generator.max_zoom; ++z) {
+            for (int x = 0; x < (1 << z); ++x) {
+                for (int y = 0; y < (1 << z); ++y) {
+                    coords.push_back({z, x, y});
+                }
+            }
+        }
+        std::mt19937 rng(generator.seed);
+        std::shuffle(coords.begin(), coords.end(), rng);
+
+        // A sample of stored blobs, and their decoded pixels, for the codec benchmarks
+        std::vector<std::string> blobs;
+        for (std::size_t i = 0; i < std::min<std::size_t>(coords.size(), 64); ++i) {
+            const auto &tile = coords[i];
+            blobs.push_back(*archive.tileData(tile.zoom, tile.x, tile.y));
+        }
+        std::vector<mbtiles::RGBAImage> images;
+        if (raster) {
+            for (const auto &blob : blobs) {
+                images.emplace_back(reinterpret_cast<const unsigned char *>(blob.data()), static_cast<int>(blob.size()));
+            }
+        }
+
+        std::vector<Result> results;
+
+        if (enabled("tile_data")) {
+            results.push_back(measure("tile_data", ops, [&](std::size_t i) {
+                const auto &tile = coords[i % coords.size()];
+                return archive.tileData(tile.zoom, tile.x, tile.y)->size();
+            }));
+        }
+
+        if (enabled("iterator_next")) {
+            auto it = archive.tiles();
+            results.push_back(measure("iterator_next", tile_count, [&](std::size_t) {
+                auto tile = it.next();
+                return tile ? tile->data.size() : 0;
+            }));
+        }
+
+        if (raster && enabled("load_from_memory")) {
+            mbtiles::RGBAImage image;
+            results.push_back(measure("load_from_memory", ops, [&](std::size_t i) {
+                const std::string &blob = blobs[i % blobs.size()];
+                image.loadFromMemory(reinterpret_cast<const unsigned char *>(blob.data()), static_cast<int>(blob.size()));
+                return blob.size();
+            }));
+        }
+
+        if (raster && enabled("encode_png")) {
+            results.push_back(measure("encode_png", std::max<std::size_t>(1, ops / 10), [&](std::size_t i) {
+                return images[i % images.size()].encodePng().size();
+            }));
+        }
+
+        if (raster && enabled("encode_jpg")) {
+            results.push_back(measure("encode_jpg", std::max<std::size_t>(1, ops / 10), [&](std::size_t i) {
+                return images[i % images.size()].encodeJpg().size();
+            }));
+        }
+
+        if (raster && enabled("to_grayscale")) {
+            results.push_back(measure("to_grayscale", ops, [&](std::size_t i) {
+                mbtiles::RGBAImage image = images[i % images.size()];
+                image.toGrayScale();
+                return image.pixels.size();
+            }));
+        }
+
+        // downsample_level is internal; convert() with one level below the
+        // base drives it on a single-level archive (decode, resample, encode)
+        if (raster && enabled("downsample_level") && generator.max_zoom > 0) {
+            const fs::path base_path = fs::path(work_dir) / "bench-base.mbtiles";
+            generate_archive(base_path, generator, true);
+            mbtiles::MBTiles base(base_path.string(), open);
+            mbtiles::ConvertOptions convert;
+            convert.zoom_levels = {"-1"};
+            convert.threads = threads;
+            const std::size_t outputs = std::size_t{1} << (2 * (generator.max_zoom - 1));
+            results.push_back(measure("downsample_level", 1, [&](std::size_t) {
+                base.convert(convert);
+                return std::size_t{0};
+            }));
+            results.back().ops = outputs;
+        }
+
+        if (enabled("extract")) {
+            const fs::path out = fs::path(work_dir) / "extract";
+            fs::remove_all(out);
+            mbtiles::ExtractOptions extract(out.string());
+            extract.threads = threads;
+            std::size_t extracted = 0;
+            results.push_back(measure("extract", 1, [&](std::size_t) {
+                extracted = archive.extract(extract);
+                return std::size_t{0};
+            }));
+            std::size_t bytes = 0;
+            for (const auto &entry : fs::recursive_directory_iterator(out)) {
+                if (entry.is_regular_file()) {
+                    bytes += entry.file_size();
+                }
+            }
+            results.back().ops = extracted;
+            results.back().bytes = bytes;
+            fs::remove_all(out);
+        }
+
+        if (enabled("http_view")) {
+            results.push_back(bench_http(archive_path, port, clients, requests, coords, generator.format));
+        }
+
+        if (json_path.empty()) {
+            write_json(std::cout, generator, results);
+        } else {
+            std::ofstream out(json_path);
+            write_json(out, generator, results);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -6,7 +6,9 @@
 #include <cstdlib>
 #include <filesystem>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <unordered_set>
@@ -23,12 +25,101 @@ int main(int argc, char **argv) {
                                "Enable extra verbose logging");
     };
 
+    bool open_immutable = false;
+    std::size_t open_mmap_mb = 0;
+    std::size_t open_page_cache_mb = 0;
+    std::string open_temp_store = "default";
+    bool open_exclusive_lock = false;
+    auto add_open_flags = [&](CLI::App *cmd) {
+        cmd->add_flag("--immutable", open_immutable,
+                      "Open the archive read-only without locking; it must not change while open");
+        cmd->add_option("--mmap-mb", open_mmap_mb, "Memory-map up to this many MiB of the archive (0 = off)")
+            ->default_val(0);
+        cmd->add_option("--page-cache-mb", open_page_cache_mb, "SQLite page cache size in MiB (0 = SQLite default)")
+            ->default_val(0);
+        cmd->add_option("--temp-store", open_temp_store, "Where SQLite keeps temporary tables: default, file or memory")
+            ->default_val("default")
+            ->check(CLI::IsMember({"default", "file", "memory"}, CLI::ignore_case));
+        cmd->add_flag("--exclusive-lock", open_exclusive_lock,
+                      "Hold the file lock for the whole session instead of per transaction");
+    };
+    auto make_open_options = [&](bool read_only) {
+        mbtiles::OpenOptions options;
+        options.read_only = read_only;
+        options.immutable = open_immutable;
+        options.mmap_size = static_cast<std::int64_t>(open_mmap_mb) * 1024 * 1024;
+        options.cache_size = -static_cast<int>(open_page_cache_mb * 1024);
+        std::string temp_store = open_temp_store;
+        std::transform(temp_store.begin(), temp_store.end(), temp_store.begin(),
+                       [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+        if (temp_store == "file") {
+            options.temp_store = mbtiles::OpenOptions::TempStore::FILE;
+        } else if (temp_store == "memory") {
+            options.temp_store = mbtiles::OpenOptions::TempStore::MEMORY;
+        }
+        if (open_exclusive_lock) {
+            options.locking_mode = mbtiles::OpenOptions::LockingMode::EXCLUSIVE;
+        }
+        return options;
+    };
+
+    mbtiles::EncoderOptions encoder_options;
+    auto add_encoder_flags = [&](CLI::App *cmd) {
+        cmd->add_option("--jpeg-quality", encoder_options.jpeg_quality, "JPEG quality for re-encoded tiles (1-100)")
+            ->default_val(encoder_options.jpeg_quality)
+            ->check(CLI::Range(1, 100));
+        cmd->add_option("--png-compression", encoder_options.png_compression,
+                        "PNG zlib level for re-encoded tiles (0-9, -1 = backend default)")
+            ->default_val(encoder_options.png_compression)
+            ->check(CLI::Range(-1, 9));
+        cmd->add_option("--webp-quality", encoder_options.webp_quality, "WebP quality for re-encoded tiles (0-100)")
+            ->default_val(encoder_options.webp_quality)
+            ->check(CLI::Range(0, 100));
+        cmd->add_flag("--webp-lossless", encoder_options.webp_lossless, "Encode WebP tiles losslessly");
+    };
+
+    bool show_stats = false;
+    auto add_stats_flag = [&](CLI::App *cmd) {
+        cmd->add_flag("--stats", show_stats, "Print time spent per stage and I/O counters when done");
+    };
+    auto print_stats = [](const mbtiles::Metrics &stats) {
+        std::cout << std::left << std::setw(14) << "stage" << std::right << std::setw(12) << "count"
+                  << std::setw(12) << "total s" << std::setw(12) << "mean us" << "\n";
+        auto stage = [](const char *name, const mbtiles::StageMetrics &metrics) {
+            if (metrics.count == 0) {
+                return;
+            }
+            std::cout << std::left << std::setw(14) << name << std::right << std::setw(12) << metrics.count
+                      << std::setw(12) << std::fixed << std::setprecision(3) << metrics.seconds << std::setw(12)
+                      << std::setprecision(1) << metrics.seconds * 1e6 / static_cast<double>(metrics.count)
+                      << "\n";
+        };
+        stage("sqlite step", stats.sqlite_step);
+        stage("decode png", stats.decode_png);
+        stage("decode jpg", stats.decode_jpg);
+        stage("decode webp", stats.decode_webp);
+        stage("decode other", stats.decode_other);
+        stage("resample", stats.resample);
+        stage("encode png", stats.encode_png);
+        stage("encode jpg", stats.encode_jpg);
+        stage("encode webp", stats.encode_webp);
+        std::cout << "read " << stats.tiles_read << " tiles (" << stats.bytes_read << " bytes), wrote "
+                  << stats.tiles_written << " tiles (" << stats.bytes_written << " bytes)";
+        if (stats.encode_cache_hits > 0) {
+            std::cout << ", " << stats.encode_cache_hits << " tiles reused without encoding";
+        }
+        std::cout << std::endl;
+    };
+
     auto extract_cmd = app.add_subcommand("extract", "Extract tiles from an MBTiles archive");
     add_logging_flags(extract_cmd);
+    add_open_flags(extract_cmd);
+    add_stats_flag(extract_cmd);
 
     std::string extract_input;
     std::string extract_output = ".";
     std::string extract_pattern = "{z}/{x}/{y}.{ext}";
+    unsigned extract_threads = 1;
 
     extract_cmd->add_option("mbtiles", extract_input, "Path to the MBTiles file")
         ->required()
@@ -38,16 +129,26 @@ int main(int argc, char **argv) {
     extract_cmd->add_option("-p,--pattern", extract_pattern,
                              "Output filename pattern using placeholders like {z}, {x}, {y}, {t}, {n}, {XX}, {ext}.")
         ->default_val("{z}/{x}/{y}.{ext}");
+    extract_cmd->add_option("-j,--threads", extract_threads,
+                            "Threads writing tile files (0 = all hardware threads)")
+        ->default_val(1);
 
     auto convert_cmd = app.add_subcommand("convert", "Convert MBTiles by copying, resizing, and changing formats");
     add_logging_flags(convert_cmd);
+    add_open_flags(convert_cmd);
+    add_stats_flag(convert_cmd);
     std::string convert_input;
     std::string convert_output;
     std::vector<std::string> convert_levels;
     bool convert_grayscale = false;
+    bool convert_compact_grayscale = false;
     std::string convert_format = "default";
     std::string convert_extract_dir;
     std::string convert_extract_pattern = "{z}/{x}/{y}.{ext}";
+    bool convert_streaming = false;
+    std::size_t convert_memory_limit_mb = 0;
+    unsigned convert_threads = 0;
+    bool convert_deduplicate = false;
 
     convert_cmd->add_option("mbtiles", convert_input, "Path to the MBTiles file")
         ->required()
@@ -78,10 +179,15 @@ int main(int argc, char **argv) {
     convert_levels_opt->expected(-1);
     convert_levels_opt->default_val(std::vector<std::string>{"0"});
     convert_levels_opt->default_str("0");
-    convert_cmd->add_flag("--grayscale", convert_grayscale, "Convert tiles to grayscale before encoding");
-    convert_cmd->add_option("--format", convert_format, "Output format: default, jpg, or png")
+    CLI::Option *convert_grayscale_opt =
+        convert_cmd->add_flag("--grayscale", convert_grayscale, "Convert tiles to grayscale before encoding");
+    convert_cmd->add_flag("--compact-grayscale", convert_compact_grayscale,
+                          "Encode grayscale tiles with a single gray channel instead of RGBA")
+        ->needs(convert_grayscale_opt);
+    convert_cmd->add_option("--format", convert_format, "Output format: default, jpg, png, or webp")
         ->default_val("default")
-        ->check(CLI::IsMember({"default", "jpg", "jpeg", "png"}, CLI::ignore_case));
+        ->check(CLI::IsMember({"default", "jpg", "jpeg", "png", "webp"}, CLI::ignore_case));
+    add_encoder_flags(convert_cmd);
     CLI::Option *convert_extract_opt = convert_cmd->add_option(
         "--extract", convert_extract_dir,
         "Extract the converted archive to this directory after conversion");
@@ -90,6 +196,111 @@ int main(int argc, char **argv) {
         "Filename pattern for extracted tiles (e.g., {z}/{x}/{y}.{ext})")
                                                             ->default_val("{z}/{x}/{y}.{ext}");
     convert_extract_pattern_opt->needs(convert_extract_opt);
+    convert_cmd->add_flag("--streaming", convert_streaming,
+                          "Generate tiles one quadtree path at a time instead of decoding whole zoom levels");
+    convert_cmd->add_option("--memory-limit", convert_memory_limit_mb,
+                            "Ceiling for decoded tile memory in MiB (0 = unlimited); larger jobs switch to streaming")
+        ->default_val(0);
+    convert_cmd->add_option("-j,--threads", convert_threads,
+                            "Worker threads for decoding and encoding tiles (0 = all hardware threads)")
+        ->default_val(0);
+    convert_cmd->add_flag("--deduplicate", convert_deduplicate,
+                          "Store each distinct tile once (map + images layout) and skip re-encoding identical tiles");
+
+    auto import_cmd = app.add_subcommand("import", "Import a z/x/y tile directory into an MBTiles archive");
+    add_logging_flags(import_cmd);
+    std::string import_directory;
+    std::string import_output;
+    std::string import_pattern = "{z}/{x}/{y}.{ext}";
+    mbtiles::ImportOptions import_options;
+    std::string import_format = "default";
+
+    import_cmd->add_option("directory", import_directory, "Directory holding the tile files")
+        ->required()
+        ->check(CLI::ExistingDirectory);
+    import_cmd->add_option("mbtiles", import_output, "MBTiles file to create or add the tiles to")->required();
+    import_cmd->add_option("-p,--pattern", import_pattern,
+                           "Filename pattern relative to the directory using {z}, {x}, {y} and {ext}")
+        ->default_val("{z}/{x}/{y}.{ext}");
+    CLI::Option *import_grayscale_opt =
+        import_cmd->add_flag("--grayscale", import_options.grayscale, "Convert tiles to grayscale before storing");
+    import_cmd->add_flag("--compact-grayscale", import_options.compact_grayscale,
+                         "Encode grayscale tiles with a single gray channel instead of RGBA")
+        ->needs(import_grayscale_opt);
+    import_cmd->add_option("--format", import_format, "Re-encode tiles: default (keep files as is), jpg, png, or webp")
+        ->default_val("default")
+        ->check(CLI::IsMember({"default", "jpg", "jpeg", "png", "webp"}, CLI::ignore_case));
+    add_encoder_flags(import_cmd);
+    import_cmd->add_flag("--tms", import_options.tms, "File names use TMS rows instead of XYZ");
+    import_cmd->add_option("-j,--threads", import_options.threads,
+                           "Threads reading and encoding files (0 = all hardware threads)")
+        ->default_val(0);
+
+    auto rebuild_cmd =
+        app.add_subcommand("rebuild", "Regenerate the tiles derived from changed base tiles in place");
+    add_logging_flags(rebuild_cmd);
+    add_open_flags(rebuild_cmd);
+    std::string rebuild_path;
+    std::vector<std::string> rebuild_tiles;
+    std::string rebuild_previous;
+    int rebuild_zoom = 0;
+    bool rebuild_grayscale = false;
+    bool rebuild_compact_grayscale = false;
+    std::string rebuild_format = "default";
+    unsigned rebuild_threads = 0;
+
+    rebuild_cmd->add_option("mbtiles", rebuild_path, "Path to the MBTiles file to update")
+        ->required()
+        ->check(CLI::ExistingFile);
+    CLI::Option *rebuild_tiles_opt =
+        rebuild_cmd->add_option("--tiles", rebuild_tiles, "Changed base tiles as z/x/y (XYZ)")->expected(-1);
+    CLI::Option *rebuild_previous_opt =
+        rebuild_cmd->add_option("--previous", rebuild_previous,
+                                "Previous version of the archive; changed tiles are found by comparing --zoom")
+            ->check(CLI::ExistingFile)
+            ->excludes(rebuild_tiles_opt);
+    rebuild_cmd->add_option("--zoom", rebuild_zoom, "Base zoom level to compare with --previous")
+        ->needs(rebuild_previous_opt);
+    CLI::Option *rebuild_grayscale_opt =
+        rebuild_cmd->add_flag("--grayscale", rebuild_grayscale, "Convert regenerated tiles to grayscale");
+    rebuild_cmd->add_flag("--compact-grayscale", rebuild_compact_grayscale,
+                          "Encode grayscale tiles with a single gray channel instead of RGBA")
+        ->needs(rebuild_grayscale_opt);
+    rebuild_cmd->add_option("--format", rebuild_format, "Output format: default, jpg, png, or webp")
+        ->default_val("default")
+        ->check(CLI::IsMember({"default", "jpg", "jpeg", "png", "webp"}, CLI::ignore_case));
+    add_encoder_flags(rebuild_cmd);
+    rebuild_cmd->add_option("-j,--threads", rebuild_threads,
+                            "Worker threads for decoding and encoding tiles (0 = all hardware threads)")
+        ->default_val(0);
+
+    auto merge_cmd = app.add_subcommand("merge", "Merge MBTiles archives into one");
+    add_logging_flags(merge_cmd);
+    add_open_flags(merge_cmd);
+    std::string merge_output;
+    std::vector<std::string> merge_sources;
+    std::string merge_conflict = "replace";
+    std::string merge_format = "default";
+    unsigned merge_threads = 0;
+
+    merge_cmd->add_option("output", merge_output, "Archive to merge into; created when missing")
+        ->required();
+    merge_cmd->add_option("sources", merge_sources, "Archives to merge, in order")
+        ->required()
+        ->expected(-1)
+        ->check(CLI::ExistingFile);
+    merge_cmd->add_option("--conflict", merge_conflict,
+                          "Tiles present more than once: replace (last wins), ignore (first wins) or composite "
+                          "(alpha-blend later tiles over earlier ones)")
+        ->default_val("replace")
+        ->check(CLI::IsMember({"replace", "ignore", "composite"}, CLI::ignore_case));
+    merge_cmd->add_option("--format", merge_format, "Format of composited tiles: default, jpg, png, or webp")
+        ->default_val("default")
+        ->check(CLI::IsMember({"default", "jpg", "jpeg", "png", "webp"}, CLI::ignore_case));
+    add_encoder_flags(merge_cmd);
+    merge_cmd->add_option("-j,--threads", merge_threads,
+                          "Worker threads for compositing tiles (0 = all hardware threads)")
+        ->default_val(0);
 
     auto metadata_cmd = app.add_subcommand("metadata", "Inspect and update MBTiles metadata");
     metadata_cmd->require_subcommand(1);
@@ -128,11 +339,44 @@ int main(int argc, char **argv) {
     metadata_set_cmd->add_flag("--no-overwrite", metadata_no_overwrite,
                                 "Fail if the key already exists instead of overwriting");
 
+    auto stats_cmd = app.add_subcommand("stats", "Summarize and validate the tiles of an MBTiles archive");
+    add_logging_flags(stats_cmd);
+    add_open_flags(stats_cmd);
+    std::string stats_path;
+    mbtiles::StatsOptions stats_options;
+    bool stats_no_duplicates = false;
+    bool stats_check = false;
+
+    stats_cmd->add_option("mbtiles", stats_path, "Path to the MBTiles file")
+        ->required()
+        ->check(CLI::ExistingFile);
+    stats_cmd->add_option("-j,--threads", stats_options.threads,
+                          "Read connections scanning the archive (0 = all hardware threads)")
+        ->default_val(0);
+    stats_cmd->add_flag("--no-duplicates", stats_no_duplicates, "Skip hashing the tiles to count duplicate blobs");
+    stats_cmd->add_flag("--fix-metadata", stats_options.update_metadata,
+                        "Rewrite stale minzoom, maxzoom and bounds metadata");
+    stats_cmd->add_flag("--check", stats_check,
+                        "Exit with an error when tiles mismatch the metadata format or metadata is stale");
+
+    // Background loading of likely next tiles, shared by view and serve.
+    auto add_prefetch_flags = [&](CLI::App *cmd, bool &prefetch, std::size_t &threads) {
+        cmd->add_flag("--prefetch", prefetch,
+                      "Load the neighbours and children of requested tiles into the cache ahead of requests");
+        cmd->add_option("--prefetch-threads", threads, "Low-priority threads loading prefetched tiles")
+            ->default_val(2);
+    };
+
     auto viewer_cmd = app.add_subcommand("view", "Launch a local web viewer for an MBTiles archive");
     add_logging_flags(viewer_cmd);
+    add_open_flags(viewer_cmd);
     std::string viewer_path;
     std::string viewer_host = "127.0.0.1";
     std::uint16_t viewer_port = 8080;
+    std::size_t viewer_cache_mb = 64;
+    unsigned viewer_max_age = 0;
+    bool viewer_prefetch = false;
+    std::size_t viewer_prefetch_threads = 2;
 
     viewer_cmd->add_option("mbtiles", viewer_path, "Path to the MBTiles file")
         ->required()
@@ -141,6 +385,64 @@ int main(int argc, char **argv) {
         ->default_val("0.0.0.0");
     viewer_cmd->add_option("-p,--port", viewer_port, "Port to bind the viewer server")
         ->default_val(8080);
+    viewer_cmd->add_option("--cache-mb", viewer_cache_mb, "In-memory tile cache size in MiB (0 disables it)")
+        ->default_val(64);
+    viewer_cmd->add_option("--max-age", viewer_max_age, "Cache-Control max-age in seconds for tile responses")
+        ->default_val(0);
+    add_prefetch_flags(viewer_cmd, viewer_prefetch, viewer_prefetch_threads);
+
+    // Flags shared by the tile server subcommands.
+    auto add_server_flags = [&](CLI::App *cmd, mbtiles::ViewerOptions &options, std::size_t &cache_mb) {
+        cmd->add_option("--host", options.host, "Host/IP address to bind the tile server")
+            ->default_val("0.0.0.0");
+        cmd->add_option("-p,--port", options.port, "Port to bind the tile server")
+            ->default_val(8080);
+        cmd->add_option("-j,--threads", options.threads, "HTTP worker threads (0 = library default)")
+            ->default_val(0);
+        cmd->add_option("--cache-mb", cache_mb, "In-memory tile cache size in MiB (0 disables it)")
+            ->default_val(64);
+        cmd->add_option("--max-age", options.max_age, "Cache-Control max-age in seconds for tile responses")
+            ->default_val(0);
+        cmd->add_option("--keep-alive", options.keep_alive_timeout, "Seconds an idle keep-alive connection stays open")
+            ->default_val(5);
+        cmd->add_option("--keep-alive-max", options.keep_alive_max_requests,
+                        "Requests served on one keep-alive connection before it is closed")
+            ->default_val(100);
+        cmd->add_option("--read-timeout", options.read_timeout, "Socket read timeout in seconds")
+            ->default_val(5);
+        cmd->add_option("--write-timeout", options.write_timeout, "Socket write timeout in seconds")
+            ->default_val(5);
+    };
+
+    auto serve_cmd = app.add_subcommand("serve", "Serve the tiles of an MBTiles archive over HTTP without the viewer pages");
+    add_logging_flags(serve_cmd);
+    add_open_flags(serve_cmd);
+    std::string serve_path;
+    mbtiles::ViewerOptions serve_options;
+    std::size_t serve_cache_mb = 64;
+
+    serve_cmd->add_option("mbtiles", serve_path, "Path to the MBTiles file")
+        ->required()
+        ->check(CLI::ExistingFile);
+    add_server_flags(serve_cmd, serve_options, serve_cache_mb);
+    add_prefetch_flags(serve_cmd, serve_options.prefetch, serve_options.prefetch_threads);
+
+    auto tilesets_cmd = app.add_subcommand(
+        "serve-tilesets", "Serve every archive of a directory or manifest as /{tileset}/{z}/{x}/{y}.{ext}");
+    add_logging_flags(tilesets_cmd);
+    add_open_flags(tilesets_cmd);
+    std::string tilesets_source;
+    mbtiles::ViewerOptions tilesets_options;
+    std::size_t tilesets_cache_mb = 64;
+
+    tilesets_cmd->add_option("source", tilesets_source,
+                             "Directory of .mbtiles files, or a manifest with one 'path' or 'name=path' per line")
+        ->required()
+        ->check(CLI::ExistingPath);
+    add_server_flags(tilesets_cmd, tilesets_options, tilesets_cache_mb);
+    tilesets_cmd->add_option("--max-open", tilesets_options.max_open_tilesets,
+                             "Archives kept open at once; the least recently used is closed first")
+        ->default_val(64);
 
     CLI11_PARSE(app, argc, argv);
 
@@ -154,9 +456,15 @@ int main(int argc, char **argv) {
 
     try {
         if (*extract_cmd) {
-            mbtiles::MBTiles mb(extract_input);
-            const auto count = mb.extract(extract_output, extract_pattern);
+            mbtiles::MBTiles mb(extract_input, make_open_options(true));
+            mbtiles::ExtractOptions options(extract_output, extract_pattern);
+            options.threads = extract_threads;
+            mbtiles::Metrics stats;
+            const auto count = mb.extract(options, stats);
             std::cout << "Extracted " << count << " tiles to '" << extract_output << "'" << std::endl;
+            if (show_stats) {
+                print_stats(stats);
+            }
             return EXIT_SUCCESS;
         }
 
@@ -178,20 +486,25 @@ int main(int argc, char **argv) {
                 options.zoom_levels = convert_levels;
             }
             options.grayscale = convert_grayscale;
+            options.compact_grayscale = convert_compact_grayscale;
             options.run_extract = convert_extract_opt->count() > 0;
+            options.streaming = convert_streaming;
+            options.memory_limit = convert_memory_limit_mb * 1024 * 1024;
+            options.threads = convert_threads;
+            options.deduplicate = convert_deduplicate;
+            options.encoder = encoder_options;
 
             const std::string format_lower = normalize_format(convert_format);
             if (format_lower == "png") {
                 options.format = mbtiles::Format::PNG;
             } else if (format_lower == "jpg") {
                 options.format = mbtiles::Format::JPG;
+            } else if (format_lower == "webp") {
+                options.format = mbtiles::Format::WEBP;
             } else {
                 options.format = mbtiles::Format::DEFAULT;
             }
 
-            mbtiles::MBTiles mb(convert_input);
-            auto converted = mb.convert(options);
-
             namespace fs = std::filesystem;
             auto build_default_output = [&]() {
                 fs::path input_path(convert_input);
@@ -209,8 +522,15 @@ int main(int argc, char **argv) {
             };
 
             fs::path output_path = convert_output_opt->count() > 0 ? fs::path(convert_output) : build_default_output();
-            converted.saveTo(output_path.string());
+            options.output_path = output_path.string();
+
+            mbtiles::MBTiles mb(convert_input, make_open_options(true));
+            mbtiles::Metrics stats;
+            auto converted = mb.convert(options, stats);
             std::cout << "Converted MBTiles written to '" << output_path.string() << "'" << std::endl;
+            if (show_stats) {
+                print_stats(stats);
+            }
 
             if (convert_extract_opt->count() > 0) {
                 const auto extracted = converted.extract(convert_extract_dir, convert_extract_pattern);
@@ -219,6 +539,99 @@ int main(int argc, char **argv) {
             return EXIT_SUCCESS;
         }
 
+        if (*import_cmd) {
+            std::string format_lower = import_format;
+            std::transform(format_lower.begin(), format_lower.end(), format_lower.begin(),
+                           [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+            if (format_lower == "png") {
+                import_options.format = mbtiles::Format::PNG;
+            } else if (format_lower == "jpg" || format_lower == "jpeg") {
+                import_options.format = mbtiles::Format::JPG;
+            } else if (format_lower == "webp") {
+                import_options.format = mbtiles::Format::WEBP;
+            }
+            import_options.encoder = encoder_options;
+            mbtiles::MBTiles mb(import_output);
+            const auto count = mb.importDirectory(import_directory, import_pattern, import_options);
+            std::cout << "Imported " << count << " tiles into '" << import_output << "'" << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        if (*rebuild_cmd) {
+            std::vector<mbtiles::TileCoord> changed;
+            mbtiles::MBTiles mb(rebuild_path, make_open_options(false));
+            if (rebuild_previous_opt->count() > 0) {
+                changed = mb.changedTiles(mbtiles::MBTiles(rebuild_previous), rebuild_zoom);
+            } else if (rebuild_tiles_opt->count() > 0) {
+                for (const std::string &token : rebuild_tiles) {
+                    mbtiles::TileCoord coord;
+                    char slash1 = 0;
+                    char slash2 = 0;
+                    std::istringstream stream(token);
+                    if (!(stream >> coord.zoom >> slash1 >> coord.x >> slash2 >> coord.y) || slash1 != '/' ||
+                        slash2 != '/' || !stream.eof()) {
+                        std::cerr << "Invalid tile '" << token << "', expected z/x/y" << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    changed.push_back(coord);
+                }
+            } else {
+                std::cerr << "Either --tiles or --previous is required" << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            mbtiles::RebuildOptions options;
+            options.grayscale = rebuild_grayscale;
+            options.compact_grayscale = rebuild_compact_grayscale;
+            options.threads = rebuild_threads;
+            std::string format_lower = rebuild_format;
+            std::transform(format_lower.begin(), format_lower.end(), format_lower.begin(),
+                           [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+            if (format_lower == "png") {
+                options.format = mbtiles::Format::PNG;
+            } else if (format_lower == "jpg" || format_lower == "jpeg") {
+                options.format = mbtiles::Format::JPG;
+            } else if (format_lower == "webp") {
+                options.format = mbtiles::Format::WEBP;
+            }
+            options.encoder = encoder_options;
+
+            const auto written = mb.rebuild(changed, options);
+            std::cout << "Rebuilt " << written << " tiles from " << changed.size() << " changed tiles" << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        if (*merge_cmd) {
+            auto lower = [](std::string value) {
+                std::transform(value.begin(), value.end(), value.begin(),
+                               [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+                return value;
+            };
+            mbtiles::MergeOptions options;
+            const std::string conflict_lower = lower(merge_conflict);
+            if (conflict_lower == "ignore") {
+                options.conflict = mbtiles::MergeConflict::IGNORE;
+            } else if (conflict_lower == "composite") {
+                options.conflict = mbtiles::MergeConflict::COMPOSITE;
+            }
+            const std::string format_lower = lower(merge_format);
+            if (format_lower == "png") {
+                options.format = mbtiles::Format::PNG;
+            } else if (format_lower == "jpg" || format_lower == "jpeg") {
+                options.format = mbtiles::Format::JPG;
+            } else if (format_lower == "webp") {
+                options.format = mbtiles::Format::WEBP;
+            }
+            options.encoder = encoder_options;
+            options.threads = merge_threads;
+
+            mbtiles::MBTiles mb(merge_output, make_open_options(false));
+            const auto written = mb.merge(merge_sources, options);
+            std::cout << "Merged " << merge_sources.size() << " archives, " << written << " tiles written"
+                      << std::endl;
+            return EXIT_SUCCESS;
+        }
+
         if (*metadata_list_cmd) {
             const auto metadata = mbtiles::MBTiles(metadata_list_path).metadata();
             for (const auto &entry : metadata) {
@@ -244,11 +657,105 @@ int main(int argc, char **argv) {
             return EXIT_SUCCESS;
         }
 
+        if (*stats_cmd) {
+            stats_options.duplicates = !stats_no_duplicates;
+            mbtiles::MBTiles mb(stats_path, make_open_options(!stats_options.update_metadata));
+            const mbtiles::ArchiveStats stats = mb.stats(stats_options);
+
+            auto format_bounds = [](const mbtiles::LatLonBounds &bounds) {
+                std::ostringstream out;
+                out << std::fixed << std::setprecision(6) << bounds.min_lon << ',' << bounds.min_lat << ','
+                    << bounds.max_lon << ',' << bounds.max_lat;
+                return out.str();
+            };
+
+            std::cout << std::left << std::setw(6) << "zoom" << std::right << std::setw(12) << "tiles"
+                      << std::setw(14) << "bytes" << std::setw(10) << "min" << std::setw(10) << "mean"
+                      << std::setw(10) << "max" << "  x range, y range\n";
+            for (const auto &level : stats.zooms) {
+                std::cout << std::left << std::setw(6) << level.zoom << std::right << std::setw(12) << level.tiles
+                          << std::setw(14) << level.bytes << std::setw(10) << level.min_size << std::setw(10)
+                          << level.bytes / level.tiles << std::setw(10) << level.max_size << "  " << level.min_x
+                          << '-' << level.max_x << ", " << level.min_y << '-' << level.max_y << "\n";
+            }
+            std::cout << std::left << std::setw(6) << "all" << std::right << std::setw(12) << stats.tiles
+                      << std::setw(14) << stats.bytes << "\n\n";
+
+            std::cout << std::left << std::setw(6) << "zoom" << std::right;
+            for (const std::size_t bound : mbtiles::kTileSizeBucketBounds) {
+                std::cout << std::setw(9) << ("<=" + (bound >= 1024 ? std::to_string(bound / 1024) + "K"
+                                                                    : std::to_string(bound)));
+            }
+            std::cout << std::setw(9) << ">4096K" << "\n";
+            for (const auto &level : stats.zooms) {
+                std::cout << std::left << std::setw(6) << level.zoom << std::right;
+                for (const std::uint64_t count : level.size_buckets) {
+                    std::cout << std::setw(9) << count;
+                }
+                std::cout << "\n";
+            }
+            std::cout << "\n";
+
+            std::cout << "formats:";
+            for (const auto &[format, count] : stats.formats) {
+                std::cout << ' ' << format << '=' << count;
+            }
+            std::cout << "\nempty tiles: " << stats.empty_tiles
+                      << "\nformat mismatches: " << stats.format_mismatches << "\n";
+            if (stats.unique_blobs) {
+                std::cout << "unique blobs: " << *stats.unique_blobs << " (" << std::fixed << std::setprecision(1)
+                          << stats.duplicateRatio() * 100.0 << "% duplicates, " << stats.duplicate_bytes
+                          << " bytes)\n";
+            }
+            if (stats.tile_bounds) {
+                std::cout << "tile bounds: " << format_bounds(*stats.tile_bounds) << "\n";
+            }
+            std::cout << "metadata bounds: "
+                      << (stats.metadata_bounds ? format_bounds(*stats.metadata_bounds) : std::string("-")) << "\n";
+            std::cout << "metadata zooms: "
+                      << (stats.metadata_min_zoom ? std::to_string(*stats.metadata_min_zoom) : std::string("-"))
+                      << '-'
+                      << (stats.metadata_max_zoom ? std::to_string(*stats.metadata_max_zoom) : std::string("-"))
+                      << "\n";
+            if (!stats.stale_metadata.empty()) {
+                std::cout << (stats_options.update_metadata ? "rewrote stale metadata:" : "stale metadata:");
+                for (const std::string &key : stats.stale_metadata) {
+                    std::cout << ' ' << key;
+                }
+                std::cout << "\n";
+            }
+            std::cout << std::flush;
+
+            const bool stale = !stats.stale_metadata.empty() && !stats_options.update_metadata;
+            return stats_check && (stale || stats.format_mismatches != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+
         if (*viewer_cmd) {
             std::cout << "Launching viewer for '" << viewer_path << "' at http://" << viewer_host << ":"
                       << viewer_port << std::endl;
             std::cout << "Press Ctrl+C to stop the server." << std::endl;
-            mbtiles::MBTiles(viewer_path).view(viewer_port, viewer_host);
+            mbtiles::ViewerOptions options;
+            options.host = viewer_host;
+            options.port = viewer_port;
+            options.cache_bytes = viewer_cache_mb * 1024 * 1024;
+            options.max_age = viewer_max_age;
+            options.prefetch = viewer_prefetch;
+            options.prefetch_threads = viewer_prefetch_threads;
+            mbtiles::MBTiles(viewer_path, make_open_options(true)).view(options);
+            return EXIT_SUCCESS;
+        }
+
+        if (*serve_cmd) {
+            serve_options.cache_bytes = serve_cache_mb * 1024 * 1024;
+            std::cout << "Press Ctrl+C to stop the server." << std::endl;
+            mbtiles::MBTiles(serve_path, make_open_options(true)).serve(serve_options);
+            return EXIT_SUCCESS;
+        }
+
+        if (*tilesets_cmd) {
+            tilesets_options.cache_bytes = tilesets_cache_mb * 1024 * 1024;
+            std::cout << "Press Ctrl+C to stop the server." << std::endl;
+            mbtiles::MBTiles::serveTilesets(tilesets_source, tilesets_options, make_open_options(true));
             return EXIT_SUCCESS;
         }
     } catch (const std::exception &ex) {
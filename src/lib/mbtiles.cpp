@@ -1,30 +1,54 @@
 #include "mbtiles.h"
 
 #include "aixlog.hpp"
+#include "mbtiles_metrics.h"
 #include "sqlite3.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cctype>
 #include <cmath>
+#include <condition_variable>
+#include <exception>
 #include <filesystem>
+#include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <limits>
+#include <locale>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <unordered_set>
 #include <sstream>
 #include <string>
 #include <system_error>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MBTILES_SIMD_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MBTILES_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -32,13 +56,26 @@
 #define STB_IMAGE_RESIZE2_IMPLEMENTATION
 #include "stb_image_resize2.h"
 
+#if defined(MBTILES_HAVE_LIBJPEG) || defined(MBTILES_HAVE_LIBPNG)
+#include <csetjmp>
+#endif
+#ifdef MBTILES_HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+#ifdef MBTILES_HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef MBTILES_HAVE_WEBP
+#include <webp/decode.h>
+#include <webp/encode.h>
+#endif
+
 
 namespace fs = std::filesystem;
 
 namespace mbtiles {
 
 using TileKey = std::uint64_t;
-using TileImageMap = std::unordered_map<TileKey, RGBAImage>;
 
 TileKey make_tile_key(int x, int y) {
     return (static_cast<TileKey>(static_cast<std::uint32_t>(x)) << 32) |
@@ -53,6 +90,201 @@ int tile_key_y(TileKey key) {
     return static_cast<int>(static_cast<std::int32_t>(key & 0xFFFFFFFFu));
 }
 
+std::uint64_t spread_bits(std::uint32_t value) {
+    std::uint64_t bits = value;
+    bits = (bits | (bits << 16)) & 0x0000FFFF0000FFFFULL;
+    bits = (bits | (bits << 8)) & 0x00FF00FF00FF00FFULL;
+    bits = (bits | (bits << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    bits = (bits | (bits << 2)) & 0x3333333333333333ULL;
+    bits = (bits | (bits << 1)) & 0x5555555555555555ULL;
+    return bits;
+}
+
+// Z-order position of a tile: x in the even bits, y in the odd ones. The two
+// low bits are the child index used by downsample_group() and the rest is
+// the parent's code, so siblings sort next to each other.
+std::uint64_t morton_code(TileKey key) {
+    return spread_bits(static_cast<std::uint32_t>(tile_key_x(key))) |
+           (spread_bits(static_cast<std::uint32_t>(tile_key_y(key))) << 1);
+}
+
+// Recycles tile pixel buffers across tiles and levels. Tiles of an archive
+// almost always share one size, so free buffers are kept per exact byte
+// size and handed out again without reallocating or clearing them.
+class PixelPool {
+  public:
+    // A buffer of exactly `size` bytes with unspecified contents.
+    std::vector<unsigned char> acquire(std::size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _free.find(size);
+            if (it != _free.end() && !it->second.empty()) {
+                std::vector<unsigned char> buffer = std::move(it->second.back());
+                it->second.pop_back();
+                _bytes -= size;
+                return buffer;
+            }
+        }
+        return std::vector<unsigned char>(size);
+    }
+
+    // Keeps `buffer` for a later acquire() of its size; a full pool simply
+    // frees it.
+    void release(std::vector<unsigned char> &&buffer) noexcept {
+        std::vector<unsigned char> retired = std::move(buffer);
+        const std::size_t size = retired.size();
+        if (size == 0) {
+            return;
+        }
+        try {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_bytes + size <= kCapacity) {
+                _free[size].push_back(std::move(retired));
+                _bytes += size;
+            }
+        } catch (...) {
+        }
+    }
+
+    // Returns every cached buffer to the allocator, e.g. once a conversion
+    // is done with its levels.
+    void trim() {
+        std::unordered_map<std::size_t, std::vector<std::vector<unsigned char>>> released;
+        std::lock_guard<std::mutex> lock(_mutex);
+        released.swap(_free);
+        _bytes = 0;
+    }
+
+  private:
+    // 256 tiles of 256x256 RGBA.
+    static constexpr std::size_t kCapacity = 64 * 1024 * 1024;
+
+    std::mutex _mutex;
+    std::unordered_map<std::size_t, std::vector<std::vector<unsigned char>>> _free;
+    std::size_t _bytes = 0;
+};
+
+PixelPool &pixel_pool() {
+    static PixelPool pool;
+    return pool;
+}
+
+// Sizes `image.pixels` to `size` bytes, taking a pooled buffer when the
+// current one is too small. Contents are unspecified.
+void size_pixels(RGBAImage &image, std::size_t size) {
+    if (image.pixels.capacity() < size) {
+        pixel_pool().release(std::move(image.pixels));
+        image.pixels = pixel_pool().acquire(size);
+    }
+    image.pixels.resize(size);
+}
+
+void recycle_pixels(RGBAImage &image) noexcept {
+    pixel_pool().release(std::move(image.pixels));
+    image.pixels.clear();
+}
+
+// Copy of `image` in a pooled buffer.
+RGBAImage pooled_copy(const RGBAImage &image) {
+    RGBAImage copy;
+    copy.width = image.width;
+    copy.height = image.height;
+    size_pixels(copy, image.pixels.size());
+    std::copy(image.pixels.begin(), image.pixels.end(), copy.pixels.begin());
+    return copy;
+}
+
+// Decoded tiles of one zoom level in one flat vector, ordered by
+// morton_code() once sealed: the four children of a parent are adjacent and
+// cache-friendly to merge. Tiles are appended in any order and seal() sorts
+// them, keeping the first of duplicate coordinates. Pixel buffers go back to
+// the pixel pool when the level is dropped.
+class TileLevel {
+  public:
+    using value_type = std::pair<TileKey, RGBAImage>;
+
+    TileLevel() = default;
+    TileLevel(TileLevel &&other) noexcept
+        : _entries(std::move(other._entries)), _sealed(other._sealed) {
+        other.clear();
+    }
+    TileLevel &operator=(TileLevel &&other) noexcept {
+        if (this != &other) {
+            clear();
+            _entries = std::move(other._entries);
+            _sealed = other._sealed;
+            other.clear();
+        }
+        return *this;
+    }
+    TileLevel(const TileLevel &) = delete;
+    TileLevel &operator=(const TileLevel &) = delete;
+    ~TileLevel() {
+        clear();
+    }
+
+    void reserve(std::size_t count) {
+        _entries.reserve(count);
+    }
+
+    void emplace(TileKey key, RGBAImage image) {
+        if (_sealed && !_entries.empty() && morton_code(_entries.back().first) >= morton_code(key)) {
+            _sealed = false;
+        }
+        _entries.emplace_back(key, std::move(image));
+    }
+
+    void seal() {
+        if (_sealed) {
+            return;
+        }
+        std::stable_sort(_entries.begin(), _entries.end(), [](const value_type &lhs, const value_type &rhs) {
+            return morton_code(lhs.first) < morton_code(rhs.first);
+        });
+        auto last = std::unique(_entries.begin(), _entries.end(),
+                                [](const value_type &lhs, const value_type &rhs) { return lhs.first == rhs.first; });
+        for (auto it = last; it != _entries.end(); ++it) {
+            recycle_pixels(it->second);
+        }
+        _entries.erase(last, _entries.end());
+        _sealed = true;
+    }
+
+    void clear() noexcept {
+        for (auto &entry : _entries) {
+            recycle_pixels(entry.second);
+        }
+        _entries.clear();
+        _sealed = true;
+    }
+
+    std::size_t size() const {
+        return _entries.size();
+    }
+    bool empty() const {
+        return _entries.empty();
+    }
+    const value_type &operator[](std::size_t index) const {
+        return _entries[index];
+    }
+    std::vector<value_type>::iterator begin() {
+        return _entries.begin();
+    }
+    std::vector<value_type>::iterator end() {
+        return _entries.end();
+    }
+    std::vector<value_type>::const_iterator begin() const {
+        return _entries.begin();
+    }
+    std::vector<value_type>::const_iterator end() const {
+        return _entries.end();
+    }
+
+  private:
+    std::vector<value_type> _entries;
+    bool _sealed = true;
+};
+
 AixLog::Severity to_aixlog_severity(LogLevel level) {
     switch (level) {
         case LogLevel::Trace:
@@ -121,16 +353,148 @@ void logDebug(const std::string &message) {
     LOG(DEBUG) << message;
 }
 
+StageMetrics operator-(const StageMetrics &later, const StageMetrics &earlier) {
+    StageMetrics delta;
+    delta.count = later.count - earlier.count;
+    delta.seconds = later.seconds - earlier.seconds;
+    for (std::size_t i = 0; i < delta.buckets.size(); ++i) {
+        delta.buckets[i] = later.buckets[i] - earlier.buckets[i];
+    }
+    return delta;
+}
+
+Metrics Metrics::operator-(const Metrics &earlier) const {
+    Metrics delta;
+    delta.sqlite_step = sqlite_step - earlier.sqlite_step;
+    delta.decode_png = decode_png - earlier.decode_png;
+    delta.decode_jpg = decode_jpg - earlier.decode_jpg;
+    delta.decode_webp = decode_webp - earlier.decode_webp;
+    delta.decode_other = decode_other - earlier.decode_other;
+    delta.encode_png = encode_png - earlier.encode_png;
+    delta.encode_jpg = encode_jpg - earlier.encode_jpg;
+    delta.encode_webp = encode_webp - earlier.encode_webp;
+    delta.resample = resample - earlier.resample;
+    delta.http_request = http_request - earlier.http_request;
+    delta.tiles_read = tiles_read - earlier.tiles_read;
+    delta.bytes_read = bytes_read - earlier.bytes_read;
+    delta.tiles_written = tiles_written - earlier.tiles_written;
+    delta.bytes_written = bytes_written - earlier.bytes_written;
+    delta.cache_hits = cache_hits - earlier.cache_hits;
+    delta.cache_misses = cache_misses - earlier.cache_misses;
+    delta.encode_cache_hits = encode_cache_hits - earlier.encode_cache_hits;
+    delta.tiles_prefetched = tiles_prefetched - earlier.tiles_prefetched;
+    return delta;
+}
+
+Metrics metrics() {
+    const MetricsRegistry &registry = metrics_registry();
+    Metrics snapshot;
+    snapshot.sqlite_step = registry.sqlite_step.snapshot();
+    snapshot.decode_png = registry.decode_png.snapshot();
+    snapshot.decode_jpg = registry.decode_jpg.snapshot();
+    snapshot.decode_webp = registry.decode_webp.snapshot();
+    snapshot.decode_other = registry.decode_other.snapshot();
+    snapshot.encode_png = registry.encode_png.snapshot();
+    snapshot.encode_jpg = registry.encode_jpg.snapshot();
+    snapshot.encode_webp = registry.encode_webp.snapshot();
+    snapshot.resample = registry.resample.snapshot();
+    snapshot.http_request = registry.http_request.snapshot();
+    snapshot.tiles_read = registry.tiles_read.load(std::memory_order_relaxed);
+    snapshot.bytes_read = registry.bytes_read.load(std::memory_order_relaxed);
+    snapshot.tiles_written = registry.tiles_written.load(std::memory_order_relaxed);
+    snapshot.bytes_written = registry.bytes_written.load(std::memory_order_relaxed);
+    snapshot.cache_hits = registry.cache_hits.load(std::memory_order_relaxed);
+    snapshot.cache_misses = registry.cache_misses.load(std::memory_order_relaxed);
+    snapshot.encode_cache_hits = registry.encode_cache_hits.load(std::memory_order_relaxed);
+    snapshot.tiles_prefetched = registry.tiles_prefetched.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void resetMetrics() {
+    MetricsRegistry &registry = metrics_registry();
+    for (LatencyHistogram *histogram :
+         {&registry.sqlite_step, &registry.decode_png, &registry.decode_jpg, &registry.decode_webp,
+          &registry.decode_other, &registry.encode_png, &registry.encode_jpg, &registry.encode_webp,
+          &registry.resample, &registry.http_request}) {
+        histogram->reset();
+    }
+    for (std::atomic<std::uint64_t> *counter :
+         {&registry.tiles_read, &registry.bytes_read, &registry.tiles_written, &registry.bytes_written,
+          &registry.cache_hits, &registry.cache_misses, &registry.encode_cache_hits,
+          &registry.tiles_prefetched}) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+}
+
+std::string metricsPrometheus() {
+    const Metrics snapshot = metrics();
+    std::ostringstream out;
+
+    auto histogram_header = [&out](const char *name, const char *help) {
+        out << "# HELP mbtiles_" << name << "_seconds " << help << "\n"
+            << "# TYPE mbtiles_" << name << "_seconds histogram\n";
+    };
+    // `label` is either empty or a `key="value"` pair
+    auto histogram = [&out](const char *name, const std::string &label, const StageMetrics &stage) {
+        const std::string prefix = label.empty() ? "{" : "{" + label + ",";
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < kMetricBucketBounds.size(); ++i) {
+            cumulative += stage.buckets[i];
+            out << "mbtiles_" << name << "_seconds_bucket" << prefix << "le=\"" << std::fixed
+                << std::setprecision(6) << kMetricBucketBounds[i] << "\"} " << cumulative << "\n";
+        }
+        out << std::defaultfloat << std::setprecision(9);
+        out << "mbtiles_" << name << "_seconds_bucket" << prefix << "le=\"+Inf\"} " << stage.count << "\n";
+        const std::string suffix = label.empty() ? "" : "{" + label + "}";
+        out << "mbtiles_" << name << "_seconds_sum" << suffix << " " << stage.seconds << "\n";
+        out << "mbtiles_" << name << "_seconds_count" << suffix << " " << stage.count << "\n";
+    };
+    auto counter = [&out](const char *name, const char *help, std::uint64_t value) {
+        out << "# HELP mbtiles_" << name << "_total " << help << "\n"
+            << "# TYPE mbtiles_" << name << "_total counter\n"
+            << "mbtiles_" << name << "_total " << value << "\n";
+    };
+
+    histogram_header("sqlite_step", "Time spent stepping SQLite statements.");
+    histogram("sqlite_step", "", snapshot.sqlite_step);
+    histogram_header("decode", "Time spent decoding tile images.");
+    histogram("decode", "format=\"png\"", snapshot.decode_png);
+    histogram("decode", "format=\"jpg\"", snapshot.decode_jpg);
+    histogram("decode", "format=\"webp\"", snapshot.decode_webp);
+    histogram("decode", "format=\"other\"", snapshot.decode_other);
+    histogram_header("encode", "Time spent encoding tile images.");
+    histogram("encode", "format=\"png\"", snapshot.encode_png);
+    histogram("encode", "format=\"jpg\"", snapshot.encode_jpg);
+    histogram("encode", "format=\"webp\"", snapshot.encode_webp);
+    histogram_header("resample", "Time spent downsampling or upsampling one group of tiles.");
+    histogram("resample", "", snapshot.resample);
+    histogram_header("http_request", "Time spent serving tile requests.");
+    histogram("http_request", "", snapshot.http_request);
+    counter("tiles_read", "Tiles read from archives.", snapshot.tiles_read);
+    counter("read_bytes", "Tile bytes read from archives.", snapshot.bytes_read);
+    counter("tiles_written", "Tiles inserted into archives or extracted to files.", snapshot.tiles_written);
+    counter("written_bytes", "Tile bytes inserted into archives or extracted to files.", snapshot.bytes_written);
+    counter("cache_hits", "Viewer tile cache hits.", snapshot.cache_hits);
+    counter("cache_misses", "Viewer tile cache misses.", snapshot.cache_misses);
+    counter("encode_cache_hits", "Converted tiles reused from an identical encoded tile.",
+            snapshot.encode_cache_hits);
+    counter("tiles_prefetched", "Viewer tiles loaded into the cache ahead of a request.", snapshot.tiles_prefetched);
+    return out.str();
+}
+
 
 
 MBTiles::MBTiles() : _name(""), _db(nullptr) {}
 
-MBTiles::MBTiles(const std::string& path) : _name(""), _db(nullptr) {
-    open(path);
+MBTiles::MBTiles(const std::string& path, const OpenOptions& options) : _name(""), _db(nullptr) {
+    open(path, options);
 }
 
-MBTiles::MBTiles(MBTiles&& other) noexcept : _name(std::move(other._name)), _db(other._db) {
+MBTiles::MBTiles(MBTiles&& other) noexcept
+    : _name(std::move(other._name)), _path(std::move(other._path)), _db(other._db),
+      _open_options(other._open_options), _statements(std::move(other._statements)) {
     other._db = nullptr;
+    other._statements.clear();
 }
 
 MBTiles& MBTiles::operator=(MBTiles&& other) noexcept {
@@ -139,8 +503,12 @@ MBTiles& MBTiles::operator=(MBTiles&& other) noexcept {
     }
     close();
     _name = std::move(other._name);
+    _path = std::move(other._path);
     _db = other._db;
+    _open_options = other._open_options;
+    _statements = std::move(other._statements);
     other._db = nullptr;
+    other._statements.clear();
     return *this;
 }
 
@@ -149,30 +517,99 @@ MBTiles::~MBTiles() {
 }
 
 void MBTiles::close() {
+    finalizeStatements();
     if (_db != nullptr) {
         sqlite3_close(_db);
     }
     _db = nullptr;
     _name.clear();
+    _path.clear();
 }
 
-void MBTiles::open(const std::string& path) {
-    if (path.empty()) {
-        throw std::invalid_argument("MBTiles path must not be empty");
+// "file:" URI for `path` with `query` appended, percent-encoding the
+// characters SQLite would otherwise read as URI syntax.
+std::string sqlite_file_uri(const std::string &path, const std::string &query) {
+    std::string absolute = std::filesystem::absolute(path).generic_string();
+    if (absolute.empty() || absolute.front() != '/') {
+        absolute.insert(absolute.begin(), '/');
     }
-    close();
-    if (sqlite3_open(path.c_str(), &_db) != SQLITE_OK) {
+
+    std::string uri = "file:";
+    for (unsigned char ch : absolute) {
+        if (ch == '%' || ch == '?' || ch == '#' || ch < 0x20 || ch >= 0x7f) {
+            char escaped[4];
+            std::snprintf(escaped, sizeof(escaped), "%%%02X", ch);
+            uri += escaped;
+        } else {
+            uri += static_cast<char>(ch);
+        }
+    }
+    return uri + "?" + query;
+}
+
+sqlite3 *MBTiles::openConnection(const std::string &path, const OpenOptions &options, int flags) {
+    const bool read_only = options.read_only || options.immutable;
+    flags |= read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    std::string location = path;
+    if (options.immutable) {
+        location = sqlite_file_uri(path, "immutable=1");
+        flags |= SQLITE_OPEN_URI;
+    }
+
+    sqlite3 *db = nullptr;
+    if (sqlite3_open_v2(location.c_str(), &db, flags, nullptr) != SQLITE_OK) {
         std::string message = "Unable to open MBTiles file: " + path;
-        if (_db != nullptr) {
+        if (db != nullptr) {
             message += ": ";
-            message += sqlite3_errmsg(_db);
-            sqlite3_close(_db);
+            message += sqlite3_errmsg(db);
+            sqlite3_close(db);
         }
         throw mbtiles_error(message);
     }
 
+    std::vector<std::string> pragmas;
+    if (options.mmap_size > 0) {
+        pragmas.push_back("PRAGMA mmap_size=" + std::to_string(options.mmap_size));
+    }
+    if (options.cache_size != 0) {
+        pragmas.push_back("PRAGMA cache_size=" + std::to_string(options.cache_size));
+    }
+    if (options.temp_store == OpenOptions::TempStore::FILE) {
+        pragmas.emplace_back("PRAGMA temp_store=FILE");
+    } else if (options.temp_store == OpenOptions::TempStore::MEMORY) {
+        pragmas.emplace_back("PRAGMA temp_store=MEMORY");
+    }
+    if (options.locking_mode == OpenOptions::LockingMode::EXCLUSIVE) {
+        pragmas.emplace_back("PRAGMA locking_mode=EXCLUSIVE");
+    }
+    for (const std::string &pragma : pragmas) {
+        if (sqlite3_exec(db, pragma.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+            const std::string message = "Failed to apply '" + pragma + "' to '" + path + "': " + sqlite3_errmsg(db);
+            sqlite3_close(db);
+            throw mbtiles_error(message);
+        }
+    }
+    return db;
+}
+
+void MBTiles::open(const std::string& path, const OpenOptions& options) {
+    if (path.empty()) {
+        throw std::invalid_argument("MBTiles path must not be empty");
+    }
+    close();
+    _db = openConnection(path, options);
+    _open_options = options;
+
     const std::filesystem::path file_path = std::filesystem::absolute(path);
     _name = file_path.filename().string();
+    // SQLite names no file for ":memory:" and temporary databases; those
+    // cannot be reopened or attached, so they keep an empty path.
+    const char *db_file = sqlite3_db_filename(_db, "main");
+    if (db_file == nullptr || *db_file == '\0') {
+        _path.clear();
+    } else {
+        _path = file_path.string();
+    }
 }
 
 struct stmt_deleter {
@@ -183,6 +620,80 @@ struct stmt_deleter {
     }
 };
 
+// Returns a cached statement to its idle state without finalizing it, so the
+// read transaction it holds is released as soon as the caller is done.
+struct stmt_resetter {
+    void operator()(sqlite3_stmt *stmt) const noexcept {
+        if (stmt != nullptr) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    }
+};
+
+using cached_stmt = std::unique_ptr<sqlite3_stmt, stmt_resetter>;
+
+constexpr std::string_view kTileLookupSql =
+    "SELECT tile_data FROM tiles WHERE zoom_level=?1 AND tile_column=?2 AND tile_row=?3 LIMIT 1";
+constexpr std::string_view kTileRangeSql =
+    "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level=?1 AND tile_column BETWEEN ?2 AND ?3 "
+    "AND tile_row BETWEEN ?4 AND ?5 ORDER BY tile_column, tile_row";
+constexpr std::string_view kMinZoomSql = "SELECT MIN(zoom_level) FROM tiles";
+constexpr std::string_view kMaxZoomSql = "SELECT MAX(zoom_level) FROM tiles";
+constexpr std::string_view kZoomLevelsSql = "SELECT DISTINCT zoom_level FROM tiles ORDER BY zoom_level";
+constexpr std::string_view kMetadataReadSql = "SELECT name, value FROM metadata ORDER BY name";
+constexpr std::string_view kMetadataKeysSql = "SELECT name FROM metadata ORDER BY name";
+constexpr std::string_view kMetadataUpsertSql =
+    "INSERT INTO metadata(name, value) VALUES(?1, ?2) ON CONFLICT(name) DO UPDATE SET value=excluded.value";
+constexpr std::string_view kMetadataInsertSql = "INSERT INTO metadata(name, value) VALUES(?1, ?2)";
+constexpr std::string_view kTileInsertSql =
+    "INSERT INTO tiles(zoom_level, tile_column, tile_row, tile_data) VALUES(?1, ?2, ?3, ?4)";
+constexpr std::string_view kTileUpsertSql =
+    "INSERT OR REPLACE INTO tiles(zoom_level, tile_column, tile_row, tile_data) VALUES(?1, ?2, ?3, ?4)";
+constexpr std::string_view kMapInsertSql =
+    "INSERT INTO map(zoom_level, tile_column, tile_row, tile_id) VALUES(?1, ?2, ?3, ?4)";
+constexpr std::string_view kImageInsertSql = "INSERT INTO images(tile_id, tile_data) VALUES(?1, ?2)";
+constexpr std::string_view kTileRangeDeleteSql =
+    "DELETE FROM tiles WHERE zoom_level=?1 AND tile_column BETWEEN ?2 AND ?3 AND tile_row BETWEEN ?4 AND ?5";
+
+sqlite3_stmt *MBTiles::cachedStatement(std::string_view sql) const {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+
+    // C++17 has no heterogeneous lookup for unordered_map; the key copy is
+    // small next to the step it saves.
+    std::vector<sqlite3_stmt *> &siblings = _statements[std::string(sql)];
+    for (sqlite3_stmt *stmt : siblings) {
+        // Busy means an outer caller is still reading its rows.
+        if (!sqlite3_stmt_busy(stmt)) {
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            return stmt;
+        }
+    }
+
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v3(_db, sql.data(), static_cast<int>(sql.size()), SQLITE_PREPARE_PERSISTENT, &stmt,
+                           nullptr) != SQLITE_OK) {
+        if (stmt != nullptr) {
+            sqlite3_finalize(stmt);
+        }
+        throw mbtiles_error("Failed to prepare statement '" + std::string(sql) + "': " + sqlite3_errmsg(_db));
+    }
+    siblings.push_back(stmt);
+    return stmt;
+}
+
+void MBTiles::finalizeStatements() noexcept {
+    for (auto &entry : _statements) {
+        for (sqlite3_stmt *stmt : entry.second) {
+            sqlite3_finalize(stmt);
+        }
+    }
+    _statements.clear();
+}
+
 
 
 bool equals_ignore_case(const std::string &lhs, const std::string &rhs) {
@@ -197,26 +708,32 @@ bool equals_ignore_case(const std::string &lhs, const std::string &rhs) {
     return true;
 }
 
-std::string detect_extension(const void *data, int size) {
+// Same detection as detect_extension(), but returns a static token without
+// the leading dot so hot paths can hand it out without allocating.
+std::string_view detect_extension_token(const void *data, int size) {
     if (data == nullptr || size <= 0) {
-        return ".bin";
+        return "bin";
     }
 
     const unsigned char *bytes = static_cast<const unsigned char *>(data);
     if (size >= 8) {
         if (bytes[0] == 0x89 && bytes[1] == 0x50 && bytes[2] == 0x4E && bytes[3] == 0x47) {
-            return ".png";
+            return "png";
         }
         if (bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF) {
-            return ".jpg";
+            return "jpg";
         }
         if (size >= 12 && bytes[0] == 0x52 && bytes[1] == 0x49 && bytes[2] == 0x46 && bytes[3] == 0x46 &&
             bytes[8] == 0x57 && bytes[9] == 0x45 && bytes[10] == 0x42 && bytes[11] == 0x50) {
-            return ".webp";
+            return "webp";
         }
     }
 
-    return ".bin";
+    return "bin";
+}
+
+std::string detect_extension(const void *data, int size) {
+    return "." + std::string(detect_extension_token(data, size));
 }
 
 std::string extension_without_dot(const std::string &ext) {
@@ -261,16 +778,57 @@ std::string trim_copy(const std::string &value) {
     return value.substr(first, last - first + 1);
 }
 
-std::vector<unsigned char> encode_image_for_format(const RGBAImage &image, const std::string &format_token) {
+std::vector<unsigned char> encode_image_for_format(const RGBAImage &image, const std::string &format_token,
+                                                   const EncoderOptions &encoder = {}) {
+    if (equals_ignore_case(format_token, "png")) {
+        return image.encodePng(encoder.png_compression);
+    }
+    if (equals_ignore_case(format_token, "jpg") || equals_ignore_case(format_token, "jpeg")) {
+        return image.encodeJpg(encoder.jpeg_quality);
+    }
+    if (equals_ignore_case(format_token, "webp")) {
+        return image.encodeWebp(encoder.webp_quality, encoder.webp_lossless);
+    }
+    throw mbtiles_error("Unsupported output format: " + format_token);
+}
+
+// Grayscale counterpart of encode_image_for_format(): the encoder receives
+// the luma plane directly instead of a grayscaled RGBA copy. WebP has no
+// gray layout, so it still gets the RGBA copy.
+std::vector<unsigned char> encode_gray_for_format(const RGBAImage &image, const std::string &format_token,
+                                                  const EncoderOptions &encoder = {}) {
     if (equals_ignore_case(format_token, "png")) {
-        return image.encodePng();
+        return image.encodeGrayPng(encoder.png_compression);
     }
     if (equals_ignore_case(format_token, "jpg") || equals_ignore_case(format_token, "jpeg")) {
-        return image.encodeJpg();
+        return image.encodeGrayJpg(encoder.jpeg_quality);
+    }
+    if (equals_ignore_case(format_token, "webp")) {
+        RGBAImage gray = pooled_copy(image);
+        gray.toGrayScale();
+        auto encoded = gray.encodeWebp(encoder.webp_quality, encoder.webp_lossless);
+        recycle_pixels(gray);
+        return encoded;
     }
     throw mbtiles_error("Unsupported output format: " + format_token);
 }
 
+// Encodes a generated tile the way convert() and rebuild() store it.
+std::vector<unsigned char> encode_output_tile(const RGBAImage &image, const std::string &format_token, bool grayscale,
+                                              bool compact_grayscale, const EncoderOptions &encoder = {}) {
+    if (grayscale && compact_grayscale) {
+        return encode_gray_for_format(image, format_token, encoder);
+    }
+    if (grayscale) {
+        RGBAImage gray = pooled_copy(image);
+        gray.toGrayScale();
+        auto encoded = encode_image_for_format(gray, format_token, encoder);
+        recycle_pixels(gray);
+        return encoded;
+    }
+    return encode_image_for_format(image, format_token, encoder);
+}
+
 std::string resolve_format_token(Format requested, const std::map<std::string, std::string> &metadata) {
     if (requested == Format::PNG) {
         return "png";
@@ -278,11 +836,14 @@ std::string resolve_format_token(Format requested, const std::map<std::string, s
     if (requested == Format::JPG) {
         return "jpg";
     }
+    if (requested == Format::WEBP) {
+        return "webp";
+    }
 
     auto it = metadata.find("format");
     if (it != metadata.end()) {
         const std::string normalized = normalize_extension_token(it->second);
-        if (normalized == "png" || normalized == "jpg") {
+        if (normalized == "png" || normalized == "jpg" || normalized == "webp") {
             return normalized;
         }
         if (normalized == "jpeg") {
@@ -387,115 +948,426 @@ std::optional<int> find_nearest_available_level(const std::set<int> &known_level
     return higher;
 }
 
-TileImageMap downsample_level(const TileImageMap &source_tiles) {
-    struct ParentGroup {
-        std::array<bool, 4> present = {false, false, false, false};
-        std::array<RGBAImage, 4> images;
+unsigned resolve_thread_count(unsigned requested) {
+    if (requested != 0) {
+        return requested;
+    }
+    const unsigned hardware = std::thread::hardware_concurrency();
+    return hardware == 0 ? 1 : hardware;
+}
+
+// Runs `fn(worker)` on `workers` threads, the calling thread being worker 0.
+// The first exception thrown by any worker is rethrown once all have joined.
+void run_workers(unsigned workers, const std::function<void(unsigned)> &fn) {
+    if (workers <= 1) {
+        fn(0);
+        return;
+    }
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto guarded = [&](unsigned worker) {
+        try {
+            fn(worker);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
     };
 
-    std::unordered_map<TileKey, ParentGroup> groups;
-    for (const auto &entry : source_tiles) {
-        const int child_x = tile_key_x(entry.first);
-        const int child_y = tile_key_y(entry.first);
-        const int parent_x = child_x / 2;
-        const int parent_y = child_y / 2;
-        const int idx = (child_y % 2) * 2 + (child_x % 2);
-        auto &group = groups[make_tile_key(parent_x, parent_y)];
-        group.present[idx] = true;
-        group.images[idx] = entry.second;
-    }
-
-    TileImageMap result;
-    for (auto &pair : groups) {
-        const ParentGroup &group = pair.second;
-        if (!std::all_of(group.present.begin(), group.present.end(), [](bool present) { return present; })) {
-            continue;
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    try {
+        for (unsigned worker = 1; worker < workers; ++worker) {
+            threads.emplace_back(guarded, worker);
         }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        error = std::current_exception();
+    }
+    if (!error) {
+        guarded(0);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
 
-        const int child_width = group.images[0].width;
-        const int child_height = group.images[0].height;
-        if (child_width <= 0 || child_height <= 0) {
-            continue;
+// Calls `fn(index)` for every index in [0, count) on up to `threads` threads.
+// Indices are handed out one at a time so slow tiles do not stall a worker's
+// whole share; once an index throws, the remaining ones are skipped.
+void parallel_for(std::size_t count, unsigned threads, const std::function<void(std::size_t)> &fn) {
+    const unsigned workers = static_cast<unsigned>(std::min<std::size_t>(threads, count));
+    if (workers <= 1) {
+        for (std::size_t index = 0; index < count; ++index) {
+            fn(index);
         }
+        return;
+    }
 
-        bool consistent = true;
-        for (const auto &img : group.images) {
-            if (img.width != child_width || img.height != child_height) {
-                consistent = false;
-                break;
+    std::atomic<std::size_t> next{0};
+    std::atomic<bool> failed{false};
+    run_workers(workers, [&](unsigned) {
+        try {
+            for (std::size_t index = next++; index < count && !failed; index = next++) {
+                fn(index);
             }
+        } catch (...) {
+            failed = true;
+            throw;
         }
-        if (!consistent) {
-            continue;
+    });
+}
+
+bool has_translucent_pixels(const std::vector<unsigned char> &rgba) {
+    for (std::size_t i = 3; i < rgba.size(); i += 4) {
+        if (rgba[i] != 255) {
+            return true;
         }
+    }
+    return false;
+}
 
-        const int canvas_width = child_width * 2;
-        const int canvas_height = child_height * 2;
-        std::vector<unsigned char> canvas(static_cast<std::size_t>(canvas_width) * canvas_height * 4, 0);
+// Averages 2x2 blocks of two RGBA rows into `count` output pixels, i.e.
+// (a + b + c + d + 2) >> 2 per channel.
+inline void box_rows_scalar(const unsigned char *top, const unsigned char *bottom, unsigned char *dst, int count) {
+    for (int i = 0; i < count * 4; ++i) {
+        const int pixel = i / 4;
+        const int channel = i % 4;
+        const int left = pixel * 8 + channel;
+        dst[i] = static_cast<unsigned char>((top[left] + top[left + 4] + bottom[left] + bottom[left + 4] + 2) >> 2);
+    }
+}
 
-        for (int idx = 0; idx < 4; ++idx) {
-            const int offset_x = (idx % 2) * child_width;
-            const int offset_y = (idx / 2) * child_height;
-            for (int row = 0; row < child_height; ++row) {
-                unsigned char *dest = canvas.data() + ((offset_y + row) * canvas_width + offset_x) * 4;
-                const unsigned char *src = group.images[idx].pixels.data() + static_cast<std::size_t>(row) * child_width * 4;
-                std::memcpy(dest, src, static_cast<std::size_t>(child_width) * 4);
+inline void box_rows(const unsigned char *top, const unsigned char *bottom, unsigned char *dst, int count) {
+    int done = 0;
+#if defined(MBTILES_SIMD_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    // Four output pixels per step: rows are added in 16 bits, then the two
+    // pixels of each horizontal pair are folded onto each other.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    auto pair_sums = [&](__m128i t, __m128i b) {
+        const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(t, zero), _mm_unpacklo_epi8(b, zero));
+        const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(t, zero), _mm_unpackhi_epi8(b, zero));
+        return _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)), _mm_add_epi16(hi, _mm_srli_si128(hi, 8)));
+    };
+    for (; done + 4 <= count; done += 4) {
+        const auto *t = reinterpret_cast<const __m128i *>(top + done * 8);
+        const auto *b = reinterpret_cast<const __m128i *>(bottom + done * 8);
+        const __m128i first = pair_sums(_mm_loadu_si128(t), _mm_loadu_si128(b));
+        const __m128i second = pair_sums(_mm_loadu_si128(t + 1), _mm_loadu_si128(b + 1));
+        const __m128i avg_first = _mm_srli_epi16(_mm_add_epi16(first, round), 2);
+        const __m128i avg_second = _mm_srli_epi16(_mm_add_epi16(second, round), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + done * 4), _mm_packus_epi16(avg_first, avg_second));
+    }
+#elif defined(MBTILES_SIMD_NEON)
+    // vld2q_u32 splits eight pixels into even and odd ones, which are exactly
+    // the left and right members of each 2x2 block.
+    for (; done + 4 <= count; done += 4) {
+        const uint32x4x2_t t = vld2q_u32(reinterpret_cast<const uint32_t *>(top + done * 8));
+        const uint32x4x2_t b = vld2q_u32(reinterpret_cast<const uint32_t *>(bottom + done * 8));
+        const uint8x16_t te = vreinterpretq_u8_u32(t.val[0]);
+        const uint8x16_t to = vreinterpretq_u8_u32(t.val[1]);
+        const uint8x16_t be = vreinterpretq_u8_u32(b.val[0]);
+        const uint8x16_t bo = vreinterpretq_u8_u32(b.val[1]);
+        const uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(te), vget_low_u8(to)),
+                                        vaddl_u8(vget_low_u8(be), vget_low_u8(bo)));
+        const uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(te), vget_high_u8(to)),
+                                        vaddl_u8(vget_high_u8(be), vget_high_u8(bo)));
+        vst1q_u8(dst + done * 4, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+    }
+#endif
+    box_rows_scalar(top + done * 8, bottom + done * 8, dst + done * 4, count - done);
+}
+
+// Alpha-weighted 2x2 average, so fully transparent pixels (whose color is
+// arbitrary) do not bleed into their neighbours.
+inline void box_rows_alpha(const unsigned char *top, const unsigned char *bottom, unsigned char *dst, int count) {
+    for (int pixel = 0; pixel < count; ++pixel) {
+        const unsigned char *block[4] = {top + pixel * 8, top + pixel * 8 + 4, bottom + pixel * 8,
+                                         bottom + pixel * 8 + 4};
+        const unsigned alpha = block[0][3] + block[1][3] + block[2][3] + block[3][3];
+        unsigned char *out = dst + pixel * 4;
+        for (int channel = 0; channel < 3; ++channel) {
+            unsigned weighted = 0;
+            for (const unsigned char *px : block) {
+                weighted += px[channel] * px[3];
             }
+            out[channel] = alpha == 0 ? 0 : static_cast<unsigned char>((weighted + alpha / 2) / alpha);
+        }
+        out[3] = static_cast<unsigned char>((alpha + 2) >> 2);
+    }
+}
+
+// Halves one child into its quadrant of the parent. `Width` fixes the tile
+// width at compile time for the common sizes so the row loop is fully
+// unrolled; 0 takes the width from `width`.
+template <int Width>
+void downsample_quadrant(const RGBAImage &child, int width, unsigned char *dst, std::size_t dst_stride) {
+    const int row_width = Width != 0 ? Width : width;
+    const std::size_t src_stride = static_cast<std::size_t>(row_width) * 4;
+    const bool translucent = has_translucent_pixels(child.pixels);
+    for (int row = 0; row < child.height / 2; ++row) {
+        const unsigned char *top = child.pixels.data() + static_cast<std::size_t>(row) * 2 * src_stride;
+        unsigned char *out = dst + static_cast<std::size_t>(row) * dst_stride;
+        if (translucent) {
+            box_rows_alpha(top, top + src_stride, out, row_width / 2);
+        } else {
+            box_rows(top, top + src_stride, out, row_width / 2);
         }
+    }
+}
 
-        std::vector<unsigned char> resized(static_cast<std::size_t>(child_width) * child_height * 4, 0);
-        if (!stbir_resize_uint8_linear(canvas.data(), canvas_width, canvas_height, canvas_width * 4, resized.data(),
-                                       child_width, child_height, child_width * 4, STBIR_RGBA)) {
-            throw mbtiles_error("Failed to downsample tile group");
+// Fallback for odd tile sizes, which have no exact 2x2 blocks: assembles the
+// children on a 2x canvas and resamples it.
+bool downsample_group_resampled(const std::array<const RGBAImage *, 4> &children, RGBAImage &parent) {
+    const int child_width = children[0]->width;
+    const int child_height = children[0]->height;
+    const int canvas_width = child_width * 2;
+    const int canvas_height = child_height * 2;
+    std::vector<unsigned char> canvas = pixel_pool().acquire(static_cast<std::size_t>(canvas_width) * canvas_height * 4);
+
+    for (int idx = 0; idx < 4; ++idx) {
+        const int offset_x = (idx % 2) * child_width;
+        const int offset_y = (idx / 2) * child_height;
+        for (int row = 0; row < child_height; ++row) {
+            unsigned char *dest = canvas.data() + ((offset_y + row) * canvas_width + offset_x) * 4;
+            const unsigned char *src = children[idx]->pixels.data() + static_cast<std::size_t>(row) * child_width * 4;
+            std::memcpy(dest, src, static_cast<std::size_t>(child_width) * 4);
         }
+    }
 
-        RGBAImage parent_image;
-        parent_image.width = child_width;
-        parent_image.height = child_height;
-        parent_image.pixels = std::move(resized);
-        result.emplace(pair.first, std::move(parent_image));
+    size_pixels(parent, static_cast<std::size_t>(child_width) * child_height * 4);
+    const bool resized = stbir_resize_uint8_linear(canvas.data(), canvas_width, canvas_height, canvas_width * 4,
+                                                   parent.pixels.data(), child_width, child_height, child_width * 4,
+                                                   STBIR_RGBA) != nullptr;
+    pixel_pool().release(std::move(canvas));
+    if (!resized) {
+        throw mbtiles_error("Failed to downsample tile group");
     }
 
-    return result;
+    parent.width = child_width;
+    parent.height = child_height;
+    return true;
 }
 
-TileImageMap upsample_level(const TileImageMap &source_tiles) {
-    TileImageMap result;
-    for (const auto &entry : source_tiles) {
-        const int parent_x = tile_key_x(entry.first);
-        const int parent_y = tile_key_y(entry.first);
-        const RGBAImage &parent = entry.second;
-        if (parent.width <= 0 || parent.height <= 0 || parent.pixels.empty()) {
-            continue;
+// Merges four equally sized children (ordered top-left, top-right,
+// bottom-left, bottom-right) into one parent tile of the same size with a
+// 2x2 box filter, reading the children in place.
+// Returns false when the children are empty or their sizes disagree.
+bool downsample_group(const std::array<const RGBAImage *, 4> &children, RGBAImage &parent) {
+    StageTimer timer(metrics_registry().resample);
+    const int child_width = children[0]->width;
+    const int child_height = children[0]->height;
+    if (child_width <= 0 || child_height <= 0) {
+        return false;
+    }
+
+    for (const RGBAImage *img : children) {
+        if (img->width != child_width || img->height != child_height ||
+            img->pixels.size() != static_cast<std::size_t>(child_width) * child_height * 4) {
+            return false;
+        }
+    }
+
+    if (child_width % 2 != 0 || child_height % 2 != 0) {
+        return downsample_group_resampled(children, parent);
+    }
+
+    // The four quadrants cover every pixel, so a recycled buffer needs no
+    // clearing.
+    parent.width = child_width;
+    parent.height = child_height;
+    size_pixels(parent, static_cast<std::size_t>(child_width) * child_height * 4);
+
+    const std::size_t stride = static_cast<std::size_t>(child_width) * 4;
+    for (int idx = 0; idx < 4; ++idx) {
+        unsigned char *dst = parent.pixels.data() + static_cast<std::size_t>(idx / 2) * (child_height / 2) * stride +
+                             static_cast<std::size_t>(idx % 2) * (child_width / 2) * 4;
+        switch (child_width) {
+        case 256:
+            downsample_quadrant<256>(*children[idx], child_width, dst, stride);
+            break;
+        case 512:
+            downsample_quadrant<512>(*children[idx], child_width, dst, stride);
+            break;
+        default:
+            downsample_quadrant<0>(*children[idx], child_width, dst, stride);
+            break;
+        }
+    }
+    return true;
+}
+
+// 2x bilinear upsample. Output pixel 2i + d sits a quarter pixel from source
+// pixel i towards its neighbour on side d, so it takes 3/4 of the near pixel
+// and 1/4 of the far one along each axis: weights 9/3/3/1 out of 16.
+// Neighbours are clamped at the tile border. The vertical 3:1 blend of a
+// source row pair is computed once and shared by both children in that row.
+template <int Width>
+void upsample_into_children(const RGBAImage &parent, std::array<RGBAImage, 4> &children) {
+    const int width = Width != 0 ? Width : parent.width;
+    const int height = parent.height;
+    const std::size_t stride = static_cast<std::size_t>(width) * 4;
+    for (RGBAImage &child : children) {
+        child.width = width;
+        child.height = height;
+        size_pixels(child, static_cast<std::size_t>(width) * height * 4);
+    }
+
+    std::vector<std::uint16_t> blended(stride);
+    auto horizontal = [&](int target, unsigned char *out) {
+        const int source = target / 2;
+        const int neighbour = std::clamp(target % 2 == 0 ? source - 1 : source + 1, 0, width - 1);
+        for (int channel = 0; channel < 4; ++channel) {
+            out[channel] = static_cast<unsigned char>(
+                (3 * blended[source * 4 + channel] + blended[neighbour * 4 + channel] + 8) >> 4);
+        }
+    };
+
+    for (int target_row = 0; target_row < height * 2; ++target_row) {
+        const int source_row = target_row / 2;
+        const int neighbour_row =
+            std::clamp(target_row % 2 == 0 ? source_row - 1 : source_row + 1, 0, height - 1);
+        const unsigned char *near_row = parent.pixels.data() + source_row * stride;
+        const unsigned char *far_row = parent.pixels.data() + neighbour_row * stride;
+        for (std::size_t i = 0; i < stride; ++i) {
+            blended[i] = static_cast<std::uint16_t>(3 * near_row[i] + far_row[i]);
         }
 
-        const int expanded_width = parent.width * 2;
-        const int expanded_height = parent.height * 2;
-        std::vector<unsigned char> expanded(static_cast<std::size_t>(expanded_width) * expanded_height * 4, 0);
-        if (!stbir_resize_uint8_linear(parent.pixels.data(), parent.width, parent.height, parent.width * 4, expanded.data(),
-                                       expanded_width, expanded_height, expanded_width * 4, STBIR_RGBA)) {
-            throw mbtiles_error("Failed to upsample tile");
-        }
-
-        for (int dy = 0; dy < 2; ++dy) {
-            for (int dx = 0; dx < 2; ++dx) {
-                RGBAImage child;
-                child.width = parent.width;
-                child.height = parent.height;
-                child.pixels.resize(static_cast<std::size_t>(child.width) * child.height * 4);
-                for (int row = 0; row < child.height; ++row) {
-                    const unsigned char *src = expanded.data() +
-                                               ((row + dy * child.height) * expanded_width + dx * child.width) * 4;
-                    unsigned char *dest = child.pixels.data() + static_cast<std::size_t>(row) * child.width * 4;
-                    std::memcpy(dest, src, static_cast<std::size_t>(child.width) * 4);
+        const int dy = target_row / height;
+        const std::size_t child_row = static_cast<std::size_t>(target_row % height);
+        for (int dx = 0; dx < 2; ++dx) {
+            unsigned char *out = children[dy * 2 + dx].pixels.data() + child_row * stride;
+            const int first = dx * width;
+            if (width % 2 != 0) {
+                for (int t = 0; t < width; ++t) {
+                    horizontal(first + t, out + t * 4);
                 }
+                continue;
+            }
 
-                const int child_x = parent_x * 2 + dx;
-                const int child_y = parent_y * 2 + dy;
-                result.emplace(make_tile_key(child_x, child_y), std::move(child));
+            // Even widths: every source pixel yields one output pair, and only
+            // the pairs at the tile border need clamping.
+            const int first_source = first / 2;
+            const int last_source = first_source + width / 2 - 1;
+            int source = first_source;
+            if (source == 0) {
+                horizontal(0, out);
+                horizontal(1, out + 4);
+                ++source;
+            }
+            const int interior_end = last_source == width - 1 ? last_source : last_source + 1;
+            for (; source < interior_end; ++source) {
+                const std::uint16_t *mid = blended.data() + source * 4;
+                unsigned char *pair = out + (source - first_source) * 8;
+                for (int channel = 0; channel < 4; ++channel) {
+                    const int centre = 3 * mid[channel];
+                    pair[channel] = static_cast<unsigned char>((centre + mid[channel - 4] + 8) >> 4);
+                    pair[channel + 4] = static_cast<unsigned char>((centre + mid[channel + 4] + 8) >> 4);
+                }
             }
+            if (source == last_source) {
+                horizontal(source * 2, out + (source * 2 - first) * 4);
+                horizontal(source * 2 + 1, out + (source * 2 + 1 - first) * 4);
+            }
+        }
+    }
+}
+
+// Splits a tile into its four children (same order as downsample_group),
+// each bilinearly upsampled to the parent's size and written in place
+// without an intermediate 2x canvas.
+std::array<RGBAImage, 4> upsample_tile(const RGBAImage &parent) {
+    StageTimer timer(metrics_registry().resample);
+    std::array<RGBAImage, 4> children;
+    switch (parent.width) {
+    case 256:
+        upsample_into_children<256>(parent, children);
+        break;
+    case 512:
+        upsample_into_children<512>(parent, children);
+        break;
+    default:
+        upsample_into_children<0>(parent, children);
+        break;
+    }
+    return children;
+}
+
+// Siblings are adjacent in a sealed level, so parents are found in one pass
+// and come out in Morton order themselves.
+TileLevel downsample_level(TileLevel &source_tiles, unsigned threads = 1) {
+    source_tiles.seal();
+    std::vector<std::pair<TileKey, std::array<const RGBAImage *, 4>>> complete;
+    complete.reserve(source_tiles.size() / 4);
+    for (std::size_t first = 0; first < source_tiles.size();) {
+        const std::uint64_t parent_code = morton_code(source_tiles[first].first) >> 2;
+        std::array<const RGBAImage *, 4> children{};
+        std::size_t next = first;
+        for (; next < source_tiles.size() && morton_code(source_tiles[next].first) >> 2 == parent_code; ++next) {
+            children[morton_code(source_tiles[next].first) & 3U] = &source_tiles[next].second;
+        }
+        if (next - first == 4) {
+            const TileKey child = source_tiles[first].first;
+            complete.emplace_back(make_tile_key(tile_key_x(child) / 2, tile_key_y(child) / 2), children);
+        }
+        first = next;
+    }
+
+    std::vector<RGBAImage> parents(complete.size());
+    std::vector<char> valid(complete.size(), 0);
+    parallel_for(complete.size(), threads, [&](std::size_t index) {
+        valid[index] = downsample_group(complete[index].second, parents[index]) ? 1 : 0;
+    });
+
+    TileLevel result;
+    result.reserve(complete.size());
+    for (std::size_t index = 0; index < complete.size(); ++index) {
+        if (valid[index] != 0) {
+            result.emplace(complete[index].first, std::move(parents[index]));
+        } else {
+            recycle_pixels(parents[index]);
+        }
+    }
+
+    return result;
+}
+
+TileLevel upsample_level(const TileLevel &source_tiles, unsigned threads = 1) {
+    std::vector<const TileLevel::value_type *> parents;
+    parents.reserve(source_tiles.size());
+    for (const auto &entry : source_tiles) {
+        const RGBAImage &parent = entry.second;
+        if (parent.width > 0 && parent.height > 0 && !parent.pixels.empty()) {
+            parents.push_back(&entry);
+        }
+    }
+
+    std::vector<std::array<RGBAImage, 4>> children(parents.size());
+    parallel_for(parents.size(), threads, [&](std::size_t index) {
+        children[index] = upsample_tile(parents[index]->second);
+    });
+
+    // Children of a parent follow it in Morton order, so the result stays
+    // sorted when the source was.
+    TileLevel result;
+    result.reserve(parents.size() * 4);
+    for (std::size_t index = 0; index < parents.size(); ++index) {
+        const int parent_x = tile_key_x(parents[index]->first);
+        const int parent_y = tile_key_y(parents[index]->first);
+        for (int idx = 0; idx < 4; ++idx) {
+            const int child_x = parent_x * 2 + idx % 2;
+            const int child_y = parent_y * 2 + idx / 2;
+            result.emplace(make_tile_key(child_x, child_y), std::move(children[index][idx]));
         }
     }
+    result.seal();
 
     return result;
 }
@@ -515,7 +1387,7 @@ std::string read_metadata_format_extension(sqlite3 *db) {
     }
 
     std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
-    const int rc = sqlite3_step(stmt.get());
+    const int rc = timed_step(stmt.get());
     if (rc == SQLITE_ROW) {
         const unsigned char *text = sqlite3_column_text(stmt.get(), 0);
         if (text != nullptr) {
@@ -637,15 +1509,364 @@ bool is_supported_image_extension(const fs::path &path) {
            equals_ignore_case(ext, ".jpeg");
 }
 
+// Encoder and decoder for one tile format. The backend is picked when the
+// library is built: SIMD codecs when CMake finds them, stb otherwise.
+class ImageCodec {
+  public:
+    virtual ~ImageCodec() = default;
+    virtual const char *backend() const = 0;
+    // Decodes to four-channel RGBA; throws on malformed data.
+    virtual void decode(const unsigned char *data, int size, RGBAImage &image) const = 0;
+    // `channels` is 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA).
+    virtual std::vector<unsigned char> encode(const unsigned char *pixels, int width, int height, int channels,
+                                              const EncoderOptions &options) const = 0;
+};
 
+void stb_decode(const unsigned char *data, int size, RGBAImage &image) {
+    int components = 0;
+    unsigned char *raw = stbi_load_from_memory(data, size, &image.width, &image.height, &components, 4);
+    if (raw == nullptr) {
+        throw mbtiles_error("Failed to decode image from MBTiles blob");
+    }
+    size_pixels(image, static_cast<std::size_t>(image.width) * image.height * 4);
+    std::memcpy(image.pixels.data(), raw, image.pixels.size());
+    stbi_image_free(raw);
+}
 
+void append_to_vector(void *context, void *data, int size) {
+    auto *destination = static_cast<std::vector<unsigned char> *>(context);
+    const auto *bytes = static_cast<unsigned char *>(data);
+    destination->insert(destination->end(), bytes, bytes + size);
+}
 
+class StbPngCodec final : public ImageCodec {
+  public:
+    const char *backend() const override { return "stb"; }
 
-RGBAImage::RGBAImage() {
+    void decode(const unsigned char *data, int size, RGBAImage &image) const override {
+        stb_decode(data, size, image);
+    }
 
-}
+    std::vector<unsigned char> encode(const unsigned char *pixels, int width, int height, int channels,
+                                      const EncoderOptions &) const override {
+        std::vector<unsigned char> buffer;
+        buffer.reserve(static_cast<std::size_t>(width) * height);
+        if (stbi_write_png_to_func(append_to_vector, &buffer, width, height, channels, pixels, width * channels) ==
+            0) {
+            throw mbtiles_error("Failed to encode tile as PNG");
+        }
+        return buffer;
+    }
+};
 
-RGBAImage::RGBAImage(const fs::path &path) {
+class StbJpegCodec final : public ImageCodec {
+  public:
+    const char *backend() const override { return "stb"; }
+
+    void decode(const unsigned char *data, int size, RGBAImage &image) const override {
+        stb_decode(data, size, image);
+    }
+
+    std::vector<unsigned char> encode(const unsigned char *pixels, int width, int height, int channels,
+                                      const EncoderOptions &options) const override {
+        std::vector<unsigned char> buffer;
+        buffer.reserve(static_cast<std::size_t>(width) * height);
+        if (stbi_write_jpg_to_func(append_to_vector, &buffer, width, height, channels, pixels,
+                                   options.jpeg_quality) == 0) {
+            throw mbtiles_error("Failed to encode tile as JPEG");
+        }
+        return buffer;
+    }
+};
+
+#ifdef MBTILES_HAVE_LIBJPEG
+// libjpeg reports errors through error_exit, which must not return; jump
+// back to the caller's setjmp() with the message instead.
+struct JpegErrorManager {
+    jpeg_error_mgr base;
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    auto *errors = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, errors->message);
+    std::longjmp(errors->jump, 1);
+}
+
+// With libjpeg-turbo the (de)compressor reads and writes RGBA directly;
+// plain libjpeg goes through an RGB copy.
+class LibJpegCodec final : public ImageCodec {
+  public:
+    const char *backend() const override { return "libjpeg"; }
+
+    void decode(const unsigned char *data, int size, RGBAImage &image) const override {
+        jpeg_decompress_struct cinfo;
+        JpegErrorManager errors;
+        cinfo.err = jpeg_std_error(&errors.base);
+        errors.base.error_exit = jpeg_error_exit;
+        // Owned out here so a longjmp never skips a destructor
+        std::vector<unsigned char> row;
+        if (setjmp(errors.jump)) {
+            jpeg_destroy_decompress(&cinfo);
+            throw mbtiles_error(std::string("Failed to decode JPEG tile: ") + errors.message);
+        }
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, data, static_cast<unsigned long>(size));
+        jpeg_read_header(&cinfo, TRUE);
+#ifdef JCS_EXTENSIONS
+        cinfo.out_color_space = JCS_EXT_RGBA;
+#else
+        cinfo.out_color_space = JCS_RGB;
+#endif
+        jpeg_start_decompress(&cinfo);
+        image.width = static_cast<int>(cinfo.output_width);
+        image.height = static_cast<int>(cinfo.output_height);
+        size_pixels(image, static_cast<std::size_t>(image.width) * image.height * 4);
+        row.resize(static_cast<std::size_t>(image.width) * cinfo.output_components);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            unsigned char *dst = image.pixels.data() + static_cast<std::size_t>(cinfo.output_scanline) * image.width * 4;
+#ifdef JCS_EXTENSIONS
+            JSAMPROW rows[1] = {dst};
+            jpeg_read_scanlines(&cinfo, rows, 1);
+#else
+            JSAMPROW rows[1] = {row.data()};
+            jpeg_read_scanlines(&cinfo, rows, 1);
+            for (int x = 0; x < image.width; ++x) {
+                dst[x * 4 + 0] = row[x * 3 + 0];
+                dst[x * 4 + 1] = row[x * 3 + 1];
+                dst[x * 4 + 2] = row[x * 3 + 2];
+                dst[x * 4 + 3] = 255;
+            }
+#endif
+        }
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+    }
+
+    std::vector<unsigned char> encode(const unsigned char *pixels, int width, int height, int channels,
+                                      const EncoderOptions &options) const override {
+        jpeg_compress_struct cinfo;
+        JpegErrorManager errors;
+        cinfo.err = jpeg_std_error(&errors.base);
+        errors.base.error_exit = jpeg_error_exit;
+        unsigned char *output = nullptr;
+        unsigned long output_size = 0;
+        std::vector<unsigned char> row;
+        if (setjmp(errors.jump)) {
+            jpeg_destroy_compress(&cinfo);
+            std::free(output);
+            throw mbtiles_error(std::string("Failed to encode tile as JPEG: ") + errors.message);
+        }
+        jpeg_create_compress(&cinfo);
+        jpeg_mem_dest(&cinfo, &output, &output_size);
+        cinfo.image_width = static_cast<JDIMENSION>(width);
+        cinfo.image_height = static_cast<JDIMENSION>(height);
+        const bool gray = channels <= 2;
+        const bool direct = gray ? channels == 1 : channels == 3
+#ifdef JCS_EXTENSIONS
+                                                        || channels == 4
+#endif
+            ;
+        cinfo.input_components = gray ? 1 : direct ? channels : 3;
+        cinfo.in_color_space = gray ? JCS_GRAYSCALE : cinfo.input_components == 3 ? JCS_RGB :
+#ifdef JCS_EXTENSIONS
+                                                                                    JCS_EXT_RGBA;
+#else
+                                                                                    JCS_RGB;
+#endif
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, std::clamp(options.jpeg_quality, 1, 100), TRUE);
+        jpeg_start_compress(&cinfo, TRUE);
+        if (!direct) {
+            row.resize(static_cast<std::size_t>(width) * cinfo.input_components);
+        }
+        const std::size_t stride = static_cast<std::size_t>(width) * channels;
+        while (cinfo.next_scanline < cinfo.image_height) {
+            const unsigned char *src = pixels + cinfo.next_scanline * stride;
+            if (!direct) {
+                // Drop alpha: RGBA -> RGB or gray + alpha -> gray
+                for (int x = 0; x < width; ++x) {
+                    for (int c = 0; c < cinfo.input_components; ++c) {
+                        row[static_cast<std::size_t>(x) * cinfo.input_components + c] = src[x * channels + c];
+                    }
+                }
+                src = row.data();
+            }
+            JSAMPROW rows[1] = {const_cast<JSAMPLE *>(src)};
+            jpeg_write_scanlines(&cinfo, rows, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+        std::vector<unsigned char> buffer(output, output + output_size);
+        std::free(output);
+        return buffer;
+    }
+};
+#endif
+
+#ifdef MBTILES_HAVE_LIBPNG
+void png_append(png_structp png, png_bytep data, png_size_t size) {
+    auto *destination = static_cast<std::vector<unsigned char> *>(png_get_io_ptr(png));
+    destination->insert(destination->end(), data, data + size);
+}
+
+// zlib-backed PNG: better compression than stb's built-in deflate, and the
+// level is selectable.
+class LibPngCodec final : public ImageCodec {
+  public:
+    const char *backend() const override { return "libpng"; }
+
+    void decode(const unsigned char *data, int size, RGBAImage &image) const override {
+        png_image png;
+        std::memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+        if (!png_image_begin_read_from_memory(&png, data, static_cast<std::size_t>(size))) {
+            throw mbtiles_error(std::string("Failed to decode PNG tile: ") + png.message);
+        }
+        png.format = PNG_FORMAT_RGBA;
+        image.width = static_cast<int>(png.width);
+        image.height = static_cast<int>(png.height);
+        size_pixels(image, PNG_IMAGE_SIZE(png));
+        if (!png_image_finish_read(&png, nullptr, image.pixels.data(), 0, nullptr)) {
+            const std::string message = png.message;
+            png_image_free(&png);
+            throw mbtiles_error("Failed to decode PNG tile: " + message);
+        }
+    }
+
+    std::vector<unsigned char> encode(const unsigned char *pixels, int width, int height, int channels,
+                                      const EncoderOptions &options) const override {
+        static constexpr int kColorTypes[] = {PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB,
+                                              PNG_COLOR_TYPE_RGBA};
+        std::vector<unsigned char> buffer;
+        buffer.reserve(static_cast<std::size_t>(width) * height);
+        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        png_infop info = png != nullptr ? png_create_info_struct(png) : nullptr;
+        if (info == nullptr) {
+            png_destroy_write_struct(&png, nullptr);
+            throw mbtiles_error("Failed to encode tile as PNG: out of memory");
+        }
+        if (setjmp(png_jmpbuf(png))) {
+            png_destroy_write_struct(&png, &info);
+            throw mbtiles_error("Failed to encode tile as PNG");
+        }
+        png_set_write_fn(png, &buffer, png_append, nullptr);
+        png_set_compression_level(png, options.png_compression < 0 ? 6 : std::min(options.png_compression, 9));
+        png_set_IHDR(png, info, static_cast<png_uint_32>(width), static_cast<png_uint_32>(height), 8,
+                     kColorTypes[channels - 1], PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                     PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+        const std::size_t stride = static_cast<std::size_t>(width) * channels;
+        for (int y = 0; y < height; ++y) {
+            png_write_row(png, const_cast<png_bytep>(pixels + y * stride));
+        }
+        png_write_end(png, nullptr);
+        png_destroy_write_struct(&png, &info);
+        return buffer;
+    }
+};
+#endif
+
+#ifdef MBTILES_HAVE_WEBP
+class WebPCodec final : public ImageCodec {
+  public:
+    const char *backend() const override { return "libwebp"; }
+
+    void decode(const unsigned char *data, int size, RGBAImage &image) const override {
+        int width = 0;
+        int height = 0;
+        std::uint8_t *raw = WebPDecodeRGBA(data, static_cast<std::size_t>(size), &width, &height);
+        if (raw == nullptr) {
+            throw mbtiles_error("Failed to decode WebP tile");
+        }
+        image.width = width;
+        image.height = height;
+        size_pixels(image, static_cast<std::size_t>(width) * height * 4);
+        std::memcpy(image.pixels.data(), raw, image.pixels.size());
+        WebPFree(raw);
+    }
+
+    std::vector<unsigned char> encode(const unsigned char *pixels, int width, int height, int channels,
+                                      const EncoderOptions &options) const override {
+        // WebP has no gray layouts; expand them to RGBA
+        std::vector<unsigned char> rgba;
+        if (channels != 4) {
+            rgba.resize(static_cast<std::size_t>(width) * height * 4);
+            for (std::size_t i = 0; i < static_cast<std::size_t>(width) * height; ++i) {
+                const unsigned char *src = pixels + i * channels;
+                unsigned char *dst = rgba.data() + i * 4;
+                dst[0] = src[0];
+                dst[1] = channels >= 3 ? src[1] : src[0];
+                dst[2] = channels >= 3 ? src[2] : src[0];
+                dst[3] = channels == 2 ? src[1] : 255;
+            }
+            pixels = rgba.data();
+        }
+        std::uint8_t *output = nullptr;
+        const std::size_t size =
+            options.webp_lossless
+                ? WebPEncodeLosslessRGBA(pixels, width, height, width * 4, &output)
+                : WebPEncodeRGBA(pixels, width, height, width * 4,
+                                 static_cast<float>(std::clamp(options.webp_quality, 0, 100)), &output);
+        if (size == 0) {
+            WebPFree(output);
+            throw mbtiles_error("Failed to encode tile as WebP");
+        }
+        std::vector<unsigned char> buffer(output, output + size);
+        WebPFree(output);
+        return buffer;
+    }
+};
+#endif
+
+const ImageCodec &png_codec() {
+#ifdef MBTILES_HAVE_LIBPNG
+    static const LibPngCodec codec;
+#else
+    static const StbPngCodec codec;
+#endif
+    return codec;
+}
+
+const ImageCodec &jpeg_codec() {
+#ifdef MBTILES_HAVE_LIBJPEG
+    static const LibJpegCodec codec;
+#else
+    static const StbJpegCodec codec;
+#endif
+    return codec;
+}
+
+// nullptr when the library was built without libwebp.
+const ImageCodec *webp_codec() {
+#ifdef MBTILES_HAVE_WEBP
+    static const WebPCodec codec;
+    return &codec;
+#else
+    return nullptr;
+#endif
+}
+
+const ImageCodec &require_webp_codec() {
+    const ImageCodec *codec = webp_codec();
+    if (codec == nullptr) {
+        throw mbtiles_error("WebP support is not available: libmbtiles was built without libwebp");
+    }
+    return *codec;
+}
+
+std::map<std::string, std::string> codecBackends() {
+    return {{"png", png_codec().backend()},
+            {"jpg", jpeg_codec().backend()},
+            {"webp", webp_codec() != nullptr ? webp_codec()->backend() : "none"}};
+}
+
+RGBAImage::RGBAImage() {
+
+}
+
+RGBAImage::RGBAImage(const fs::path &path) {
     load(path);
 }
 
@@ -668,13 +1889,22 @@ void RGBAImage::loadFromMemory(const unsigned char *data, int size) {
         throw mbtiles_error("Tile image data is empty");
     }
 
-    int components = 0;
-    unsigned char *raw = stbi_load_from_memory(data, size, &this->width, &this->height, &components, 4);
-    if (raw == nullptr) {
-        throw mbtiles_error("Failed to decode image from MBTiles blob");
+    auto &registry = metrics_registry();
+    const std::string_view token = detect_extension_token(data, size);
+    if (token == "png") {
+        StageTimer timer(registry.decode_png);
+        png_codec().decode(data, size, *this);
+    } else if (token == "jpg") {
+        StageTimer timer(registry.decode_jpg);
+        jpeg_codec().decode(data, size, *this);
+    } else if (token == "webp") {
+        StageTimer timer(registry.decode_webp);
+        require_webp_codec().decode(data, size, *this);
+    } else {
+        // GIF, BMP and the other formats stb understands
+        StageTimer timer(registry.decode_other);
+        stb_decode(data, size, *this);
     }
-    this->pixels.assign(raw, raw + static_cast<std::size_t>(this->width) * this->height * 4);
-    stbi_image_free(raw);
 }
 
 void RGBAImage::save(const fs::path &path) const {
@@ -719,54 +1949,189 @@ void RGBAImage::save(const fs::path &path) const {
     }
 }
 
-std::vector<unsigned char> RGBAImage::encodePng() const {
-    std::vector<unsigned char> buffer;
-    buffer.reserve(static_cast<std::size_t>(this->width) * this->height);
+// Luma kernels. Every variant computes (77 R + 150 G + 29 B + 128) >> 8 so
+// the output is bit-identical whichever one the CPU ends up running; the
+// weights are the BT.601 coefficients scaled to sum to 256.
+void luma_scalar(const unsigned char *rgba, unsigned char *gray, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const unsigned char *px = rgba + i * 4;
+        gray[i] = static_cast<unsigned char>((77U * px[0] + 150U * px[1] + 29U * px[2] + 128U) >> 8);
+    }
+}
 
-    auto callback = [](void *context, void *data_ptr, int size) {
-        auto *destination = static_cast<std::vector<unsigned char> *>(context);
-        const auto *bytes = static_cast<unsigned char *>(data_ptr);
-        destination->insert(destination->end(), bytes, bytes + size);
-    };
+#if defined(MBTILES_SIMD_X86)
+// Luma of four pixels as 32-bit lanes. Splitting each pixel into (R, B) and
+// (G, A) 16-bit pairs lets one multiply-add per pair produce the weighted sum.
+inline __m128i luma4_sse2(__m128i px) {
+    const __m128i rb = _mm_and_si128(px, _mm_set1_epi32(0x00FF00FF));
+    const __m128i ga = _mm_srli_epi16(px, 8);
+    __m128i sum = _mm_madd_epi16(rb, _mm_set1_epi32((29 << 16) | 77));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(ga, _mm_set1_epi32(150)));
+    return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+}
 
-    if (stbi_write_png_to_func(callback, &buffer, this->width, this->height, 4, this->pixels.data(), this->width * 4) == 0) {
-        throw mbtiles_error("Failed to encode tile as PNG");
+void luma_sse2(const unsigned char *rgba, unsigned char *gray, std::size_t count) {
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const auto *src = reinterpret_cast<const __m128i *>(rgba + i * 4);
+        const __m128i l0 = luma4_sse2(_mm_loadu_si128(src + 0));
+        const __m128i l1 = luma4_sse2(_mm_loadu_si128(src + 1));
+        const __m128i l2 = luma4_sse2(_mm_loadu_si128(src + 2));
+        const __m128i l3 = luma4_sse2(_mm_loadu_si128(src + 3));
+        const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(l0, l1), _mm_packs_epi32(l2, l3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(gray + i), packed);
     }
+    luma_scalar(rgba + i * 4, gray + i, count - i);
+}
 
-    return buffer;
+#if defined(__GNUC__) || defined(__clang__)
+#define MBTILES_GRAY_AVX2 1
+__attribute__((target("avx2"))) inline __m256i luma8_avx2(__m256i px) {
+    const __m256i rb = _mm256_and_si256(px, _mm256_set1_epi32(0x00FF00FF));
+    const __m256i ga = _mm256_srli_epi16(px, 8);
+    __m256i sum = _mm256_madd_epi16(rb, _mm256_set1_epi32((29 << 16) | 77));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(ga, _mm256_set1_epi32(150)));
+    return _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
 }
 
-std::vector<unsigned char> RGBAImage::encodeJpg(int quality) const {
-    std::vector<unsigned char> buffer;
-    buffer.reserve(static_cast<std::size_t>(this->width) * this->height);
+__attribute__((target("avx2"))) void luma_avx2(const unsigned char *rgba, unsigned char *gray, std::size_t count) {
+    // The packs work per 128-bit lane; the final permute restores pixel order.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    std::size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const auto *src = reinterpret_cast<const __m256i *>(rgba + i * 4);
+        const __m256i l0 = luma8_avx2(_mm256_loadu_si256(src + 0));
+        const __m256i l1 = luma8_avx2(_mm256_loadu_si256(src + 1));
+        const __m256i l2 = luma8_avx2(_mm256_loadu_si256(src + 2));
+        const __m256i l3 = luma8_avx2(_mm256_loadu_si256(src + 3));
+        const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(l0, l1), _mm256_packs_epi32(l2, l3));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(gray + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    luma_sse2(rgba + i * 4, gray + i, count - i);
+}
+#endif
+#endif
+
+#if defined(MBTILES_SIMD_NEON)
+void luma_neon(const unsigned char *rgba, unsigned char *gray, std::size_t count) {
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const uint8x16x4_t px = vld4q_u8(rgba + i * 4);
+        uint16x8_t lo = vmull_u8(vget_low_u8(px.val[0]), vdup_n_u8(77));
+        lo = vmlal_u8(lo, vget_low_u8(px.val[1]), vdup_n_u8(150));
+        lo = vmlal_u8(lo, vget_low_u8(px.val[2]), vdup_n_u8(29));
+        uint16x8_t hi = vmull_u8(vget_high_u8(px.val[0]), vdup_n_u8(77));
+        hi = vmlal_u8(hi, vget_high_u8(px.val[1]), vdup_n_u8(150));
+        hi = vmlal_u8(hi, vget_high_u8(px.val[2]), vdup_n_u8(29));
+        vst1q_u8(gray + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+    luma_scalar(rgba + i * 4, gray + i, count - i);
+}
+#endif
 
-    auto callback = [](void *context, void *data_ptr, int size) {
-        auto *destination = static_cast<std::vector<unsigned char> *>(context);
-        const auto *bytes = static_cast<unsigned char *>(data_ptr);
-        destination->insert(destination->end(), bytes, bytes + size);
-    };
+using LumaKernel = void (*)(const unsigned char *, unsigned char *, std::size_t);
+
+LumaKernel select_luma_kernel() {
+#if defined(MBTILES_GRAY_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return luma_avx2;
+    }
+#endif
+#if defined(MBTILES_SIMD_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+    return luma_sse2;
+#elif defined(MBTILES_SIMD_NEON)
+    return luma_neon;
+#else
+    return luma_scalar;
+#endif
+}
+
+// Writes the luma of `count` RGBA pixels to `gray`, one byte per pixel.
+void compute_luma(const unsigned char *rgba, unsigned char *gray, std::size_t count) {
+    static const LumaKernel kernel = select_luma_kernel();
+    kernel(rgba, gray, count);
+}
+
+// Grayscale pixels in the layout the encoders expect: one channel, or gray
+// and alpha interleaved when `keep_alpha` is set.
+std::vector<unsigned char> gray_pixels(const RGBAImage &image, bool keep_alpha) {
+    const std::size_t total_pixels = image.pixels.size() / 4;
+    std::vector<unsigned char> gray(total_pixels * (keep_alpha ? 2 : 1));
+    if (!keep_alpha) {
+        compute_luma(image.pixels.data(), gray.data(), total_pixels);
+        return gray;
+    }
 
-    if (stbi_write_jpg_to_func(callback, &buffer, this->width, this->height, 4, this->pixels.data(), quality) == 0) {
-        throw mbtiles_error("Failed to encode tile as JPEG");
+    std::vector<unsigned char> luma(total_pixels);
+    compute_luma(image.pixels.data(), luma.data(), total_pixels);
+    for (std::size_t i = 0; i < total_pixels; ++i) {
+        gray[i * 2] = luma[i];
+        gray[i * 2 + 1] = image.pixels[i * 4 + 3];
     }
+    return gray;
+}
+
+std::vector<unsigned char> encode_png_pixels(const unsigned char *pixels, int width, int height, int channels,
+                                             int compression) {
+    StageTimer timer(metrics_registry().encode_png);
+    EncoderOptions options;
+    options.png_compression = compression;
+    return png_codec().encode(pixels, width, height, channels, options);
+}
+
+std::vector<unsigned char> encode_jpg_pixels(const unsigned char *pixels, int width, int height, int channels,
+                                             int quality) {
+    StageTimer timer(metrics_registry().encode_jpg);
+    EncoderOptions options;
+    options.jpeg_quality = quality;
+    return jpeg_codec().encode(pixels, width, height, channels, options);
+}
+
+std::vector<unsigned char> RGBAImage::encodePng(int compression) const {
+    return encode_png_pixels(this->pixels.data(), this->width, this->height, 4, compression);
+}
+
+std::vector<unsigned char> RGBAImage::encodeJpg(int quality) const {
+    return encode_jpg_pixels(this->pixels.data(), this->width, this->height, 4, quality);
+}
+
+std::vector<unsigned char> RGBAImage::encodeWebp(int quality, bool lossless) const {
+    const ImageCodec &codec = require_webp_codec();
+    StageTimer timer(metrics_registry().encode_webp);
+    EncoderOptions options;
+    options.webp_quality = quality;
+    options.webp_lossless = lossless;
+    return codec.encode(this->pixels.data(), this->width, this->height, 4, options);
+}
 
-    return buffer;
+std::vector<unsigned char> RGBAImage::encodeGrayPng(int compression) const {
+    const bool keep_alpha = has_translucent_pixels(pixels);
+    const auto gray = gray_pixels(*this, keep_alpha);
+    return encode_png_pixels(gray.data(), this->width, this->height, keep_alpha ? 2 : 1, compression);
+}
+
+std::vector<unsigned char> RGBAImage::encodeGrayJpg(int quality) const {
+    const auto gray = gray_pixels(*this, false);
+    return encode_jpg_pixels(gray.data(), this->width, this->height, 1, quality);
 }
 
 void RGBAImage::toGrayScale() {
     if (pixels.empty()) {
         return;
     }
+    // Luma is computed a block at a time so the scratch buffer stays in L1.
+    constexpr std::size_t kBlockPixels = 1024;
+    unsigned char luma[kBlockPixels];
     const std::size_t total_pixels = pixels.size() / 4;
-    for (std::size_t i = 0; i < total_pixels; ++i) {
-        const std::size_t index = i * 4;
-        const unsigned char r = pixels[index + 0];
-        const unsigned char g = pixels[index + 1];
-        const unsigned char b = pixels[index + 2];
-        const unsigned char gray = static_cast<unsigned char>(0.299 * r + 0.587 * g + 0.114 * b);
-        pixels[index + 0] = gray;
-        pixels[index + 1] = gray;
-        pixels[index + 2] = gray;
+    for (std::size_t start = 0; start < total_pixels; start += kBlockPixels) {
+        const std::size_t count = std::min(kBlockPixels, total_pixels - start);
+        unsigned char *block = pixels.data() + start * 4;
+        compute_luma(block, luma, count);
+        for (std::size_t i = 0; i < count; ++i) {
+            block[i * 4 + 0] = luma[i];
+            block[i * 4 + 1] = luma[i];
+            block[i * 4 + 2] = luma[i];
+        }
     }
 }
 
@@ -797,7 +2162,7 @@ std::vector<int> collect_zoom_levels(sqlite3 *db) {
     std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
     std::vector<int> levels;
     while (true) {
-        const int rc = sqlite3_step(stmt.get());
+        const int rc = timed_step(stmt.get());
         if (rc == SQLITE_DONE) {
             break;
         }
@@ -810,22 +2175,25 @@ std::vector<int> collect_zoom_levels(sqlite3 *db) {
 }
 
 std::vector<int> MBTiles::zoomLevels() const {
-    if (_db == nullptr) {
-        throw mbtiles_error("MBTiles database is not open");
+    cached_stmt stmt(cachedStatement(kZoomLevelsSql));
+    std::vector<int> levels;
+    while (true) {
+        const int rc = timed_step(stmt.get());
+        if (rc == SQLITE_DONE) {
+            break;
+        }
+        if (rc != SQLITE_ROW) {
+            throw mbtiles_error("SQLite error while reading zoom levels: " + std::string(sqlite3_errmsg(_db)));
+        }
+        levels.push_back(sqlite3_column_int(stmt.get(), 0));
     }
-    return collect_zoom_levels(_db);
+    return levels;
 }
 
-std::optional<int> MBTiles::queryZoomValue(const char *sql) const {
-    if (_db == nullptr) {
-        throw mbtiles_error("MBTiles database is not open");
-    }
-    sqlite3_stmt *stmt = nullptr;
-    if (sqlite3_prepare_v2(_db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        throw mbtiles_error("Failed to query zoom information: " + std::string(sqlite3_errmsg(_db)));
-    }
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> guard(stmt);
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
+std::optional<int> MBTiles::queryZoomValue(std::string_view sql) const {
+    cached_stmt guard(cachedStatement(sql));
+    sqlite3_stmt *stmt = guard.get();
+    if (timed_step(stmt) == SQLITE_ROW) {
         if (sqlite3_column_type(stmt, 0) == SQLITE_NULL) {
             return std::nullopt;
         }
@@ -835,53 +2203,280 @@ std::optional<int> MBTiles::queryZoomValue(const char *sql) const {
 }
 
 std::optional<int> MBTiles::minZoomLevel() const {
-    return queryZoomValue("SELECT MIN(zoom_level) FROM tiles");
+    return queryZoomValue(kMinZoomSql);
 }
 
 std::optional<int> MBTiles::maxZoomLevel() const {
-    return queryZoomValue("SELECT MAX(zoom_level) FROM tiles");
+    return queryZoomValue(kMaxZoomSql);
 }
 
 std::optional<std::string> MBTiles::fetchTileBlob(int zoom, int x, int y) const {
-    if (_db == nullptr) {
-        throw mbtiles_error("MBTiles database is not open");
+    std::optional<std::string> result;
+    tileDataView(zoom, x, y, [&result](const TileView &tile) {
+        result.emplace(reinterpret_cast<const char *>(tile.data), tile.size);
+    });
+    return result;
+}
+
+std::optional<std::string> MBTiles::tileData(int zoom, int x, int y) const {
+    if (zoom < 0 || x < 0 || y < 0) {
+        return std::nullopt;
     }
+    return fetchTileBlob(zoom, x, y);
+}
 
-    const char *sql = "SELECT tile_data FROM tiles WHERE zoom_level=?1 AND tile_column=?2 AND tile_row=?3 LIMIT 1";
-    sqlite3_stmt *stmt = nullptr;
-    if (sqlite3_prepare_v2(_db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        throw mbtiles_error("Failed to prepare tile query: " + std::string(sqlite3_errmsg(_db)));
+bool MBTiles::tileDataView(int zoom, int x, int y, const TileViewCallback &fn) const {
+    if (zoom < 0 || x < 0 || y < 0) {
+        return false;
     }
 
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> guard(stmt);
+    cached_stmt guard(cachedStatement(kTileLookupSql));
+    sqlite3_stmt *stmt = guard.get();
     const int tms_y = xyz_to_tms_y(y, zoom);
     sqlite3_bind_int(stmt, 1, zoom);
     sqlite3_bind_int(stmt, 2, x);
     sqlite3_bind_int(stmt, 3, tms_y);
 
-    if (sqlite3_step(stmt) != SQLITE_ROW) {
-        return std::nullopt;
+    if (timed_step(stmt) != SQLITE_ROW) {
+        return false;
     }
 
     const void *blob = sqlite3_column_blob(stmt, 0);
     const int blob_size = sqlite3_column_bytes(stmt, 0);
     if (blob == nullptr || blob_size <= 0) {
-        return std::nullopt;
+        return false;
+    }
+    count_tile_read(static_cast<std::size_t>(blob_size));
+
+    TileView view;
+    view.zoom = zoom;
+    view.x = x;
+    view.y = y;
+    view.tms_y = tms_y;
+    view.data = static_cast<const std::byte *>(blob);
+    view.size = static_cast<std::size_t>(blob_size);
+    view.extension = detect_extension_token(blob, blob_size);
+    fn(view);
+    return true;
+}
+
+// Fills `view` from a (tile_column, tile_row, tile_data) row at `zoom`.
+// Returns false for rows without tile data.
+bool read_tile_row(sqlite3_stmt *stmt, int zoom, TileView &view) {
+    const void *blob = sqlite3_column_blob(stmt, 2);
+    const int blob_size = sqlite3_column_bytes(stmt, 2);
+    if (blob == nullptr || blob_size <= 0) {
+        return false;
     }
+    count_tile_read(static_cast<std::size_t>(blob_size));
+    view.zoom = zoom;
+    view.x = sqlite3_column_int(stmt, 0);
+    view.tms_y = sqlite3_column_int(stmt, 1);
+    view.y = tms_to_xyz_y(view.tms_y, zoom);
+    view.data = static_cast<const std::byte *>(blob);
+    view.size = static_cast<std::size_t>(blob_size);
+    view.extension = detect_extension_token(blob, blob_size);
+    return true;
+}
 
-    std::string result;
-    result.assign(static_cast<const char *>(blob), static_cast<std::size_t>(blob_size));
+std::size_t MBTiles::tilesInRange(int zoom, int xmin, int xmax, int ymin, int ymax, const TileViewCallback &fn) const {
+    if (zoom < 0 || zoom > 30) {
+        return 0;
+    }
+    const int max_index = static_cast<int>((1LL << zoom) - 1);
+    xmin = std::max(xmin, 0);
+    ymin = std::max(ymin, 0);
+    xmax = std::min(xmax, max_index);
+    ymax = std::min(ymax, max_index);
+    if (xmin > xmax || ymin > ymax) {
+        return 0;
+    }
+
+    cached_stmt guard(cachedStatement(kTileRangeSql));
+    sqlite3_stmt *stmt = guard.get();
+    sqlite3_bind_int(stmt, 1, zoom);
+    sqlite3_bind_int(stmt, 2, xmin);
+    sqlite3_bind_int(stmt, 3, xmax);
+    sqlite3_bind_int(stmt, 4, xyz_to_tms_y(ymax, zoom));
+    sqlite3_bind_int(stmt, 5, xyz_to_tms_y(ymin, zoom));
+
+    std::size_t count = 0;
+    TileView view;
+    while (true) {
+        const int rc = timed_step(stmt);
+        if (rc == SQLITE_DONE) {
+            break;
+        }
+        if (rc != SQLITE_ROW) {
+            throw mbtiles_error("SQLite error while reading tile range: " + std::string(sqlite3_errmsg(_db)));
+        }
+        if (read_tile_row(stmt, zoom, view)) {
+            fn(view);
+            ++count;
+        }
+    }
+    return count;
+}
+
+std::size_t MBTiles::tileDataBatch(const std::vector<TileCoord> &coords, const TileViewCallback &fn) const {
+    // Group the request by zoom and sort each group into index order.
+    std::map<int, std::vector<std::pair<int, int>>> by_zoom;  // zoom -> (x, tms_y)
+    for (const TileCoord &coord : coords) {
+        if (coord.zoom < 0 || coord.zoom > 30 || coord.x < 0 || coord.y < 0 ||
+            coord.x > (1LL << coord.zoom) - 1 || coord.y > (1LL << coord.zoom) - 1) {
+            continue;
+        }
+        by_zoom[coord.zoom].emplace_back(coord.x, xyz_to_tms_y(coord.y, coord.zoom));
+    }
+
+    std::size_t count = 0;
+    for (auto &entry : by_zoom) {
+        const int zoom = entry.first;
+        auto &wanted = entry.second;
+        std::sort(wanted.begin(), wanted.end());
+        wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+        int xmin = wanted.front().first;
+        int xmax = wanted.front().first;
+        int rmin = wanted.front().second;
+        int rmax = wanted.front().second;
+        for (const auto &tile : wanted) {
+            xmin = std::min(xmin, tile.first);
+            xmax = std::max(xmax, tile.first);
+            rmin = std::min(rmin, tile.second);
+            rmax = std::max(rmax, tile.second);
+        }
+
+        // A clustered request (a viewport, a region) is cheapest as one range
+        // scan filtered against the wanted set; scattered tiles would make
+        // that scan read mostly unwanted rows, so they are looked up one by
+        // one, still in index order so consecutive seeks share B-tree pages.
+        const double box_area = (static_cast<double>(xmax) - xmin + 1) * (static_cast<double>(rmax) - rmin + 1);
+        if (box_area <= 4.0 * static_cast<double>(wanted.size())) {
+            const std::unordered_set<TileKey> keys = [&] {
+                std::unordered_set<TileKey> result;
+                result.reserve(wanted.size());
+                for (const auto &tile : wanted) {
+                    result.insert(make_tile_key(tile.first, tile.second));
+                }
+                return result;
+            }();
+            tilesInRange(zoom, xmin, xmax, tms_to_xyz_y(rmax, zoom), tms_to_xyz_y(rmin, zoom),
+                         [&](const TileView &view) {
+                             if (keys.count(make_tile_key(view.x, view.tms_y)) != 0U) {
+                                 fn(view);
+                                 ++count;
+                             }
+                         });
+            continue;
+        }
+
+        for (const auto &tile : wanted) {
+            if (tileDataView(zoom, tile.first, tms_to_xyz_y(tile.second, zoom), fn)) {
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+TileIterator MBTiles::tiles() const {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    return TileIterator(_db);
+}
+
+TileIterator MBTiles::tiles(const TileIteratorOptions &options) const {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    return TileIterator(_db, options);
+}
+
+bool MBTiles::tilesIsTable() const {
+    cached_stmt guard(cachedStatement("SELECT type='table' FROM sqlite_master WHERE name='tiles'"));
+    return timed_step(guard.get()) == SQLITE_ROW && sqlite3_column_int(guard.get(), 0) != 0;
+}
+
+std::vector<TileIteratorOptions> MBTiles::shards(std::size_t count, const TileIteratorOptions &base) const {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    if (count == 0) {
+        throw mbtiles_error("Shard count must be at least 1");
+    }
+    if (base.shard_count != 1) {
+        throw mbtiles_error("Cannot shard options that are already sharded");
+    }
+
+    std::vector<TileIteratorOptions> result(count, base);
+    if (count == 1) {
+        return result;
+    }
+
+    // A real table has rowids, and MIN/MAX are single B-tree probes. Splitting
+    // that span evenly gives contiguous page ranges per shard; archives written
+    // in bulk have dense rowids, so the shards come out close to equal.
+    const bool is_table = tilesIsTable();
+    if (!is_table) {
+        for (std::size_t i = 0; i < count; ++i) {
+            result[i].shard_count = count;
+            result[i].shard_index = i;
+        }
+        return result;
+    }
+
+    cached_stmt range_guard(cachedStatement("SELECT MIN(rowid), MAX(rowid) FROM tiles"));
+    sqlite3_stmt *range_stmt = range_guard.get();
+    if (timed_step(range_stmt) != SQLITE_ROW) {
+        throw mbtiles_error("Failed to read tile rowid range: " + std::string(sqlite3_errmsg(_db)));
+    }
+    if (sqlite3_column_type(range_stmt, 0) == SQLITE_NULL) {
+        return result;
+    }
+    std::int64_t lo = sqlite3_column_int64(range_stmt, 0);
+    std::int64_t hi = sqlite3_column_int64(range_stmt, 1);
+    if (base.first_rowid) {
+        lo = std::max(lo, *base.first_rowid);
+    }
+    if (base.last_rowid) {
+        hi = std::min(hi, *base.last_rowid);
+    }
+
+    // Shard i covers [lo + q*i + min(i, r), ...) with q, r = span / count,
+    // span % count; unsigned so the span of any int64 range fits.
+    const std::uint64_t span = static_cast<std::uint64_t>(hi) - static_cast<std::uint64_t>(lo) + 1;
+    const std::uint64_t quotient = span / count;
+    const std::uint64_t remainder = span % count;
+    const auto shard_begin = [&](std::uint64_t i) {
+        return static_cast<std::uint64_t>(lo) + quotient * i + std::min<std::uint64_t>(i, remainder);
+    };
+    for (std::size_t i = 0; i < count; ++i) {
+        if (hi < lo) {
+            result[i].first_rowid = 1;
+            result[i].last_rowid = 0;
+            continue;
+        }
+        result[i].first_rowid = static_cast<std::int64_t>(shard_begin(i));
+        result[i].last_rowid = static_cast<std::int64_t>(shard_begin(i + 1) - 1);
+    }
     return result;
 }
 
-std::optional<std::string> MBTiles::tileData(int zoom, int x, int y) const {
-    if (zoom < 0 || x < 0 || y < 0) {
-        return std::nullopt;
+std::size_t MBTiles::forEachTile(const TileViewCallback &fn) const {
+    TileIterator iter = tiles();
+    std::size_t count = 0;
+    while (auto tile = iter.nextView()) {
+        fn(*tile);
+        ++count;
     }
-    return fetchTileBlob(zoom, x, y);
+    return count;
 }
 
-TileImageMap load_level_images(sqlite3 *db, int zoom) {
+// Reads a whole zoom level; blobs are copied out row by row and decoded on
+// up to `threads` threads.
+TileLevel load_level_images(sqlite3 *db, int zoom, unsigned threads = 1) {
     if (db == nullptr) {
         throw mbtiles_error("MBTiles database is not open");
     }
@@ -894,10 +2489,11 @@ TileImageMap load_level_images(sqlite3 *db, int zoom) {
     }
 
     std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
-    TileImageMap tiles;
+    sqlite3_bind_int(stmt.get(), 1, zoom);
+    std::vector<std::pair<TileKey, std::vector<unsigned char>>> blobs;
 
     while (true) {
-        const int rc = sqlite3_step(stmt.get());
+        const int rc = timed_step(stmt.get());
         if (rc == SQLITE_DONE) {
             break;
         }
@@ -912,53 +2508,779 @@ TileImageMap load_level_images(sqlite3 *db, int zoom) {
         if (blob == nullptr || blob_size <= 0) {
             continue;
         }
+        count_tile_read(static_cast<std::size_t>(blob_size));
 
         const int y = tms_to_xyz_y(tms_y, zoom);
-        RGBAImage image(static_cast<const unsigned char *>(blob), blob_size);
-        tiles.emplace(make_tile_key(x, y), std::move(image));
+        const auto *bytes = static_cast<const unsigned char *>(blob);
+        blobs.emplace_back(make_tile_key(x, y), std::vector<unsigned char>(bytes, bytes + blob_size));
     }
-
+    stmt.reset();
+
+    std::vector<RGBAImage> images(blobs.size());
+    parallel_for(blobs.size(), threads, [&](std::size_t index) {
+        auto &blob = blobs[index].second;
+        images[index].loadFromMemory(blob.data(), static_cast<int>(blob.size()));
+        std::vector<unsigned char>().swap(blob);
+    });
+
+    TileLevel tiles;
+    tiles.reserve(blobs.size());
+    for (std::size_t index = 0; index < blobs.size(); ++index) {
+        tiles.emplace(blobs[index].first, std::move(images[index]));
+    }
+    tiles.seal();
     return tiles;
 }
 
-
-/*
-TileMap MBTiles::loadLevelRgba(int zoom) {
-    const char *query = "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level=?";
+std::unique_ptr<sqlite3_stmt, stmt_deleter> prepare_statement(sqlite3 *db, const char *sql, const std::string &context) {
     sqlite3_stmt *raw_stmt = nullptr;
-    if (sqlite3_prepare_v2(_db, query, -1, &raw_stmt, nullptr) != SQLITE_OK) {
-        throw mbtiles_error("Failed to read tiles for zoom level " + std::to_string(zoom) + ": " +
-        std::string(sqlite3_errmsg(_db)));
-    }
-    
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
-    TileMap tiles;
-    
-    while (true) {
-        const int rc = sqlite3_step(stmt.get());
-        if (rc == SQLITE_DONE) {
-            break;
-        }
-        if (rc != SQLITE_ROW) {
-            throw mbtiles_error("SQLite error while reading tiles: " + std::string(sqlite3_errmsg(_db)));
+    if (sqlite3_prepare_v2(db, sql, -1, &raw_stmt, nullptr) != SQLITE_OK) {
+        if (raw_stmt != nullptr) {
+            sqlite3_finalize(raw_stmt);
         }
-        
-        const int x = sqlite3_column_int(stmt.get(), 0);
-        const int tms_y = sqlite3_column_int(stmt.get(), 1);
-        const void *blob = sqlite3_column_blob(stmt.get(), 2);
-        const int blob_size = sqlite3_column_bytes(stmt.get(), 2);
-        
-        const int y = tms_to_xyz_y(tms_y, zoom);
-        RGBAImage image(static_cast<const unsigned char *>(blob), blob_size);
-        tiles.emplace(make_tile_key(x, y), std::move(image));
+        throw mbtiles_error("Failed to " + context + ": " + std::string(sqlite3_errmsg(db)));
     }
-    
-    return tiles;
+    return std::unique_ptr<sqlite3_stmt, stmt_deleter>(raw_stmt);
 }
-*/
 
-// TileMap downsample_level(const TileMap &source_tiles, int source_zoom) {
-    //     struct ParentGroup {
+struct db_closer {
+    void operator()(sqlite3 *db) const noexcept {
+        if (db != nullptr) {
+            sqlite3_close_v2(db);
+        }
+    }
+};
+
+using db_handle = std::unique_ptr<sqlite3, db_closer>;
+
+// Opens a private read-only connection, e.g. for a worker thread that must
+// not share statements with the connection of the owning MBTiles object.
+db_handle open_read_only_connection(const std::string &path) {
+    sqlite3 *raw_db = nullptr;
+    const int rc = sqlite3_open_v2(path.c_str(), &raw_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    db_handle db(raw_db);
+    if (rc != SQLITE_OK) {
+        throw mbtiles_error("Unable to open MBTiles file '" + path + "' for reading: " +
+                            std::string(raw_db != nullptr ? sqlite3_errmsg(raw_db) : "out of memory"));
+    }
+    return db;
+}
+
+// Decoded size of one tile of the archive, used to estimate memory needs.
+std::optional<std::size_t> sample_tile_bytes(sqlite3 *db) {
+    auto stmt = prepare_statement(db, "SELECT tile_data FROM tiles WHERE length(tile_data) > 0 LIMIT 1",
+                                  "sample tile data");
+    if (timed_step(stmt.get()) != SQLITE_ROW) {
+        return std::nullopt;
+    }
+    const RGBAImage image(static_cast<const unsigned char *>(sqlite3_column_blob(stmt.get(), 0)),
+                          sqlite3_column_bytes(stmt.get(), 0));
+    return image.pixels.size();
+}
+
+std::size_t count_tiles(sqlite3 *db) {
+    auto stmt = prepare_statement(db, "SELECT COUNT(*) FROM tiles", "count tiles");
+    if (timed_step(stmt.get()) != SQLITE_ROW) {
+        return 0;
+    }
+    return static_cast<std::size_t>(sqlite3_column_int64(stmt.get(), 0));
+}
+
+// Format of the stored blobs: the metadata value when set, otherwise sniffed
+// from one tile. Empty for an archive without tiles or metadata.
+std::string stored_tile_format(sqlite3 *db, const std::map<std::string, std::string> &metadata) {
+    auto it = metadata.find("format");
+    if (it != metadata.end()) {
+        std::string normalized = normalize_extension_token(it->second);
+        if (!normalized.empty()) {
+            return normalized;
+        }
+    }
+    auto stmt = prepare_statement(db, "SELECT tile_data FROM tiles WHERE length(tile_data) > 0 LIMIT 1",
+                                  "sample tile format");
+    if (timed_step(stmt.get()) != SQLITE_ROW) {
+        return {};
+    }
+    return std::string(detect_extension_token(sqlite3_column_blob(stmt.get(), 0), sqlite3_column_bytes(stmt.get(), 0)));
+}
+
+// Copies zoom level `level` of the archive attached as `source` into the
+// plain tiles table of `db`. The blobs never leave SQLite. `insert` may
+// carry a conflict clause ("INSERT OR IGNORE"); returns the rows written.
+std::size_t copy_attached_level(sqlite3 *db, int level, const std::string &insert = "INSERT") {
+    auto size = prepare_statement(db, "SELECT COUNT(*), TOTAL(LENGTH(tile_data)) FROM source.tiles WHERE zoom_level = ?1",
+                                  "measure zoom level");
+    sqlite3_bind_int(size.get(), 1, level);
+    if (timed_step(size.get()) != SQLITE_ROW) {
+        throw mbtiles_error("Failed to measure zoom level " + std::to_string(level) + ": " + sqlite3_errmsg(db));
+    }
+    const auto tiles = static_cast<std::uint64_t>(sqlite3_column_int64(size.get(), 0));
+    const auto bytes = static_cast<std::uint64_t>(sqlite3_column_double(size.get(), 1));
+
+    const std::string sql = insert +
+                            " INTO main.tiles (zoom_level, tile_column, tile_row, tile_data) "
+                            "SELECT zoom_level, tile_column, tile_row, tile_data FROM source.tiles WHERE zoom_level = ?1";
+    auto copy = prepare_statement(db, sql.c_str(), "copy zoom level");
+    sqlite3_bind_int(copy.get(), 1, level);
+    if (timed_step(copy.get()) != SQLITE_DONE) {
+        throw mbtiles_error("Failed to copy zoom level " + std::to_string(level) + ": " + sqlite3_errmsg(db));
+    }
+    const auto written = static_cast<std::uint64_t>(sqlite3_changes64(db));
+
+    // Rows skipped by a conflict clause are not known individually, so the
+    // bytes written are prorated.
+    auto &registry = metrics_registry();
+    count_event(registry.tiles_read, tiles);
+    count_event(registry.bytes_read, bytes);
+    count_event(registry.tiles_written, written);
+    count_event(registry.bytes_written, written == tiles ? bytes : (tiles == 0 ? 0 : bytes / tiles * written));
+    return static_cast<std::size_t>(written);
+}
+
+using TileSink =std::function<void(int level, int x, int y, const RGBAImage &image)>;
+
+// Target zoom levels that a streaming conversion derives from one source
+// level, either by merging children (downsample) or splitting parents.
+struct StreamGroup {
+    int source_level = 0;
+    bool downsample = false;
+    std::vector<int> targets;
+};
+
+struct StreamPlan {
+    std::vector<int> copy_levels;
+    std::vector<StreamGroup> groups;
+};
+
+// Picks source levels exactly like the whole-level path: a missing target is
+// derived from the nearest known level, and every level generated on the way
+// becomes a candidate for the targets that follow.
+StreamPlan plan_stream_levels(const std::vector<int> &target_levels, const std::vector<int> &available_levels) {
+    const std::set<int> base_levels(available_levels.begin(), available_levels.end());
+    std::set<int> known_levels = base_levels;
+    std::map<int, std::pair<int, bool>> origin;  // generated level -> (source level, downsample)
+    std::map<std::pair<int, bool>, std::set<int>> grouped;
+
+    StreamPlan plan;
+    for (int level : target_levels) {
+        if (base_levels.count(level) != 0U) {
+            plan.copy_levels.push_back(level);
+            continue;
+        }
+
+        auto known = origin.find(level);
+        if (known == origin.end()) {
+            const auto nearest = find_nearest_available_level(known_levels, level);
+            if (!nearest) {
+                throw mbtiles_error("Unable to derive zoom level " + std::to_string(level));
+            }
+            const auto root = base_levels.count(*nearest) != 0U ? std::make_pair(*nearest, *nearest > level)
+                                                                 : origin.at(*nearest);
+            const int step = *nearest > level ? -1 : 1;
+            for (int generated = *nearest + step;; generated += step) {
+                origin.emplace(generated, root);
+                known_levels.insert(generated);
+                if (generated == level) {
+                    break;
+                }
+            }
+            known = origin.find(level);
+        }
+        grouped[known->second].insert(level);
+    }
+
+    for (const auto &entry : grouped) {
+        StreamGroup group;
+        group.source_level = entry.first.first;
+        group.downsample = entry.first.second;
+        group.targets.assign(entry.second.begin(), entry.second.end());
+        plan.groups.push_back(std::move(group));
+    }
+    return plan;
+}
+
+// Distinct tiles at zoom `source_level - shift` that have at least one
+// descendant at `source_level`, as (x, XYZ y) pairs in row-major order.
+std::vector<std::pair<int, int>> stream_roots(sqlite3 *db, int source_level, int shift) {
+    auto roots = prepare_statement(db,
+                                   "SELECT DISTINCT tile_column >> ?1, tile_row >> ?1 FROM tiles "
+                                   "WHERE zoom_level=?2 ORDER BY 1, 2",
+                                   "enumerate parent tiles");
+    sqlite3_bind_int(roots.get(), 1, shift);
+    sqlite3_bind_int(roots.get(), 2, source_level);
+    std::vector<std::pair<int, int>> result;
+    while (true) {
+        const int rc = timed_step(roots.get());
+        if (rc == SQLITE_DONE) {
+            break;
+        }
+        if (rc != SQLITE_ROW) {
+            throw mbtiles_error("SQLite error while enumerating parent tiles: " + std::string(sqlite3_errmsg(db)));
+        }
+        result.emplace_back(sqlite3_column_int(roots.get(), 0),
+                            tms_to_xyz_y(sqlite3_column_int(roots.get(), 1), source_level - shift));
+    }
+    return result;
+}
+
+// Produces converted tiles one quadtree path at a time. Only the images on the
+// path between the tile being generated and its source tiles are alive, so
+// memory use is bounded by the zoom span instead of the size of a level.
+// A streamer owns statements on `db` and must stay on one thread; parallel
+// conversions give every worker its own connection and streamer.
+class PyramidStreamer {
+  public:
+    PyramidStreamer(sqlite3 *db, TileSink sink, std::size_t memory_limit)
+        : _db(db), _sink(std::move(sink)), _memory_limit(memory_limit),
+          _lookup(prepare_statement(db,
+                                    "SELECT tile_data FROM tiles WHERE zoom_level=?1 AND tile_column=?2 AND "
+                                    "tile_row=?3 LIMIT 1",
+                                    "prepare tile lookup")),
+          _exists(prepare_statement(db,
+                                    "SELECT 1 FROM tiles WHERE zoom_level=?1 AND tile_column BETWEEN ?2 AND ?3 AND "
+                                    "tile_row BETWEEN ?4 AND ?5 LIMIT 1",
+                                    "prepare tile range probe")) {}
+
+    // Selects the group the following render calls work on. `root_level` is
+    // the level render calls start from; the budget covers the path below it.
+    void begin(const StreamGroup &group, int root_level) {
+        _group = &group;
+        _depth = group.downsample ? group.source_level - root_level : group.targets.back() - group.source_level;
+        _budget_checked = false;
+    }
+
+    // Downsampling: generates (level, x, y) from its descendants at the
+    // source level and emits every target level passed on the way. A parent
+    // only exists when all four children do, matching downsample_level().
+    bool renderDown(int level, int x, int y, RGBAImage &out) {
+        if (level == _group->source_level) {
+            return loadSource(x, y, out);
+        }
+        if (_group->source_level - level >= 2 && !subtreeHasTiles(level, x, y)) {
+            return false;
+        }
+
+        bool complete = true;
+        {
+            std::array<RGBAImage, 4> children;
+            for (int idx = 0; idx < 4; ++idx) {
+                if (!renderDown(level + 1, x * 2 + idx % 2, y * 2 + idx / 2, children[idx])) {
+                    complete = false;
+                }
+            }
+            complete = complete &&
+                       downsample_group({&children[0], &children[1], &children[2], &children[3]}, out);
+            for (RGBAImage &child : children) {
+                recycle_pixels(child);
+            }
+        }
+
+        if (complete && isTarget(level)) {
+            _sink(level, x, y, out);
+        }
+        return complete;
+    }
+
+    // Copying and upsampling: loads one source tile and emits it and every
+    // target level below it.
+    void expandSource(int x, int y) {
+        RGBAImage image;
+        if (loadSource(x, y, image)) {
+            renderUp(_group->source_level, x, y, image);
+        }
+        recycle_pixels(image);
+    }
+
+  private:
+    // Every level on the current path keeps up to four decoded siblings.
+    void checkBudget(const RGBAImage &image) {
+        if (_budget_checked || _memory_limit == 0) {
+            return;
+        }
+        _budget_checked = true;
+        const std::size_t working_set = image.pixels.size() * 4 * static_cast<std::size_t>(_depth + 1);
+        if (working_set > _memory_limit) {
+            throw mbtiles_error("Streaming conversion needs about " + std::to_string(working_set) +
+                                " bytes of tile memory, which exceeds the configured limit of " +
+                                std::to_string(_memory_limit));
+        }
+    }
+
+    RGBAImage decode(const void *blob, int blob_size) {
+        RGBAImage image(static_cast<const unsigned char *>(blob), blob_size);
+        checkBudget(image);
+        return image;
+    }
+
+    bool isTarget(int level) const {
+        return std::binary_search(_group->targets.begin(), _group->targets.end(), level);
+    }
+
+    bool loadSource(int x, int y, RGBAImage &out) {
+        const int level = _group->source_level;
+        sqlite3_stmt *stmt = _lookup.get();
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, level);
+        sqlite3_bind_int(stmt, 2, x);
+        sqlite3_bind_int(stmt, 3, xyz_to_tms_y(y, level));
+        bool found = false;
+        if (timed_step(stmt) == SQLITE_ROW) {
+            const void *blob = sqlite3_column_blob(stmt, 0);
+            const int blob_size = sqlite3_column_bytes(stmt, 0);
+            if (blob != nullptr && blob_size > 0) {
+                count_tile_read(static_cast<std::size_t>(blob_size));
+                out = decode(blob, blob_size);
+                found = true;
+            }
+        }
+        sqlite3_reset(stmt);
+        return found;
+    }
+
+    bool subtreeHasTiles(int level, int x, int y) {
+        const int level_shift = _group->source_level - level;
+        const long long first_column = static_cast<long long>(x) << level_shift;
+        const long long last_column = ((static_cast<long long>(x) + 1) << level_shift) - 1;
+        const long long max_row = (1LL << _group->source_level) - 1;
+        const long long first_row = max_row - (((static_cast<long long>(y) + 1) << level_shift) - 1);
+        const long long last_row = max_row - (static_cast<long long>(y) << level_shift);
+
+        sqlite3_stmt *stmt = _exists.get();
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, _group->source_level);
+        sqlite3_bind_int64(stmt, 2, first_column);
+        sqlite3_bind_int64(stmt, 3, last_column);
+        sqlite3_bind_int64(stmt, 4, first_row);
+        sqlite3_bind_int64(stmt, 5, last_row);
+        const bool found = timed_step(stmt) == SQLITE_ROW;
+        sqlite3_reset(stmt);
+        return found;
+    }
+
+    void renderUp(int level, int x, int y, const RGBAImage &image) {
+        if (isTarget(level)) {
+            _sink(level, x, y, image);
+        }
+        if (level == _group->targets.back() || image.width <= 0 || image.height <= 0 || image.pixels.empty()) {
+            return;
+        }
+
+        std::array<RGBAImage, 4> children = upsample_tile(image);
+        for (int idx = 0; idx < 4; ++idx) {
+            renderUp(level + 1, x * 2 + idx % 2, y * 2 + idx / 2, children[idx]);
+            recycle_pixels(children[idx]);
+        }
+    }
+
+    sqlite3 *_db;
+    TileSink _sink;
+    std::size_t _memory_limit;
+    std::unique_ptr<sqlite3_stmt, stmt_deleter> _lookup;
+    std::unique_ptr<sqlite3_stmt, stmt_deleter> _exists;
+    const StreamGroup *_group = nullptr;
+    int _depth = 0;
+    bool _budget_checked = false;
+};
+
+
+// 128-bit content hash: two MurmurHash64A lanes with different seeds fed
+// from the same 8-byte words, so the second lane costs almost nothing.
+struct ContentHash {
+    std::uint64_t high = 0;
+    std::uint64_t low = 0;
+
+    bool operator==(const ContentHash &other) const {
+        return high == other.high && low == other.low;
+    }
+};
+
+struct ContentHashHasher {
+    std::size_t operator()(const ContentHash &hash) const {
+        return static_cast<std::size_t>(hash.low);
+    }
+};
+
+ContentHash content_hash(const unsigned char *data, std::size_t size, std::uint64_t salt = 0) {
+    constexpr std::uint64_t m = 0xc6a4a7935bd1e995ULL;
+    constexpr int r = 47;
+    std::uint64_t h1 = (0x9e3779b97f4a7c15ULL ^ salt) ^ (size * m);
+    std::uint64_t h2 = (0x2545f4914f6cdd1dULL + salt) ^ (size * m);
+    auto mix = [&](std::uint64_t k) {
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h1 = (h1 ^ k) * m;
+        h2 = (h2 ^ (k + 0x632be59bd9b4e019ULL)) * m;
+    };
+
+    std::size_t offset = 0;
+    for (; offset + 8 <= size; offset += 8) {
+        std::uint64_t k;
+        std::memcpy(&k, data + offset, sizeof(k));
+        mix(k);
+    }
+    if (offset < size) {
+        std::uint64_t k = 0;
+        std::memcpy(&k, data + offset, size - offset);
+        mix(k);
+    }
+
+    auto finish = [&](std::uint64_t h) {
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    };
+    return ContentHash{finish(h1), finish(h2)};
+}
+
+// Identifier of an encoded blob in the deduplicated layout.
+std::string content_hash_id(const ContentHash &hash) {
+    char buffer[33];
+    std::snprintf(buffer, sizeof(buffer), "%016llx%016llx", static_cast<unsigned long long>(hash.high),
+                  static_cast<unsigned long long>(hash.low));
+    return std::string(buffer, 32);
+}
+
+// Encoded blobs by hash of the pixels they were produced from, so repeated
+// tiles (ocean, blank, solid colours) are encoded once. Only small blobs are
+// kept, up to a fixed byte budget: repeated tiles compress well, and unique
+// ones would just fill the memo.
+class EncodeMemo {
+  public:
+    struct Entry {
+        std::vector<unsigned char> data;
+        ContentHash id;
+    };
+
+    static constexpr std::size_t kMaxBlobBytes = 64 * 1024;
+    static constexpr std::size_t kBudgetBytes = 64 * 1024 * 1024;
+
+    static ContentHash key(const RGBAImage &image) {
+        const std::uint64_t dims = (static_cast<std::uint64_t>(image.width) << 32) |
+                                   static_cast<std::uint32_t>(image.height);
+        return content_hash(image.pixels.data(), image.pixels.size(), dims);
+    }
+
+    std::optional<Entry> find(const ContentHash &pixels) const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(pixels);
+        if (it == _entries.end()) {
+            return std::nullopt;
+        }
+        ++_hits;
+        return it->second;
+    }
+
+    void store(const ContentHash &pixels, const std::vector<unsigned char> &data, const ContentHash &id) {
+        if (data.size() > kMaxBlobBytes) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_bytes + data.size() > kBudgetBytes) {
+            return;
+        }
+        if (_entries.emplace(pixels, Entry{data, id}).second) {
+            _bytes += data.size();
+        }
+    }
+
+    std::size_t hits() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _hits;
+    }
+
+  private:
+    mutable std::mutex _mutex;
+    std::unordered_map<ContentHash, Entry, ContentHashHasher> _entries;
+    std::size_t _bytes = 0;
+    mutable std::size_t _hits = 0;
+};
+
+struct EncodedTile {
+    int level = 0;
+    int x = 0;
+    int tms_y = 0;
+    std::vector<unsigned char> data;
+    // Content hash of `data`, filled in when the tile came from the memo.
+    std::optional<ContentHash> id;
+};
+
+// Funnels encoded tiles into the output connection, which only ever sees one
+// thread. With a background writer, producers append to a bounded queue and
+// the writer swaps it out and inserts the whole batch at once, so encoding
+// threads never wait on SQLite for longer than a queue hand-off.
+class TileInsertQueue {
+  public:
+    // `commit_interval` > 0 commits the surrounding transaction and opens a
+    // new one after that many inserts. With `image_insert`, `insert` targets
+    // the map table and each distinct blob is stored once through
+    // `image_insert`, keyed by its content hash.
+    TileInsertQueue(sqlite3 *db, sqlite3_stmt *insert, bool background, std::size_t capacity,
+                    std::size_t commit_interval = 0, sqlite3_stmt *image_insert = nullptr)
+        : _db(db), _insert(insert), _image_insert(image_insert), _capacity(std::max<std::size_t>(capacity, 1)),
+          _commit_interval(commit_interval) {
+        if (background) {
+            _writer = std::thread([this] { drain(); });
+        }
+    }
+
+    TileInsertQueue(const TileInsertQueue &) = delete;
+    TileInsertQueue &operator=(const TileInsertQueue &) = delete;
+
+    ~TileInsertQueue() {
+        stop();
+    }
+
+    // Thread-safe. Blocks while the queue is full; rethrows a writer failure.
+    void push(EncodedTile tile) {
+        if (!_writer.joinable()) {
+            insert(tile);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [&] { return _pending.size() < _capacity || _error; });
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+        _pending.push_back(std::move(tile));
+        _not_empty.notify_one();
+    }
+
+    // Waits until every queued tile is inserted; rethrows a writer failure.
+    void finish() {
+        stop();
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+    }
+
+    std::size_t written() const {
+        return _written;
+    }
+
+    // Distinct blobs stored in the images table (deduplicated layout only).
+    std::size_t uniqueImages() const {
+        return _image_ids.size();
+    }
+
+  private:
+    void stop() {
+        if (!_writer.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closing = true;
+        }
+        _not_empty.notify_one();
+        _writer.join();
+    }
+
+    void drain() {
+        std::vector<EncodedTile> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _not_empty.wait(lock, [&] { return !_pending.empty() || _closing; });
+                if (_pending.empty()) {
+                    return;
+                }
+                batch.swap(_pending);
+            }
+            _not_full.notify_all();
+
+            try {
+                for (const EncodedTile &tile : batch) {
+                    insert(tile);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _error = std::current_exception();
+                _pending.clear();
+                _not_full.notify_all();
+                return;
+            }
+            batch.clear();
+        }
+    }
+
+    void insert(const EncodedTile &tile) {
+        sqlite3_reset(_insert);
+        sqlite3_clear_bindings(_insert);
+        sqlite3_bind_int(_insert, 1, tile.level);
+        sqlite3_bind_int(_insert, 2, tile.x);
+        sqlite3_bind_int(_insert, 3, tile.tms_y);
+
+        std::string tile_id;
+        if (_image_insert != nullptr) {
+            const ContentHash id = tile.id ? *tile.id : content_hash(tile.data.data(), tile.data.size());
+            tile_id = content_hash_id(id);
+            if (_image_ids.insert(id).second) {
+                insertImage(tile_id, tile.data);
+            }
+            sqlite3_bind_text(_insert, 4, tile_id.data(), static_cast<int>(tile_id.size()), SQLITE_STATIC);
+        } else {
+            sqlite3_bind_blob(_insert, 4, tile.data.data(), static_cast<int>(tile.data.size()), SQLITE_STATIC);
+        }
+
+        if (timed_step(_insert) != SQLITE_DONE) {
+            const std::string message = "Failed to insert tile: " + std::string(sqlite3_errmsg(_db));
+            sqlite3_reset(_insert);
+            throw mbtiles_error(message);
+        }
+        sqlite3_reset(_insert);
+        ++_written;
+        count_tile_written(tile.data.size());
+
+        if (_commit_interval != 0 && ++_uncommitted >= _commit_interval) {
+            _uncommitted = 0;
+            if (sqlite3_exec(_db, "COMMIT; BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+                throw mbtiles_error("Failed to commit converted tiles: " + std::string(sqlite3_errmsg(_db)));
+            }
+        }
+    }
+
+    void insertImage(const std::string &tile_id, const std::vector<unsigned char> &data) {
+        sqlite3_reset(_image_insert);
+        sqlite3_clear_bindings(_image_insert);
+        sqlite3_bind_text(_image_insert, 1, tile_id.data(), static_cast<int>(tile_id.size()), SQLITE_STATIC);
+        sqlite3_bind_blob(_image_insert, 2, data.data(), static_cast<int>(data.size()), SQLITE_STATIC);
+        if (timed_step(_image_insert) != SQLITE_DONE) {
+            const std::string message = "Failed to insert tile image: " + std::string(sqlite3_errmsg(_db));
+            sqlite3_reset(_image_insert);
+            throw mbtiles_error(message);
+        }
+        sqlite3_reset(_image_insert);
+    }
+
+    sqlite3 *_db;
+    sqlite3_stmt *_insert;
+    sqlite3_stmt *_image_insert;
+    std::unordered_set<ContentHash, ContentHashHasher> _image_ids;
+    std::size_t _capacity;
+    std::size_t _commit_interval;
+    std::size_t _uncommitted = 0;
+    std::atomic<std::size_t> _written{0};
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::vector<EncodedTile> _pending;
+    std::exception_ptr _error;
+    bool _closing = false;
+    std::thread _writer;
+};
+
+// Runs one streaming group. With several threads and a file-backed source,
+// the roots of the walk are shared between workers that each read through
+// their own connection. Downsampling towards a level with only a handful of
+// tiles would leave workers idle, so the walk then starts at the first level
+// with enough tiles and the levels above it are derived from the retained
+// tiles of that level, which are few by construction.
+void stream_group(sqlite3 *db, const std::string &source_path, const StreamGroup &group, const TileSink &sink,
+                  std::size_t memory_limit, unsigned threads) {
+    const unsigned workers = source_path.empty() ? 1 : threads;
+    int root_level = group.downsample ? group.targets.front() : group.source_level;
+    auto roots = stream_roots(db, group.source_level, group.source_level - root_level);
+    while (workers > 1 && group.downsample && root_level < group.source_level &&
+           roots.size() < static_cast<std::size_t>(workers) * 4) {
+        ++root_level;
+        roots = stream_roots(db, group.source_level, group.source_level - root_level);
+    }
+
+    const bool keep_split = group.downsample && root_level > group.targets.front();
+    std::mutex split_mutex;
+    TileLevel split_tiles;
+    auto render_root = [&](PyramidStreamer &streamer, std::size_t index) {
+        const int x = roots[index].first;
+        const int y = roots[index].second;
+        if (!group.downsample) {
+            streamer.expandSource(x, y);
+            return;
+        }
+        RGBAImage image;
+        if (streamer.renderDown(root_level, x, y, image) && keep_split) {
+            std::lock_guard<std::mutex> lock(split_mutex);
+            split_tiles.emplace(make_tile_key(x, y), std::move(image));
+        }
+        recycle_pixels(image);
+    };
+
+    const unsigned active = static_cast<unsigned>(std::min<std::size_t>(workers, roots.size()));
+    if (active <= 1) {
+        PyramidStreamer streamer(db, sink, memory_limit);
+        streamer.begin(group, root_level);
+        for (std::size_t index = 0; index < roots.size(); ++index) {
+            render_root(streamer, index);
+        }
+    } else {
+        std::atomic<std::size_t> next{0};
+        std::atomic<bool> failed{false};
+        run_workers(active, [&](unsigned) {
+            try {
+                db_handle connection = open_read_only_connection(source_path);
+                PyramidStreamer streamer(connection.get(), sink, memory_limit / active);
+                streamer.begin(group, root_level);
+                for (std::size_t index = next++; index < roots.size() && !failed; index = next++) {
+                    render_root(streamer, index);
+                }
+            } catch (...) {
+                failed = true;
+                throw;
+            }
+        });
+    }
+
+    for (int level = root_level - 1; keep_split && level >= group.targets.front(); --level) {
+        split_tiles = downsample_level(split_tiles, threads);
+        if (!std::binary_search(group.targets.begin(), group.targets.end(), level)) {
+            continue;
+        }
+        parallel_for(split_tiles.size(), threads, [&](std::size_t index) {
+            const auto &entry = split_tiles[index];
+            sink(level, tile_key_x(entry.first), tile_key_y(entry.first), entry.second);
+        });
+    }
+}
+
+/*
+TileMap MBTiles::loadLevelRgba(int zoom) {
+    const char *query = "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level=?";
+    sqlite3_stmt *raw_stmt = nullptr;
+    if (sqlite3_prepare_v2(_db, query, -1, &raw_stmt, nullptr) != SQLITE_OK) {
+        throw mbtiles_error("Failed to read tiles for zoom level " + std::to_string(zoom) + ": " +
+        std::string(sqlite3_errmsg(_db)));
+    }
+    
+    std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
+    TileMap tiles;
+    
+    while (true) {
+        const int rc = sqlite3_step(stmt.get());
+        if (rc == SQLITE_DONE) {
+            break;
+        }
+        if (rc != SQLITE_ROW) {
+            throw mbtiles_error("SQLite error while reading tiles: " + std::string(sqlite3_errmsg(_db)));
+        }
+        
+        const int x = sqlite3_column_int(stmt.get(), 0);
+        const int tms_y = sqlite3_column_int(stmt.get(), 1);
+        const void *blob = sqlite3_column_blob(stmt.get(), 2);
+        const int blob_size = sqlite3_column_bytes(stmt.get(), 2);
+        
+        const int y = tms_to_xyz_y(tms_y, zoom);
+        RGBAImage image(static_cast<const unsigned char *>(blob), blob_size);
+        tiles.emplace(make_tile_key(x, y), std::move(image));
+    }
+    
+    return tiles;
+}
+*/
+
+// TileMap downsample_level(const TileMap &source_tiles, int source_zoom) {
+    //     struct ParentGroup {
         //         std::array<bool, 4> present = {false, false, false, false};
         //         std::array<image_data, 4> images;
         //     };
@@ -1035,269 +3357,1888 @@ TileMap MBTiles::loadLevelRgba(int zoom) {
 
 // }  // namespace
 
-std::size_t MBTiles::extract(const std::string& output_directory, const std::string& pattern) const {
-    namespace fs = std::filesystem;
+// Remembers directories that already exist so extraction does not issue a
+// create_directories() round of stat calls for every tile. Thread-safe.
+class DirectoryCache {
+  public:
+    void ensure(const fs::path &directory) {
+        if (directory.empty()) {
+            return;
+        }
+        std::string key = directory.string();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_known.count(key) != 0U) {
+                return;
+            }
+        }
+        std::error_code ec;
+        fs::create_directories(directory, ec);
+        if (ec) {
+            throw mbtiles_error("Failed to create directory '" + key + "': " + ec.message());
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _known.insert(std::move(key));
+    }
 
-    // Resolve output root directory
-    fs::path output_root = output_directory.empty() ? fs::current_path() : fs::path(output_directory);
-    std::error_code ec;
-    fs::create_directories(output_root, ec);
-    if (ec) {
-        throw mbtiles_error("Failed to create output directory '" + output_root.string() + "': " + ec.message());
+  private:
+    std::mutex _mutex;
+    std::unordered_set<std::string> _known;
+};
+
+// Writes `size` bytes to a new or truncated file. Uses a plain file
+// descriptor where available; iostreams add buffering and locale machinery
+// that only cost time for one-shot writes.
+void write_tile_file(const fs::path &path, const std::byte *data, std::size_t size) {
+    count_tile_written(size);
+#ifndef _WIN32
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw mbtiles_error("Failed to open output file '" + path.string() + "': " + std::strerror(errno));
+    }
+    const auto *cursor = reinterpret_cast<const char *>(data);
+    std::size_t remaining = size;
+    while (remaining > 0) {
+        const ssize_t written = ::write(fd, cursor, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            const int error = errno;
+            ::close(fd);
+            throw mbtiles_error("Failed to write tile to '" + path.string() + "': " + std::strerror(error));
+        }
+        cursor += written;
+        remaining -= static_cast<std::size_t>(written);
+    }
+    if (::close(fd) != 0) {
+        throw mbtiles_error("Failed to write tile to '" + path.string() + "': " + std::strerror(errno));
+    }
+#else
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        throw mbtiles_error("Failed to open output file '" + path.string() + "'");
+    }
+    if (size > 0) {
+        file.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+    }
+    if (!file) {
+        throw mbtiles_error("Failed to write tile to '" + path.string() + "'");
+    }
+#endif
+}
+
+// Target file of one tile: the formatted pattern below `root`, with the
+// tile's extension appended when the pattern does not produce one.
+fs::path extract_target_path(const fs::path &root, const TileView &tile, const std::string &pattern) {
+    const std::string extension_token(tile.extension);
+    fs::path output_path = root / fs::path(format_pattern(tile.zoom, tile.x, tile.y, pattern, extension_token));
+    if (output_path.extension().empty() && !extension_token.empty()) {
+        output_path += "." + extension_token;
+    }
+    return output_path;
+}
+
+struct ExtractJob {
+    fs::path path;
+    std::vector<std::byte> data;
+};
+
+// Pool of file writers fed by the single TileIterator reader. Jobs travel in
+// batches so the queue lock is taken once per batch rather than per tile,
+// and the queue is bounded so a slow filesystem throttles the reader instead
+// of buffering the archive in memory.
+class ExtractWriterPool {
+  public:
+    ExtractWriterPool(unsigned threads, DirectoryCache &directories)
+        : _directories(directories), _capacity(static_cast<std::size_t>(threads) * 2) {
+        _workers.reserve(threads);
+        try {
+            for (unsigned i = 0; i < threads; ++i) {
+                _workers.emplace_back([this] { work(); });
+            }
+        } catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    ExtractWriterPool(const ExtractWriterPool &) = delete;
+    ExtractWriterPool &operator=(const ExtractWriterPool &) = delete;
+
+    ~ExtractWriterPool() {
+        stop();
+    }
+
+    // Blocks while the queue is full; rethrows the first writer failure.
+    void push(std::vector<ExtractJob> batch) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [&] { return _batches.size() < _capacity || _error; });
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+        _batches.push_back(std::move(batch));
+        _not_empty.notify_one();
+    }
+
+    // Waits for all queued jobs; rethrows the first writer failure.
+    void finish() {
+        stop();
+        if (_error) {
+            std::rethrow_exception(_error);
+        }
+    }
+
+  private:
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closing = true;
+        }
+        _not_empty.notify_all();
+        for (auto &worker : _workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+
+    void work() {
+        while (true) {
+            std::vector<ExtractJob> batch;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _not_empty.wait(lock, [&] { return !_batches.empty() || _closing || _error; });
+                if (_error || _batches.empty()) {
+                    return;
+                }
+                batch = std::move(_batches.front());
+                _batches.pop_front();
+            }
+            _not_full.notify_one();
+
+            try {
+                for (const ExtractJob &job : batch) {
+                    _directories.ensure(job.path.parent_path());
+                    write_tile_file(job.path, job.data.data(), job.data.size());
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (!_error) {
+                    _error = std::current_exception();
+                }
+                _batches.clear();
+                _not_full.notify_all();
+                _not_empty.notify_all();
+                return;
+            }
+        }
+    }
+
+    DirectoryCache &_directories;
+    std::size_t _capacity;
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
+    std::deque<std::vector<ExtractJob>> _batches;
+    std::exception_ptr _error;
+    bool _closing = false;
+    std::vector<std::thread> _workers;
+};
+
+// Tiles handed to a writer thread at once.
+constexpr std::size_t kExtractBatchSize = 64;
+
+std::size_t MBTiles::extract(const std::string& output_directory, const std::string& pattern) const {
+    return extract(ExtractOptions(output_directory, pattern));
+}
+
+std::size_t MBTiles::extract(const ExtractOptions& options, Metrics& stats) const {
+    const Metrics before = metrics();
+    const std::size_t extracted = extract(options);
+    stats = metrics() - before;
+    return extracted;
+}
+
+std::size_t MBTiles::extract(const ExtractOptions& options) const {
+    // Resolve output root directory
+    const fs::path output_root = options.output_directory.empty() ? fs::current_path()
+                                                                  : fs::path(options.output_directory);
+    std::error_code ec;
+    fs::create_directories(output_root, ec);
+    if (ec) {
+        throw mbtiles_error("Failed to create output directory '" + output_root.string() + "': " + ec.message());
+    }
+
+    DirectoryCache directories;
+    TileIterator iter = tiles();
+    std::size_t count = 0;
+    auto report = [&]() {
+        ++count;
+        if (count % 100 == 0) {
+            logInfo("Extracted " + std::to_string(count) + " tiles...");
+        }
+    };
+
+    const unsigned threads = resolve_thread_count(options.threads);
+    if (threads <= 1) {
+        while (auto tile = iter.nextView()) {
+            // Write straight from SQLite's row buffer
+            const fs::path output_path = extract_target_path(output_root, *tile, options.pattern);
+            directories.ensure(output_path.parent_path());
+            write_tile_file(output_path, tile->data, tile->size);
+            report();
+        }
+    } else {
+        ExtractWriterPool writers(threads, directories);
+        std::vector<ExtractJob> batch;
+        batch.reserve(kExtractBatchSize);
+        while (auto tile = iter.nextView()) {
+            ExtractJob job;
+            job.path = extract_target_path(output_root, *tile, options.pattern);
+            job.data.assign(tile->data, tile->data + tile->size);
+            batch.push_back(std::move(job));
+            if (batch.size() == kExtractBatchSize) {
+                writers.push(std::move(batch));
+                batch.clear();
+                batch.reserve(kExtractBatchSize);
+            }
+            report();
+        }
+        if (!batch.empty()) {
+            writers.push(std::move(batch));
+        }
+        writers.finish();
+    }
+
+    logInfo("Extraction completed. Total tiles: " + std::to_string(count));
+    return count;
+}
+
+// Filename pattern split into literal text and tile fields, matched against
+// paths relative to the import root. Only placeholders that read back to a
+// unique tile are accepted: {z}, {x}, {y} and {ext}.
+class TilePathPattern {
+  public:
+    explicit TilePathPattern(const std::string &pattern) {
+        bool has[3] = {false, false, false};
+        for (std::size_t i = 0; i < pattern.size();) {
+            if (pattern[i] != '{') {
+                const std::size_t next = std::min(pattern.find('{', i), pattern.size());
+                _parts.push_back(Part{Field::LITERAL, pattern.substr(i, next - i)});
+                i = next;
+                continue;
+            }
+
+            const std::size_t closing = pattern.find('}', i + 1);
+            if (closing == std::string::npos) {
+                throw mbtiles_error("Unclosed placeholder in pattern: " + pattern);
+            }
+            const std::string token = pattern.substr(i + 1, closing - i - 1);
+            Field field;
+            if (token_is(token, 'z')) {
+                field = Field::ZOOM;
+            } else if (token_is(token, 'x')) {
+                field = Field::X;
+            } else if (token_is(token, 'y')) {
+                field = Field::Y;
+            } else if (token == "ext") {
+                field = Field::EXT;
+                _has_extension = true;
+            } else {
+                throw mbtiles_error("Placeholder '{" + token + "}' cannot be matched when importing: " + pattern);
+            }
+            if (!_parts.empty() && _parts.back().field != Field::LITERAL) {
+                throw mbtiles_error("Placeholders must be separated by literal text in pattern: " + pattern);
+            }
+            if (field != Field::EXT) {
+                has[static_cast<int>(field) - 1] = true;
+            }
+            _parts.push_back(Part{field, {}});
+            i = closing + 1;
+        }
+        if (!has[0] || !has[1] || !has[2]) {
+            throw mbtiles_error("Import pattern needs {z}, {x} and {y}: " + pattern);
+        }
+    }
+
+    // Parses `path` (generic separators); a pattern without {ext} still
+    // accepts a trailing ".ext", as extract() appends one.
+    bool match(std::string_view path, TileCoord &coord, std::string_view &extension) const {
+        std::size_t pos = 0;
+        extension = {};
+        for (const Part &part : _parts) {
+            if (part.field == Field::LITERAL) {
+                if (path.compare(pos, part.text.size(), part.text) != 0) {
+                    return false;
+                }
+                pos += part.text.size();
+                continue;
+            }
+            if (part.field == Field::EXT) {
+                const std::size_t start = pos;
+                while (pos < path.size() && std::isalnum(static_cast<unsigned char>(path[pos])) != 0) {
+                    ++pos;
+                }
+                if (pos == start) {
+                    return false;
+                }
+                extension = path.substr(start, pos - start);
+                continue;
+            }
+
+            long long value = 0;
+            const std::size_t start = pos;
+            while (pos < path.size() && pos - start < 10 && std::isdigit(static_cast<unsigned char>(path[pos])) != 0) {
+                value = value * 10 + (path[pos] - '0');
+                ++pos;
+            }
+            if (pos == start || value > std::numeric_limits<int>::max()) {
+                return false;
+            }
+            (part.field == Field::ZOOM ? coord.zoom : part.field == Field::X ? coord.x : coord.y) =
+                static_cast<int>(value);
+        }
+
+        if (!_has_extension && pos < path.size() && path[pos] == '.') {
+            extension = path.substr(pos + 1);
+            pos = path.size();
+        }
+        return pos == path.size();
+    }
+
+  private:
+    enum class Field {
+        LITERAL,
+        ZOOM,
+        X,
+        Y,
+        EXT,
+    };
+    struct Part {
+        Field field;
+        std::string text;
+    };
+
+    std::vector<Part> _parts;
+    bool _has_extension = false;
+};
+
+// Reads a whole file into memory; the raw descriptor path mirrors
+// write_tile_file().
+std::vector<unsigned char> read_tile_file(const fs::path &path) {
+    std::vector<unsigned char> data;
+#ifndef _WIN32
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw mbtiles_error("Failed to open tile file '" + path.string() + "': " + std::strerror(errno));
+    }
+    std::size_t size = 0;
+    data.resize(16 * 1024);
+    while (true) {
+        if (size == data.size()) {
+            data.resize(data.size() * 2);
+        }
+        const ssize_t got = ::read(fd, data.data() + size, data.size() - size);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            const int error = errno;
+            ::close(fd);
+            throw mbtiles_error("Failed to read tile file '" + path.string() + "': " + std::strerror(error));
+        }
+        if (got == 0) {
+            break;
+        }
+        size += static_cast<std::size_t>(got);
+    }
+    ::close(fd);
+    data.resize(size);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw mbtiles_error("Failed to open tile file '" + path.string() + "'");
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+#endif
+    return data;
+}
+
+// Directories still to be listed during an import. Each worker lists one
+// directory at a time and queues the subdirectories it finds, so a deep
+// z/x/y tree spreads over all workers from the first level down.
+class DirectoryWalkQueue {
+  public:
+    explicit DirectoryWalkQueue(fs::path root) {
+        _pending.push_back(std::move(root));
+    }
+
+    // Blocks until a directory is available; false once every directory has
+    // been listed or the walk was aborted.
+    bool pop(fs::path &directory) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ready.wait(lock, [&] { return !_pending.empty() || _active == 0 || _aborted; });
+        if (_aborted || _pending.empty()) {
+            return false;
+        }
+        directory = std::move(_pending.back());
+        _pending.pop_back();
+        ++_active;
+        return true;
+    }
+
+    void push(fs::path directory) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(std::move(directory));
+        }
+        _ready.notify_one();
+    }
+
+    // Marks the directory returned by the last pop() as listed.
+    void done() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_active == 0 && _pending.empty()) {
+            _ready.notify_all();
+        }
+    }
+
+    void abort() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _aborted = true;
+        }
+        _ready.notify_all();
+    }
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _ready;
+    std::vector<fs::path> _pending;
+    std::size_t _active = 0;
+    bool _aborted = false;
+};
+
+// Tiles inserted per transaction during an import; imported files are small,
+// so transactions can be much larger than when converting.
+constexpr std::size_t kImportCommitInterval = 16384;
+
+std::size_t MBTiles::importDirectory(const std::string &directory, const std::string &pattern,
+                                     const ImportOptions &options) {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    const fs::path root = fs::absolute(directory);
+    if (!fs::is_directory(root)) {
+        throw mbtiles_error("Import source '" + directory + "' is not a directory");
+    }
+    const TilePathPattern matcher(pattern);
+
+    auto exec_sql = [&](const char *sql, const char *context) {
+        if (sqlite3_exec(_db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw mbtiles_error(std::string("Failed to ") + context + ": " + sqlite3_errmsg(_db));
+        }
+    };
+
+    // A fresh tiles table is indexed once after the bulk insert, still inside
+    // the transaction; an existing one needs its unique index in place so
+    // rows at the same coordinates are replaced rather than added.
+    bool has_tiles = false;
+    {
+        cached_stmt guard(cachedStatement("SELECT type FROM sqlite_master WHERE name='tiles'"));
+        if (timed_step(guard.get()) == SQLITE_ROW) {
+            has_tiles = true;
+            if (std::string_view(reinterpret_cast<const char *>(sqlite3_column_text(guard.get(), 0))) != "table") {
+                throw mbtiles_error("Importing needs a plain tiles table");
+            }
+        }
+    }
+    if (!has_tiles) {
+        exec_sql("CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)",
+                 "create tiles table");
+    } else {
+        cached_stmt guard(cachedStatement("SELECT 1 FROM pragma_index_list('tiles') WHERE \"unique\" = 1"));
+        if (timed_step(guard.get()) != SQLITE_ROW) {
+            logInfo("Indexing tiles before importing");
+            exec_sql("CREATE UNIQUE INDEX tiles_index ON tiles (zoom_level, tile_column, tile_row)",
+                     "index tiles (is a tile present twice?)");
+        }
+    }
+    exec_sql("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)", "create metadata table");
+
+    std::string format_token;
+    if (options.format == Format::PNG) {
+        format_token = "png";
+    } else if (options.format == Format::JPG) {
+        format_token = "jpg";
+    } else if (options.format == Format::WEBP) {
+        format_token = "webp";
+    }
+    const bool reencode = !format_token.empty() || options.grayscale;
+
+    const unsigned threads = resolve_thread_count(options.threads);
+    std::atomic<std::size_t> skipped{0};
+    std::mutex extension_mutex;
+    std::string first_extension;
+
+    exec_sql("BEGIN IMMEDIATE", "start import transaction");
+    std::size_t imported = 0;
+    try {
+        sqlite3_stmt *insert = cachedStatement(has_tiles ? kTileUpsertSql : kTileInsertSql);
+        // A fresh table is filled in one transaction, so a duplicate caught by
+        // its index rolls the whole import back.
+        TileInsertQueue writer(_db, insert, threads > 1, static_cast<std::size_t>(threads) * 64,
+                               has_tiles ? kImportCommitInterval : 0);
+        DirectoryWalkQueue walk(root);
+
+        auto import_file = [&](const fs::path &path) {
+            const std::string relative = path.lexically_relative(root).generic_string();
+            TileCoord coord;
+            std::string_view extension;
+            if (!matcher.match(relative, coord, extension) || coord.zoom > 30 ||
+                coord.x > (1 << coord.zoom) - 1 || coord.y > (1 << coord.zoom) - 1) {
+                logDebug("Skipping '" + relative + "': does not match the import pattern");
+                ++skipped;
+                return;
+            }
+
+            EncodedTile tile;
+            tile.level = coord.zoom;
+            tile.x = coord.x;
+            tile.tms_y = options.tms ? coord.y : xyz_to_tms_y(coord.y, coord.zoom);
+            tile.data = read_tile_file(path);
+
+            std::string token = format_token.empty() ? normalize_extension_token(std::string(extension)) : format_token;
+            if (token == "jpeg") {
+                token = "jpg";
+            }
+            if (reencode) {
+                const RGBAImage image(tile.data.data(), static_cast<int>(tile.data.size()));
+                tile.data = encode_output_tile(image, token, options.grayscale, options.compact_grayscale,
+                                               options.encoder);
+            }
+            {
+                std::lock_guard<std::mutex> lock(extension_mutex);
+                if (first_extension.empty()) {
+                    first_extension = token;
+                }
+            }
+            writer.push(std::move(tile));
+        };
+
+        run_workers(threads, [&](unsigned) {
+            fs::path current;
+            while (walk.pop(current)) {
+                try {
+                    for (const fs::directory_entry &entry : fs::directory_iterator(current)) {
+                        if (entry.is_directory()) {
+                            walk.push(entry.path());
+                        } else if (entry.is_regular_file()) {
+                            import_file(entry.path());
+                        }
+                    }
+                } catch (...) {
+                    walk.abort();
+                    throw;
+                }
+                walk.done();
+            }
+        });
+
+        writer.finish();
+        imported = writer.written();
+        if (!has_tiles) {
+            logInfo("Indexing imported tiles");
+            exec_sql("CREATE UNIQUE INDEX tiles_index ON tiles (zoom_level, tile_column, tile_row)",
+                     "index imported tiles (is a tile present twice, e.g. as .png and .jpg?)");
+        }
+        exec_sql("COMMIT", "commit imported tiles");
+    } catch (...) {
+        sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw;
+    }
+
+    std::map<std::string, std::string> entries;
+    if (const auto min_zoom = minZoomLevel()) {
+        entries["minzoom"] = std::to_string(*min_zoom);
+        entries["maxzoom"] = std::to_string(*maxZoomLevel());
+    }
+    // Keep a format recorded earlier unless the tiles were re-encoded.
+    if (!first_extension.empty() && (reencode || metadata().count("format") == 0U)) {
+        entries["format"] = first_extension;
+    }
+    setMetadata(entries, true);
+
+    if (skipped != 0) {
+        logWarn("Skipped " + std::to_string(skipped.load()) + " files that do not match '" + pattern + "'");
+    }
+    logInfo("Import completed. Tiles imported: " + std::to_string(imported));
+    return imported;
+}
+
+struct TileWriter::Impl {
+    Impl(sqlite3 *db, sqlite3_stmt *insert, const TileWriterOptions &options)
+        : db(db), queue(db, insert, true, options.queue_capacity, options.commit_interval) {}
+
+    sqlite3 *db;
+    TileInsertQueue queue;
+    bool finished = false;
+};
+
+TileWriter::TileWriter(MBTiles &archive, const TileWriterOptions &options) {
+    sqlite3 *db = archive._db;
+    if (db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    auto exec_sql = [&](const char *sql, const char *context) {
+        if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw mbtiles_error(std::string("Failed to ") + context + ": " + sqlite3_errmsg(db));
+        }
+    };
+
+    {
+        cached_stmt guard(archive.cachedStatement("SELECT type FROM sqlite_master WHERE name='tiles'"));
+        if (timed_step(guard.get()) == SQLITE_ROW &&
+            std::string_view(reinterpret_cast<const char *>(sqlite3_column_text(guard.get(), 0))) != "table") {
+            throw mbtiles_error("TileWriter needs a plain tiles table");
+        }
+    }
+    // Replacing by coordinate needs the unique index up front.
+    exec_sql("CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)",
+             "create tiles table");
+    exec_sql("CREATE UNIQUE INDEX IF NOT EXISTS tiles_index ON tiles (zoom_level, tile_column, tile_row)",
+             "create tiles index");
+    exec_sql("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)", "create metadata table");
+
+    sqlite3_stmt *insert = archive.cachedStatement(kTileUpsertSql);
+    exec_sql("BEGIN IMMEDIATE", "start tile writer transaction");
+    try {
+        _impl = std::make_unique<Impl>(db, insert, options);
+    } catch (...) {
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw;
+    }
+}
+
+TileWriter::~TileWriter() {
+    if (_impl && !_impl->finished) {
+        try {
+            finish();
+        } catch (const std::exception &ex) {
+            logError(std::string("TileWriter failed while closing: ") + ex.what());
+        }
+    }
+}
+
+void TileWriter::write(int zoom, int x, int y, std::vector<unsigned char> data) {
+    if (_impl->finished) {
+        throw mbtiles_error("TileWriter is already finished");
+    }
+    EncodedTile tile;
+    tile.level = zoom;
+    tile.x = x;
+    tile.tms_y = xyz_to_tms_y(y, zoom);
+    tile.data = std::move(data);
+    _impl->queue.push(std::move(tile));
+}
+
+std::size_t TileWriter::finish() {
+    if (_impl->finished) {
+        return _impl->queue.written();
+    }
+    _impl->finished = true;
+    try {
+        _impl->queue.finish();
+    } catch (...) {
+        // Batches committed at earlier commit intervals are kept.
+        sqlite3_exec(_impl->db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw;
+    }
+    if (sqlite3_exec(_impl->db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        throw mbtiles_error("Failed to commit written tiles: " + std::string(sqlite3_errmsg(_impl->db)));
+    }
+    return _impl->queue.written();
+}
+
+// Resolves `path` to the absolute file a new archive is written to, adding
+// the .mbtiles extension when missing. Touches nothing on disk.
+fs::path resolve_output_path(const std::string &path) {
+    if (path.empty()) {
+        throw mbtiles_error("Output path must not be empty");
+    }
+
+    fs::path destination = fs::absolute(path);
+    if (!destination.has_extension()) {
+        destination.replace_extension(".mbtiles");
+    }
+    return destination;
+}
+
+// Makes `destination` (from resolve_output_path()) ready for a new archive:
+// creates parent directories and removes a previous file at that location.
+// Callers check that it is not an archive still in use first.
+void prepare_output_file(const fs::path &destination) {
+    if (!destination.parent_path().empty()) {
+        std::error_code ec;
+        fs::create_directories(destination.parent_path(), ec);
+        if (ec) {
+            throw mbtiles_error("Failed to create directory '" + destination.parent_path().string() + "': " + ec.message());
+        }
+    }
+
+    if (fs::exists(destination)) {
+        std::error_code ec;
+        fs::remove(destination, ec);
+        if (ec) {
+            throw mbtiles_error("Failed to overwrite existing file '" + destination.string() + "': " + ec.message());
+        }
+    }
+}
+
+// Deletes a partially written output file unless the conversion finished.
+struct PartialOutputGuard {
+    fs::path path;
+    bool keep = false;
+
+    ~PartialOutputGuard() {
+        if (!keep && !path.empty()) {
+            std::error_code ec;
+            fs::remove(path, ec);
+        }
+    }
+};
+
+// Tiles inserted per transaction when converting into a file, so the page
+// cache is flushed regularly instead of growing with the whole output.
+constexpr std::size_t kConvertCommitInterval = 4096;
+
+MBTiles MBTiles::convert(const ConvertOptions& options, Metrics& stats) const {
+    const Metrics before = metrics();
+    MBTiles output = convert(options);
+    stats = metrics() - before;
+    return output;
+}
+
+MBTiles MBTiles::convert(const ConvertOptions& options) const {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    if (options.zoom_levels.empty()) {
+        throw mbtiles_error("At least one zoom level must be specified for conversion");
+    }
+
+    auto available_levels = zoomLevels();
+    auto target_levels = resolve_target_zoom_levels(options.zoom_levels, available_levels);
+    std::sort(target_levels.begin(), target_levels.end());
+    target_levels.erase(std::unique(target_levels.begin(), target_levels.end()), target_levels.end());
+
+    if (target_levels.empty()) {
+        throw mbtiles_error("No target zoom levels resolved for conversion");
+    }
+
+    const auto source_metadata = metadata();
+    const std::string format_token = resolve_format_token(options.format, source_metadata);
+
+    PartialOutputGuard partial_output;
+    if (!options.output_path.empty()) {
+        // Compared once the extension is resolved: "a" names "a.mbtiles".
+        const fs::path destination = resolve_output_path(options.output_path);
+        std::error_code ec;
+        if (!_path.empty() && fs::equivalent(destination, _path, ec)) {
+            throw mbtiles_error("Conversion output must not overwrite the source archive '" + _path + "'");
+        }
+        prepare_output_file(destination);
+        partial_output.path = destination;
+    }
+    const bool to_file = !partial_output.path.empty();
+    const std::string output_location = to_file ? partial_output.path.string() : std::string(":memory:");
+
+    sqlite3 *raw_out = nullptr;
+    if (sqlite3_open_v2(output_location.c_str(), &raw_out, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) !=
+        SQLITE_OK) {
+        std::string message = to_file ? "Unable to create output MBTiles file '" + output_location + "'"
+                                      : std::string("Unable to create conversion database");
+        if (raw_out != nullptr) {
+            message += ": ";
+            message += sqlite3_errmsg(raw_out);
+            sqlite3_close(raw_out);
+        }
+        throw mbtiles_error(message);
+    }
+
+    MBTiles output;
+    output._db = raw_out;
+    auto exec_sql = [&](const char *sql, const char *context) {
+        if (sqlite3_exec(output._db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw mbtiles_error(std::string("Failed to ") + context + ": " + sqlite3_errmsg(output._db));
+        }
+    };
+
+    // The output is a fresh file that is deleted if conversion fails, so it
+    // needs neither a rollback journal nor fsyncs while it is being filled.
+    exec_sql("PRAGMA synchronous=OFF", "configure synchronous mode");
+    exec_sql("PRAGMA journal_mode=OFF", "configure journal mode");
+    exec_sql("PRAGMA locking_mode=EXCLUSIVE", "configure locking mode");
+    exec_sql("PRAGMA temp_store=MEMORY", "configure temp store");
+    exec_sql("PRAGMA cache_size=-65536", "configure page cache");
+
+    if (options.deduplicate) {
+        // The standard MBTiles deduplicated schema: tiles is a view joining
+        // the coordinate map with the distinct images.
+        exec_sql("CREATE TABLE IF NOT EXISTS map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT)",
+                 "create map table");
+        exec_sql("CREATE TABLE IF NOT EXISTS images (tile_data BLOB, tile_id TEXT)", "create images table");
+        exec_sql("CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, "
+                 "map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id",
+                 "create tiles view");
+    } else {
+        exec_sql("CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)",
+                 "create tiles table");
+    }
+    exec_sql("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)",
+             "create metadata table");
+
+    // Existing levels already stored in the output format need no pixel work:
+    // their blobs are copied as is, which also spares JPEG a lossy re-encode.
+    std::set<int> passthrough_levels;
+    if (!options.grayscale && stored_tile_format(_db, source_metadata) == format_token) {
+        for (int level : target_levels) {
+            if (std::find(available_levels.begin(), available_levels.end(), level) != available_levels.end()) {
+                passthrough_levels.insert(level);
+            }
+        }
+    }
+    // ATTACH is refused inside a transaction, so it happens up front.
+    bool source_attached = false;
+    if (!passthrough_levels.empty() && !options.deduplicate && !_path.empty()) {
+        auto attach = prepare_statement(output._db, "ATTACH DATABASE ?1 AS source", "attach source archive");
+        sqlite3_bind_text(attach.get(), 1, _path.c_str(), -1, SQLITE_TRANSIENT);
+        source_attached = timed_step(attach.get()) == SQLITE_DONE;
+        if (!source_attached) {
+            logInfo("Unable to attach source archive (" + std::string(sqlite3_errmsg(output._db)) +
+                    "); copying tiles through the writer");
+        }
+    }
+
+    exec_sql("BEGIN IMMEDIATE", "start conversion transaction");
+
+    sqlite3_stmt *insert_stmt = nullptr;
+    sqlite3_stmt *image_insert_stmt = nullptr;
+    try {
+        insert_stmt = output.cachedStatement(options.deduplicate ? kMapInsertSql : kTileInsertSql);
+        if (options.deduplicate) {
+            image_insert_stmt = output.cachedStatement(kImageInsertSql);
+        }
+    } catch (const mbtiles_error &) {
+        sqlite3_exec(output._db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw;
+    }
+
+    // Decoding, resampling, grayscale and encoding run on `threads` workers;
+    // SQLite inserts are serialized through one writer thread.
+    const unsigned threads = resolve_thread_count(options.threads);
+    TileInsertQueue writer(output._db, insert_stmt, threads > 1, static_cast<std::size_t>(threads) * 4,
+                           to_file ? kConvertCommitInterval : 0, image_insert_stmt);
+    EncodeMemo memo;
+    auto write_tile = [&](int level, int x, int y, const RGBAImage &image) {
+        EncodedTile tile;
+        tile.level = level;
+        tile.x = x;
+        tile.tms_y = xyz_to_tms_y(y, level);
+
+        std::optional<ContentHash> pixel_hash;
+        if (options.deduplicate) {
+            pixel_hash = EncodeMemo::key(image);
+            if (auto memoized = memo.find(*pixel_hash)) {
+                count_event(metrics_registry().encode_cache_hits);
+                tile.data = std::move(memoized->data);
+                tile.id = memoized->id;
+                writer.push(std::move(tile));
+                return;
+            }
+        }
+
+        tile.data =
+            encode_output_tile(image, format_token, options.grayscale, options.compact_grayscale, options.encoder);
+        if (pixel_hash) {
+            tile.id = content_hash(tile.data.data(), tile.data.size());
+            memo.store(*pixel_hash, tile.data, *tile.id);
+        }
+        writer.push(std::move(tile));
+    };
+
+    std::size_t copied_tiles = 0;
+    for (int level : passthrough_levels) {
+        logInfo("Copying zoom level " + std::to_string(level) + " without re-encoding");
+        if (source_attached) {
+            copied_tiles += copy_attached_level(output._db, level);
+            continue;
+        }
+        auto rows = prepare_statement(_db, "SELECT tile_column, tile_row, tile_data FROM tiles WHERE zoom_level = ?1",
+                                      "read zoom level");
+        sqlite3_bind_int(rows.get(), 1, level);
+        while (timed_step(rows.get()) == SQLITE_ROW) {
+            EncodedTile tile;
+            tile.level = level;
+            tile.x = sqlite3_column_int(rows.get(), 0);
+            tile.tms_y = sqlite3_column_int(rows.get(), 1);
+            const auto *blob = static_cast<const unsigned char *>(sqlite3_column_blob(rows.get(), 2));
+            const int blob_size = sqlite3_column_bytes(rows.get(), 2);
+            count_tile_read(static_cast<std::size_t>(std::max(blob_size, 0)));
+            if (blob != nullptr && blob_size > 0) {
+                tile.data.assign(blob, blob + blob_size);
+            }
+            writer.push(std::move(tile));
+        }
+    }
+
+    bool streaming = options.streaming;
+    if (!streaming && options.memory_limit > 0) {
+        const auto tile_bytes = sample_tile_bytes(_db);
+        const std::size_t estimate = tile_bytes.value_or(0) * count_tiles(_db);
+        if (estimate > options.memory_limit) {
+            logInfo("Decoded levels would need about " + std::to_string(estimate) +
+                    " bytes; switching to streaming conversion");
+            streaming = true;
+        }
+    }
+
+    if (streaming) {
+        const StreamPlan plan = plan_stream_levels(target_levels, available_levels);
+        for (int level : plan.copy_levels) {
+            if (passthrough_levels.count(level) != 0U) {
+                continue;
+            }
+            logInfo("Streaming zoom level " + std::to_string(level) + " from source");
+            StreamGroup copy;
+            copy.source_level = level;
+            copy.targets = {level};
+            stream_group(_db, _path, copy, write_tile, options.memory_limit, threads);
+        }
+        for (const StreamGroup &group : plan.groups) {
+            logInfo(std::string(group.downsample ? "Streaming downsampled levels " : "Streaming upsampled levels ") +
+                    std::to_string(group.targets.front()) + "-" + std::to_string(group.targets.back()) +
+                    " from zoom " + std::to_string(group.source_level));
+            stream_group(_db, _path, group, write_tile, options.memory_limit, threads);
+        }
+    } else {
+        std::unordered_set<int> base_levels(available_levels.begin(), available_levels.end());
+        std::set<int> known_levels(base_levels.begin(), base_levels.end());
+        std::unordered_map<int, std::shared_ptr<TileLevel>> level_cache;
+
+        std::function<std::shared_ptr<TileLevel>(int)> ensure_level = [&](int level) -> std::shared_ptr<TileLevel> {
+            auto cached = level_cache.find(level);
+            if (cached != level_cache.end()) {
+                return cached->second;
+            }
+
+            std::shared_ptr<TileLevel> resolved;
+            if (base_levels.count(level) != 0U) {
+                logInfo("Loading zoom level " + std::to_string(level) + " from source");
+                resolved = std::make_shared<TileLevel>(load_level_images(_db, level, threads));
+                level_cache.emplace(level, resolved);
+                return resolved;
+            }
+
+            const auto nearest = find_nearest_available_level(known_levels, level);
+            if (!nearest) {
+                throw mbtiles_error("Unable to derive zoom level " + std::to_string(level));
+            }
+
+            std::shared_ptr<TileLevel> current = ensure_level(*nearest);
+            int current_level = *nearest;
+            const bool use_downsample = current_level > level;
+            const bool use_upsample = current_level < level;
+            if (!use_downsample && !use_upsample) {
+                return current;
+            }
+
+            while (current_level != level) {
+                std::shared_ptr<TileLevel> next;
+                if (use_downsample) {
+                    next = std::make_shared<TileLevel>(downsample_level(*current, threads));
+                    --current_level;
+                } else {
+                    next = std::make_shared<TileLevel>(upsample_level(*current, threads));
+                    ++current_level;
+                }
+                logInfo(std::string(use_downsample ? "Generated downsampled level " : "Generated upsampled level ") +
+                        std::to_string(current_level));
+                level_cache[current_level] = next;
+                known_levels.insert(current_level);
+                current = next;
+            }
+
+            return current;
+        };
+
+        for (int level : target_levels) {
+            if (passthrough_levels.count(level) != 0U) {
+                continue;
+            }
+            logInfo("Preparing zoom level " + std::to_string(level));
+            auto tiles_ptr = ensure_level(level);
+            if (!tiles_ptr || tiles_ptr->empty()) {
+                logWarn("Zoom level " + std::to_string(level) + " has no tiles after processing");
+                continue;
+            }
+
+            const TileLevel &tiles = *tiles_ptr;
+            parallel_for(tiles.size(), threads, [&](std::size_t index) {
+                const auto &entry = tiles[index];
+                write_tile(level, tile_key_x(entry.first), tile_key_y(entry.first), entry.second);
+            });
+            logInfo("Written " + std::to_string(tiles_ptr->size()) + " tiles for zoom " + std::to_string(level));
+        }
+    }
+
+    writer.finish();
+    pixel_pool().trim();
+    const std::size_t total_tiles_written = writer.written() + copied_tiles;
+    sqlite3_reset(insert_stmt);
+    sqlite3_clear_bindings(insert_stmt);
+    exec_sql("COMMIT", "commit converted tiles");
+    if (source_attached) {
+        exec_sql("DETACH DATABASE source", "detach source archive");
+    }
+
+    // Building the index once after the bulk insert is much cheaper than
+    // maintaining it row by row.
+    logInfo("Indexing converted tiles");
+    if (options.deduplicate) {
+        exec_sql("CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row)",
+                 "create map index");
+        exec_sql("CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id)", "create images index");
+        logInfo("Deduplicated " + std::to_string(writer.written()) + " tiles into " +
+                std::to_string(writer.uniqueImages()) + " images; " + std::to_string(memo.hits()) +
+                " encodes skipped");
+    } else {
+        exec_sql("CREATE UNIQUE INDEX IF NOT EXISTS tiles_index ON tiles (zoom_level, tile_column, tile_row)",
+                 "create tiles index");
+    }
+
+    if (to_file) {
+        output._name = partial_output.path.filename().string();
+        output._path = partial_output.path.string();
+    } else {
+        output._name = _name.empty() ? std::string("converted") : _name + "_converted";
+    }
+
+    std::map<std::string, std::string> output_metadata = source_metadata;
+    output_metadata["format"] = format_token;
+    output_metadata["minzoom"] = std::to_string(target_levels.front());
+    output_metadata["maxzoom"] = std::to_string(target_levels.back());
+    output.setMetadata(output_metadata, true);
+
+    if (options.run_extract) {
+        logWarn("ConvertOptions::run_extract is set, but extraction should be triggered explicitly via the CLI.");
+    }
+
+    if (to_file) {
+        // Leave a regular archive behind that other processes may open.
+        exec_sql("PRAGMA locking_mode=NORMAL", "restore locking mode");
+        exec_sql("PRAGMA journal_mode=DELETE", "restore journal mode");
+        exec_sql("PRAGMA synchronous=FULL", "restore synchronous mode");
+        partial_output.keep = true;
+        logInfo("Converted MBTiles written to '" + output._path + "'");
+    }
+
+    logInfo("Conversion completed. Tiles written: " + std::to_string(total_tiles_written));
+    return output;
+}
+
+std::size_t MBTiles::rebuild(const std::vector<TileCoord> &changed, const RebuildOptions &options) {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
+    if (changed.empty()) {
+        return 0;
+    }
+
+    const int base_level = changed.front().zoom;
+    if (base_level < 0 || base_level > 29) {
+        throw mbtiles_error("Unsupported zoom level: " + std::to_string(base_level));
+    }
+    std::set<TileKey> base_keys;
+    for (const TileCoord &coord : changed) {
+        if (coord.zoom != base_level) {
+            throw mbtiles_error("Changed tiles must all share one zoom level");
+        }
+        const int max_index = (1 << base_level) - 1;
+        if (coord.x < 0 || coord.y < 0 || coord.x > max_index || coord.y > max_index) {
+            throw mbtiles_error("Tile " + std::to_string(coord.zoom) + "/" + std::to_string(coord.x) + "/" +
+                                std::to_string(coord.y) + " is outside the tile grid");
+        }
+        base_keys.insert(make_tile_key(coord.x, coord.y));
+    }
+
+    if (!tilesIsTable()) {
+        throw mbtiles_error("Incremental rebuild needs a plain tiles table");
+    }
+
+    const auto levels = zoomLevels();
+    const std::set<int> present(levels.begin(), levels.end());
+    const std::string format_token = resolve_format_token(options.format, metadata());
+    const unsigned threads = resolve_thread_count(options.threads);
+
+    // Copies the stored blobs of `keys` at `level`, then decodes them in
+    // parallel; coordinates without a row are left out of the result.
+    auto load_tiles = [&](int level, const std::vector<TileKey> &keys) {
+        std::vector<std::pair<TileKey, std::vector<unsigned char>>> blobs;
+        for (TileKey key : keys) {
+            tileDataView(level, tile_key_x(key), tile_key_y(key), [&](const TileView &tile) {
+                const auto *data = reinterpret_cast<const unsigned char *>(tile.data);
+                blobs.emplace_back(key, std::vector<unsigned char>(data, data + tile.size));
+            });
+        }
+        std::vector<RGBAImage> images(blobs.size());
+        parallel_for(blobs.size(), threads, [&](std::size_t index) {
+            images[index].loadFromMemory(blobs[index].second.data(), static_cast<int>(blobs[index].second.size()));
+        });
+        TileLevel result;
+        result.reserve(blobs.size());
+        for (std::size_t index = 0; index < blobs.size(); ++index) {
+            result.emplace(blobs[index].first, std::move(images[index]));
+        }
+        result.seal();
+        return result;
+    };
+
+    auto encode = [&](int level, int x, int y, const RGBAImage &image) {
+        EncodedTile tile;
+        tile.level = level;
+        tile.x = x;
+        tile.tms_y = xyz_to_tms_y(y, level);
+        tile.data =
+            encode_output_tile(image, format_token, options.grayscale, options.compact_grayscale, options.encoder);
+        return tile;
+    };
+
+    // Deletes every row of `level` covered by the tile (x, y) of `from_level`.
+    auto delete_covered = [&](int from_level, TileKey key, int level) {
+        const int shift = level - from_level;
+        const long long first_x = static_cast<long long>(tile_key_x(key)) << shift;
+        const long long first_y = static_cast<long long>(tile_key_y(key)) << shift;
+        const long long last_x = first_x + (1LL << shift) - 1;
+        const long long last_y = first_y + (1LL << shift) - 1;
+        cached_stmt guard(cachedStatement(kTileRangeDeleteSql));
+        sqlite3_stmt *stmt = guard.get();
+        sqlite3_bind_int(stmt, 1, level);
+        sqlite3_bind_int64(stmt, 2, first_x);
+        sqlite3_bind_int64(stmt, 3, last_x);
+        sqlite3_bind_int(stmt, 4, xyz_to_tms_y(static_cast<int>(last_y), level));
+        sqlite3_bind_int(stmt, 5, xyz_to_tms_y(static_cast<int>(first_y), level));
+        if (timed_step(stmt) != SQLITE_DONE) {
+            throw mbtiles_error("Failed to delete stale tiles: " + std::string(sqlite3_errmsg(_db)));
+        }
+    };
+
+    if (sqlite3_exec(_db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        throw mbtiles_error("Failed to start rebuild transaction: " + std::string(sqlite3_errmsg(_db)));
+    }
+
+    std::size_t written = 0;
+    try {
+        // Everything below runs on this thread's connection; only decoding,
+        // resampling and encoding are spread over the workers.
+        TileInsertQueue writer(_db, cachedStatement(kTileInsertSql), false, 1);
+        auto insert_all = [&](std::vector<EncodedTile> &tiles) {
+            for (EncodedTile &tile : tiles) {
+                writer.push(std::move(tile));
+            }
+            tiles.clear();
+        };
+
+        const std::vector<TileKey> base_list(base_keys.begin(), base_keys.end());
+        TileLevel base_images = load_tiles(base_level, base_list);
+
+        // Descendants: every row under a changed tile is replaced by the
+        // upsampled subtree of its new content, walked depth first so only
+        // one path per worker is decoded at a time.
+        int top_level = base_level;
+        while (top_level < 30 && present.count(top_level + 1) != 0U) {
+            ++top_level;
+        }
+        if (top_level > base_level) {
+            for (TileKey key : base_keys) {
+                for (int level = base_level + 1; level <= top_level; ++level) {
+                    delete_covered(base_level, key, level);
+                }
+            }
+
+            std::function<void(const RGBAImage &, int, int, int, std::vector<EncodedTile> &)> expand =
+                [&](const RGBAImage &image, int level, int x, int y, std::vector<EncodedTile> &out) {
+                    if (level == top_level) {
+                        return;
+                    }
+                    auto children = upsample_tile(image);
+                    for (int idx = 0; idx < 4; ++idx) {
+                        const int child_x = x * 2 + idx % 2;
+                        const int child_y = y * 2 + idx / 2;
+                        out.push_back(encode(level + 1, child_x, child_y, children[idx]));
+                        expand(children[idx], level + 1, child_x, child_y, out);
+                        recycle_pixels(children[idx]);
+                    }
+                };
+
+            // A few roots per worker at a time bound the encoded subtrees
+            // waiting for insertion.
+            const std::size_t batch = static_cast<std::size_t>(threads) * 2;
+            for (std::size_t begin = 0; begin < base_images.size(); begin += batch) {
+                const std::size_t count = std::min(batch, base_images.size() - begin);
+                std::vector<std::vector<EncodedTile>> subtrees(count);
+                parallel_for(count, threads, [&](std::size_t index) {
+                    const auto &entry = base_images[begin + index];
+                    expand(entry.second, base_level, tile_key_x(entry.first), tile_key_y(entry.first), subtrees[index]);
+                });
+                for (auto &subtree : subtrees) {
+                    insert_all(subtree);
+                }
+            }
+            logInfo("Rebuilt zoom levels " + std::to_string(base_level + 1) + "-" + std::to_string(top_level) +
+                    " under " + std::to_string(base_images.size()) + " changed tiles");
+        }
+
+        // Ancestors: each level only needs the parents of the tiles that
+        // changed one level up, built from those tiles and their unchanged
+        // siblings. Parents that lose a child are dropped, as in convert().
+        TileLevel current = std::move(base_images);
+        std::set<TileKey> affected = base_keys;
+        for (int level = base_level - 1; level >= 0 && present.count(level) != 0U; --level) {
+            std::set<TileKey> parents;
+            std::vector<TileKey> siblings;
+            for (TileKey key : affected) {
+                parents.insert(make_tile_key(tile_key_x(key) / 2, tile_key_y(key) / 2));
+            }
+            for (TileKey parent : parents) {
+                for (int idx = 0; idx < 4; ++idx) {
+                    const TileKey child =
+                        make_tile_key(tile_key_x(parent) * 2 + idx % 2, tile_key_y(parent) * 2 + idx / 2);
+                    if (affected.count(child) == 0U) {
+                        siblings.push_back(child);
+                    }
+                }
+            }
+
+            TileLevel children = load_tiles(level + 1, siblings);
+            for (auto &entry : current) {
+                children.emplace(entry.first, std::move(entry.second));
+            }
+            current = downsample_level(children, threads);
+
+            for (TileKey parent : parents) {
+                delete_covered(level, parent, level);
+            }
+            std::vector<EncodedTile> encoded(current.size());
+            parallel_for(current.size(), threads, [&](std::size_t index) {
+                const auto &entry = current[index];
+                encoded[index] = encode(level, tile_key_x(entry.first), tile_key_y(entry.first), entry.second);
+            });
+            insert_all(encoded);
+            logInfo("Rebuilt " + std::to_string(current.size()) + " tiles at zoom " + std::to_string(level));
+            affected = std::move(parents);
+        }
+
+        writer.finish();
+        written = writer.written();
+    } catch (...) {
+        sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw;
+    }
+
+    if (sqlite3_exec(_db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        const std::string message = "Failed to commit rebuilt tiles: " + std::string(sqlite3_errmsg(_db));
+        sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
+        throw mbtiles_error(message);
+    }
+    pixel_pool().trim();
+    logInfo("Rebuild completed. Tiles written: " + std::to_string(written));
+    return written;
+}
+
+std::vector<TileCoord> MBTiles::changedTiles(const MBTiles &previous, int zoom) const {
+    if (_db == nullptr || previous._db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
     }
 
-    // Create tile iterator
-    TileIterator iter(_db);
-
-    std::size_t count = 0;
-    while (auto tile = iter.next()) {
-        // Determine file extension for output
-        std::string extension_token = tile->extension; // already normalized (no dot)
-
-        // Format output path using pattern (e.g., "{z}/{x}/{y}.png")
-        std::string relative_path = format_pattern(
-            tile->zoom,
-            tile->x,
-            tile->y,           // XYZ Y (already converted from TMS)
-            pattern,
-            extension_token
-        );
-        fs::path output_path = output_root / fs::path(relative_path);
-
-        // Ensure file has proper extension if missing
-        if (output_path.extension().empty() && !extension_token.empty()) {
-            // Reconstruct dot-prefixed extension (e.g., "png" → ".png")
-            std::string dot_ext = "." + extension_token;
-            output_path += dot_ext;
-        }
-
-        // Create parent directories
-        fs::create_directories(output_path.parent_path(), ec);
-        if (ec) {
-            throw mbtiles_error("Failed to create directory '" + output_path.parent_path().string() + "': " + ec.message());
+    // Both sides are walked in index order and merged, so the diff costs
+    // one sequential scan of the level in each archive.
+    TileIteratorOptions filter;
+    filter.min_zoom = zoom;
+    filter.max_zoom = zoom;
+    filter.ordered = true;
+    TileIterator current_tiles = tiles(filter);
+    TileIterator previous_tiles = previous.tiles(filter);
+
+    std::vector<TileCoord> result;
+    auto current = current_tiles.nextView();
+    auto old = previous_tiles.nextView();
+    while (current || old) {
+        const bool take_current = current && (!old || std::make_pair(current->x, current->tms_y) <=
+                                                           std::make_pair(old->x, old->tms_y));
+        const bool take_old = old && (!current || std::make_pair(old->x, old->tms_y) <=
+                                                      std::make_pair(current->x, current->tms_y));
+        if (take_current && take_old) {
+            if (current->size != old->size ||
+                (current->size != 0 && std::memcmp(current->data, old->data, current->size) != 0)) {
+                result.push_back(TileCoord{zoom, current->x, current->y});
+            }
+        } else if (take_current) {
+            result.push_back(TileCoord{zoom, current->x, current->y});
+        } else {
+            result.push_back(TileCoord{zoom, old->x, old->y});
+        }
+        if (take_current) {
+            current = current_tiles.nextView();
         }
+        if (take_old) {
+            old = previous_tiles.nextView();
+        }
+    }
+    return result;
+}
 
-        // Write tile data to file
-        std::ofstream file(output_path, std::ios::binary);
-        if (!file) {
-            throw mbtiles_error("Failed to open output file '" + output_path.string() + "'");
+// "minlon,minlat,maxlon,maxlat" as stored in the `bounds` metadata.
+std::optional<LatLonBounds> parse_bounds_value(const std::string &value) {
+    std::istringstream in(value);
+    in.imbue(std::locale::classic());
+    std::array<double, 4> parts{};
+    for (std::size_t i = 0; i < parts.size(); ++i) {
+        char comma = ',';
+        if (!(in >> parts[i]) || (i + 1 < parts.size() && !(in >> comma)) || comma != ',') {
+            return std::nullopt;
         }
+    }
+    in >> std::ws;
+    if (!in.eof()) {
+        return std::nullopt;
+    }
+    return LatLonBounds{parts[0], parts[1], parts[2], parts[3]};
+}
 
-        if (!tile->data.empty()) {
-            file.write(
-                reinterpret_cast<const char*>(tile->data.data()),
-                static_cast<std::streamsize>(tile->data.size())
-            );
+std::optional<int> parse_zoom_value(const std::map<std::string, std::string> &metadata, const std::string &key) {
+    const auto it = metadata.find(key);
+    if (it == metadata.end()) {
+        return std::nullopt;
+    }
+    const std::string value = trim_copy(it->second);
+    try {
+        std::size_t processed = 0;
+        const int zoom = std::stoi(value, &processed);
+        if (processed == value.size()) {
+            return zoom;
         }
+    } catch (const std::exception &) {
+    }
+    return std::nullopt;
+}
 
-        if (!file) {
-            throw mbtiles_error("Failed to write tile to '" + output_path.string() + "'");
+// detect_extension_token() plus vector tiles, which it reports as "bin":
+// gzip-wrapped blobs and raw protobufs opening with a layer field (tag 0x1a).
+std::string_view stats_format_token(const std::byte *data, std::size_t size) {
+    const std::string_view token = detect_extension_token(data, static_cast<int>(size));
+    if (token == "bin" && size >= 2) {
+        const auto first = static_cast<unsigned char>(data[0]);
+        if ((first == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b) || first == 0x1a) {
+            return "pbf";
         }
+    }
+    return token;
+}
 
-        ++count;
-        if (count % 100 == 0) {
-            logInfo("Extracted " + std::to_string(count) + " tiles...");
+// One worker's share of stats(), merged once every shard is done.
+struct StatsAccumulator {
+    std::vector<ZoomStats> zooms;  // indexed by zoom; unused levels have no tiles
+    std::uint64_t empty_tiles = 0;
+    std::uint64_t format_mismatches = 0;
+    std::map<std::string_view, std::uint64_t> formats;  // static tokens
+    std::vector<std::pair<ContentHash, std::uint64_t>> blobs;
+
+    void add(const TileView &tile, bool hash_blobs, const std::string &expected_format) {
+        if (static_cast<std::size_t>(tile.zoom) >= zooms.size()) {
+            zooms.resize(static_cast<std::size_t>(tile.zoom) + 1);
+        }
+        ZoomStats &level = zooms[static_cast<std::size_t>(tile.zoom)];
+        if (level.tiles == 0) {
+            level.zoom = tile.zoom;
+            level.min_size = level.max_size = tile.size;
+            level.min_x = level.max_x = tile.x;
+            level.min_y = level.max_y = tile.y;
+        }
+        ++level.tiles;
+        level.bytes += tile.size;
+        level.min_size = std::min<std::uint64_t>(level.min_size, tile.size);
+        level.max_size = std::max<std::uint64_t>(level.max_size, tile.size);
+        std::size_t bucket = 0;
+        while (bucket < kTileSizeBucketBounds.size() && tile.size > kTileSizeBucketBounds[bucket]) {
+            ++bucket;
+        }
+        ++level.size_buckets[bucket];
+        level.min_x = std::min(level.min_x, tile.x);
+        level.max_x = std::max(level.max_x, tile.x);
+        level.min_y = std::min(level.min_y, tile.y);
+        level.max_y = std::max(level.max_y, tile.y);
+
+        if (tile.size == 0) {
+            ++empty_tiles;
+            return;
+        }
+        const std::string_view format = stats_format_token(tile.data, tile.size);
+        ++formats[format];
+        if (!expected_format.empty() && format != expected_format) {
+            ++format_mismatches;
+        }
+        if (hash_blobs) {
+            blobs.emplace_back(content_hash(reinterpret_cast<const unsigned char *>(tile.data), tile.size),
+                               tile.size);
         }
     }
+};
 
-    logInfo("Extraction completed. Total tiles: " + std::to_string(count));
-    return count;
+bool hash_less(const std::pair<ContentHash, std::uint64_t> &a, const std::pair<ContentHash, std::uint64_t> &b) {
+    return std::tie(a.first.high, a.first.low) < std::tie(b.first.high, b.first.low);
 }
 
-MBTiles MBTiles::convert(const ConvertOptions& options) const {
+ArchiveStats MBTiles::stats(const StatsOptions &options) {
     if (_db == nullptr) {
         throw mbtiles_error("MBTiles database is not open");
     }
-    if (options.zoom_levels.empty()) {
-        throw mbtiles_error("At least one zoom level must be specified for conversion");
-    }
-
-    auto available_levels = zoomLevels();
-    auto target_levels = resolve_target_zoom_levels(options.zoom_levels, available_levels);
-    std::sort(target_levels.begin(), target_levels.end());
-    target_levels.erase(std::unique(target_levels.begin(), target_levels.end()), target_levels.end());
-
-    if (target_levels.empty()) {
-        throw mbtiles_error("No target zoom levels resolved for conversion");
-    }
-
-    const auto source_metadata = metadata();
-    const std::string format_token = resolve_format_token(options.format, source_metadata);
 
-    sqlite3 *raw_out = nullptr;
-    if (sqlite3_open(":memory:", &raw_out) != SQLITE_OK) {
-        std::string message = "Unable to create conversion database";
-        if (raw_out != nullptr) {
-            message += ": ";
-            message += sqlite3_errmsg(raw_out);
-            sqlite3_close(raw_out);
+    const auto metadata_entries = metadata();
+    std::string expected_format;
+    if (const auto it = metadata_entries.find("format"); it != metadata_entries.end()) {
+        expected_format = normalize_extension_token(it->second);
+        if (expected_format == "mvt") {
+            expected_format = "pbf";
         }
-        throw mbtiles_error(message);
     }
 
-    std::unique_ptr<sqlite3, decltype(&sqlite3_close)> out_db(raw_out, sqlite3_close);
-    auto exec_sql = [&](const char *sql, const char *context) {
-        if (sqlite3_exec(out_db.get(), sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
-            throw mbtiles_error(std::string("Failed to ") + context + ": " + sqlite3_errmsg(out_db.get()));
+    // Every shard gets its own connection, so a scan costs one sequential
+    // pass over the tiles table split N ways; in-memory archives cannot be
+    // reopened and are scanned on their own connection.
+    const unsigned threads = _path.empty() ? 1 : resolve_thread_count(options.threads);
+    const std::vector<TileIteratorOptions> shard_options = shards(threads);
+    std::vector<StatsAccumulator> partials(shard_options.size());
+    auto scan = [&](sqlite3 *db, std::size_t index) {
+        StatsAccumulator &partial = partials[index];
+        TileIterator iter(db, shard_options[index]);
+        while (auto tile = iter.nextView()) {
+            partial.add(*tile, options.duplicates, expected_format);
         }
+        std::sort(partial.blobs.begin(), partial.blobs.end(), hash_less);
     };
+    if (shard_options.size() == 1) {
+        scan(_db, 0);
+    } else {
+        OpenOptions read_options = _open_options;
+        read_options.read_only = true;
+        parallel_for(shard_options.size(), threads, [&](std::size_t index) {
+            db_handle connection(openConnection(_path, read_options, SQLITE_OPEN_NOMUTEX));
+            scan(connection.get(), index);
+        });
+    }
 
-    exec_sql("PRAGMA synchronous=OFF", "configure synchronous mode");
-    exec_sql("PRAGMA journal_mode=WAL", "configure journal mode");
-
-    exec_sql("CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)",
-             "create tiles table");
-    exec_sql("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)",
-             "create metadata table");
-    exec_sql("CREATE UNIQUE INDEX IF NOT EXISTS tiles_index ON tiles (zoom_level, tile_column, tile_row)",
-             "create tiles index");
+    ArchiveStats result;
+    std::vector<ZoomStats> zooms;
+    std::vector<std::pair<ContentHash, std::uint64_t>> blobs;
+    for (StatsAccumulator &partial : partials) {
+        if (partial.zooms.size() > zooms.size()) {
+            zooms.resize(partial.zooms.size());
+        }
+        for (const ZoomStats &level : partial.zooms) {
+            if (level.tiles == 0) {
+                continue;
+            }
+            ZoomStats &merged = zooms[static_cast<std::size_t>(level.zoom)];
+            if (merged.tiles == 0) {
+                merged = level;
+                continue;
+            }
+            merged.tiles += level.tiles;
+            merged.bytes += level.bytes;
+            merged.min_size = std::min(merged.min_size, level.min_size);
+            merged.max_size = std::max(merged.max_size, level.max_size);
+            for (std::size_t i = 0; i < merged.size_buckets.size(); ++i) {
+                merged.size_buckets[i] += level.size_buckets[i];
+            }
+            merged.min_x = std::min(merged.min_x, level.min_x);
+            merged.max_x = std::max(merged.max_x, level.max_x);
+            merged.min_y = std::min(merged.min_y, level.min_y);
+            merged.max_y = std::max(merged.max_y, level.max_y);
+        }
+        result.empty_tiles += partial.empty_tiles;
+        result.format_mismatches += partial.format_mismatches;
+        for (const auto &[format, count] : partial.formats) {
+            result.formats[std::string(format)] += count;
+        }
+        // Shards come back sorted, so merging keeps the whole list sorted.
+        const auto middle = static_cast<std::ptrdiff_t>(blobs.size());
+        blobs.insert(blobs.end(), partial.blobs.begin(), partial.blobs.end());
+        std::inplace_merge(blobs.begin(), blobs.begin() + middle, blobs.end(), hash_less);
+        std::vector<std::pair<ContentHash, std::uint64_t>>().swap(partial.blobs);
+    }
+    for (const ZoomStats &level : zooms) {
+        if (level.tiles != 0) {
+            result.tiles += level.tiles;
+            result.bytes += level.bytes;
+            result.zooms.push_back(level);
+        }
+    }
+    if (options.duplicates) {
+        std::uint64_t unique = 0;
+        for (std::size_t i = 0; i < blobs.size(); ++i) {
+            if (i == 0 || !(blobs[i].first == blobs[i - 1].first)) {
+                ++unique;
+            } else {
+                result.duplicate_bytes += blobs[i].second;
+            }
+        }
+        result.unique_blobs = unique;
+    }
 
-    exec_sql("BEGIN IMMEDIATE", "start conversion transaction");
+    result.metadata_min_zoom = parse_zoom_value(metadata_entries, "minzoom");
+    result.metadata_max_zoom = parse_zoom_value(metadata_entries, "maxzoom");
+    if (const auto it = metadata_entries.find("bounds"); it != metadata_entries.end()) {
+        result.metadata_bounds = parse_bounds_value(it->second);
+    }
+    if (result.zooms.empty()) {
+        return result;
+    }
 
-    const char *insert_sql =
-        "INSERT INTO tiles(zoom_level, tile_column, tile_row, tile_data) VALUES(?1, ?2, ?3, ?4)";
-    sqlite3_stmt *insert_stmt_raw = nullptr;
-    if (sqlite3_prepare_v2(out_db.get(), insert_sql, -1, &insert_stmt_raw, nullptr) != SQLITE_OK) {
-        sqlite3_exec(out_db.get(), "ROLLBACK", nullptr, nullptr, nullptr);
-        throw mbtiles_error("Failed to prepare tile insert statement: " + std::string(sqlite3_errmsg(out_db.get())));
+    const ZoomStats &deepest = result.zooms.back();
+    const int zoom = deepest.zoom;
+    LatLonBounds tile_bounds;
+    tile_bounds.min_lon = tile_x_to_lon(deepest.min_x, zoom);
+    tile_bounds.max_lon = tile_x_to_lon(deepest.max_x + 1, zoom);
+    tile_bounds.min_lat = tile_y_to_lat(deepest.max_y + 1, zoom);
+    tile_bounds.max_lat = tile_y_to_lat(deepest.min_y, zoom);
+    result.tile_bounds = tile_bounds;
+
+    std::map<std::string, std::string> updates;
+    if (result.metadata_min_zoom != result.zooms.front().zoom) {
+        result.stale_metadata.emplace_back("minzoom");
+        updates["minzoom"] = std::to_string(result.zooms.front().zoom);
+    }
+    if (result.metadata_max_zoom != zoom) {
+        result.stale_metadata.emplace_back("maxzoom");
+        updates["maxzoom"] = std::to_string(zoom);
     }
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> insert_stmt(insert_stmt_raw);
+    // Bounds are stale when they cover other tiles at the deepest zoom than
+    // the archive holds. The edges are pulled in by 1e-6 degrees so bounds
+    // on tile edges, as written here, do not spill into the neighbours.
+    bool bounds_stale = !result.metadata_bounds;
+    if (const auto &bounds = result.metadata_bounds; bounds && bounds->min_lon <= bounds->max_lon) {
+        constexpr double kEdge = 1e-6;
+        const auto [west, north] = latlon2tile(zoom, bounds->max_lat - kEdge, bounds->min_lon + kEdge);
+        const auto [east, south] = latlon2tile(zoom, bounds->min_lat + kEdge, bounds->max_lon - kEdge);
+        bounds_stale = west != deepest.min_x || east != deepest.max_x || north != deepest.min_y ||
+                       south != deepest.max_y;
+    }
+    if (bounds_stale) {
+        result.stale_metadata.emplace_back("bounds");
+        updates["bounds"] = format_decimal(tile_bounds.min_lon) + ',' + format_decimal(tile_bounds.min_lat) + ',' +
+                            format_decimal(tile_bounds.max_lon) + ',' + format_decimal(tile_bounds.max_lat);
+    }
+    if (options.update_metadata && !updates.empty()) {
+        setMetadata(updates, true);
+    }
+    return result;
+}
 
-    std::unordered_set<int> base_levels(available_levels.begin(), available_levels.end());
-    std::set<int> known_levels(base_levels.begin(), base_levels.end());
-    std::unordered_map<int, std::shared_ptr<TileImageMap>> level_cache;
+// Draws `top` over `bottom` in place: Porter-Duff "source over" on straight
+// (non-premultiplied) RGBA of the same size.
+void composite_over(RGBAImage &bottom, const RGBAImage &top) {
+    unsigned char *dst = bottom.pixels.data();
+    const unsigned char *src = top.pixels.data();
+    const std::size_t count = std::min(bottom.pixels.size(), top.pixels.size()) / 4;
+    for (std::size_t i = 0; i < count; ++i, dst += 4, src += 4) {
+        const std::uint32_t src_alpha = src[3];
+        if (src_alpha == 0) {
+            continue;
+        }
+        if (src_alpha == 255) {
+            std::memcpy(dst, src, 4);
+            continue;
+        }
+        const std::uint32_t dst_weight = dst[3] * (255 - src_alpha);
+        const std::uint32_t out_alpha = (src_alpha * 255 + dst_weight + 127) / 255;
+        const std::uint32_t denominator = out_alpha * 255;
+        for (int channel = 0; channel < 3; ++channel) {
+            dst[channel] = static_cast<unsigned char>(
+                (src[channel] * src_alpha * 255 + dst[channel] * dst_weight + denominator / 2) / denominator);
+        }
+        dst[3] = static_cast<unsigned char>(out_alpha);
+    }
+}
 
-    std::function<std::shared_ptr<TileImageMap>(int)> ensure_level = [&](int level) -> std::shared_ptr<TileImageMap> {
-        auto cached = level_cache.find(level);
-        if (cached != level_cache.end()) {
-            return cached->second;
+bool is_opaque(const RGBAImage &image) {
+    for (std::size_t i = 3; i < image.pixels.size(); i += 4) {
+        if (image.pixels[i] != 255) {
+            return false;
         }
+    }
+    return true;
+}
 
-        std::shared_ptr<TileImageMap> resolved;
-        if (base_levels.count(level) != 0U) {
-            logInfo("Loading zoom level " + std::to_string(level) + " from source");
-            resolved = std::make_shared<TileImageMap>(load_level_images(_db, level));
-            level_cache.emplace(level, resolved);
-            return resolved;
+// Blends the tiles of zoom `level` present both in the attached `source` and
+// in `db`, the source tile on top, and stores the result in `db`. Opaque
+// source tiles, and tiles that are not images, are taken as they are.
+// Returns the number of tiles rewritten.
+std::size_t composite_attached_level(sqlite3 *db, int level, const std::string &format_token,
+                                     const EncoderOptions &encoder, unsigned threads) {
+    std::vector<std::pair<int, int>> overlap;
+    {
+        auto stmt = prepare_statement(db,
+                                      "SELECT s.tile_column, s.tile_row FROM source.tiles s JOIN main.tiles t "
+                                      "ON t.zoom_level = s.zoom_level AND t.tile_column = s.tile_column "
+                                      "AND t.tile_row = s.tile_row WHERE s.zoom_level = ?1",
+                                      "find overlapping tiles");
+        sqlite3_bind_int(stmt.get(), 1, level);
+        int rc = SQLITE_ROW;
+        while ((rc = timed_step(stmt.get())) == SQLITE_ROW) {
+            overlap.emplace_back(sqlite3_column_int(stmt.get(), 0), sqlite3_column_int(stmt.get(), 1));
+        }
+        if (rc != SQLITE_DONE) {
+            throw mbtiles_error("Failed to find overlapping tiles at zoom " + std::to_string(level) + ": " +
+                                sqlite3_errmsg(db));
         }
+    }
 
-        const auto nearest = find_nearest_available_level(known_levels, level);
-        if (!nearest) {
-            throw mbtiles_error("Unable to derive zoom level " + std::to_string(level));
+    auto read_source = prepare_statement(
+        db, "SELECT tile_data FROM source.tiles WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3",
+        "read source tile");
+    auto read_target = prepare_statement(
+        db, "SELECT tile_data FROM main.tiles WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3",
+        "read merged tile");
+    auto update = prepare_statement(
+        db, "UPDATE main.tiles SET tile_data = ?4 WHERE zoom_level = ?1 AND tile_column = ?2 AND tile_row = ?3",
+        "write composited tile");
+    auto read_blob = [level](sqlite3_stmt *stmt, int column, int row) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_int(stmt, 1, level);
+        sqlite3_bind_int(stmt, 2, column);
+        sqlite3_bind_int(stmt, 3, row);
+        std::vector<unsigned char> blob;
+        if (timed_step(stmt) == SQLITE_ROW) {
+            const auto *data = static_cast<const unsigned char *>(sqlite3_column_blob(stmt, 0));
+            blob.assign(data, data + sqlite3_column_bytes(stmt, 0));
+            count_tile_read(blob.size());
         }
+        sqlite3_reset(stmt);
+        return blob;
+    };
 
-        std::shared_ptr<TileImageMap> current = ensure_level(*nearest);
-        int current_level = *nearest;
-        const bool use_downsample = current_level > level;
-        const bool use_upsample = current_level < level;
-        if (!use_downsample && !use_upsample) {
-            return current;
+    // Blobs are read and written on this thread, in batches small enough to
+    // keep memory flat; only the pixel work is spread over the workers.
+    const std::size_t batch_size = static_cast<std::size_t>(std::max(threads, 1U)) * 64;
+    std::vector<std::vector<unsigned char>> top(batch_size);
+    std::vector<std::vector<unsigned char>> bottom(batch_size);
+    std::size_t written = 0;
+    for (std::size_t begin = 0; begin < overlap.size(); begin += batch_size) {
+        const std::size_t count = std::min(batch_size, overlap.size() - begin);
+        for (std::size_t i = 0; i < count; ++i) {
+            top[i] = read_blob(read_source.get(), overlap[begin + i].first, overlap[begin + i].second);
+            bottom[i] = read_blob(read_target.get(), overlap[begin + i].first, overlap[begin + i].second);
         }
 
-        while (current_level != level) {
-            std::shared_ptr<TileImageMap> next;
-            if (use_downsample) {
-                next = std::make_shared<TileImageMap>(downsample_level(*current));
-                --current_level;
+        // Afterwards bottom[i] holds the tile to store, or is empty when the
+        // stored one stays.
+        parallel_for(count, threads, [&](std::size_t i) {
+            const auto top_size = static_cast<int>(top[i].size());
+            const auto bottom_size = static_cast<int>(bottom[i].size());
+            if (top[i].empty() || detect_extension_token(top[i].data(), top_size) == "bin" ||
+                bottom[i].empty() || detect_extension_token(bottom[i].data(), bottom_size) == "bin") {
+                bottom[i] = std::move(top[i]);
+                return;
+            }
+            RGBAImage over(top[i].data(), top_size);
+            if (is_opaque(over)) {
+                recycle_pixels(over);
+                bottom[i] = std::move(top[i]);
+                return;
+            }
+            RGBAImage under(bottom[i].data(), bottom_size);
+            if (under.width != over.width || under.height != over.height) {
+                bottom[i] = std::move(top[i]);
             } else {
-                next = std::make_shared<TileImageMap>(upsample_level(*current));
-                ++current_level;
+                composite_over(under, over);
+                bottom[i] = encode_image_for_format(under, format_token, encoder);
             }
-            logInfo(std::string(use_downsample ? "Generated downsampled level " : "Generated upsampled level ") +
-                    std::to_string(current_level));
-            level_cache[current_level] = next;
-            known_levels.insert(current_level);
-            current = next;
+            recycle_pixels(over);
+            recycle_pixels(under);
+        });
+
+        for (std::size_t i = 0; i < count; ++i) {
+            sqlite3_reset(update.get());
+            sqlite3_bind_int(update.get(), 1, level);
+            sqlite3_bind_int(update.get(), 2, overlap[begin + i].first);
+            sqlite3_bind_int(update.get(), 3, overlap[begin + i].second);
+            sqlite3_bind_blob(update.get(), 4, bottom[i].data(), static_cast<int>(bottom[i].size()), SQLITE_STATIC);
+            if (timed_step(update.get()) != SQLITE_DONE) {
+                throw mbtiles_error("Failed to write composited tile: " + std::string(sqlite3_errmsg(db)));
+            }
+            count_tile_written(bottom[i].size());
+            ++written;
         }
+    }
+    return written;
+}
 
-        return current;
-    };
+std::size_t MBTiles::merge(const std::vector<std::string> &sources, const MergeOptions &options) {
+    if (_db == nullptr) {
+        throw mbtiles_error("MBTiles database is not open");
+    }
 
-    std::size_t total_tiles_written = 0;
-    for (int level : target_levels) {
-        logInfo("Preparing zoom level " + std::to_string(level));
-        auto tiles_ptr = ensure_level(level);
-        if (!tiles_ptr || tiles_ptr->empty()) {
-            logWarn("Zoom level " + std::to_string(level) + " has no tiles after processing");
-            continue;
+    auto exec_sql = [&](const char *sql, const char *context) {
+        if (sqlite3_exec(_db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw mbtiles_error(std::string("Failed to ") + context + ": " + sqlite3_errmsg(_db));
         }
+    };
 
-        for (const auto &entry : *tiles_ptr) {
-            RGBAImage tile = entry.second;
-            if (options.grayscale) {
-                tile.toGrayScale();
+    // A fresh tiles table gets the first source without an index, which is
+    // built once afterwards; conflicts with later sources need it in place.
+    bool has_tiles = false;
+    {
+        cached_stmt guard(cachedStatement("SELECT type FROM sqlite_master WHERE name='tiles'"));
+        if (timed_step(guard.get()) == SQLITE_ROW) {
+            has_tiles = true;
+            if (std::string_view(reinterpret_cast<const char *>(sqlite3_column_text(guard.get(), 0))) != "table") {
+                throw mbtiles_error("Merging needs a plain tiles table");
             }
-            const auto encoded = encode_image_for_format(tile, format_token);
-            const int x = tile_key_x(entry.first);
-            const int y = tile_key_y(entry.first);
-            const int tms_y = xyz_to_tms_y(y, level);
+        }
+    }
+    if (!has_tiles) {
+        exec_sql("CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB)",
+                 "create tiles table");
+    } else {
+        cached_stmt guard(cachedStatement("SELECT 1 FROM pragma_index_list('tiles') WHERE \"unique\" = 1"));
+        if (timed_step(guard.get()) != SQLITE_ROW) {
+            logInfo("Indexing tiles before merging");
+            exec_sql("CREATE UNIQUE INDEX tiles_index ON tiles (zoom_level, tile_column, tile_row)",
+                     "index tiles");
+        }
+    }
+    exec_sql("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)", "create metadata table");
 
-            sqlite3_reset(insert_stmt.get());
-            sqlite3_clear_bindings(insert_stmt.get());
-            sqlite3_bind_int(insert_stmt.get(), 1, level);
-            sqlite3_bind_int(insert_stmt.get(), 2, x);
-            sqlite3_bind_int(insert_stmt.get(), 3, tms_y);
-            sqlite3_bind_blob(insert_stmt.get(), 4, encoded.data(), static_cast<int>(encoded.size()), SQLITE_TRANSIENT);
+    std::optional<LatLonBounds> bounds;
+    auto add_bounds = [&bounds](const std::optional<std::string> &value) {
+        const auto parsed = value ? parse_bounds_value(*value) : std::nullopt;
+        if (!parsed) {
+            return;
+        }
+        if (!bounds) {
+            bounds = parsed;
+            return;
+        }
+        bounds->min_lon = std::min(bounds->min_lon, parsed->min_lon);
+        bounds->min_lat = std::min(bounds->min_lat, parsed->min_lat);
+        bounds->max_lon = std::max(bounds->max_lon, parsed->max_lon);
+        bounds->max_lat = std::max(bounds->max_lat, parsed->max_lat);
+    };
+    if (has_tiles) {
+        const auto entries = metadata();
+        const auto it = entries.find("bounds");
+        add_bounds(it != entries.end() ? std::optional<std::string>(it->second) : std::nullopt);
+    }
 
-            if (sqlite3_step(insert_stmt.get()) != SQLITE_DONE) {
-                sqlite3_exec(out_db.get(), "ROLLBACK", nullptr, nullptr, nullptr);
-                throw mbtiles_error("Failed to insert tile: " + std::string(sqlite3_errmsg(out_db.get())));
+    std::string insert = "INSERT OR REPLACE";
+    if (options.conflict != MergeConflict::REPLACE) {
+        // Under COMPOSITE the overlapping tiles are blended first, so the
+        // copy only adds the rest.
+        insert = "INSERT OR IGNORE";
+    }
+    const unsigned threads = resolve_thread_count(options.threads);
+    std::optional<std::string> format_token;
+
+    std::size_t merged = 0;
+    bool indexed = has_tiles;
+    for (const std::string &source : sources) {
+        logInfo("Merging '" + source + "'");
+        {
+            auto attach = prepare_statement(_db, "ATTACH DATABASE ?1 AS source", "attach source archive");
+            sqlite3_bind_text(attach.get(), 1, source.c_str(), -1, SQLITE_TRANSIENT);
+            if (timed_step(attach.get()) != SQLITE_DONE) {
+                throw mbtiles_error("Failed to attach '" + source + "': " + sqlite3_errmsg(_db));
+            }
+        }
+        try {
+            std::vector<int> levels;
+            {
+                auto stmt = prepare_statement(
+                    _db, "SELECT DISTINCT zoom_level FROM source.tiles ORDER BY zoom_level", "read source zoom levels");
+                while (timed_step(stmt.get()) == SQLITE_ROW) {
+                    levels.push_back(sqlite3_column_int(stmt.get(), 0));
+                }
+                auto bounds_stmt = prepare_statement(
+                    _db, "SELECT value FROM source.metadata WHERE name = 'bounds'", "read source bounds");
+                if (timed_step(bounds_stmt.get()) == SQLITE_ROW) {
+                    add_bounds(std::string(reinterpret_cast<const char *>(sqlite3_column_text(bounds_stmt.get(), 0))));
+                }
+            }
+            exec_sql("INSERT OR IGNORE INTO main.metadata (name, value) SELECT name, value FROM source.metadata",
+                     "copy source metadata");
+            if (options.conflict == MergeConflict::COMPOSITE && indexed && !format_token) {
+                format_token = resolve_format_token(options.format, metadata());
             }
 
-            ++total_tiles_written;
+            // One transaction per zoom level keeps the journal bounded while
+            // still moving whole levels per statement.
+            for (int level : levels) {
+                exec_sql("BEGIN IMMEDIATE", "start merge transaction");
+                try {
+                    if (!indexed) {
+                        merged += copy_attached_level(_db, level);
+                    } else {
+                        if (options.conflict == MergeConflict::COMPOSITE) {
+                            merged += composite_attached_level(_db, level, *format_token, options.encoder, threads);
+                        }
+                        merged += copy_attached_level(_db, level, insert);
+                    }
+                    exec_sql("COMMIT", "commit merged tiles");
+                } catch (...) {
+                    sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
+                    throw;
+                }
+            }
+            if (!indexed) {
+                logInfo("Indexing merged tiles");
+                exec_sql("CREATE UNIQUE INDEX tiles_index ON tiles (zoom_level, tile_column, tile_row)",
+                         "index merged tiles");
+                indexed = true;
+            }
+        } catch (...) {
+            sqlite3_exec(_db, "DETACH DATABASE source", nullptr, nullptr, nullptr);
+            throw;
         }
-        logInfo("Written " + std::to_string(tiles_ptr->size()) + " tiles for zoom " + std::to_string(level));
+        exec_sql("DETACH DATABASE source", "detach source archive");
     }
 
-    exec_sql("COMMIT", "commit converted tiles");
-
-    MBTiles output;
-    output._db = out_db.release();
-    output._name = _name.empty() ? std::string("converted") : _name + "_converted";
-
-    std::map<std::string, std::string> output_metadata = source_metadata;
-    output_metadata["format"] = format_token;
-    output_metadata["minzoom"] = std::to_string(target_levels.front());
-    output_metadata["maxzoom"] = std::to_string(target_levels.back());
-    output.setMetadata(output_metadata, true);
-
-    if (options.run_extract) {
-        logWarn("ConvertOptions::run_extract is set, but extraction should be triggered explicitly via the CLI.");
+    std::map<std::string, std::string> entries;
+    if (const auto min_zoom = minZoomLevel()) {
+        entries["minzoom"] = std::to_string(*min_zoom);
+        entries["maxzoom"] = std::to_string(*maxZoomLevel());
+    }
+    if (bounds) {
+        entries["bounds"] = format_decimal(bounds->min_lon) + ',' + format_decimal(bounds->min_lat) + ',' +
+                            format_decimal(bounds->max_lon) + ',' + format_decimal(bounds->max_lat);
     }
+    setMetadata(entries, true);
 
-    logInfo("Conversion completed. Tiles written: " + std::to_string(total_tiles_written));
-    return output;
+    logInfo("Merge completed. Tiles written: " + std::to_string(merged));
+    return merged;
 }
 
 void MBTiles::saveTo(const std::string &path) const {
     if (_db == nullptr) {
         throw mbtiles_error("MBTiles database is not open");
     }
-    if (path.empty()) {
-        throw mbtiles_error("Output path must not be empty");
-    }
-
-    namespace fs = std::filesystem;
-    fs::path destination = fs::absolute(path);
-    if (!destination.has_extension()) {
-        destination.replace_extension(".mbtiles");
-    }
-
-    if (!destination.parent_path().empty()) {
-        std::error_code ec;
-        fs::create_directories(destination.parent_path(), ec);
-        if (ec) {
-            throw mbtiles_error("Failed to create directory '" + destination.parent_path().string() + "': " + ec.message());
-        }
-    }
-
-    if (fs::exists(destination)) {
-        std::error_code ec;
-        fs::remove(destination, ec);
-        if (ec) {
-            throw mbtiles_error("Failed to overwrite existing file '" + destination.string() + "': " + ec.message());
-        }
+    const fs::path destination = resolve_output_path(path);
+    std::error_code ec;
+    if (!_path.empty() && fs::equivalent(destination, _path, ec)) {
+        throw mbtiles_error("Cannot save the archive over itself at '" + _path + "'");
     }
+    prepare_output_file(destination);
 
     sqlite3 *target = nullptr;
     if (sqlite3_open(destination.string().c_str(), &target) != SQLITE_OK) {
@@ -1814,17 +5755,11 @@ void MBTiles::saveTo(const std::string &path) const {
 // }
 
 std::map<std::string, std::string> MBTiles::metadata() const{
-    const char *query = "SELECT name, value FROM metadata ORDER BY name";
-    sqlite3_stmt *raw_stmt = nullptr;
-    if (sqlite3_prepare_v2(_db, query, -1, &raw_stmt, nullptr) != SQLITE_OK) {
-        throw mbtiles_error("Failed to read metadata: " + std::string(sqlite3_errmsg(_db)));
-    }
-
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
+    cached_stmt stmt(cachedStatement(kMetadataReadSql));
     std::map<std::string, std::string> result;
 
     while (true) {
-        const int rc = sqlite3_step(stmt.get());
+        const int rc = timed_step(stmt.get());
         if (rc == SQLITE_DONE) {
             break;
         }
@@ -1857,25 +5792,21 @@ void MBTiles::setMetadata(const std::map<std::string, std::string> &entries,
         throw mbtiles_error("Failed to begin transaction: " + std::string(sqlite3_errmsg(_db)));
     }
 
-    const char *insert_sql = overwrite_existing
-                                 ? "INSERT INTO metadata(name, value) VALUES(?1, ?2) ON CONFLICT(name) DO UPDATE SET value=excluded.value"
-                                 : "INSERT INTO metadata(name, value) VALUES(?1, ?2)";
-
-    sqlite3_stmt *raw_stmt = nullptr;
-    if (sqlite3_prepare_v2(_db, insert_sql, -1, &raw_stmt, nullptr) != SQLITE_OK) {
+    cached_stmt stmt;
+    try {
+        stmt.reset(cachedStatement(overwrite_existing ? kMetadataUpsertSql : kMetadataInsertSql));
+    } catch (const mbtiles_error &) {
         sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
-        throw mbtiles_error("Failed to prepare metadata statement: " + std::string(sqlite3_errmsg(_db)));
+        throw;
     }
 
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
-
     for (const auto &entry : entries) {
         sqlite3_reset(stmt.get());
         sqlite3_clear_bindings(stmt.get());
         sqlite3_bind_text(stmt.get(), 1, entry.first.c_str(), -1, SQLITE_TRANSIENT);
         sqlite3_bind_text(stmt.get(), 2, entry.second.c_str(), -1, SQLITE_TRANSIENT);
 
-        const int rc = sqlite3_step(stmt.get());
+        const int rc = timed_step(stmt.get());
         if (rc != SQLITE_DONE) {
             sqlite3_exec(_db, "ROLLBACK", nullptr, nullptr, nullptr);
             throw mbtiles_error("Failed to write metadata entry '" + entry.first + "': " +
@@ -1883,6 +5814,7 @@ void MBTiles::setMetadata(const std::map<std::string, std::string> &entries,
         }
     }
 
+    stmt.reset();
     if (sqlite3_exec(_db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
         throw mbtiles_error("Failed to commit metadata changes: " + std::string(sqlite3_errmsg(_db)));
     }
@@ -1895,17 +5827,11 @@ void MBTiles::setMetadata(const std::string &key, const std::string &value,
 }
 
 std::vector<std::string> MBTiles::metadataKeys() const {
-    const char *query = "SELECT name FROM metadata ORDER BY name";
-    sqlite3_stmt *raw_stmt = nullptr;
-    if (sqlite3_prepare_v2(_db, query, -1, &raw_stmt, nullptr) != SQLITE_OK) {
-        throw mbtiles_error("Failed to read metadata keys: " + std::string(sqlite3_errmsg(_db)));
-    }
-
-    std::unique_ptr<sqlite3_stmt, stmt_deleter> stmt(raw_stmt);
+    cached_stmt stmt(cachedStatement(kMetadataKeysSql));
     std::vector<std::string> keys;
 
     while (true) {
-        const int rc = sqlite3_step(stmt.get());
+        const int rc = timed_step(stmt.get());
         if (rc == SQLITE_DONE) {
             break;
         }
@@ -1936,9 +5862,21 @@ std::pair<double, double> tile2latlon(int z, int x, int y) {
     TileInfo tile;
     tile.zoom = z;
     tile.x = x;
-    tile.x = y;
+    tile.y = y;
     return tile2latlon(tile);
-} // anonymous namespace
+}
+
+std::pair<int, int> latlon2tile(int zoom, double lat, double lon) {
+    if (zoom < 0 || zoom > 30) {
+        throw mbtiles_error("Unsupported zoom level: " + std::to_string(zoom));
+    }
+    const double n = std::pow(2.0, zoom);
+    const double max_index = n - 1;
+    const double lat_rad = std::clamp(lat, -85.0511287798, 85.0511287798) * M_PI / 180.0;
+    const double x = std::floor((lon + 180.0) / 360.0 * n);
+    const double y = std::floor((1.0 - std::asinh(std::tan(lat_rad)) / M_PI) / 2.0 * n);
+    return {static_cast<int>(std::clamp(x, 0.0, max_index)), static_cast<int>(std::clamp(y, 0.0, max_index))};
+}
 
 double TileInfo::latMin() const {
     // Bottom edge = y+1
@@ -1964,13 +5902,40 @@ double TileInfo::lonMax() const {
 
 
 
-TileIterator::TileIterator(sqlite3* db) : _db(db) {
+TileIterator::TileIterator(sqlite3* db, TileIteratorOptions options) : _db(db), _options(std::move(options)) {
     if (!_db) {
         throw std::invalid_argument("Database handle is null");
     }
+    if (_options.shard_count == 0 || _options.shard_index >= _options.shard_count) {
+        throw std::invalid_argument("Shard index must be below a non-zero shard count");
+    }
     _metadata_ext = read_metadata_format_extension(_db);
 }
 
+TileIterator::TileIterator(TileIterator&& other) noexcept
+    : _db(other._db), _stmt(other._stmt), _started(other._started), _metadata_ext(std::move(other._metadata_ext)),
+      _options(std::move(other._options)) {
+    other._stmt = nullptr;
+    other._started = false;
+}
+
+TileIterator& TileIterator::operator=(TileIterator&& other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+    if (_stmt) {
+        sqlite3_finalize(_stmt);
+    }
+    _db = other._db;
+    _stmt = other._stmt;
+    _started = other._started;
+    _metadata_ext = std::move(other._metadata_ext);
+    _options = std::move(other._options);
+    other._stmt = nullptr;
+    other._started = false;
+    return *this;
+}
+
 TileIterator::~TileIterator() {
     if (_stmt) {
         sqlite3_finalize(_stmt);
@@ -1978,16 +5943,118 @@ TileIterator::~TileIterator() {
 }
 
 std::optional<TileInfo> TileIterator::next() {
-    if (!_started) {
-        const char* query = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles";
-        int rc = sqlite3_prepare_v2(_db, query, -1, &_stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            throw std::runtime_error("Failed to prepare tile query: " + std::string(sqlite3_errmsg(_db)));
+    auto view = nextView();
+    if (!view) {
+        return std::nullopt;
+    }
+
+    std::vector<std::byte> data(view->data, view->data + view->size);
+    return TileInfo{
+        view->zoom,
+        view->x,
+        view->y,
+        view->tms_y,
+        std::move(data),
+        std::string(view->extension)
+    };
+}
+
+// Builds the filtered tile query from the options. Every value is bound, and
+// a bounding box becomes one (zoom, column range, row range) term per zoom so
+// SQLite can answer each with a range scan of the tiles index.
+void TileIterator::prepare() {
+    std::string query = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles";
+    std::vector<std::string> conditions;
+    std::vector<std::int64_t> params;
+
+    const int min_zoom = std::max(_options.min_zoom.value_or(0), 0);
+    const int max_zoom = _options.max_zoom.value_or(std::numeric_limits<int>::max());
+    if (_options.bounds) {
+        std::vector<int> levels;
+        if (_options.min_zoom && _options.max_zoom) {
+            for (int z = min_zoom; z <= std::min(max_zoom, 30); ++z) {
+                levels.push_back(z);
+            }
+        } else {
+            for (int z : collect_zoom_levels(_db)) {
+                if (z >= min_zoom && z <= max_zoom && z <= 30) {
+                    levels.push_back(z);
+                }
+            }
+        }
+
+        const LatLonBounds &box = *_options.bounds;
+        std::vector<std::pair<double, double>> lon_spans;
+        if (box.min_lon <= box.max_lon) {
+            lon_spans.emplace_back(box.min_lon, box.max_lon);
+        } else {
+            lon_spans.emplace_back(box.min_lon, 180.0);
+            lon_spans.emplace_back(-180.0, box.max_lon);
+        }
+
+        std::string terms;
+        for (int z : levels) {
+            for (const auto &span : lon_spans) {
+                const auto top_left = latlon2tile(z, box.max_lat, span.first);
+                const auto bottom_right = latlon2tile(z, box.min_lat, span.second);
+                const std::int64_t max_index = (std::int64_t{1} << z) - 1;
+                if (!terms.empty()) {
+                    terms += " OR ";
+                }
+                terms += "(zoom_level=? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ?)";
+                params.insert(params.end(), {z, top_left.first, bottom_right.first,
+                                             max_index - bottom_right.second, max_index - top_left.second});
+            }
+        }
+        conditions.push_back(terms.empty() ? "0" : "(" + terms + ")");
+    } else {
+        if (_options.min_zoom) {
+            conditions.push_back("zoom_level>=?");
+            params.push_back(min_zoom);
         }
+        if (_options.max_zoom) {
+            conditions.push_back("zoom_level<=?");
+            params.push_back(max_zoom);
+        }
+    }
+    if (_options.first_rowid) {
+        conditions.push_back("rowid>=?");
+        params.push_back(*_options.first_rowid);
+    }
+    if (_options.last_rowid) {
+        conditions.push_back("rowid<=?");
+        params.push_back(*_options.last_rowid);
+    }
+    if (_options.shard_count > 1) {
+        conditions.push_back("(tile_column+tile_row)%?=?");
+        params.push_back(static_cast<std::int64_t>(_options.shard_count));
+        params.push_back(static_cast<std::int64_t>(_options.shard_index));
+    }
+
+    for (std::size_t i = 0; i < conditions.size(); ++i) {
+        query += i == 0 ? " WHERE " : " AND ";
+        query += conditions[i];
+    }
+    if (_options.ordered) {
+        query += " ORDER BY zoom_level, tile_column, tile_row";
+    }
+
+    int rc = sqlite3_prepare_v2(_db, query.c_str(), -1, &_stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        throw std::runtime_error("Failed to prepare tile query: " + std::string(sqlite3_errmsg(_db)));
+    }
+    for (std::size_t i = 0; i < params.size(); ++i) {
+        sqlite3_bind_int64(_stmt, static_cast<int>(i + 1), params[i]);
+    }
+}
+
+std::optional<TileView> TileIterator::nextView() {
+    if (!_started) {
+        prepare();
         _started = true;
     }
 
-    int rc = sqlite3_step(_stmt);
+    int rc = timed_step(_stmt);
     if (rc == SQLITE_DONE) {
         return std::nullopt;
     }
@@ -2012,29 +6079,22 @@ std::optional<TileInfo> TileIterator::next() {
     const void* blob = sqlite3_column_blob(_stmt, 3);
     const int blob_size = sqlite3_column_bytes(_stmt, 3);
 
-    std::string ext;
-    const bool has_meta_ext = !_metadata_ext.empty();
-    if (has_meta_ext) {
-        ext = _metadata_ext;
-    } else {
-        ext = detect_extension(blob, blob_size);
-        ext = extension_without_dot(ext);
-    }
-
-    std::vector<std::byte> data;
+    TileView view;
+    view.zoom = z;
+    view.x = x;
+    view.y = xyz_y;
+    view.tms_y = tms_y;
     if (blob && blob_size > 0) {
-        data.resize(blob_size);
-        std::memcpy(data.data(), blob, blob_size);
+        view.data = static_cast<const std::byte *>(blob);
+        view.size = static_cast<std::size_t>(blob_size);
     }
-
-    return TileInfo{
-        z,
-        x,
-        xyz_y,
-        tms_y,
-        std::move(data),
-        ext
-    };
+    count_tile_read(view.size);
+    if (!_metadata_ext.empty()) {
+        view.extension = _metadata_ext;
+    } else {
+        view.extension = detect_extension_token(blob, blob_size);
+    }
+    return view;
 }
 
 }  // namespace mbtiles
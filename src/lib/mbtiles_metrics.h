@@ -0,0 +1,123 @@
+#ifndef MBTILES_METRICS_H
+#define MBTILES_METRICS_H
+
+// Library-internal recording side of metrics(): relaxed atomics only, so the
+// hot paths pay a clock read and a few uncontended increments per event.
+
+#include "mbtiles.h"
+#include "sqlite3.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace mbtiles {
+
+class LatencyHistogram {
+  public:
+    void observe(std::chrono::steady_clock::duration elapsed) noexcept {
+        const auto ns = static_cast<std::uint64_t>(
+            std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        // Bounds grow by 4x from 1us, so the bucket is found in a few compares
+        std::size_t bucket = 0;
+        while (bucket < kMetricBucketBounds.size() && ns > (std::uint64_t{1000} << (2 * bucket))) {
+            ++bucket;
+        }
+        _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    StageMetrics snapshot() const noexcept {
+        StageMetrics stage;
+        stage.count = _count.load(std::memory_order_relaxed);
+        stage.seconds = static_cast<double>(_sum_ns.load(std::memory_order_relaxed)) / 1e9;
+        for (std::size_t i = 0; i < _buckets.size(); ++i) {
+            stage.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+        }
+        return stage;
+    }
+
+    void reset() noexcept {
+        _count.store(0, std::memory_order_relaxed);
+        _sum_ns.store(0, std::memory_order_relaxed);
+        for (auto &bucket : _buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+  private:
+    std::atomic<std::uint64_t> _count{0};
+    std::atomic<std::uint64_t> _sum_ns{0};
+    std::array<std::atomic<std::uint64_t>, kMetricBucketBounds.size() + 1> _buckets{};
+};
+
+struct MetricsRegistry {
+    LatencyHistogram sqlite_step;
+    LatencyHistogram decode_png;
+    LatencyHistogram decode_jpg;
+    LatencyHistogram decode_webp;
+    LatencyHistogram decode_other;
+    LatencyHistogram encode_png;
+    LatencyHistogram encode_jpg;
+    LatencyHistogram encode_webp;
+    LatencyHistogram resample;
+    LatencyHistogram http_request;
+    std::atomic<std::uint64_t> tiles_read{0};
+    std::atomic<std::uint64_t> bytes_read{0};
+    std::atomic<std::uint64_t> tiles_written{0};
+    std::atomic<std::uint64_t> bytes_written{0};
+    std::atomic<std::uint64_t> cache_hits{0};
+    std::atomic<std::uint64_t> cache_misses{0};
+    std::atomic<std::uint64_t> encode_cache_hits{0};
+    std::atomic<std::uint64_t> tiles_prefetched{0};
+};
+
+// One registry per process, shared by both translation units.
+inline MetricsRegistry &metrics_registry() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// Adds the lifetime of the timer to `histogram`.
+class StageTimer {
+  public:
+    explicit StageTimer(LatencyHistogram &histogram) noexcept
+        : _histogram(histogram), _start(std::chrono::steady_clock::now()) {}
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+    ~StageTimer() { _histogram.observe(std::chrono::steady_clock::now() - _start); }
+
+  private:
+    LatencyHistogram &_histogram;
+    std::chrono::steady_clock::time_point _start;
+};
+
+inline void count_event(std::atomic<std::uint64_t> &counter, std::uint64_t amount = 1) noexcept {
+    counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+inline void count_tile_read(std::size_t bytes) noexcept {
+    auto &registry = metrics_registry();
+    count_event(registry.tiles_read);
+    count_event(registry.bytes_read, bytes);
+}
+
+inline void count_tile_written(std::size_t bytes) noexcept {
+    auto &registry = metrics_registry();
+    count_event(registry.tiles_written);
+    count_event(registry.bytes_written, bytes);
+}
+
+// sqlite3_step() with its time added to the sqlite_step histogram.
+inline int timed_step(sqlite3_stmt *stmt) {
+    StageTimer timer(metrics_registry().sqlite_step);
+    return sqlite3_step(stmt);
+}
+
+}  // namespace mbtiles
+
+#endif  // MBTILES_METRICS_H
@@ -1,7 +1,10 @@
 #include "mbtiles.h"
 
 #include "httplib.h"
+#include "mbtiles_metrics.h"
 #include "mustache.hpp"
+#include "sqlite3.h"
+#include "stb_image.h"
 
 
 #include "templates/index_mustache_html.h"
@@ -10,10 +13,17 @@
 #include "templates/assets/leaflet_js.h"
 
 #include <algorithm>
+#include <array>
+#include <charconv>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <list>
 #include <locale>
 #include <map>
 #include <memory>
@@ -22,16 +32,65 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <cctype>
 #include <cstdint>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 namespace mbtiles {
 namespace {
 
 
 
-std::string detect_content_type(const std::string &payload) {
+// Lower-cased metadata `format` with aliases folded (jpeg -> jpg,
+// mvt -> pbf), also used to match request extensions against the archive.
+std::string normalize_format(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(),
+                   [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+    if (value == "jpeg") {
+        return "jpg";
+    }
+    if (value == "mvt") {
+        return "pbf";
+    }
+    return value;
+}
+
+bool is_gzip(std::string_view payload) {
+    return payload.size() >= 2 && static_cast<unsigned char>(payload[0]) == 0x1F &&
+           static_cast<unsigned char>(payload[1]) == 0x8B;
+}
+
+std::string content_type_for_format(const std::string &format) {
+    if (format == "png") {
+        return "image/png";
+    }
+    if (format == "jpg") {
+        return "image/jpeg";
+    }
+    if (format == "webp") {
+        return "image/webp";
+    }
+    if (format == "pbf") {
+        return "application/x-protobuf";
+    }
+    return "application/octet-stream";
+}
+
+// Raster payloads are recognised by their magic bytes; anything else (e.g.
+// protobuf vector tiles, which have no signature) falls back to the
+// archive's normalized `format`.
+std::string detect_content_type(std::string_view payload, const std::string &format = {}) {
     if (payload.size() >= 8) {
         const unsigned char *bytes = reinterpret_cast<const unsigned char *>(payload.data());
         if (bytes[0] == 0x89 && bytes[1] == 0x50 && bytes[2] == 0x4E && bytes[3] == 0x47) {
@@ -45,7 +104,7 @@ std::string detect_content_type(const std::string &payload) {
             return "image/webp";
         }
     }
-    return "application/octet-stream";
+    return content_type_for_format(format);
 }
 
 std::string trim(const std::string &value) {
@@ -170,6 +229,295 @@ std::optional<BoundsInfo> parse_bounds(const std::string &value) {
     return bounds;
 }
 
+// Read-only connections to the archive being served. httplib dispatches
+// requests onto a pool of worker threads; each request borrows a connection
+// (opened lazily, at most one per worker) together with the tile lookup
+// statement prepared on it, so tile reads no longer queue on one handle.
+class ReadConnectionPool {
+  public:
+    struct Connection {
+        sqlite3 *db = nullptr;
+        sqlite3_stmt *tile_stmt = nullptr;
+    };
+
+    class Lease {
+      public:
+        Lease(ReadConnectionPool &pool, Connection *connection) : _pool(pool), _connection(connection) {}
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        ~Lease() { _pool.release(_connection); }
+
+        Connection &operator*() const { return *_connection; }
+
+      private:
+        ReadConnectionPool &_pool;
+        Connection *_connection;
+    };
+
+    using Opener = std::function<sqlite3 *()>;
+
+    ReadConnectionPool(Opener opener, std::size_t capacity)
+        : _opener(std::move(opener)), _capacity(std::max<std::size_t>(capacity, 1)) {}
+
+    ReadConnectionPool(const ReadConnectionPool &) = delete;
+    ReadConnectionPool &operator=(const ReadConnectionPool &) = delete;
+
+    ~ReadConnectionPool() {
+        for (auto &connection : _connections) {
+            sqlite3_finalize(connection->tile_stmt);
+            sqlite3_close(connection->db);
+        }
+    }
+
+    Lease acquire() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _available.wait(lock, [this] { return !_idle.empty() || _connections.size() < _capacity; });
+        if (!_idle.empty()) {
+            Connection *connection = _idle.back();
+            _idle.pop_back();
+            return Lease(*this, connection);
+        }
+        _connections.push_back(open_connection());
+        return Lease(*this, _connections.back().get());
+    }
+
+  private:
+    std::unique_ptr<Connection> open_connection() const {
+        auto connection = std::make_unique<Connection>();
+        connection->db = _opener();
+
+        const char *sql = "SELECT tile_data FROM tiles WHERE zoom_level=?1 AND tile_column=?2 AND tile_row=?3 LIMIT 1";
+        if (sqlite3_prepare_v3(connection->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &connection->tile_stmt, nullptr) !=
+            SQLITE_OK) {
+            const std::string message = "Failed to prepare tile query: " + std::string(sqlite3_errmsg(connection->db));
+            sqlite3_close(connection->db);
+            throw mbtiles_error(message);
+        }
+        return connection;
+    }
+
+    void release(Connection *connection) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _idle.push_back(connection);
+        }
+        _available.notify_one();
+    }
+
+    Opener _opener;
+    std::size_t _capacity;
+    std::mutex _mutex;
+    std::condition_variable _available;
+    std::vector<std::unique_ptr<Connection>> _connections;
+    std::vector<Connection *> _idle;
+};
+
+// Looks up a tile on a pooled connection and hands `fn` a view of SQLite's
+// row buffer; returns false when the tile does not exist.
+template <typename Fn>
+bool with_tile(ReadConnectionPool::Connection &connection, int zoom, int column, int row, Fn &&fn) {
+    sqlite3_stmt *stmt = connection.tile_stmt;
+    const int tms_row = static_cast<int>((static_cast<std::int64_t>(1) << zoom) - 1 - row);
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, zoom);
+    sqlite3_bind_int(stmt, 2, column);
+    sqlite3_bind_int(stmt, 3, tms_row);
+
+    bool found = false;
+    const int rc = timed_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const void *blob = sqlite3_column_blob(stmt, 0);
+        const int blob_size = sqlite3_column_bytes(stmt, 0);
+        if (blob != nullptr && blob_size > 0) {
+            found = true;
+            count_tile_read(static_cast<std::size_t>(blob_size));
+            try {
+                fn(std::string_view(static_cast<const char *>(blob), static_cast<std::size_t>(blob_size)));
+            } catch (...) {
+                sqlite3_reset(stmt);
+                throw;
+            }
+        }
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        throw mbtiles_error("SQLite error while reading tile: " + std::string(sqlite3_errmsg(connection.db)));
+    }
+    return found;
+}
+
+// An encoded tile as served: payload plus what the response headers need.
+struct CachedTile {
+    std::string data;
+    std::string content_type;
+    std::string content_encoding;  // "gzip" for precompressed blobs, else empty
+    std::string etag;
+};
+
+// 64-bit FNV-1a; cheap enough to run once per cache fill, and collisions only
+// matter between versions of the same tile URL.
+std::uint64_t hash_payload(std::string_view payload) {
+    std::uint64_t hash = 1469598103934665603ULL;
+    for (const char ch : payload) {
+        hash ^= static_cast<unsigned char>(ch);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string make_etag(std::string_view payload) {
+    std::ostringstream oss;
+    oss << '"' << std::hex << std::setfill('0') << std::setw(16) << hash_payload(payload) << '-' << payload.size()
+        << '"';
+    return oss.str();
+}
+
+// Gzip-wrapped blobs (the usual encoding of vector tiles in MBTiles) are kept
+// as stored and labelled with Content-Encoding; send_tile() inflates them
+// only for clients that do not accept gzip.
+std::shared_ptr<const CachedTile> make_cached_tile(std::string_view payload, const std::string &format) {
+    auto tile = std::make_shared<CachedTile>();
+    tile->data.assign(payload.data(), payload.size());
+    if (is_gzip(payload)) {
+        tile->content_type = content_type_for_format(format);
+        tile->content_encoding = "gzip";
+    } else {
+        tile->content_type = detect_content_type(payload, format);
+    }
+    tile->etag = make_etag(payload);
+    return tile;
+}
+
+// True when an If-None-Match header value lists `etag` (or is "*"). Weak
+// validators compare equal to their strong form, as RFC 9110 prescribes for
+// this header.
+bool etag_matches(const std::string &header, const std::string &etag) {
+    std::stringstream ss(header);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        token = trim(token);
+        if (token.rfind("W/", 0) == 0) {
+            token.erase(0, 2);
+        }
+        if (token == "*" || token == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Byte-bounded LRU of encoded tiles, striped over independently locked
+// shards. Entries are shared_ptrs so a response can keep using a tile after
+// it has been evicted.
+class TileCache {
+  public:
+    TileCache(std::size_t capacity_bytes, std::size_t shard_count)
+        : _shards(capacity_bytes == 0 ? 0 : std::max<std::size_t>(shard_count, 1)) {
+        for (auto &shard : _shards) {
+            shard.capacity = capacity_bytes / _shards.size();
+        }
+    }
+
+    // A packed tile address plus the tileset it belongs to, so several
+    // archives can share one cache; a single archive uses tileset 0.
+    struct Key {
+        std::uint64_t tile = 0;
+        std::uint32_t tileset = 0;
+
+        bool operator==(const Key &other) const { return tile == other.tile && tileset == other.tileset; }
+    };
+
+    // Zoom levels above 29 do not fit the packed key and are never cached.
+    static std::optional<Key> key(int zoom, int column, int row, std::uint32_t tileset = 0) {
+        if (zoom < 0 || zoom > 29) {
+            return std::nullopt;
+        }
+        Key key;
+        key.tile = (static_cast<std::uint64_t>(zoom) << 58) | (static_cast<std::uint64_t>(column) << 29) |
+                   static_cast<std::uint64_t>(row);
+        key.tileset = tileset;
+        return key;
+    }
+
+    // Like find(), without counting as a use.
+    bool contains(const Key &key) {
+        if (_shards.empty()) {
+            return false;
+        }
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.index.count(key) != 0;
+    }
+
+    std::shared_ptr<const CachedTile> find(const Key &key) {
+        if (_shards.empty()) {
+            return nullptr;
+        }
+        Shard &shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            return nullptr;
+        }
+        shard.order.splice(shard.order.begin(), shard.order, it->second);
+        return it->second->second;
+    }
+
+    void insert(const Key &key, std::shared_ptr<const CachedTile> tile) {
+        if (_shards.empty()) {
+            return;
+        }
+        Shard &shard = shardFor(key);
+        const std::size_t size = tile->data.size();
+        if (size > shard.capacity) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto existing = shard.index.find(key);
+        if (existing != shard.index.end()) {
+            shard.bytes -= existing->second->second->data.size();
+            shard.order.erase(existing->second);
+            shard.index.erase(existing);
+        }
+        while (!shard.order.empty() && shard.bytes + size > shard.capacity) {
+            const auto &victim = shard.order.back();
+            shard.bytes -= victim.second->data.size();
+            shard.index.erase(victim.first);
+            shard.order.pop_back();
+        }
+        shard.order.emplace_front(key, std::move(tile));
+        shard.index.emplace(key, shard.order.begin());
+        shard.bytes += size;
+    }
+
+  private:
+    // Spreads neighbouring tiles, which share most key bits, over shards and
+    // buckets.
+    static std::uint64_t mix(const Key &key) {
+        const std::uint64_t tile = key.tile ^ (static_cast<std::uint64_t>(key.tileset) * 0xC2B2AE3D27D4EB4FULL);
+        return (tile ^ (tile >> 29) ^ (tile >> 58)) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    struct KeyHash {
+        std::size_t operator()(const Key &key) const { return static_cast<std::size_t>(mix(key)); }
+    };
+
+    using Entry = std::pair<Key, std::shared_ptr<const CachedTile>>;
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> order;  // most recently used first
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+        std::size_t bytes = 0;
+        std::size_t capacity = 0;
+    };
+
+    Shard &shardFor(const Key &key) { return _shards[(mix(key) >> 32) % _shards.size()]; }
+
+    std::vector<Shard> _shards;
+};
+
 std::string format_double(double value) {
     std::ostringstream oss;
     oss.imbue(std::locale::classic());
@@ -190,137 +538,937 @@ std::string format_double(double value) {
     return result;
 }
 
-}  // namespace
+// Puts the calling thread at the back of the CPU queue and, on Linux, of the
+// disk queue (idle I/O class), so prefetching yields to foreground reads.
+void lower_thread_priority() {
+#ifdef __linux__
+    constexpr int kIoprioWhoProcess = 1;  // with id 0: the calling thread
+    constexpr int kIoprioClassIdle = 3;
+    constexpr int kIoprioClassShift = 13;
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+    syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift);
+#endif
+}
 
-void MBTiles::view(std::uint16_t port, std::string host) {
-    std::mutex db_mutex;
+// Background loader of the tiles a client is likely to ask for next: the
+// ring of neighbours around each requested tile, led by the direction the
+// client pans in, and its four children, first when the client zooms in.
+// Predictions wait in a bounded LIFO, so the newest are loaded first and
+// stale ones fall off the far end, and are loaded by a few low-priority
+// threads on their own connections, so foreground requests never wait for
+// a prefetch.
+class Prefetcher {
+  public:
+    Prefetcher(TileCache &cache, ReadConnectionPool::Opener opener, std::string format, int max_zoom,
+               std::size_t threads, std::size_t queue_capacity)
+        : _cache(cache), _pool(std::move(opener), threads), _format(std::move(format)), _max_zoom(max_zoom),
+          _queue_capacity(std::max<std::size_t>(queue_capacity, 1)) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i) {
+            _workers.emplace_back([this] { run(); });
+        }
+    }
 
-    const auto _metadata = metadata();
+    Prefetcher(const Prefetcher &) = delete;
+    Prefetcher &operator=(const Prefetcher &) = delete;
 
-    std::optional<int> min_zoom_value;
-    if (const auto min_zoom_str = find_metadata_value(_metadata, "minzoom")) {
-        min_zoom_value = parse_int(*min_zoom_str);
+    ~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _wake.notify_all();
+        for (auto &worker : _workers) {
+            worker.join();
+        }
     }
-    if (!min_zoom_value) {
-        min_zoom_value = minZoomLevel();
+
+    // Records a request by `client` and queues what it predicts.
+    void observe(const std::string &client, int zoom, int column, int row) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_clients.size() >= kMaxClients && _clients.count(client) == 0) {
+                _clients.clear();
+            }
+            LastRequest &last = _clients[client];
+            int dx = 0;
+            int dy = 0;
+            if (last.valid && last.zoom == zoom) {
+                dx = (column > last.column) - (column < last.column);
+                dy = (row > last.row) - (row < last.row);
+            }
+            const bool zooming_in = last.valid && last.zoom < zoom;
+            last = LastRequest{zoom, column, row, true};
+
+            // Pushed in rising priority: the queue is served newest first.
+            if (zooming_in) {
+                queueNeighbours(zoom, column, row, dx, dy);
+                queueChildren(zoom, column, row);
+            } else {
+                queueChildren(zoom, column, row);
+                queueNeighbours(zoom, column, row, dx, dy);
+            }
+        }
+        _wake.notify_all();
     }
 
-    std::optional<int> max_zoom_value;
-    if (const auto max_zoom_str = find_metadata_value(_metadata, "maxzoom")) {
-        max_zoom_value = parse_int(*max_zoom_str);
+  private:
+    static constexpr std::size_t kMaxClients = 1024;
+
+    struct LastRequest {
+        int zoom = 0;
+        int column = 0;
+        int row = 0;
+        bool valid = false;
+    };
+
+    struct Task {
+        int zoom = 0;
+        int column = 0;
+        int row = 0;
+        TileCache::Key key;
+    };
+
+    void queueChildren(int zoom, int column, int row) {
+        if (zoom >= _max_zoom) {
+            return;
+        }
+        for (int i = 0; i < 4; ++i) {
+            queue(zoom + 1, column * 2 + (i & 1), row * 2 + (i >> 1));
+        }
     }
-    if (!max_zoom_value) {
-        max_zoom_value = maxZoomLevel();
+
+    void queueNeighbours(int zoom, int column, int row, int dx, int dy) {
+        std::array<std::pair<int, int>, 8> offsets = {
+            {{-1, -1}, {0, -1}, {1, -1}, {-1, 0}, {1, 0}, {-1, 1}, {0, 1}, {1, 1}}};
+        std::stable_sort(offsets.begin(), offsets.end(), [dx, dy](const auto &a, const auto &b) {
+            return a.first * dx + a.second * dy < b.first * dx + b.second * dy;
+        });
+        for (const auto &[ox, oy] : offsets) {
+            queue(zoom, column + ox, row + oy);
+        }
     }
 
-    int min_zoom = min_zoom_value.value_or(0);
-    int max_zoom = max_zoom_value.value_or(min_zoom);
-    if (max_zoom < min_zoom) {
-        max_zoom = min_zoom;
+    // Caller holds _mutex.
+    void queue(int zoom, int column, int row) {
+        const std::int64_t max_index = (static_cast<std::int64_t>(1) << zoom) - 1;
+        if (column < 0 || row < 0 || column > max_index || row > max_index) {
+            return;
+        }
+        const auto key = TileCache::key(zoom, column, row);
+        if (!key || _pending.count(key->tile) != 0 || _cache.contains(*key)) {
+            return;
+        }
+        _pending.insert(key->tile);
+        _queue.push_back(Task{zoom, column, row, *key});
+        if (_queue.size() > _queue_capacity) {
+            _pending.erase(_queue.front().key.tile);
+            _queue.pop_front();
+        }
+    }
+
+    void run() {
+        lower_thread_priority();
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [this] { return _stopping || !_queue.empty(); });
+                if (_stopping) {
+                    return;
+                }
+                task = _queue.back();
+                _queue.pop_back();
+            }
+            // Best effort: a failed prefetch leaves the tile to its request.
+            try {
+                if (!_cache.contains(task.key)) {
+                    std::shared_ptr<const CachedTile> tile;
+                    auto connection = _pool.acquire();
+                    with_tile(*connection, task.zoom, task.column, task.row,
+                              [&](std::string_view payload) { tile = make_cached_tile(payload, _format); });
+                    if (tile) {
+                        _cache.insert(task.key, tile);
+                        count_event(metrics_registry().tiles_prefetched);
+                    }
+                }
+            } catch (const std::exception &) {
+            }
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.erase(task.key.tile);
+        }
     }
 
+    TileCache &_cache;
+    ReadConnectionPool _pool;
+    const std::string _format;
+    const int _max_zoom;
+    const std::size_t _queue_capacity;
 
-    std::optional<CenterInfo> center_info;
-    if (const auto center_value = find_metadata_value(_metadata, "center")) {
-        center_info = parse_center(*center_value);
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    bool _stopping = false;
+    std::deque<Task> _queue;  // newest at the back
+    std::unordered_set<std::uint64_t> _pending;
+    std::unordered_map<std::string, LastRequest> _clients;
+    std::vector<std::thread> _workers;
+};
+
+// Worker pool and connection limits shared by every server mode.
+void configure_server(httplib::Server &server, const ViewerOptions &options, std::size_t worker_count) {
+    server.new_task_queue = [worker_count] { return new httplib::ThreadPool(worker_count); };
+    server.set_keep_alive_timeout(static_cast<time_t>(options.keep_alive_timeout));
+    server.set_keep_alive_max_count(options.keep_alive_max_requests);
+    server.set_read_timeout(static_cast<time_t>(options.read_timeout));
+    server.set_write_timeout(static_cast<time_t>(options.write_timeout));
+}
+
+// Parses the z/x/y captures starting at req.matches[first] and rejects
+// coordinates outside the zoom level's grid. Digit runs too long for an int
+// are a client error (400), not a server one; nullopt means `res` already
+// holds the error response.
+std::optional<TileCoord> parse_tile_coordinates(const httplib::Request &req, std::size_t first,
+                                                httplib::Response &res) {
+    // Deepest level whose tile indices fit in an int.
+    constexpr int kMaxTileZoom = 30;
+    std::array<int, 3> values{};
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        const std::string capture = req.matches[first + i];
+        const char *end = capture.data() + capture.size();
+        const auto [ptr, ec] = std::from_chars(capture.data(), end, values[i]);
+        if (ec != std::errc() || ptr != end || values[i] < 0) {
+            res.status = 400;
+            res.set_content("Invalid tile coordinates", "text/plain; charset=utf-8");
+            return std::nullopt;
+        }
     }
 
-    double center_lat = 0.0;
-    double center_lon = 0.0;
-    if (center_info) {
-        center_lat = center_info->lat;
-        center_lon = center_info->lon;
-    } else if (const auto bounds_value = find_metadata_value(_metadata, "bounds")) {
-        if (const auto bounds = parse_bounds(*bounds_value)) {
-            center_lat = (bounds->min_lat + bounds->max_lat) / 2.0;
-            center_lon = (bounds->min_lon + bounds->max_lon) / 2.0;
+    const TileCoord coord{values[0], values[1], values[2]};
+    if (coord.zoom > kMaxTileZoom || coord.x > (1 << coord.zoom) - 1 || coord.y > (1 << coord.zoom) - 1) {
+        res.status = 404;
+        res.set_content("Tile coordinates exceed range for zoom level", "text/plain; charset=utf-8");
+        return std::nullopt;
+    }
+    return coord;
+}
+
+// True when an Accept-Encoding header value allows gzip, by name or "*",
+// with a non-zero quality.
+bool accepts_gzip(const std::string &header) {
+    std::stringstream ss(header);
+    std::string token;
+    while (std::getline(ss, token, ',')) {
+        std::string coding = token;
+        std::string params;
+        if (const auto semicolon = token.find(';'); semicolon != std::string::npos) {
+            coding = token.substr(0, semicolon);
+            params = token.substr(semicolon + 1);
+        }
+        coding = trim(coding);
+        std::transform(coding.begin(), coding.end(), coding.begin(),
+                       [](unsigned char ch) { return static_cast<char>(std::tolower(ch)); });
+        if (coding != "gzip" && coding != "x-gzip" && coding != "*") {
+            continue;
+        }
+        params = trim(params);
+        if (params.rfind("q=", 0) == 0 || params.rfind("Q=", 0) == 0) {
+            const std::string quality = params.substr(2);
+            if (!quality.empty() && quality.find_first_not_of("0.") == std::string::npos) {
+                continue;
+            }
         }
+        return true;
     }
+    return false;
+}
 
-    int initial_zoom = min_zoom;
-    if (center_info && center_info->zoom) {
-        initial_zoom = *center_info->zoom;
+// Inflates a gzip member (RFC 1952) with stb_image's deflate decoder, so the
+// archive's gzip blobs can reach clients that do not accept gzip.
+std::optional<std::string> gunzip(std::string_view payload) {
+    constexpr unsigned char kFlagHcrc = 0x02;
+    constexpr unsigned char kFlagExtra = 0x04;
+    constexpr unsigned char kFlagName = 0x08;
+    constexpr unsigned char kFlagComment = 0x10;
+    if (!is_gzip(payload) || payload.size() < 18 || payload[2] != 8) {
+        return std::nullopt;
+    }
+    const auto flags = static_cast<unsigned char>(payload[3]);
+    std::size_t offset = 10;
+    if ((flags & kFlagExtra) != 0) {
+        if (offset + 2 > payload.size()) {
+            return std::nullopt;
+        }
+        offset += 2 + (static_cast<unsigned char>(payload[offset]) |
+                       static_cast<std::size_t>(static_cast<unsigned char>(payload[offset + 1])) << 8);
     }
-    initial_zoom = std::clamp(initial_zoom, min_zoom, max_zoom);
+    for (const unsigned char flag : {kFlagName, kFlagComment}) {
+        if ((flags & flag) != 0) {
+            offset = payload.find('\0', offset);
+            if (offset == std::string_view::npos) {
+                return std::nullopt;
+            }
+            ++offset;
+        }
+    }
+    if ((flags & kFlagHcrc) != 0) {
+        offset += 2;
+    }
+    if (offset >= payload.size()) {
+        return std::nullopt;
+    }
+    int size = 0;
+    char *inflated = stbi_zlib_decode_noheader_malloc(payload.data() + offset,
+                                                      static_cast<int>(payload.size() - offset), &size);
+    if (inflated == nullptr) {
+        return std::nullopt;
+    }
+    std::string data(inflated, static_cast<std::size_t>(size));
+    std::free(inflated);  // stb_image allocates with malloc()
+    return data;
+}
 
-    kainjow::mustache::data context;
-    context.set("title", _name);
-    context.set("tile_path", std::string{"/tiles"});
-    context.set("min_zoom", std::to_string(min_zoom));
-    context.set("max_zoom", std::to_string(max_zoom));
-    context.set("initial_zoom", std::to_string(initial_zoom));
-    context.set("center_lat", format_double(center_lat));
-    context.set("center_lng", format_double(center_lon));
+// Fills `res` with `tile`, or with 304 when the client already holds it.
+// Gzip blobs go out as stored to clients accepting gzip and are inflated per
+// request for the rest, which are rare enough not to be worth caching.
+void send_tile(const httplib::Request &req, httplib::Response &res, const CachedTile &tile,
+               const std::string &cache_control) {
+    res.set_header("Cache-Control", cache_control);
+    const bool encoded = !tile.content_encoding.empty();
+    const bool inflate = encoded && !accepts_gzip(req.get_header_value("Accept-Encoding"));
+    // The inflated body is a different representation, so it gets its own
+    // validator.
+    const std::string etag = inflate ? tile.etag.substr(0, tile.etag.size() - 1) + "-identity\"" : tile.etag;
+    if (encoded) {
+        res.set_header("Vary", "Accept-Encoding");
+    }
+    res.set_header("ETag", etag);
+    if (req.has_header("If-None-Match") && etag_matches(req.get_header_value("If-None-Match"), etag)) {
+        res.status = 304;
+        return;
+    }
+    if (!inflate) {
+        if (encoded) {
+            res.set_header("Content-Encoding", tile.content_encoding);
+        }
+        res.set_content(tile.data.data(), tile.data.size(), tile.content_type);
+        return;
+    }
+    const auto data = gunzip(std::string_view(tile.data.data(), tile.data.size()));
+    if (!data) {
+        res.status = 406;
+        res.set_content("Tile is stored gzip-compressed and the request does not accept gzip", "text/plain");
+        return;
+    }
+    res.set_content(*data, tile.content_type);
+}
+
+std::string json_string(std::string_view value) {
+    std::string out = "\"";
+    for (const char ch : value) {
+        switch (ch) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(ch) < 0x20) {
+                std::ostringstream oss;
+                oss << "\\u" << std::hex << std::setfill('0') << std::setw(4) << static_cast<int>(ch);
+                out += oss.str();
+            } else {
+                out += ch;
+            }
+        }
+    }
+    out += '"';
+    return out;
+}
+
+// Everything of a TileJSON 3.0 document except its leading "tiles" member,
+// which depends on the Host the request came through. The members of the
+// MBTiles `json` metadata (vector_layers, tilestats) are spliced in as is.
+std::string tilejson_members(const std::string &name, const std::map<std::string, std::string> &metadata,
+                             const std::string &format, int min_zoom, int max_zoom) {
+    std::string out = "\"tilejson\":\"3.0.0\",\"scheme\":\"xyz\"";
+    out += ",\"name\":" + json_string(find_metadata_value(metadata, "name").value_or(name));
+    for (const char *key : {"description", "attribution", "version"}) {
+        if (const auto value = find_metadata_value(metadata, key)) {
+            out += ",\"" + std::string(key) + "\":" + json_string(*value);
+        }
+    }
+    if (!format.empty()) {
+        out += ",\"format\":" + json_string(format);
+    }
+    out += ",\"minzoom\":" + std::to_string(min_zoom) + ",\"maxzoom\":" + std::to_string(max_zoom);
+
+    std::optional<BoundsInfo> bounds;
+    if (const auto value = find_metadata_value(metadata, "bounds")) {
+        bounds = parse_bounds(*value);
+    }
+    if (bounds) {
+        out += ",\"bounds\":[" + format_double(bounds->min_lon) + ',' + format_double(bounds->min_lat) + ',' +
+               format_double(bounds->max_lon) + ',' + format_double(bounds->max_lat) + ']';
+    }
+    std::optional<CenterInfo> center;
+    if (const auto value = find_metadata_value(metadata, "center")) {
+        center = parse_center(*value);
+    }
+    if (center) {
+        out += ",\"center\":[" + format_double(center->lon) + ',' + format_double(center->lat) + ',' +
+               std::to_string(std::clamp(center->zoom.value_or(min_zoom), min_zoom, max_zoom)) + ']';
+    }
+
+    if (const auto value = find_metadata_value(metadata, "json")) {
+        const std::string json = trim(*value);
+        if (json.size() > 2 && json.front() == '{' && json.back() == '}') {
+            const std::string inner = trim(json.substr(1, json.size() - 2));
+            if (!inner.empty()) {
+                out += ',' + inner;
+            }
+        }
+    }
+    return out;
+}
+
+// Tileset names double as URL segments and, for a directory, as file stems,
+// so they are kept to characters that need no escaping and cannot climb out
+// of the directory.
+bool valid_tileset_name(const std::string &name) {
+    if (name.empty() || name.front() == '.') {
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char ch) {
+        return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_' || ch == '-' || ch == '.';
+    });
+}
+
+// The archives behind MBTiles::serveTilesets(), by tileset name. Names
+// resolve to paths without touching the files; an archive is opened on its
+// first request and kept, with its format and TileJSON, in an LRU of at most
+// `capacity` entries. Evicted entries close once their last in-flight request
+// lets go of them.
+class TilesetRegistry {
+  public:
+    struct Tileset {
+        std::string name;
+        std::uint32_t id = 0;  // TileCache namespace, stable across reopenings
+        std::string format;
+        std::string tilejson;  // see tilejson_members()
+        std::unique_ptr<ReadConnectionPool> pool;
+    };
+
+    using ReaderOpener = std::function<sqlite3 *(const std::string &path)>;
+
+    TilesetRegistry(const std::string &source, OpenOptions options, ReaderOpener open_reader, std::size_t capacity,
+                    std::size_t pool_capacity)
+        : _options(options), _open_reader(std::move(open_reader)), _capacity(std::max<std::size_t>(capacity, 1)),
+          _pool_capacity(pool_capacity) {
+        namespace fs = std::filesystem;
+        _options.read_only = true;
+        if (fs::is_directory(source)) {
+            _directory = fs::path(source);
+        } else if (fs::is_regular_file(source)) {
+            loadManifest(fs::path(source));
+        } else {
+            throw mbtiles_error("Tileset source is neither a directory nor a manifest file: " + source);
+        }
+    }
+
+    // Names currently servable, sorted; never opens an archive.
+    std::vector<std::string> names() const {
+        std::vector<std::string> names;
+        if (!_directory) {
+            for (const auto &entry : _manifest) {
+                names.push_back(entry.first);
+            }
+            return names;
+        }
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(*_directory, ec)) {
+            const auto &path = entry.path();
+            if (path.extension() == ".mbtiles" && entry.is_regular_file(ec) &&
+                valid_tileset_name(path.stem().string())) {
+                names.push_back(path.stem().string());
+            }
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    // The open tileset `name`, opening it (and evicting the least recently
+    // used one) if needed; null when no such archive exists.
+    std::shared_ptr<const Tileset> find(const std::string &name) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (const auto it = _index.find(name); it != _index.end()) {
+                _order.splice(_order.begin(), _order, it->second);
+                return *it->second;
+            }
+        }
+
+        const auto path = resolve(name);
+        if (!path) {
+            return nullptr;
+        }
+        // Opened outside the lock so a slow archive does not stall requests
+        // for the others; when two requests race, the first one in wins.
+        auto tileset = load(name, *path);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (const auto it = _index.find(name); it != _index.end()) {
+            _order.splice(_order.begin(), _order, it->second);
+            return *it->second;
+        }
+        const auto id = _ids.emplace(name, static_cast<std::uint32_t>(_ids.size() + 1)).first->second;
+        tileset->id = id;
+        _order.push_front(std::move(tileset));
+        _index.emplace(name, _order.begin());
+        while (_order.size() > _capacity) {
+            _index.erase(_order.back()->name);
+            _order.pop_back();
+        }
+        return _order.front();
+    }
+
+  private:
+    void loadManifest(const std::filesystem::path &manifest) {
+        std::ifstream in(manifest);
+        if (!in) {
+            throw mbtiles_error("Unable to read tileset manifest: " + manifest.string());
+        }
+        // One "path" or "name=path" per line; '#' starts a comment line and
+        // relative paths are taken from the manifest's directory.
+        std::string line;
+        std::size_t line_number = 0;
+        while (std::getline(in, line)) {
+            ++line_number;
+            line = trim(line);
+            if (line.empty() || line.front() == '#') {
+                continue;
+            }
+            std::string name;
+            std::filesystem::path path;
+            if (const auto eq = line.find('='); eq != std::string::npos) {
+                name = trim(line.substr(0, eq));
+                path = trim(line.substr(eq + 1));
+            } else {
+                path = line;
+                name = path.stem().string();
+            }
+            if (path.is_relative()) {
+                path = manifest.parent_path() / path;
+            }
+            if (!valid_tileset_name(name)) {
+                throw mbtiles_error("Invalid tileset name '" + name + "' on line " + std::to_string(line_number) +
+                                    " of " + manifest.string());
+            }
+            if (!_manifest.emplace(name, path).second) {
+                throw mbtiles_error("Duplicate tileset name '" + name + "' on line " + std::to_string(line_number) +
+                                    " of " + manifest.string());
+            }
+        }
+    }
+
+    std::optional<std::filesystem::path> resolve(const std::string &name) const {
+        if (!_directory) {
+            const auto it = _manifest.find(name);
+            return it != _manifest.end() ? std::optional<std::filesystem::path>(it->second) : std::nullopt;
+        }
+        if (!valid_tileset_name(name)) {
+            return std::nullopt;
+        }
+        auto path = *_directory / (name + ".mbtiles");
+        std::error_code ec;
+        if (!std::filesystem::is_regular_file(path, ec)) {
+            return std::nullopt;
+        }
+        return path;
+    }
+
+    std::shared_ptr<Tileset> load(const std::string &name, const std::filesystem::path &path) const {
+        auto tileset = std::make_shared<Tileset>();
+        tileset->name = name;
+
+        const std::string file = path.string();
+        const MBTiles archive(file, _options);
+        const auto metadata = archive.metadata();
+        tileset->format = normalize_format(find_metadata_value(metadata, "format").value_or(""));
+
+        std::optional<int> min_zoom;
+        if (const auto value = find_metadata_value(metadata, "minzoom")) {
+            min_zoom = parse_int(*value);
+        }
+        if (!min_zoom) {
+            min_zoom = archive.minZoomLevel();
+        }
+        std::optional<int> max_zoom;
+        if (const auto value = find_metadata_value(metadata, "maxzoom")) {
+            max_zoom = parse_int(*value);
+        }
+        if (!max_zoom) {
+            max_zoom = archive.maxZoomLevel();
+        }
+        const int min_value = min_zoom.value_or(0);
+        const int max_value = std::max(max_zoom.value_or(min_value), min_value);
+        tileset->tilejson = tilejson_members(name, metadata, tileset->format, min_value, max_value);
+
+        const ReaderOpener open_reader = _open_reader;
+        tileset->pool = std::make_unique<ReadConnectionPool>([open_reader, file] { return open_reader(file); },
+                                                             _pool_capacity);
+        return tileset;
+    }
+
+    OpenOptions _options;
+    ReaderOpener _open_reader;
+    std::size_t _capacity;
+    std::size_t _pool_capacity;
+    std::optional<std::filesystem::path> _directory;
+    std::map<std::string, std::filesystem::path> _manifest;
+
+    std::mutex _mutex;
+    std::list<std::shared_ptr<Tileset>> _order;  // most recently used first
+    std::unordered_map<std::string, std::list<std::shared_ptr<Tileset>>::iterator> _index;
+    std::unordered_map<std::string, std::uint32_t> _ids;
+};
+
+}  // namespace
+
+void MBTiles::view(std::uint16_t port, std::string host) {
+    ViewerOptions options;
+    options.port = port;
+    options.host = std::move(host);
+    view(options);
+}
+
+void MBTiles::view(const ViewerOptions &options) {
+    runServer(options, true);
+}
 
-    kainjow::mustache::mustache view_template{templates::view_mustache_html};
-    const std::string map_page = view_template.render(context);
+void MBTiles::serve(const ViewerOptions &options) {
+    runServer(options, false);
+}
 
+void MBTiles::runServer(const ViewerOptions &options, bool viewer_pages) {
+    std::mutex db_mutex;
+    const std::size_t worker_count = options.threads != 0 ? options.threads : CPPHTTPLIB_THREAD_POOL_COUNT;
 
-    kainjow::mustache::mustache index_template{templates::index_mustache_html};
-    const std::string index_page = index_template.render(context);
+    // In-memory archives (e.g. fresh convert() output) cannot be reopened, so
+    // they keep sharing this connection behind db_mutex.
+    std::unique_ptr<ReadConnectionPool> pool;
+    ReadConnectionPool::Opener opener;
+    if (!_path.empty()) {
+        // Pooled readers inherit the archive's open options, always read-only.
+        OpenOptions read_options = _open_options;
+        read_options.read_only = true;
+        const std::string path = _path;
+        opener = [path, read_options] { return openConnection(path, read_options, SQLITE_OPEN_NOMUTEX); };
+        pool = std::make_unique<ReadConnectionPool>(opener, worker_count);
+    }
 
+    const auto _metadata = metadata();
+    const std::string tile_format = normalize_format(find_metadata_value(_metadata, "format").value_or(""));
 
     httplib::Server server;
+    configure_server(server, options, worker_count);
 
-    server.Get("/", [index_page](const httplib::Request &, httplib::Response &res) {
-        res.set_content(index_page, "text/html; charset=utf-8");
-    });
+    if (viewer_pages) {
+        std::optional<int> min_zoom_value;
+        if (const auto min_zoom_str = find_metadata_value(_metadata, "minzoom")) {
+            min_zoom_value = parse_int(*min_zoom_str);
+        }
+        if (!min_zoom_value) {
+            min_zoom_value = minZoomLevel();
+        }
 
-    server.Get("/map", [map_page](const httplib::Request &, httplib::Response &res) {
-        res.set_content(map_page, "text/html; charset=utf-8");
-    });
+        std::optional<int> max_zoom_value;
+        if (const auto max_zoom_str = find_metadata_value(_metadata, "maxzoom")) {
+            max_zoom_value = parse_int(*max_zoom_str);
+        }
+        if (!max_zoom_value) {
+            max_zoom_value = maxZoomLevel();
+        }
 
-    server.Get("/assets/leaflet.js", [](const httplib::Request &, httplib::Response &res) {
-        res.set_content(templates::assets::leaflet_js, "application/javascript; charset=utf-8");
-    });
+        int min_zoom = min_zoom_value.value_or(0);
+        int max_zoom = max_zoom_value.value_or(min_zoom);
+        if (max_zoom < min_zoom) {
+            max_zoom = min_zoom;
+        }
 
-    server.Get("/assets/leaflet.css", [](const httplib::Request &, httplib::Response &res) {
-        res.set_content(templates::assets::leaflet_css, "text/css; charset=utf-8");
-    });
 
-    server.Get(R"(/tiles/(\d+)/(\d+)/(\d+)\.png)",
-               [this, &db_mutex](const httplib::Request &req, httplib::Response &res) {
-                   const int zoom = std::stoi(req.matches[1]);
-                   const int column = std::stoi(req.matches[2]);
-                   const int row = std::stoi(req.matches[3]);
+        std::optional<CenterInfo> center_info;
+        if (const auto center_value = find_metadata_value(_metadata, "center")) {
+            center_info = parse_center(*center_value);
+        }
+
+        double center_lat = 0.0;
+        double center_lon = 0.0;
+        if (center_info) {
+            center_lat = center_info->lat;
+            center_lon = center_info->lon;
+        } else if (const auto bounds_value = find_metadata_value(_metadata, "bounds")) {
+            if (const auto bounds = parse_bounds(*bounds_value)) {
+                center_lat = (bounds->min_lat + bounds->max_lat) / 2.0;
+                center_lon = (bounds->min_lon + bounds->max_lon) / 2.0;
+            }
+        }
+
+        int initial_zoom = min_zoom;
+        if (center_info && center_info->zoom) {
+            initial_zoom = *center_info->zoom;
+        }
+        initial_zoom = std::clamp(initial_zoom, min_zoom, max_zoom);
+
+        kainjow::mustache::data context;
+        context.set("title", _name);
+        context.set("tile_path", std::string{"/tiles"});
+        context.set("min_zoom", std::to_string(min_zoom));
+        context.set("max_zoom", std::to_string(max_zoom));
+        context.set("initial_zoom", std::to_string(initial_zoom));
+        context.set("center_lat", format_double(center_lat));
+        context.set("center_lng", format_double(center_lon));
+
+        kainjow::mustache::mustache view_template{templates::view_mustache_html};
+        const std::string map_page = view_template.render(context);
+
+
+        kainjow::mustache::mustache index_template{templates::index_mustache_html};
+        const std::string index_page = index_template.render(context);
+
+
+        server.Get("/", [index_page](const httplib::Request &, httplib::Response &res) {
+            res.set_content(index_page, "text/html; charset=utf-8");
+        });
+
+        server.Get("/map", [map_page](const httplib::Request &, httplib::Response &res) {
+            res.set_content(map_page, "text/html; charset=utf-8");
+        });
+
+        server.Get("/assets/leaflet.js", [](const httplib::Request &, httplib::Response &res) {
+            res.set_content(templates::assets::leaflet_js, "application/javascript; charset=utf-8");
+        });
 
-                   if (zoom < 0 || column < 0 || row < 0) {
-                       res.status = 400;
-                       res.set_content("Invalid tile coordinates", "text/plain; charset=utf-8");
+        server.Get("/assets/leaflet.css", [](const httplib::Request &, httplib::Response &res) {
+            res.set_content(templates::assets::leaflet_css, "text/css; charset=utf-8");
+        });
+    }
+
+    TileCache cache(options.cache_bytes, options.cache_shards);
+    const std::string cache_control = "public, max-age=" + std::to_string(options.max_age);
+
+    // Prefetched tiles only pay off through the cache, and need connections
+    // of their own.
+    std::unique_ptr<Prefetcher> prefetcher;
+    if (options.prefetch && pool && options.cache_bytes > 0) {
+        prefetcher = std::make_unique<Prefetcher>(cache, opener, tile_format, maxZoomLevel().value_or(0),
+                                                  options.prefetch_threads, options.prefetch_queue);
+    }
+
+    // The viewer page always requests ".png" whatever the archive holds, so
+    // only serve mode insists on the extension matching the format.
+    const bool strict_extension = !viewer_pages && !tile_format.empty();
+
+    server.Get(R"(/tiles/(\d+)/(\d+)/(\d+)\.(\w+))",
+               [this, &db_mutex, &pool, &cache, &prefetcher, &cache_control, &tile_format, strict_extension,
+                viewer_pages](const httplib::Request &req, httplib::Response &res) {
+                   StageTimer timer(metrics_registry().http_request);
+                   if (!viewer_pages) {
+                       res.set_header("Access-Control-Allow-Origin", "*");
+                   }
+                   if (strict_extension && normalize_format(req.matches[4]) != tile_format) {
+                       res.status = 404;
+                       res.set_content("Archive does not contain '" + std::string(req.matches[4]) + "' tiles",
+                                       "text/plain; charset=utf-8");
                        return;
                    }
 
-                   const std::int64_t max_index = (static_cast<std::int64_t>(1) << zoom) - 1;
-                   if (column > max_index || row > max_index) {
-                       res.status = 404;
-                       res.set_content("Tile coordinates exceed range for zoom level", "text/plain; charset=utf-8");
+                   const auto coord = parse_tile_coordinates(req, 1, res);
+                   if (!coord) {
                        return;
                    }
+                   const int zoom = coord->zoom;
+                   const int column = coord->x;
+                   const int row = coord->y;
+                   if (prefetcher) {
+                       prefetcher->observe(req.remote_addr, zoom, column, row);
+                   }
 
-                   std::optional<std::string> tile_data;
-                   {
-                       std::lock_guard<std::mutex> lock(db_mutex);
-                       tile_data = tileData(zoom, column, row);
+                   const auto cache_key = TileCache::key(zoom, column, row);
+                   std::shared_ptr<const CachedTile> tile = cache_key ? cache.find(*cache_key) : nullptr;
+                   count_event(tile ? metrics_registry().cache_hits : metrics_registry().cache_misses);
+                   if (!tile) {
+                       auto load = [&](std::string_view payload) { tile = make_cached_tile(payload, tile_format); };
+                       if (pool) {
+                           auto connection = pool->acquire();
+                           with_tile(*connection, zoom, column, row, load);
+                       } else {
+                           std::lock_guard<std::mutex> lock(db_mutex);
+                           tileDataView(zoom, column, row, [&load](const TileView &view) {
+                               load(std::string_view(reinterpret_cast<const char *>(view.data), view.size));
+                           });
+                       }
+                       if (tile && cache_key) {
+                           cache.insert(*cache_key, tile);
+                       }
                    }
 
-                   if (!tile_data || tile_data->empty()) {
+                   if (!tile) {
                        res.status = 404;
                        res.set_content("Tile not found", "text/plain; charset=utf-8");
                        return;
                    }
 
-                   const std::string content_type = detect_content_type(*tile_data);
-                   res.set_header("Cache-Control", "no-store, max-age=0");
-                   res.set_content(*tile_data, content_type.c_str());
+                   send_tile(req, res, *tile, cache_control);
                });
 
-    std::cout << "Serving MBTiles viewer for '" << _name << "' on http://" << host << ':'
-              << port << "/map" << std::endl;
+    server.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+        res.set_content(metricsPrometheus(), "text/plain; version=0.0.4; charset=utf-8");
+    });
 
-    if (!server.listen(host.c_str(), port)) {
+    if (viewer_pages) {
+        std::cout << "Serving MBTiles viewer for '" << _name << "' on http://" << options.host << ':'
+                  << options.port << "/map" << std::endl;
+    } else {
+        std::cout << "Serving tiles of '" << _name << "' on http://" << options.host << ':' << options.port
+                  << "/tiles/{z}/{x}/{y}." << (tile_format.empty() ? std::string("{ext}") : tile_format)
+                  << " with " << worker_count << " worker threads" << std::endl;
+    }
+
+    if (!server.listen(options.host.c_str(), options.port)) {
         throw std::runtime_error("Failed to start HTTP server. Ensure the port is available.");
     }
 }
 
-}  // namespace mbtiles
+void MBTiles::serveTilesets(const std::string &source, const ViewerOptions &options,
+                            const OpenOptions &open_options) {
+    const std::size_t worker_count = options.threads != 0 ? options.threads : CPPHTTPLIB_THREAD_POOL_COUNT;
+    OpenOptions read_options = open_options;
+    read_options.read_only = true;
+    TilesetRegistry registry(
+        source, read_options,
+        [read_options](const std::string &path) { return openConnection(path, read_options, SQLITE_OPEN_NOMUTEX); },
+        options.max_open_tilesets, worker_count);
+
+    httplib::Server server;
+    configure_server(server, options, worker_count);
+
+    TileCache cache(options.cache_bytes, options.cache_shards);
+    const std::string cache_control = "public, max-age=" + std::to_string(options.max_age);
+    const std::string default_origin = "http://" + options.host + ':' + std::to_string(options.port);
+
+    // TileJSON "tiles" URLs follow the Host the client used, so they stay
+    // valid behind proxies and port forwards.
+    auto origin_of = [&default_origin](const httplib::Request &req) {
+        return req.has_header("Host") ? "http://" + req.get_header_value("Host") : default_origin;
+    };
 
+    // Unreadable archives answer 500 without taking the server down.
+    auto find_tileset = [&registry](const std::string &name,
+                                    httplib::Response &res) -> std::shared_ptr<const TilesetRegistry::Tileset> {
+        try {
+            if (auto tileset = registry.find(name)) {
+                return tileset;
+            }
+            res.status = 404;
+            res.set_content("Unknown tileset '" + name + "'", "text/plain; charset=utf-8");
+        } catch (const std::exception &e) {
+            res.status = 500;
+            res.set_content("Failed to open tileset '" + name + "': " + e.what(), "text/plain; charset=utf-8");
+        }
+        return nullptr;
+    };
+
+    server.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+        res.set_content(metricsPrometheus(), "text/plain; version=0.0.4; charset=utf-8");
+    });
+
+    server.Get("/", [&registry, &origin_of](const httplib::Request &req, httplib::Response &res) {
+        const std::string origin = origin_of(req);
+        std::string body = "[";
+        for (const auto &name : registry.names()) {
+            if (body.size() > 1) {
+                body += ',';
+            }
+            body += "{\"name\":" + json_string(name) + ",\"tilejson\":" + json_string(origin + '/' + name + ".json") +
+                    '}';
+        }
+        body += ']';
+        res.set_header("Access-Control-Allow-Origin", "*");
+        res.set_content(body, "application/json");
+    });
+
+    server.Get(R"(/([\w.-]+)\.json)", [&find_tileset, &origin_of](const httplib::Request &req,
+                                                               httplib::Response &res) {
+        res.set_header("Access-Control-Allow-Origin", "*");
+        const auto tileset = find_tileset(req.matches[1], res);
+        if (!tileset) {
+            return;
+        }
+        const std::string url = origin_of(req) + '/' + tileset->name + "/{z}/{x}/{y}." +
+                                (tileset->format.empty() ? std::string("png") : tileset->format);
+        res.set_content("{\"tiles\":[" + json_string(url) + "]," + tileset->tilejson + '}', "application/json");
+    });
+
+    server.Get(R"(/([\w.-]+)/(\d+)/(\d+)/(\d+)\.(\w+))", [&find_tileset, &cache, &cache_control](
+                                                              const httplib::Request &req, httplib::Response &res) {
+        StageTimer timer(metrics_registry().http_request);
+        res.set_header("Access-Control-Allow-Origin", "*");
+        const auto tileset = find_tileset(req.matches[1], res);
+        if (!tileset) {
+            return;
+        }
+        if (!tileset->format.empty() && normalize_format(req.matches[5]) != tileset->format) {
+            res.status = 404;
+            res.set_content("Tileset '" + tileset->name + "' does not contain '" + std::string(req.matches[5]) +
+                                "' tiles",
+                            "text/plain; charset=utf-8");
+            return;
+        }
+
+        const auto coord = parse_tile_coordinates(req, 2, res);
+        if (!coord) {
+            return;
+        }
+        const int zoom = coord->zoom;
+        const int column = coord->x;
+        const int row = coord->y;
+
+        const auto cache_key = TileCache::key(zoom, column, row, tileset->id);
+        std::shared_ptr<const CachedTile> tile = cache_key ? cache.find(*cache_key) : nullptr;
+        count_event(tile ? metrics_registry().cache_hits : metrics_registry().cache_misses);
+        if (!tile) {
+            auto connection = tileset->pool->acquire();
+            with_tile(*connection, zoom, column, row,
+                      [&](std::string_view payload) { tile = make_cached_tile(payload, tileset->format); });
+            if (tile && cache_key) {
+                cache.insert(*cache_key, tile);
+            }
+        }
+
+        if (!tile) {
+            res.status = 404;
+            res.set_content("Tile not found", "text/plain; charset=utf-8");
+            return;
+        }
+        send_tile(req, res, *tile, cache_control);
+    });
+
+    std::cout << "Serving tilesets of '" << source << "' on " << default_origin
+              << "/{tileset}/{z}/{x}/{y}.{ext} with " << worker_count << " worker threads, at most "
+              << std::max<std::size_t>(options.max_open_tilesets, 1) << " archives open" << std::endl;
+
+    if (!server.listen(options.host.c_str(), options.port)) {
+        throw std::runtime_error("Failed to start HTTP server. Ensure the port is available.");
+    }
+}
+
+}  // namespace mbtiles
@@ -21,17 +21,21 @@
 #include <arpa/inet.h>
 #include <sstream>
 
-// STB Image libraries for grayscale conversion
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include <map>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+
+#include "mbtiles.h"
 
 #define pi 3.1415926535
 
 struct TileCoord {
     int x;
     int y;
+    size_t index = 0;   // position in the sorted job list, keys JobState
 };
 
 // Function declarations
@@ -43,7 +47,7 @@ bool createDirectoryRecursive(const std::string& path);
 std::string getRandomBingServer();
 bool fileExists(const std::string& path);
 bool fileExistsAndValidSize(const std::string& path);
-bool convert_image_to_grayscale(const std::string& filename);
+bool convert_image_to_grayscale(std::string& body);
 std::vector<std::string> getSystemIPs();
 void initializeSystemIPs();
 std::vector<TileCoord> parseTileCoordinatesFromFile(const std::string& filename);
@@ -53,6 +57,11 @@ static double minLat, maxLat, minLon, maxLon;
 static int zoom;
 static std::string mapSource;
 static bool convertToGrayscale = false;
+// Direct-to-archive sink; when set, tiles skip the file tree entirely.
+static std::unique_ptr<mbtiles::MBTiles> outputArchive;
+static std::unique_ptr<mbtiles::TileWriter> tileWriter;
+static int maxRetries = 3;
+static bool checkExistingFiles = false;
 static std::atomic<int> successCount(0);
 static std::atomic<int> currentTile(0);
 static std::atomic<int> skippedCount(0);
@@ -72,25 +81,287 @@ static const std::vector<std::string> bingServers = {
     "t3.ssl.ak.tiles.virtualearth.net"
 };
 
-// Thread statistics structure
+// Tiles still to be fetched, shared by all engines. Each engine claims the
+// next tile when it has a free slot, so a slow engine or a run of 404s only
+// delays its own in-flight requests instead of a fixed share of the job.
+// Tiles that hit a transient error are handed back and served first; the
+// job is drained only once nothing is queued or still being worked on.
+class TileQueue {
+public:
+    enum class Status { TILE, WAIT, DRAINED };
+
+    explicit TileQueue(const std::vector<TileCoord>& tiles) : tiles(tiles) {}
+
+    Status pop(TileCoord& tile, int& attempts) {
+        {
+            std::lock_guard<std::mutex> lock(retryMutex);
+            if (!retries.empty()) {
+                tile = retries.front().first;
+                attempts = retries.front().second;
+                retries.pop_front();
+                return Status::TILE;
+            }
+        }
+        outstanding.fetch_add(1, std::memory_order_relaxed);
+        const size_t index = next.fetch_add(1, std::memory_order_relaxed);
+        if (index < tiles.size()) {
+            tile = tiles[index];
+            attempts = 0;
+            return Status::TILE;
+        }
+        return outstanding.fetch_sub(1, std::memory_order_relaxed) > 1 ? Status::WAIT : Status::DRAINED;
+    }
+
+    // Puts a claimed tile back for another attempt.
+    void retry(const TileCoord& tile, int attempts) {
+        std::lock_guard<std::mutex> lock(retryMutex);
+        retries.emplace_back(tile, attempts);
+    }
+
+    // Marks a claimed tile as finished, whatever the outcome.
+    void done() { outstanding.fetch_sub(1, std::memory_order_relaxed); }
+
+private:
+    const std::vector<TileCoord>& tiles;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> outstanding{0};
+    std::mutex retryMutex;
+    std::deque<std::pair<TileCoord, int>> retries;
+};
+
+// Per-host request limiter shared by all engines: a token bucket refilled at
+// `rate` requests per second with one second of burst, plus a backoff window
+// that 429/5xx responses open (doubling up to a minute, or the server's
+// Retry-After). A rate of 0 leaves only the backoff.
+class HostLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void setRate(double requestsPerSecond) { rate = requestsPerSecond; }
+
+    // Takes a token for `host`, or returns how long to wait for one.
+    Clock::duration acquire(const std::string& host) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto now = Clock::now();
+        Bucket& bucket = buckets[host];
+        if (now < bucket.blockedUntil) {
+            return bucket.blockedUntil - now;
+        }
+        if (rate <= 0) {
+            return Clock::duration::zero();
+        }
+        const double capacity = std::max(1.0, rate);
+        if (bucket.last == Clock::time_point{}) {
+            bucket.tokens = capacity;
+        } else {
+            bucket.tokens = std::min(capacity, bucket.tokens + rate * std::chrono::duration<double>(now - bucket.last).count());
+        }
+        bucket.last = now;
+        if (bucket.tokens >= 1.0) {
+            bucket.tokens -= 1.0;
+            return Clock::duration::zero();
+        }
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1.0 - bucket.tokens) / rate));
+    }
+
+    void success(const std::string& host) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buckets[host].backoff = std::chrono::seconds(0);
+    }
+
+    // Opens (or extends) the backoff window; returns its length.
+    std::chrono::seconds throttle(const std::string& host, std::chrono::seconds retryAfter) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Bucket& bucket = buckets[host];
+        const auto now = Clock::now();
+        if (now < bucket.blockedUntil) {
+            // Responses to requests sent before the window opened
+            return std::chrono::ceil<std::chrono::seconds>(bucket.blockedUntil - now);
+        }
+        bucket.backoff = bucket.backoff.count() == 0 ? std::chrono::seconds(1)
+                                                     : std::min(bucket.backoff * 2, std::chrono::seconds(60));
+        const auto wait = std::max(bucket.backoff, retryAfter);
+        bucket.blockedUntil = now + wait;
+        bucket.tokens = 0;
+        return wait;
+    }
+
+private:
+    struct Bucket {
+        double tokens = 0;
+        Clock::time_point last{};
+        Clock::time_point blockedUntil{};
+        std::chrono::seconds backoff{0};
+    };
+
+    std::mutex mutex;
+    double rate = 0;
+    std::unordered_map<std::string, Bucket> buckets;
+};
+
+// Job progress, two bits per tile of the sorted job list, saved next to the
+// output so a restart skips finished tiles with a bit lookup instead of a
+// stat() or query per tile. The file header carries a fingerprint of the
+// tile list, so state from a different job is ignored.
+class JobState {
+public:
+    enum State : uint8_t { PENDING = 0, DONE = 1, FAILED = 2, RETRY = 3 };
+
+    JobState(const std::vector<TileCoord>& sortedTiles, int zoom)
+        : count(sortedTiles.size()), bytes((sortedTiles.size() + 3) / 4),
+          bits(new std::atomic<uint8_t>[(sortedTiles.size() + 3) / 4]) {
+        for (size_t i = 0; i < bytes; i++) {
+            bits[i].store(0, std::memory_order_relaxed);
+        }
+        // FNV-1a over the zoom and coordinates
+        fingerprint = 1469598103934665603ULL;
+        auto mix = [this](uint64_t value) {
+            fingerprint = (fingerprint ^ value) * 1099511628211ULL;
+        };
+        mix(static_cast<uint64_t>(zoom));
+        for (const auto& tile : sortedTiles) {
+            mix((static_cast<uint64_t>(static_cast<uint32_t>(tile.x)) << 32) | static_cast<uint32_t>(tile.y));
+        }
+    }
+
+    State get(size_t index) const {
+        return static_cast<State>((bits[index / 4].load(std::memory_order_relaxed) >> ((index % 4) * 2)) & 3);
+    }
+
+    void set(size_t index, State state) {
+        const int shift = (index % 4) * 2;
+        auto& byte = bits[index / 4];
+        uint8_t old = byte.load(std::memory_order_relaxed);
+        while (!byte.compare_exchange_weak(old, static_cast<uint8_t>((old & ~(3 << shift)) | (state << shift)),
+                                           std::memory_order_relaxed)) {
+        }
+    }
+
+    // Turns every tile in `from` back to `to` (e.g. failed tiles on --retry-failed).
+    void replace(State from, State to) {
+        for (size_t i = 0; i < count; i++) {
+            if (get(i) == from) {
+                set(i, to);
+            }
+        }
+    }
+
+    size_t countOf(State state) const {
+        size_t n = 0;
+        for (size_t i = 0; i < count; i++) {
+            n += get(i) == state;
+        }
+        return n;
+    }
+
+    // Returns false when the file is missing or belongs to another job.
+    bool load(const std::string& path) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp) {
+            return false;
+        }
+        char magic[8];
+        uint64_t fileFingerprint = 0, fileCount = 0;
+        bool ok = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, kMagic, sizeof(magic)) == 0 &&
+                  fread(&fileFingerprint, sizeof(fileFingerprint), 1, fp) == 1 && fileFingerprint == fingerprint &&
+                  fread(&fileCount, sizeof(fileCount), 1, fp) == 1 && fileCount == count;
+        std::vector<uint8_t> buffer(bytes);
+        ok = ok && fread(buffer.data(), 1, bytes, fp) == bytes;
+        fclose(fp);
+        if (ok) {
+            for (size_t i = 0; i < bytes; i++) {
+                bits[i].store(buffer[i], std::memory_order_relaxed);
+            }
+        }
+        return ok;
+    }
+
+    // Writes through a temporary file so a crash never leaves a torn state.
+    bool save(const std::string& path) const {
+        std::vector<uint8_t> buffer(bytes);
+        for (size_t i = 0; i < bytes; i++) {
+            buffer[i] = bits[i].load(std::memory_order_relaxed);
+        }
+        const std::string temp = path + ".tmp";
+        FILE* fp = fopen(temp.c_str(), "wb");
+        if (!fp) {
+            return false;
+        }
+        const uint64_t fileCount = count;
+        bool ok = fwrite(kMagic, sizeof(kMagic), 1, fp) == 1 &&
+                  fwrite(&fingerprint, sizeof(fingerprint), 1, fp) == 1 &&
+                  fwrite(&fileCount, sizeof(fileCount), 1, fp) == 1 &&
+                  fwrite(buffer.data(), 1, bytes, fp) == bytes;
+        ok = fclose(fp) == 0 && ok;
+        return ok && rename(temp.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'T', 'D', 'J', 'O', 'B', '0', '0', '1'};
+
+    size_t count;
+    size_t bytes;
+    std::unique_ptr<std::atomic<uint8_t>[]> bits;
+    uint64_t fingerprint = 0;
+};
+
+static HostLimiter hostLimiter;
+static std::unique_ptr<JobState> jobState;
+static std::string jobStatePath;
+static std::mutex jobStateMutex;
+
+void saveJobState() {
+    if (!jobState) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(jobStateMutex);
+    if (!jobState->save(jobStatePath)) {
+        std::lock_guard<std::mutex> coutLock(coutMutex);
+        std::cerr << "Warning: failed to save job state to " << jobStatePath << std::endl;
+    }
+}
+
+// Row-major order of the job list that JobState indexes.
+bool tileOrder(const TileCoord& a, const TileCoord& b) {
+    return a.y != b.y ? a.y < b.y : a.x < b.x;
+}
+
+// Host part of a tile URL, the key for rate limiting.
+std::string urlHost(const std::string& url) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    const size_t end = url.find('/', start);
+    return url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+}
+
+// Per-engine statistics: each engine thread drives many transfers over
+// the connections its multi handle keeps open.
 struct ThreadStats {
     int downloadCount;
     long long downloadSize;
+    int inFlight;
+    long newConnections;
 };
 
-// Progress tracking structure
-struct DownloadProgress {
-    std::ofstream* stream;
-    long long* downloadSize;
-    size_t lastSize;
+// One in-flight request. The body is buffered and written to disk only once
+// the transfer succeeded, so failures never leave truncated tiles behind.
+struct Transfer {
+    CURL* easy = nullptr;
+    TileCoord tile{};
+    int attempts = 0;
+    std::string filename;
+    std::string url;
+    std::string host;
+    std::string body;
+    ThreadStats* stats = nullptr;
 };
 
-// Custom write callback to track download size
-static size_t WriteCallbackWithProgress(void* contents, size_t size, size_t nmemb, void* userp) {
+static size_t WriteCallbackToBuffer(void* contents, size_t size, size_t nmemb, void* userp) {
     size_t realsize = size * nmemb;
-    DownloadProgress* progress = (DownloadProgress*)userp;
-    progress->stream->write((char*)contents, realsize);
-    *(progress->downloadSize) += realsize;
+    Transfer* transfer = (Transfer*)userp;
+    transfer->body.append((const char*)contents, realsize);
+    std::lock_guard<std::mutex> lock(statsMutex);
+    transfer->stats->downloadSize += realsize;
     return realsize;
 }
 
@@ -99,6 +370,7 @@ void displayProgress(int numThreads, const std::vector<ThreadStats>& threadStats
     auto lastUpdate = std::chrono::steady_clock::now();
     std::vector<int> lastCounts(numThreads, 0);
     std::vector<long long> lastSizes(numThreads, 0);
+    auto lastCheckpoint = std::chrono::steady_clock::now();
     
     std::this_thread::sleep_for(std::chrono::seconds(1));
 
@@ -134,10 +406,18 @@ void displayProgress(int numThreads, const std::vector<ThreadStats>& threadStats
                      << " | Unsuccessful: " << std::setprecision(0) << unsuccessfulCount << "\n"
                      << " | Elapsed: " << std::setprecision(0) << totalElapsed << "s\n";
             
-            // Display thread-specific rates
+            // Display engine-specific rates
             for (int i = 0; i < numThreads; i++) {
-                int currentCount = threadStats[i].downloadCount;
-                long long currentSize = threadStats[i].downloadSize;
+                int currentCount, inFlight;
+                long long currentSize;
+                long newConnections;
+                {
+                    std::lock_guard<std::mutex> statsLock(statsMutex);
+                    currentCount = threadStats[i].downloadCount;
+                    currentSize = threadStats[i].downloadSize;
+                    inFlight = threadStats[i].inFlight;
+                    newConnections = threadStats[i].newConnections;
+                }
                 
                 int deltaCount = currentCount - lastCounts[i];
                 long long deltaSize = currentSize - lastSizes[i];
@@ -145,9 +425,11 @@ void displayProgress(int numThreads, const std::vector<ThreadStats>& threadStats
                 double rateTiles = (elapsed > 0) ? deltaCount / elapsed : 0.0;
                 double rateBytes = (elapsed > 0) ? deltaSize / elapsed : 0.0;
                 
-                std::cout << "Thread " << (i + 1) << ": " << currentCount << " tiles"
+                std::cout << "Engine " << (i + 1) << ": " << currentCount << " tiles"
                          << " | " << std::setprecision(1) << rateTiles << " tiles/sec"
-                         << " | " << std::setprecision(1) << (rateBytes / 1024.0) << " KB/s\n";
+                         << " | " << std::setprecision(1) << (rateBytes / 1024.0) << " KB/s"
+                         << " | in flight: " << inFlight
+                         << " | connections opened: " << newConnections << "\n";
                 
                 lastCounts[i] = currentCount;
                 lastSizes[i] = currentSize;
@@ -163,6 +445,11 @@ void displayProgress(int numThreads, const std::vector<ThreadStats>& threadStats
             
             lastUpdate = now;
         }
+
+        if (now - lastCheckpoint >= std::chrono::seconds(30)) {
+            saveJobState();
+            lastCheckpoint = now;
+        }
     }
 }
 
@@ -211,158 +498,282 @@ void initializeSystemIPs() {
     }
 }
 
-// Thread worker function
-void downloadWorker(const std::vector<TileCoord>& tiles, int threadId, const std::string& outputDir, ThreadStats& stats) {
-    activeThreads++;
-    
-    // Initialize CURL for this thread
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        std::lock_guard<std::mutex> lock(coutMutex);
-        std::cerr << "Thread " << threadId << ": Failed to initialize CURL" << std::endl;
-        activeThreads--;
-        return;
+std::string tileUrl(const TileCoord& tile) {
+    if (mapSource == "bing") {
+        std::string quadKey = tileXYToQuadKey(tile.x, tile.y, zoom);
+        std::string server = getRandomBingServer();
+        return "https://" + server + "/tiles/a" + quadKey + ".jpeg?g=1398";
+    }
+    if (mapSource == "google-sat") {
+        return "http://khm.google.com/kh/v=1000&x=" + std::to_string(tile.x) +
+               "&y=" + std::to_string(tile.y) + "&z=" + std::to_string(zoom);
     }
+    return "http://khm.google.com/vt/lbw/lyrs=y&hl=x-local&x=" + std::to_string(tile.x) +
+           "&y=" + std::to_string(tile.y) + "&z=" + std::to_string(zoom);
+}
 
-    // Set common CURL options
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0");
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 40L);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 20L);
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // Prevent signals from interrupting curl
+// Final state of one attempt at a tile.
+enum class Outcome { STORED, FAILED, RETRY };
+
+// Handles a finished transfer: checks the result, stores the tile and
+// updates the counters. 429/5xx responses throttle the host and ask for a
+// retry; other HTTP errors (404 for tiles outside the coverage) are final.
+Outcome completeTransfer(Transfer& transfer, CURLcode res, int threadId) {
+    long newConnections = 0;
+    curl_easy_getinfo(transfer.easy, CURLINFO_NUM_CONNECTS, &newConnections);
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        transfer.stats->newConnections += newConnections;
+    }
 
-    auto workStartTime = std::chrono::steady_clock::now();
-    int processedInThisWorkPeriod = 0;
+    if (res != CURLE_OK) {
+        std::lock_guard<std::mutex> lock(coutMutex);
+        std::cerr << "Engine " << threadId << ": transfer failed: " << curl_easy_strerror(res) << std::endl;
+        return Outcome::RETRY;
+    }
 
-    for (size_t i = 0; i < tiles.size(); i++) {
-        const auto& tile = tiles[i];
-        int tileNumber = ++currentTile;
-        
-        // Check if we need to take a break (every 5 minutes of work)
-        auto now = std::chrono::steady_clock::now();
-        auto workDuration = std::chrono::duration_cast<std::chrono::minutes>(now - workStartTime);
-        
-        if (workDuration.count() >= 5 && processedInThisWorkPeriod > 0) {
-            {
-                std::lock_guard<std::mutex> lock(coutMutex);
-                std::cout << "Thread " << threadId << ": Worked for " << workDuration.count() 
-                        << " minutes, taking 1 minute break..." << std::endl;
-            }
-            
-            std::this_thread::sleep_for(std::chrono::minutes(1));
-            
-            workStartTime = std::chrono::steady_clock::now();
-            processedInThisWorkPeriod = 0;
-        }
+    long http_code = 0;
+    curl_easy_getinfo(transfer.easy, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code == 429 || http_code >= 500) {
+        curl_off_t retryAfter = 0;
+        curl_easy_getinfo(transfer.easy, CURLINFO_RETRY_AFTER, &retryAfter);
+        const auto wait = hostLimiter.throttle(transfer.host, std::chrono::seconds(retryAfter));
+        std::lock_guard<std::mutex> lock(coutMutex);
+        std::cerr << "Engine " << threadId << ": HTTP " << http_code << " from " << transfer.host
+                  << ", backing off " << wait.count() << "s" << std::endl;
+        return Outcome::RETRY;
+    }
+    if (http_code != 200) {
+        std::lock_guard<std::mutex> lock(coutMutex);
+        std::cerr << "Engine " << threadId << ": HTTP request failed with code: " << http_code << std::endl;
+        return Outcome::FAILED;
+    }
+    hostLimiter.success(transfer.host);
 
-        // Create directory structure
-        std::string xDir = outputDir + "/" + std::to_string(zoom) + "/" + std::to_string(tile.x);
-        if (!createDirectoryRecursive(xDir)) {
+    if (convertToGrayscale) {
+        if (!convert_image_to_grayscale(transfer.body)) {
             std::lock_guard<std::mutex> lock(coutMutex);
-            std::cerr << "Thread " << threadId << ": Failed to create directory: " << xDir << std::endl;
-            continue;
+            std::cerr << "Engine " << threadId << ": Warning: Failed to convert tile to grayscale: "
+                      << zoom << "/" << transfer.tile.x << "/" << transfer.tile.y << std::endl;
         }
+    }
 
-        std::string filename = xDir + "/" + std::to_string(tile.y) + ".jpg";
-        
-        // Check if file already exists
-        if (fileExistsAndValidSize(filename)) {
+    if (tileWriter) {
+        try {
+            tileWriter->write(zoom, transfer.tile.x, transfer.tile.y,
+                              std::vector<unsigned char>(transfer.body.begin(), transfer.body.end()));
+        } catch (const std::exception& e) {
             std::lock_guard<std::mutex> lock(coutMutex);
-            //std::cout << "Tile " << tileNumber << " of " << totalTiles 
-            //         << " (X=" << tile.x << ", Y=" << tile.y << ") already exists. Skipping.\n";
-            skippedCount++;
-            continue;
+            std::cerr << "Engine " << threadId << ": Failed to store tile: " << e.what() << std::endl;
+            return Outcome::RETRY;
         }
-
-        /*{
-            std::lock_guard<std::mutex> lock(coutMutex);
-            std::cout << "Thread " << threadId << ": Downloading tile " << tileNumber << " of " << totalTiles 
-                     << " (X=" << tile.x << ", Y=" << tile.y << ")...\n";
-        }*/
-        
-        // Apply IP rotation strategy
-        if (!systemIPs.empty()) {
-            int currentActiveThreads = activeThreads.load();
-            int ip_index = (currentActiveThreads - 1) % systemIPs.size();
-            
-            std::lock_guard<std::mutex> lock(ipMutex);
-            curl_easy_setopt(curl, CURLOPT_INTERFACE, systemIPs[ip_index].c_str());
-            
-            // Optional: Debug output to see which IP is being used
-            // std::cout << "Thread " << threadId << " using IP: " << systemIPs[ip_index] << std::endl;
-        }
-        
-        // Download the tile
-        std::string url;
-        if (mapSource == "bing") {
-            std::string quadKey = tileXYToQuadKey(tile.x, tile.y, zoom);
-            std::string server = getRandomBingServer();
-            url = "https://" + server + "/tiles/a" + quadKey + ".jpeg?g=1398";
-        }
-        else if (mapSource == "google-sat") {
-            url = "http://khm.google.com/kh/v=1000&x=" + std::to_string(tile.x) + 
-                  "&y=" + std::to_string(tile.y) + "&z=" + std::to_string(zoom);
-        }
-        else if (mapSource == "google-hybrid") {
-            url = "http://khm.google.com/vt/lbw/lyrs=y&hl=x-local&x=" + std::to_string(tile.x) + 
-                  "&y=" + std::to_string(tile.y) + "&z=" + std::to_string(zoom);
-        }
-
-        std::ofstream outputFile(filename, std::ios::binary);
+    } else {
+        std::ofstream outputFile(transfer.filename, std::ios::binary);
         if (!outputFile.is_open()) {
             std::lock_guard<std::mutex> lock(coutMutex);
-            std::cerr << "Thread " << threadId << ": Failed to open file: " << filename << std::endl;
-            continue;
+            std::cerr << "Engine " << threadId << ": Failed to open file: " << transfer.filename << std::endl;
+            return Outcome::RETRY;
         }
+        outputFile.write(transfer.body.data(), transfer.body.size());
+        outputFile.close();
+    }
 
-        // Set up progress tracking
-        long long downloadSize = 0;
-        DownloadProgress progress = {&outputFile, &downloadSize, 0};
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        transfer.stats->downloadCount++;
+    }
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallbackWithProgress);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &progress);
+    successCount++;
+    return Outcome::STORED;
+}
 
-        CURLcode res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            std::lock_guard<std::mutex> lock(coutMutex);
-            std::cerr << "Thread " << threadId << ": curl_easy_perform() failed: " << curl_easy_strerror(res) << std::endl;
-            unsuccessfulCount++;
-            outputFile.close();
-            continue;
-        }
+// Records the outcome of an attempt: retryable failures go back to the
+// queue until --retries is exhausted, after which the tile is left in the
+// RETRY state for the next run.
+void finishTile(TileQueue& queue, const TileCoord& tile, int attempts, Outcome outcome) {
+    if (outcome == Outcome::RETRY && attempts < maxRetries) {
+        queue.retry(tile, attempts + 1);
+        return;
+    }
+    if (outcome != Outcome::STORED) {
+        unsuccessfulCount++;
+    }
+    if (jobState) {
+        jobState->set(tile.index, outcome == Outcome::STORED   ? JobState::DONE
+                                  : outcome == Outcome::FAILED ? JobState::FAILED
+                                                               : JobState::RETRY);
+    }
+    queue.done();
+}
 
-        long http_code = 0;
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        if (http_code != 200) {
-            std::lock_guard<std::mutex> lock(coutMutex);
-            std::cerr << "Thread " << threadId << ": HTTP request failed with code: " << http_code << std::endl;
-            unsuccessfulCount++;
-            outputFile.close();
+// Event-driven download engine: one curl multi handle per thread keeps up to
+// `concurrency` transfers in flight, reusing connections per host and
+// multiplexing them over HTTP/2 where the server supports it, so a thread
+// never sits idle waiting for a single round trip.
+void downloadEngine(TileQueue& queue, int threadId, const std::string& outputDir, ThreadStats& stats, int concurrency) {
+    activeThreads++;
+
+    CURLM* multi = curl_multi_init();
+    if (!multi) {
+        std::lock_guard<std::mutex> lock(coutMutex);
+        std::cerr << "Engine " << threadId << ": Failed to initialize CURL multi handle" << std::endl;
+        activeThreads--;
+        return;
+    }
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, 8L);
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(concurrency));
+
+    // Easy handles are recycled between transfers; the multi handle's
+    // connection cache keeps the sockets alive across them.
+    std::vector<Transfer> transfers(concurrency);
+    std::vector<Transfer*> idle;
+    for (auto& transfer : transfers) {
+        transfer.easy = curl_easy_init();
+        if (!transfer.easy) {
             continue;
         }
+        transfer.stats = &stats;
+        curl_easy_setopt(transfer.easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(transfer.easy, CURLOPT_USERAGENT, "Mozilla/5.0");
+        curl_easy_setopt(transfer.easy, CURLOPT_TIMEOUT, 40L);
+        curl_easy_setopt(transfer.easy, CURLOPT_CONNECTTIMEOUT, 20L);
+        curl_easy_setopt(transfer.easy, CURLOPT_NOSIGNAL, 1L); // Prevent signals from interrupting curl
+        curl_easy_setopt(transfer.easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(transfer.easy, CURLOPT_PIPEWAIT, 1L);
+        curl_easy_setopt(transfer.easy, CURLOPT_WRITEFUNCTION, WriteCallbackToBuffer);
+        curl_easy_setopt(transfer.easy, CURLOPT_WRITEDATA, &transfer);
+        curl_easy_setopt(transfer.easy, CURLOPT_PRIVATE, &transfer);
+        if (!systemIPs.empty()) {
+            // Apply IP rotation strategy: each engine sends from its own address
+            std::lock_guard<std::mutex> lock(ipMutex);
+            curl_easy_setopt(transfer.easy, CURLOPT_INTERFACE, systemIPs[(threadId - 1) % systemIPs.size()].c_str());
+        }
+        idle.push_back(&transfer);
+    }
+    const size_t slots = idle.size();
+
+    bool queueDrained = slots == 0;
+    int running = 0;
+
+    // A claimed tile whose host has no token yet; it goes out first once the
+    // limiter allows it
+    bool holding = false;
+    TileCoord held{};
+    int heldAttempts = 0;
+    std::string heldUrl;
+
+    while (!queueDrained || holding || idle.size() < slots) {
+        // Top up the in-flight set
+        int waitMs = 1000;
+        while (!idle.empty()) {
+            if (!holding) {
+                if (queueDrained) {
+                    break;
+                }
+                const TileQueue::Status status = queue.pop(held, heldAttempts);
+                if (status == TileQueue::Status::DRAINED) {
+                    queueDrained = true;
+                    break;
+                }
+                if (status == TileQueue::Status::WAIT) {
+                    // Other engines still hold tiles that may come back for a retry
+                    waitMs = 100;
+                    break;
+                }
+                if (heldAttempts == 0) {
+                    ++currentTile;
+                }
+                if (jobState && jobState->get(held.index) != JobState::PENDING) {
+                    skippedCount++;
+                    queue.done();
+                    continue;
+                }
+                heldUrl = tileUrl(held);
+                holding = true;
+            }
 
-        outputFile.close();
+            const auto wait = hostLimiter.acquire(urlHost(heldUrl));
+            if (wait > std::chrono::steady_clock::duration::zero()) {
+                waitMs = static_cast<int>(std::min<long long>(
+                    waitMs, std::max<long long>(1, std::chrono::duration_cast<std::chrono::milliseconds>(wait).count())));
+                break;
+            }
+            holding = false;
+            const TileCoord tile = held;
+
+            std::string filename;
+            if (!tileWriter) {
+                // Create directory structure
+                std::string xDir = outputDir + "/" + std::to_string(zoom) + "/" + std::to_string(tile.x);
+                if (!createDirectoryRecursive(xDir)) {
+                    std::lock_guard<std::mutex> lock(coutMutex);
+                    std::cerr << "Engine " << threadId << ": Failed to create directory: " << xDir << std::endl;
+                    finishTile(queue, tile, maxRetries, Outcome::RETRY);
+                    continue;
+                }
+
+                filename = xDir + "/" + std::to_string(tile.y) + ".jpg";
+
+                // Without saved job state (first run over an existing tree) the
+                // files themselves tell which tiles are done
+                if (checkExistingFiles && fileExistsAndValidSize(filename)) {
+                    skippedCount++;
+                    finishTile(queue, tile, 0, Outcome::STORED);
+                    continue;
+                }
+            }
 
-        // Update download statistics
+            Transfer* transfer = idle.back();
+            idle.pop_back();
+            transfer->tile = tile;
+            transfer->attempts = heldAttempts;
+            transfer->filename = std::move(filename);
+            transfer->url = std::move(heldUrl);
+            transfer->host = urlHost(transfer->url);
+            transfer->body.clear();
+            curl_easy_setopt(transfer->easy, CURLOPT_URL, transfer->url.c_str());
+            curl_multi_add_handle(multi, transfer->easy);
+        }
         {
             std::lock_guard<std::mutex> lock(statsMutex);
-            stats.downloadCount++;
-            stats.downloadSize += downloadSize;
+            stats.inFlight = static_cast<int>(slots - idle.size());
         }
+        curl_multi_perform(multi, &running);
 
-        if (convertToGrayscale) {
-            if (!convert_image_to_grayscale(filename)) {
-                std::lock_guard<std::mutex> lock(coutMutex);
-                std::cerr << "Thread " << threadId << ": Warning: Failed to convert tile to grayscale: " << filename << std::endl;
+        int queued = 0;
+        bool completed = false;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
             }
+            Transfer* transfer = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&transfer);
+            const CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            finishTile(queue, transfer->tile, transfer->attempts, completeTransfer(*transfer, res, threadId));
+            transfer->body.clear();
+            transfer->body.shrink_to_fit();
+            idle.push_back(transfer);
+            completed = true;
         }
 
-        successCount++;
-        processedInThisWorkPeriod++;
+        if (!completed && (!queueDrained || holding || idle.size() < slots)) {
+            // Waits for socket activity, or for the limiter / retry delay
+            curl_multi_poll(multi, nullptr, 0, running > 0 ? std::min(waitMs, 1000) : waitMs, nullptr);
+        }
     }
 
-    curl_easy_cleanup(curl);
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.inFlight = 0;
+    }
+    for (auto& transfer : transfers) {
+        if (transfer.easy) {
+            curl_easy_cleanup(transfer.easy);
+        }
+    }
+    curl_multi_cleanup(multi);
     activeThreads--;
 }
 
@@ -417,8 +828,16 @@ int main(int argc, char *argv[]) {
     // Parse command line arguments
     if (argc < 4) {
         std::cout << "Usage:\n"
-                  << "  Mode 1 (Lat/Lon bounds): ./tile_downloader minLat maxLat minLon maxLon zoom mapSource numThreads [--grayscale]\n"
-                  << "  Mode 2 (Tile file): ./tile_downloader --file tile_file.txt mapSource numThreads [--grayscale]\n"
+                  << "  Mode 1 (Lat/Lon bounds): ./tile_downloader minLat maxLat minLon maxLon zoom mapSource numThreads [options]\n"
+                  << "  Mode 2 (Tile file): ./tile_downloader --file tile_file.txt mapSource numThreads [options]\n"
+                  << "Options: [--grayscale] [--concurrency N] [--mbtiles out.mbtiles] [--rate R] [--retries N]\n"
+                  << "         [--state file] [--retry-failed]\n"
+                  << "numThreads is the number of download engines; each keeps up to N requests in flight (default 32).\n"
+                  << "--mbtiles stores tiles straight into an MBTiles archive instead of a z/x/y directory.\n"
+                  << "--rate caps requests per second per host (default: no cap); 429/5xx responses back off\n"
+                  << "  and are retried up to --retries times (default 3).\n"
+                  << "Progress is saved to --state (default: next to the output) so a rerun resumes; tiles that\n"
+                  << "  failed for good (e.g. 404) are skipped on rerun unless --retry-failed is given.\n"
                   << "Examples:\n"
                   << "  ./tile_downloader 40.7 40.8 -74.0 -73.9 12 bing 4 --grayscale\n"
                   << "  ./tile_downloader --file tiles.txt bing 4 --grayscale\n"
@@ -473,6 +892,39 @@ int main(int argc, char *argv[]) {
         mapSource = argv[6];
     }
 
+    int concurrency = 32;
+    double rate = 0;
+    bool retryFailed = false;
+    std::string mbtilesPath;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--retry-failed") == 0) {
+            retryFailed = true;
+        }
+        if (i + 1 >= argc) {
+            continue;
+        }
+        if (strcmp(argv[i], "--concurrency") == 0) {
+            concurrency = std::stoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--mbtiles") == 0) {
+            mbtilesPath = argv[i + 1];
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            rate = std::stod(argv[i + 1]);
+        } else if (strcmp(argv[i], "--retries") == 0) {
+            maxRetries = std::stoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--state") == 0) {
+            jobStatePath = argv[i + 1];
+        }
+    }
+    if (concurrency < 1) {
+        std::cerr << "Concurrency must be at least 1" << std::endl;
+        return 1;
+    }
+    if (rate < 0 || maxRetries < 0) {
+        std::cerr << "--rate and --retries must not be negative" << std::endl;
+        return 1;
+    }
+    hostLimiter.setRate(rate);
+
     // Validate map source
     if (mapSource != "bing" && mapSource != "google-sat" && mapSource != "google-hybrid") {
         std::cerr << "Unsupported map source: " << mapSource << std::endl;
@@ -485,7 +937,8 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    std::cout << "Using " << numThreads << " threads for downloading" << std::endl;
+    std::cout << "Using " << numThreads << " download engines with up to " << concurrency
+              << " requests in flight each" << std::endl;
 
     // Initialize system IP addresses
     initializeSystemIPs();
@@ -494,7 +947,7 @@ int main(int argc, char *argv[]) {
     curl_global_init(CURL_GLOBAL_DEFAULT);
 
     std::string outputDir = mapSource + "_tiles";
-    if (!createDirectoryRecursive(outputDir)) {
+    if (mbtilesPath.empty() && !createDirectoryRecursive(outputDir)) {
         std::cerr << "Failed to create base directory: " << outputDir << std::endl;
         return 1;
     }
@@ -545,20 +998,65 @@ int main(int argc, char *argv[]) {
     // Initialize thread statistics
     std::vector<ThreadStats> threadStats(numThreads);
     for (int i = 0; i < numThreads; i++) {
-        threadStats[i] = {0, 0};
+        threadStats[i] = {0, 0, 0, 0};
+    }
+
+    // Index the job in a stable order for the job state, then shuffle
+    std::sort(allTiles.begin(), allTiles.end(), tileOrder);
+    allTiles.erase(std::unique(allTiles.begin(), allTiles.end(),
+                               [](const TileCoord& a, const TileCoord& b) { return a.x == b.x && a.y == b.y; }),
+                   allTiles.end());
+    totalTiles = allTiles.size();
+    for (size_t i = 0; i < allTiles.size(); i++) {
+        allTiles[i].index = i;
+    }
+    jobState = std::make_unique<JobState>(allTiles, zoom);
+    if (jobStatePath.empty()) {
+        jobStatePath = (mbtilesPath.empty() ? outputDir + "/" + std::to_string(zoom) : mbtilesPath) + ".jobstate";
+    }
+    const bool resumed = jobState->load(jobStatePath);
+
+    if (!mbtilesPath.empty()) {
+        try {
+            outputArchive = std::make_unique<mbtiles::MBTiles>(mbtilesPath);
+            // The writer creates the schema for a fresh archive
+            tileWriter = std::make_unique<mbtiles::TileWriter>(*outputArchive);
+            // Only committed tiles count as done, whatever the saved state says
+            jobState->replace(JobState::DONE, JobState::PENDING);
+            mbtiles::TileIteratorOptions level;
+            level.min_zoom = zoom;
+            level.max_zoom = zoom;
+            auto it = outputArchive->tiles(level);
+            while (auto tile = it.nextView()) {
+                const TileCoord key{tile->x, tile->y};
+                auto found = std::lower_bound(allTiles.begin(), allTiles.end(), key, tileOrder);
+                if (found != allTiles.end() && found->x == key.x && found->y == key.y) {
+                    jobState->set(found->index, JobState::DONE);
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Writing tiles to '" << mbtilesPath << "'" << std::endl;
+    } else {
+        checkExistingFiles = !resumed;
     }
+    if (retryFailed) {
+        jobState->replace(JobState::FAILED, JobState::PENDING);
+    }
+    // Tiles out of retries last run get a fresh budget
+    jobState->replace(JobState::RETRY, JobState::PENDING);
+    std::cout << (resumed ? "Resuming from " : "Saving progress to ") << jobStatePath << ": "
+              << jobState->countOf(JobState::DONE) << " done, " << jobState->countOf(JobState::FAILED)
+              << " failed" << std::endl;
 
-    // Shuffle the tile list
     std::random_device rd;
     std::mt19937 g(rd());
     std::shuffle(allTiles.begin(), allTiles.end(), g);
     std::cout << "Shuffled " << allTiles.size() << " tiles for download" << std::endl;
 
-    // Divide tiles among threads
-    std::vector<std::vector<TileCoord>> threadTiles(numThreads);
-    for (size_t i = 0; i < allTiles.size(); i++) {
-        threadTiles[i % numThreads].push_back(allTiles[i]);
-    }
+    TileQueue queue(allTiles);
 
     // Create space for progress display
     for (int i = 0; i < numThreads + 2; i++) {
@@ -570,7 +1068,7 @@ int main(int argc, char *argv[]) {
     // Create and start download threads
     std::vector<std::thread> threads;
     for (int i = 0; i < numThreads; i++) {
-        threads.emplace_back(downloadWorker, threadTiles[i], i + 1, outputDir, std::ref(threadStats[i]));
+        threads.emplace_back(downloadEngine, std::ref(queue), i + 1, outputDir, std::ref(threadStats[i]), concurrency);
     }
 
     // Start progress display thread
@@ -590,6 +1088,32 @@ int main(int argc, char *argv[]) {
     // Wait for progress thread to finish
     progressThread.join();
 
+    if (tileWriter) {
+        try {
+            tileWriter->finish();
+            tileWriter.reset();
+            // Done bits can be trusted once the tiles are committed
+            saveJobState();
+            std::map<std::string, std::string> entries{{"format", "jpg"}};
+            // No zoom range when no tile was stored (all failed or skipped).
+            if (const auto minZoom = outputArchive->minZoomLevel()) {
+                entries["minzoom"] = std::to_string(*minZoom);
+                entries["maxzoom"] = std::to_string(*outputArchive->maxZoomLevel());
+            }
+            outputArchive->setMetadata(entries);
+            if (outputArchive->metadata().count("name") == 0) {
+                outputArchive->setMetadata("name", mapSource);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Failed to finish '" << mbtilesPath << "': " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    if (mbtilesPath.empty()) {
+        saveJobState();
+    }
+
     // Final summary
     auto totalElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - programStartTime).count();
     double overallRate = (totalElapsed > 0) ? (successCount + skippedCount) / totalElapsed : 0.0;
@@ -605,34 +1129,17 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
-bool convert_image_to_grayscale(const std::string& filename) {
-    int width, height, channels;
-    unsigned char* data = stbi_load(filename.c_str(), &width, &height, &channels, 0);
-    if (!data) {
-        std::cerr << "Failed to load image for grayscale conversion: " << filename << std::endl;
+// Re-encodes a downloaded tile in place as a single-channel JPEG.
+bool convert_image_to_grayscale(std::string& body) {
+    try {
+        mbtiles::RGBAImage image(reinterpret_cast<const unsigned char*>(body.data()), static_cast<int>(body.size()));
+        const std::vector<unsigned char> gray = image.encodeGrayJpg(100);
+        body.assign(gray.begin(), gray.end());
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Failed to convert image to grayscale: " << e.what() << std::endl;
         return false;
     }
-
-    std::vector<unsigned char> gray_image(width * height);
-
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            unsigned char* pixel = data + (y * width + x) * channels;
-            unsigned char r = pixel[0];
-            unsigned char g = channels > 1 ? pixel[1] : r;
-            unsigned char b = channels > 2 ? pixel[2] : r;
-            gray_image[y * width + x] = static_cast<unsigned char>(0.299f * r + 0.587f * g + 0.114f * b);
-        }
-    }
-
-    bool success = stbi_write_jpg(filename.c_str(), width, height, 1, gray_image.data(), 100);
-    stbi_image_free(data);
-    
-    if (!success) {
-        std::cerr << "Failed to save grayscale image: " << filename << std::endl;
-    }
-    
-    return success;
 }
 
 bool fileExists(const std::string& path) {
@@ -0,0 +1,441 @@
+// nanobind module behind the libmbtiles Python package. Tile blobs and
+// image pixels are handed to Python as buffers that own the C++ storage, so
+// memoryview() and numpy.asarray() see them without a copy. Long calls drop
+// the GIL; each archive serializes its own calls with a mutex because the
+// connection and its statement cache are not thread-safe.
+
+#include "mbtiles.h"
+
+#include <nanobind/nanobind.h>
+#include <nanobind/ndarray.h>
+#include <nanobind/stl/array.h>
+#include <nanobind/stl/map.h>
+#include <nanobind/stl/optional.h>
+#include <nanobind/stl/string.h>
+#include <nanobind/stl/tuple.h>
+#include <nanobind/stl/vector.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace nb = nanobind;
+
+namespace {
+
+using Bytes = nb::ndarray<const std::uint8_t, nb::ndim<1>, nb::c_contig, nb::device::cpu>;
+using Pixels = nb::ndarray<std::uint8_t, nb::ndim<3>, nb::c_contig, nb::device::cpu>;
+using Coord = std::tuple<int, int, int>;
+
+// Moves `container` to the heap and returns a buffer that frees it when the
+// last Python reference goes away.
+template <typename Container>
+Bytes to_buffer(Container &&container) {
+    auto *owned = new Container(std::forward<Container>(container));
+    nb::capsule owner(owned, [](void *pointer) noexcept { delete static_cast<Container *>(pointer); });
+    return Bytes(reinterpret_cast<const std::uint8_t *>(owned->data()), {owned->size()}, owner);
+}
+
+struct Archive {
+    mbtiles::MBTiles archive;
+    std::mutex mutex;
+
+    Archive() = default;
+    explicit Archive(mbtiles::MBTiles &&opened) : archive(std::move(opened)) {}
+
+    // Runs `fn` on the archive without the GIL; blocks while another thread
+    // is using the same archive.
+    template <typename Fn>
+    auto locked(Fn &&fn) {
+        nb::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(mutex);
+        return fn(archive);
+    }
+};
+
+struct Iterator {
+    Archive *owner = nullptr;
+    mbtiles::TileIterator tiles;
+
+    mbtiles::TileInfo next() {
+        std::optional<mbtiles::TileInfo> tile;
+        {
+            std::lock_guard<std::mutex> lock(owner->mutex);
+            tile = tiles.next();
+        }
+        if (!tile) {
+            throw nb::stop_iteration();
+        }
+        return std::move(*tile);
+    }
+};
+
+mbtiles::TileIteratorOptions iterator_options(std::optional<int> min_zoom, std::optional<int> max_zoom,
+                                              std::optional<std::tuple<double, double, double, double>> bounds,
+                                              bool ordered) {
+    mbtiles::TileIteratorOptions options;
+    options.min_zoom = min_zoom;
+    options.max_zoom = max_zoom;
+    if (bounds) {
+        mbtiles::LatLonBounds box;
+        std::tie(box.min_lon, box.min_lat, box.max_lon, box.max_lat) = *bounds;
+        options.bounds = box;
+    }
+    options.ordered = ordered;
+    return options;
+}
+
+}  // namespace
+
+NB_MODULE(_core, m) {
+    m.doc() = "Native bindings for libmbtiles";
+
+    nb::exception<mbtiles::mbtiles_error>(m, "MBTilesError", PyExc_RuntimeError);
+
+    nb::enum_<mbtiles::Format>(m, "Format")
+        .value("DEFAULT", mbtiles::Format::DEFAULT)
+        .value("JPG", mbtiles::Format::JPG)
+        .value("PNG", mbtiles::Format::PNG)
+        .value("WEBP", mbtiles::Format::WEBP);
+
+    nb::enum_<mbtiles::OpenOptions::TempStore>(m, "TempStore")
+        .value("DEFAULT", mbtiles::OpenOptions::TempStore::DEFAULT)
+        .value("FILE", mbtiles::OpenOptions::TempStore::FILE)
+        .value("MEMORY", mbtiles::OpenOptions::TempStore::MEMORY);
+
+    nb::enum_<mbtiles::OpenOptions::LockingMode>(m, "LockingMode")
+        .value("NORMAL", mbtiles::OpenOptions::LockingMode::NORMAL)
+        .value("EXCLUSIVE", mbtiles::OpenOptions::LockingMode::EXCLUSIVE);
+
+    nb::class_<mbtiles::OpenOptions>(m, "OpenOptions")
+        .def(nb::init<>())
+        .def_rw("read_only", &mbtiles::OpenOptions::read_only)
+        .def_rw("immutable", &mbtiles::OpenOptions::immutable)
+        .def_rw("mmap_size", &mbtiles::OpenOptions::mmap_size)
+        .def_rw("cache_size", &mbtiles::OpenOptions::cache_size)
+        .def_rw("temp_store", &mbtiles::OpenOptions::temp_store)
+        .def_rw("locking_mode", &mbtiles::OpenOptions::locking_mode);
+
+    nb::class_<mbtiles::EncoderOptions>(m, "EncoderOptions")
+        .def(nb::init<>())
+        .def_rw("jpeg_quality", &mbtiles::EncoderOptions::jpeg_quality)
+        .def_rw("png_compression", &mbtiles::EncoderOptions::png_compression)
+        .def_rw("webp_quality", &mbtiles::EncoderOptions::webp_quality)
+        .def_rw("webp_lossless", &mbtiles::EncoderOptions::webp_lossless);
+
+    nb::class_<mbtiles::ExtractOptions>(m, "ExtractOptions")
+        .def(nb::init<const std::string &, const std::string &>(), nb::arg("output_directory") = ".",
+             nb::arg("pattern") = "{z}/{x}/{y}.{ext}")
+        .def_rw("output_directory", &mbtiles::ExtractOptions::output_directory)
+        .def_rw("pattern", &mbtiles::ExtractOptions::pattern)
+        .def_rw("threads", &mbtiles::ExtractOptions::threads);
+
+    nb::class_<mbtiles::ConvertOptions>(m, "ConvertOptions")
+        .def(nb::init<>())
+        .def_rw("zoom_levels", &mbtiles::ConvertOptions::zoom_levels)
+        .def_rw("grayscale", &mbtiles::ConvertOptions::grayscale)
+        .def_rw("compact_grayscale", &mbtiles::ConvertOptions::compact_grayscale)
+        .def_rw("format", &mbtiles::ConvertOptions::format)
+        .def_rw("encoder", &mbtiles::ConvertOptions::encoder)
+        .def_rw("streaming", &mbtiles::ConvertOptions::streaming)
+        .def_rw("memory_limit", &mbtiles::ConvertOptions::memory_limit)
+        .def_rw("threads", &mbtiles::ConvertOptions::threads)
+        .def_rw("deduplicate", &mbtiles::ConvertOptions::deduplicate)
+        .def_rw("output_path", &mbtiles::ConvertOptions::output_path);
+
+    nb::class_<mbtiles::ImportOptions>(m, "ImportOptions")
+        .def(nb::init<>())
+        .def_rw("format", &mbtiles::ImportOptions::format)
+        .def_rw("encoder", &mbtiles::ImportOptions::encoder)
+        .def_rw("grayscale", &mbtiles::ImportOptions::grayscale)
+        .def_rw("compact_grayscale", &mbtiles::ImportOptions::compact_grayscale)
+        .def_rw("tms", &mbtiles::ImportOptions::tms)
+        .def_rw("threads", &mbtiles::ImportOptions::threads);
+
+    nb::enum_<mbtiles::MergeConflict>(m, "MergeConflict")
+        .value("REPLACE", mbtiles::MergeConflict::REPLACE)
+        .value("IGNORE", mbtiles::MergeConflict::IGNORE)
+        .value("COMPOSITE", mbtiles::MergeConflict::COMPOSITE);
+
+    nb::class_<mbtiles::MergeOptions>(m, "MergeOptions")
+        .def(nb::init<>())
+        .def_rw("conflict", &mbtiles::MergeOptions::conflict)
+        .def_rw("format", &mbtiles::MergeOptions::format)
+        .def_rw("encoder", &mbtiles::MergeOptions::encoder)
+        .def_rw("threads", &mbtiles::MergeOptions::threads);
+
+    nb::class_<mbtiles::StatsOptions>(m, "StatsOptions")
+        .def(nb::init<>())
+        .def_rw("threads", &mbtiles::StatsOptions::threads)
+        .def_rw("duplicates", &mbtiles::StatsOptions::duplicates)
+        .def_rw("update_metadata", &mbtiles::StatsOptions::update_metadata);
+
+    nb::class_<mbtiles::LatLonBounds>(m, "LatLonBounds")
+        .def_ro("min_lon", &mbtiles::LatLonBounds::min_lon)
+        .def_ro("min_lat", &mbtiles::LatLonBounds::min_lat)
+        .def_ro("max_lon", &mbtiles::LatLonBounds::max_lon)
+        .def_ro("max_lat", &mbtiles::LatLonBounds::max_lat);
+
+    nb::class_<mbtiles::ZoomStats>(m, "ZoomStats")
+        .def_ro("zoom", &mbtiles::ZoomStats::zoom)
+        .def_ro("tiles", &mbtiles::ZoomStats::tiles)
+        .def_ro("bytes", &mbtiles::ZoomStats::bytes)
+        .def_ro("min_size", &mbtiles::ZoomStats::min_size)
+        .def_ro("max_size", &mbtiles::ZoomStats::max_size)
+        .def_ro("size_buckets", &mbtiles::ZoomStats::size_buckets)
+        .def_ro("min_x", &mbtiles::ZoomStats::min_x)
+        .def_ro("max_x", &mbtiles::ZoomStats::max_x)
+        .def_ro("min_y", &mbtiles::ZoomStats::min_y)
+        .def_ro("max_y", &mbtiles::ZoomStats::max_y);
+
+    nb::class_<mbtiles::ArchiveStats>(m, "ArchiveStats")
+        .def_ro("zooms", &mbtiles::ArchiveStats::zooms)
+        .def_ro("tiles", &mbtiles::ArchiveStats::tiles)
+        .def_ro("bytes", &mbtiles::ArchiveStats::bytes)
+        .def_ro("empty_tiles", &mbtiles::ArchiveStats::empty_tiles)
+        .def_ro("unique_blobs", &mbtiles::ArchiveStats::unique_blobs)
+        .def_ro("duplicate_bytes", &mbtiles::ArchiveStats::duplicate_bytes)
+        .def_ro("formats", &mbtiles::ArchiveStats::formats)
+        .def_ro("format_mismatches", &mbtiles::ArchiveStats::format_mismatches)
+        .def_ro("tile_bounds", &mbtiles::ArchiveStats::tile_bounds)
+        .def_ro("metadata_bounds", &mbtiles::ArchiveStats::metadata_bounds)
+        .def_ro("metadata_min_zoom", &mbtiles::ArchiveStats::metadata_min_zoom)
+        .def_ro("metadata_max_zoom", &mbtiles::ArchiveStats::metadata_max_zoom)
+        .def_ro("stale_metadata", &mbtiles::ArchiveStats::stale_metadata)
+        .def_prop_ro("duplicate_ratio", &mbtiles::ArchiveStats::duplicateRatio);
+
+    nb::class_<mbtiles::TileInfo>(m, "Tile")
+        .def_ro("zoom", &mbtiles::TileInfo::zoom)
+        .def_ro("x", &mbtiles::TileInfo::x)
+        .def_ro("y", &mbtiles::TileInfo::y)
+        .def_ro("tms_y", &mbtiles::TileInfo::tms_y)
+        .def_ro("extension", &mbtiles::TileInfo::extension)
+        // A view of the tile's own blob; it keeps the Tile alive.
+        .def_prop_ro(
+            "data",
+            [](const mbtiles::TileInfo &tile) {
+                return Bytes(reinterpret_cast<const std::uint8_t *>(tile.data.data()), {tile.data.size()},
+                             nb::handle());
+            },
+            nb::rv_policy::reference_internal)
+        .def("__repr__", [](const mbtiles::TileInfo &tile) {
+            return "Tile(" + std::to_string(tile.zoom) + "/" + std::to_string(tile.x) + "/" + std::to_string(tile.y) +
+                   ", " + std::to_string(tile.data.size()) + " bytes " + tile.extension + ")";
+        });
+
+    nb::class_<Iterator>(m, "TileIterator")
+        .def("__iter__", [](nb::object self) { return self; })
+        .def("__next__", &Iterator::next);
+
+    nb::class_<mbtiles::RGBAImage>(m, "RGBAImage")
+        .def(nb::init<>())
+        .def(
+            "__init__",
+            [](mbtiles::RGBAImage *image, Bytes data) {
+                mbtiles::RGBAImage decoded;
+                {
+                    nb::gil_scoped_release release;
+                    decoded.loadFromMemory(data.data(), static_cast<int>(data.size()));
+                }
+                new (image) mbtiles::RGBAImage(std::move(decoded));
+            },
+            nb::arg("data"))
+        .def_static(
+            "from_file",
+            [](const std::string &path) {
+                nb::gil_scoped_release release;
+                return mbtiles::RGBAImage(std::filesystem::path(path));
+            },
+            nb::arg("path"))
+        .def_ro("width", &mbtiles::RGBAImage::width)
+        .def_ro("height", &mbtiles::RGBAImage::height)
+        // Writable (height, width, 4) view of the pixels; it keeps the image
+        // alive and is invalidated by load().
+        .def_prop_ro(
+            "pixels",
+            [](mbtiles::RGBAImage &image) {
+                return Pixels(image.pixels.data(),
+                              {static_cast<std::size_t>(image.height), static_cast<std::size_t>(image.width), 4},
+                              nb::handle());
+            },
+            nb::rv_policy::reference_internal)
+        .def("save", [](const mbtiles::RGBAImage &image, const std::string &path) { image.save(path); },
+             nb::arg("path"), nb::call_guard<nb::gil_scoped_release>())
+        .def("to_grayscale", &mbtiles::RGBAImage::toGrayScale, nb::call_guard<nb::gil_scoped_release>())
+        .def(
+            "encode_png",
+            [](const mbtiles::RGBAImage &image, int compression) {
+                std::vector<unsigned char> encoded;
+                {
+                    nb::gil_scoped_release release;
+                    encoded = image.encodePng(compression);
+                }
+                return to_buffer(std::move(encoded));
+            },
+            nb::arg("compression") = -1)
+        .def(
+            "encode_jpg",
+            [](const mbtiles::RGBAImage &image, int quality) {
+                std::vector<unsigned char> encoded;
+                {
+                    nb::gil_scoped_release release;
+                    encoded = image.encodeJpg(quality);
+                }
+                return to_buffer(std::move(encoded));
+            },
+            nb::arg("quality") = 90)
+        .def(
+            "encode_webp",
+            [](const mbtiles::RGBAImage &image, int quality, bool lossless) {
+                std::vector<unsigned char> encoded;
+                {
+                    nb::gil_scoped_release release;
+                    encoded = image.encodeWebp(quality, lossless);
+                }
+                return to_buffer(std::move(encoded));
+            },
+            nb::arg("quality") = 80, nb::arg("lossless") = false);
+
+    nb::class_<Archive>(m, "MBTiles")
+        .def(nb::init<>())
+        .def(
+            "__init__",
+            [](Archive *self, const std::string &path, const mbtiles::OpenOptions &options) {
+                mbtiles::MBTiles opened;
+                {
+                    nb::gil_scoped_release release;
+                    opened.open(path, options);
+                }
+                new (self) Archive(std::move(opened));
+            },
+            nb::arg("path"), nb::arg("options") = mbtiles::OpenOptions())
+        .def(
+            "open",
+            [](Archive &self, const std::string &path, const mbtiles::OpenOptions &options) {
+                self.locked([&](mbtiles::MBTiles &archive) { archive.open(path, options); });
+            },
+            nb::arg("path"), nb::arg("options") = mbtiles::OpenOptions())
+        .def("close", [](Archive &self) { self.locked([](mbtiles::MBTiles &archive) { archive.close(); }); })
+        .def("__enter__", [](nb::object self) { return self; })
+        .def("__exit__",
+             [](Archive &self, nb::args) {
+                 self.locked([](mbtiles::MBTiles &archive) { archive.close(); });
+             })
+        .def("metadata",
+             [](Archive &self) { return self.locked([](mbtiles::MBTiles &archive) { return archive.metadata(); }); })
+        .def(
+            "set_metadata",
+            [](Archive &self, const std::map<std::string, std::string> &entries, bool overwrite_existing) {
+                self.locked([&](mbtiles::MBTiles &archive) { archive.setMetadata(entries, overwrite_existing); });
+            },
+            nb::arg("entries"), nb::arg("overwrite_existing") = true)
+        .def("zoom_levels",
+             [](Archive &self) { return self.locked([](mbtiles::MBTiles &archive) { return archive.zoomLevels(); }); })
+        .def("min_zoom",
+             [](Archive &self) { return self.locked([](mbtiles::MBTiles &archive) { return archive.minZoomLevel(); }); })
+        .def("max_zoom",
+             [](Archive &self) { return self.locked([](mbtiles::MBTiles &archive) { return archive.maxZoomLevel(); }); })
+        .def(
+            "tile_data",
+            [](Archive &self, int zoom, int x, int y) -> std::optional<Bytes> {
+                auto blob = self.locked([&](mbtiles::MBTiles &archive) { return archive.tileData(zoom, x, y); });
+                if (!blob) {
+                    return std::nullopt;
+                }
+                return to_buffer(std::move(*blob));
+            },
+            nb::arg("zoom"), nb::arg("x"), nb::arg("y"))
+        .def(
+            "tile_data_batch",
+            [](Archive &self, const std::vector<Coord> &coords) {
+                std::vector<mbtiles::TileCoord> requested;
+                requested.reserve(coords.size());
+                for (const auto &[zoom, x, y] : coords) {
+                    requested.push_back({zoom, x, y});
+                }
+                std::vector<std::pair<Coord, std::vector<std::byte>>> found;
+                self.locked([&](mbtiles::MBTiles &archive) {
+                    return archive.tileDataBatch(requested, [&](const mbtiles::TileView &view) {
+                        found.emplace_back(Coord{view.zoom, view.x, view.y},
+                                           std::vector<std::byte>(view.data, view.data + view.size));
+                    });
+                });
+                nb::dict result;
+                for (auto &[coord, data] : found) {
+                    result[nb::cast(coord)] = to_buffer(std::move(data));
+                }
+                return result;
+            },
+            nb::arg("coords"), "Fetch many (zoom, x, y) tiles at once; returns {(zoom, x, y): buffer} for those found.")
+        .def(
+            "tiles",
+            [](Archive &self, std::optional<int> min_zoom, std::optional<int> max_zoom,
+               std::optional<std::tuple<double, double, double, double>> bounds, bool ordered) {
+                const auto options = iterator_options(min_zoom, max_zoom, bounds, ordered);
+                return self.locked(
+                    [&](mbtiles::MBTiles &archive) { return Iterator{&self, archive.tiles(options)}; });
+            },
+            nb::arg("min_zoom") = nb::none(), nb::arg("max_zoom") = nb::none(), nb::arg("bounds") = nb::none(),
+            nb::arg("ordered") = false, nb::keep_alive<0, 1>(),
+            "Iterate over tiles; bounds is (min_lon, min_lat, max_lon, max_lat).")
+        .def("__iter__",
+             [](Archive &self) {
+                 return self.locked([&](mbtiles::MBTiles &archive) { return Iterator{&self, archive.tiles()}; });
+             },
+             nb::keep_alive<0, 1>())
+        .def(
+            "convert",
+            [](Archive &self, const mbtiles::ConvertOptions &options) {
+                return new Archive(
+                    self.locked([&](mbtiles::MBTiles &archive) { return archive.convert(options); }));
+            },
+            nb::arg("options"), nb::rv_policy::take_ownership)
+        .def(
+            "extract",
+            [](Archive &self, const mbtiles::ExtractOptions &options) {
+                return self.locked([&](mbtiles::MBTiles &archive) { return archive.extract(options); });
+            },
+            nb::arg("options"))
+        .def(
+            "extract",
+            [](Archive &self, const std::string &output_directory, const std::string &pattern, unsigned threads) {
+                mbtiles::ExtractOptions options(output_directory, pattern);
+                options.threads = threads;
+                return self.locked([&](mbtiles::MBTiles &archive) { return archive.extract(options); });
+            },
+            nb::arg("output_directory") = ".", nb::arg("pattern") = "{z}/{x}/{y}.{ext}", nb::arg("threads") = 1)
+        .def(
+            "import_directory",
+            [](Archive &self, const std::string &directory, const std::string &pattern,
+               const mbtiles::ImportOptions &options) {
+                return self.locked(
+                    [&](mbtiles::MBTiles &archive) { return archive.importDirectory(directory, pattern, options); });
+            },
+            nb::arg("directory"), nb::arg("pattern") = "{z}/{x}/{y}.{ext}",
+            nb::arg("options") = mbtiles::ImportOptions())
+        .def(
+            "merge",
+            [](Archive &self, const std::vector<std::string> &sources, const mbtiles::MergeOptions &options) {
+                return self.locked([&](mbtiles::MBTiles &archive) { return archive.merge(sources, options); });
+            },
+            nb::arg("sources"), nb::arg("options") = mbtiles::MergeOptions())
+        .def(
+            "save_to",
+            [](Archive &self, const std::string &path) {
+                self.locked([&](mbtiles::MBTiles &archive) { archive.saveTo(path); });
+            },
+            nb::arg("path"))
+        .def(
+            "stats",
+            [](Archive &self, const mbtiles::StatsOptions &options) {
+                return self.locked([&](mbtiles::MBTiles &archive) { return archive.stats(options); });
+            },
+            nb::arg("options") = mbtiles::StatsOptions());
+
+    m.def("codec_backends", &mbtiles::codecBackends);
+}
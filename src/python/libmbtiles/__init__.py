@@ -1,5 +1,50 @@
 import importlib.metadata
 __version__ = importlib.metadata.version("libmbtiles")
 
+from ._core import (
+    ArchiveStats,
+    ConvertOptions,
+    EncoderOptions,
+    ExtractOptions,
+    Format,
+    ImportOptions,
+    LatLonBounds,
+    LockingMode,
+    MBTiles,
+    MBTilesError,
+    MergeConflict,
+    MergeOptions,
+    OpenOptions,
+    RGBAImage,
+    StatsOptions,
+    TempStore,
+    Tile,
+    TileIterator,
+    ZoomStats,
+    codec_backends,
+)
 
-__all__ = ["__version__"]
\ No newline at end of file
+
+__all__ = [
+    "__version__",
+    "ArchiveStats",
+    "ConvertOptions",
+    "EncoderOptions",
+    "ExtractOptions",
+    "Format",
+    "ImportOptions",
+    "LatLonBounds",
+    "LockingMode",
+    "MBTiles",
+    "MBTilesError",
+    "MergeConflict",
+    "MergeOptions",
+    "OpenOptions",
+    "RGBAImage",
+    "StatsOptions",
+    "TempStore",
+    "Tile",
+    "TileIterator",
+    "ZoomStats",
+    "codec_backends",
+]
@@ -0,0 +1,13 @@
+#define DOCTEST_CONFIG_IMPLEMENT
+#include "doctest.h"
+
+#include "mbtiles.h"
+
+int main(int argc, char **argv) {
+    // Keep per-level progress logging out of the test report.
+    mbtiles::Logger::set_level(mbtiles::LogLevel::WARNING);
+
+    doctest::Context context;
+    context.applyCommandLine(argc, argv);
+    return context.run();
+}
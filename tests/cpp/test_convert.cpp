@@ -0,0 +1,119 @@
+#include "doctest.h"
+#include "test_support.h"
+
+using namespace mbtiles_test;
+
+namespace {
+
+// Levels 0-3 from a level 3 base: three levels are downsampled and the base
+// is copied.
+mbtiles::ConvertOptions pyramid_options() {
+    mbtiles::ConvertOptions options;
+    options.zoom_levels = {"-3", "-2", "-1", "0"};
+    options.threads = 1;
+    return options;
+}
+
+}  // namespace
+
+TEST_CASE("convert produces the same tiles in every mode") {
+    TempDir dir;
+    write_png_archive(dir.file("base.mbtiles"), 3, 3);
+    const mbtiles::MBTiles source(dir.file("base.mbtiles"));
+
+    const TileContents expected = read_tiles(source.convert(pyramid_options()));
+    REQUIRE(expected.size() == 1 + 4 + 16 + 64);
+
+    SUBCASE("pass-through copies the base level byte for byte") {
+        for (const auto &[coord, blob] : read_tiles(source)) {
+            CHECK(expected.at(coord) == blob);
+        }
+    }
+    SUBCASE("streaming") {
+        auto options = pyramid_options();
+        options.streaming = true;
+        CHECK(read_tiles(source.convert(options)) == expected);
+    }
+    SUBCASE("threaded") {
+        auto options = pyramid_options();
+        options.threads = 4;
+        CHECK(read_tiles(source.convert(options)) == expected);
+    }
+    SUBCASE("deduplicated") {
+        auto options = pyramid_options();
+        options.deduplicate = true;
+        CHECK(read_tiles(source.convert(options)) == expected);
+    }
+    SUBCASE("written to a file") {
+        auto options = pyramid_options();
+        options.output_path = dir.file("out.mbtiles");
+        source.convert(options);
+        CHECK(read_tiles(mbtiles::MBTiles(options.output_path)) == expected);
+    }
+}
+
+TEST_CASE("convert refuses an output path that resolves to the source") {
+    TempDir dir;
+    const std::string path = dir.file("a.mbtiles");
+    write_png_archive(path, 0, 1);
+    const mbtiles::MBTiles source(path);
+    const TileContents before = read_tiles(source);
+
+    mbtiles::ConvertOptions options;
+    options.threads = 1;
+    SUBCASE("extension added by the library") { options.output_path = dir.file("a"); }
+    SUBCASE("same file") { options.output_path = path; }
+    CHECK_THROWS_AS(source.convert(options), mbtiles::mbtiles_error);
+
+    REQUIRE(fs::exists(path));
+    CHECK(read_tiles(mbtiles::MBTiles(path)) == before);
+}
+
+TEST_CASE("convert of an in-memory archive") {
+    TempDir dir;
+    write_png_archive(dir.file("base.mbtiles"), 3, 3);
+    const mbtiles::MBTiles source(dir.file("base.mbtiles"));
+    const TileContents expected = read_tiles(source.convert(pyramid_options()));
+
+    TempDir cwd;
+    const fs::path previous = fs::current_path();
+    fs::current_path(cwd.path());
+    mbtiles::MBTiles memory(":memory:");
+    memory.merge({dir.file("base.mbtiles")});
+    const TileContents converted = read_tiles(memory.convert(pyramid_options()));
+    const bool wrote_files = !fs::is_empty(cwd.path());
+    fs::current_path(previous);
+
+    CHECK(converted == expected);
+    CHECK_FALSE(wrote_files);
+}
+
+TEST_CASE("rebuild matches a full reconvert") {
+    TempDir dir;
+    const std::string base_path = dir.file("base.mbtiles");
+    write_png_archive(base_path, 3, 3);
+    auto options = pyramid_options();
+    options.output_path = dir.file("pyramid.mbtiles");
+    mbtiles::MBTiles(base_path).convert(options);
+
+    const std::vector<mbtiles::TileCoord> changed = {{3, 0, 0}, {3, 5, 2}, {3, 7, 7}};
+    std::uint32_t seed = 1000;
+    mbtiles::MBTiles base(base_path);
+    mbtiles::MBTiles pyramid(options.output_path);
+    {
+        mbtiles::TileWriter base_writer(base);
+        mbtiles::TileWriter pyramid_writer(pyramid);
+        for (const auto &coord : changed) {
+            const auto blob = make_image(seed++).encodePng();
+            base_writer.write(coord.zoom, coord.x, coord.y, blob);
+            pyramid_writer.write(coord.zoom, coord.x, coord.y, blob);
+        }
+        base_writer.finish();
+        pyramid_writer.finish();
+    }
+
+    mbtiles::RebuildOptions rebuild;
+    rebuild.threads = 2;
+    CHECK(pyramid.rebuild(changed, rebuild) > 0);
+    CHECK(read_tiles(pyramid) == read_tiles(base.convert(pyramid_options())));
+}
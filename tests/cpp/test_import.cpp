@@ -0,0 +1,92 @@
+#include "doctest.h"
+#include "test_support.h"
+
+#include "sqlite3.h"
+
+#include <fstream>
+
+using namespace mbtiles_test;
+
+namespace {
+
+void write_file(const fs::path &path, const std::vector<unsigned char> &data) {
+    fs::create_directories(path.parent_path());
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+}
+
+std::size_t tile_rows(const std::string &path) {
+    sqlite3 *db = nullptr;
+    REQUIRE(sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK);
+    sqlite3_stmt *stmt = nullptr;
+    REQUIRE(sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM tiles", -1, &stmt, nullptr) == SQLITE_OK);
+    REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+    const auto rows = static_cast<std::size_t>(sqlite3_column_int64(stmt, 0));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return rows;
+}
+
+}  // namespace
+
+TEST_CASE("extract and import round-trip every tile") {
+    TempDir dir;
+    write_png_archive(dir.file("source.mbtiles"), 0, 2);
+    const mbtiles::MBTiles source(dir.file("source.mbtiles"));
+
+    mbtiles::ExtractOptions extract(dir.file("tiles"));
+    SUBCASE("single-threaded") { extract.threads = 1; }
+    SUBCASE("threaded") { extract.threads = 4; }
+    REQUIRE(source.extract(extract) == 21);
+
+    mbtiles::MBTiles imported(dir.file("imported.mbtiles"));
+    mbtiles::ImportOptions options;
+    options.threads = 2;
+    CHECK(imported.importDirectory(dir.file("tiles"), "{z}/{x}/{y}.{ext}", options) == 21);
+    CHECK(read_tiles(imported) == read_tiles(source));
+    CHECK(imported.metadata().at("format") == "png");
+    CHECK(imported.metadata().at("minzoom") == "0");
+    CHECK(imported.metadata().at("maxzoom") == "2");
+}
+
+TEST_CASE("import rolls back when a tile is present twice") {
+    TempDir dir;
+    const auto blob = make_image(1).encodePng();
+    write_file(dir.path() / "tiles" / "1" / "0" / "0.png", blob);
+    write_file(dir.path() / "tiles" / "1" / "0" / "0.jpg", blob);
+    write_file(dir.path() / "tiles" / "1" / "1" / "0.png", blob);
+
+    const std::string path = dir.file("imported.mbtiles");
+    {
+        mbtiles::MBTiles archive(path);
+        CHECK_THROWS_AS(archive.importDirectory(dir.file("tiles")), mbtiles::mbtiles_error);
+    }
+    CHECK(tile_rows(path) == 0);
+
+    // Without the duplicate the same archive imports cleanly, once per tile.
+    fs::remove(dir.path() / "tiles" / "1" / "0" / "0.jpg");
+    mbtiles::MBTiles archive(path);
+    CHECK(archive.importDirectory(dir.file("tiles")) == 2);
+    CHECK(archive.importDirectory(dir.file("tiles")) == 2);
+    CHECK(tile_rows(path) == 2);
+}
+
+TEST_CASE("import replaces tiles in a table created without a unique index") {
+    TempDir dir;
+    const std::string path = dir.file("plain.mbtiles");
+    {
+        sqlite3 *db = nullptr;
+        REQUIRE(sqlite3_open(path.c_str(), &db) == SQLITE_OK);
+        REQUIRE(sqlite3_exec(db,
+                             "CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, "
+                             "tile_data BLOB)",
+                             nullptr, nullptr, nullptr) == SQLITE_OK);
+        sqlite3_close(db);
+    }
+    write_file(dir.path() / "tiles" / "0" / "0" / "0.png", make_image(1).encodePng());
+
+    mbtiles::MBTiles archive(path);
+    archive.importDirectory(dir.file("tiles"));
+    archive.importDirectory(dir.file("tiles"));
+    CHECK(tile_rows(path) == 1);
+}
@@ -0,0 +1,54 @@
+#include "doctest.h"
+#include "test_support.h"
+
+using namespace mbtiles_test;
+
+TEST_CASE("merge resolves conflicts by the chosen policy") {
+    TempDir dir;
+    const auto red = make_solid(255, 0, 0, 255).encodePng();
+    const auto green = make_solid(0, 255, 0, 255).encodePng();
+    const auto translucent_blue = make_solid(0, 0, 255, 128).encodePng();
+    const auto blue = make_solid(0, 0, 255, 255).encodePng();
+    const std::map<std::string, std::string> metadata = {
+        {"name", "test"}, {"format", "png"}, {"minzoom", "1"}, {"maxzoom", "1"}};
+
+    // Both hold 1/0/0; each also has a tile of its own.
+    const std::string target_path = dir.file("target.mbtiles");
+    const std::string source_path = dir.file("source.mbtiles");
+    write_archive(target_path, {{1, 0, 0, red}, {1, 1, 1, green}}, metadata);
+    write_archive(source_path, {{1, 0, 0, translucent_blue}, {1, 0, 1, blue}}, metadata);
+
+    mbtiles::MergeOptions options;
+    options.threads = 2;
+    std::string expected_overlap;
+    SUBCASE("replace") {
+        options.conflict = mbtiles::MergeConflict::REPLACE;
+        expected_overlap = as_string(translucent_blue);
+    }
+    SUBCASE("ignore") {
+        options.conflict = mbtiles::MergeConflict::IGNORE;
+        expected_overlap = as_string(red);
+    }
+    SUBCASE("composite") { options.conflict = mbtiles::MergeConflict::COMPOSITE; }
+
+    mbtiles::MBTiles target(target_path);
+    target.merge({source_path}, options);
+    const TileContents tiles = read_tiles(target);
+
+    REQUIRE(tiles.size() == 3);
+    CHECK(tiles.at({1, 1, 1}) == as_string(green));
+    CHECK(tiles.at({1, 0, 1}) == as_string(blue));
+    const std::string &overlap = tiles.at({1, 0, 0});
+    if (!expected_overlap.empty()) {
+        CHECK(overlap == expected_overlap);
+    } else {
+        // Half-opaque blue over opaque red.
+        const mbtiles::RGBAImage blended(reinterpret_cast<const unsigned char *>(overlap.data()),
+                                         static_cast<int>(overlap.size()));
+        REQUIRE(blended.pixels.size() >= 4);
+        CHECK(blended.pixels[0] == 127);
+        CHECK(blended.pixels[1] == 0);
+        CHECK(blended.pixels[2] == 128);
+        CHECK(blended.pixels[3] == 255);
+    }
+}
@@ -0,0 +1,31 @@
+#include "doctest.h"
+#include "test_support.h"
+
+#include <cstring>
+
+using namespace mbtiles_test;
+
+TEST_CASE("reads nested inside tile callbacks leave the outer read intact") {
+    TempDir dir;
+    write_png_archive(dir.file("archive.mbtiles"), 0, 2);
+    const mbtiles::MBTiles archive(dir.file("archive.mbtiles"));
+
+    SUBCASE("tileData inside tileDataView") {
+        const auto expected = archive.tileData(1, 0, 0);
+        REQUIRE(expected.has_value());
+        bool intact = false;
+        CHECK(archive.tileDataView(1, 0, 0, [&](const mbtiles::TileView &outer) {
+            CHECK(archive.tileData(1, 1, 1).has_value());
+            intact = outer.size == expected->size() && std::memcmp(outer.data, expected->data(), outer.size) == 0;
+        }));
+        CHECK(intact);
+    }
+    SUBCASE("tilesInRange inside tilesInRange") {
+        std::size_t inner = 0;
+        const std::size_t outer = archive.tilesInRange(1, 0, 1, 0, 1, [&](const mbtiles::TileView &) {
+            inner += archive.tilesInRange(2, 0, 3, 0, 3, [](const mbtiles::TileView &) {});
+        });
+        CHECK(outer == 4);
+        CHECK(inner == 4 * 16);
+    }
+}
@@ -0,0 +1,171 @@
+#include "doctest.h"
+#include "test_support.h"
+
+#ifndef _WIN32
+
+#include "httplib.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace mbtiles_test;
+
+namespace {
+
+// Runs serve() in a child process, since it only returns on a signal, and
+// stops it when the object goes out of scope.
+class ServeProcess {
+  public:
+    ServeProcess(const std::string &path, std::uint16_t port) : _port(port) {
+        std::fflush(nullptr);
+        _child = fork();
+        REQUIRE(_child >= 0);
+        if (_child == 0) {
+            if (!std::freopen("/dev/null", "w", stdout)) {
+                _exit(1);
+            }
+            mbtiles::OpenOptions open;
+            open.read_only = true;
+            mbtiles::ViewerOptions options;
+            options.host = "127.0.0.1";
+            options.port = port;
+            options.threads = 2;
+            mbtiles::MBTiles(path, open).serve(options);
+            _exit(0);
+        }
+        for (int attempt = 0; attempt < 100; ++attempt) {
+            if (client().Get("/metrics")) {
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        FAIL("serve() did not start on port " << port);
+    }
+    ServeProcess(const ServeProcess &) = delete;
+    ServeProcess &operator=(const ServeProcess &) = delete;
+    ~ServeProcess() {
+        kill(_child, SIGKILL);
+        waitpid(_child, nullptr, 0);
+    }
+
+    // Bodies arrive as sent: this build of httplib cannot inflate gzip.
+    httplib::Client client() const {
+        httplib::Client client("127.0.0.1", _port);
+        client.set_decompress(false);
+        return client;
+    }
+
+  private:
+    pid_t _child = -1;
+    std::uint16_t _port;
+};
+
+// Ports per test process, so parallel ctest runs do not collide.
+std::uint16_t test_port(int offset) {
+    return static_cast<std::uint16_t>(20000 + (getpid() % 10000) * 4 + offset);
+}
+
+std::uint32_t crc32(const std::string &data) {
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (const unsigned char byte : data) {
+        crc ^= byte;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+// A gzip member holding `data` in one stored (uncompressed) deflate block.
+std::vector<unsigned char> gzip_stored(const std::string &data) {
+    std::vector<unsigned char> out = {0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF, 0x01};
+    auto put16 = [&out](std::uint32_t value) {
+        out.push_back(static_cast<unsigned char>(value & 0xFF));
+        out.push_back(static_cast<unsigned char>((value >> 8) & 0xFF));
+    };
+    put16(static_cast<std::uint32_t>(data.size()));
+    put16(static_cast<std::uint32_t>(~data.size() & 0xFFFF));
+    out.insert(out.end(), data.begin(), data.end());
+    const std::uint32_t crc = crc32(data);
+    put16(crc & 0xFFFF);
+    put16(crc >> 16);
+    put16(static_cast<std::uint32_t>(data.size() & 0xFFFF));
+    put16(static_cast<std::uint32_t>(data.size() >> 16));
+    return out;
+}
+
+}  // namespace
+
+TEST_CASE("serve answers revalidation with 304 and rejects bad coordinates") {
+    TempDir dir;
+    const auto blob = make_image(1).encodePng();
+    write_archive(dir.file("png.mbtiles"), {{0, 0, 0, blob}},
+                  {{"name", "test"}, {"format", "png"}, {"minzoom", "0"}, {"maxzoom", "0"}});
+    const ServeProcess server(dir.file("png.mbtiles"), test_port(0));
+    auto client = server.client();
+
+    const auto first = client.Get("/tiles/0/0/0.png");
+    REQUIRE(first);
+    CHECK(first->status == 200);
+    CHECK(first->body == as_string(blob));
+    const std::string etag = first->get_header_value("ETag");
+    REQUIRE_FALSE(etag.empty());
+
+    const auto revalidated = client.Get("/tiles/0/0/0.png", {{"If-None-Match", etag}});
+    REQUIRE(revalidated);
+    CHECK(revalidated->status == 304);
+    CHECK(revalidated->body.empty());
+
+    const auto weak = client.Get("/tiles/0/0/0.png", {{"If-None-Match", "\"other\", W/" + etag}});
+    REQUIRE(weak);
+    CHECK(weak->status == 304);
+
+    const auto changed = client.Get("/tiles/0/0/0.png", {{"If-None-Match", "\"other\""}});
+    REQUIRE(changed);
+    CHECK(changed->status == 200);
+
+    const auto overflow = client.Get("/tiles/99999999999999999999/0/0.png");
+    REQUIRE(overflow);
+    CHECK(overflow->status == 400);
+
+    const auto outside = client.Get("/tiles/1/2/0.png");
+    REQUIRE(outside);
+    CHECK(outside->status == 404);
+}
+
+TEST_CASE("serve sends gzip tiles by Accept-Encoding and varies on it") {
+    TempDir dir;
+    const std::string body = "vector tile payload";
+    const auto blob = gzip_stored(body);
+    write_archive(dir.file("pbf.mbtiles"), {{0, 0, 0, blob}},
+                  {{"name", "test"}, {"format", "pbf"}, {"minzoom", "0"}, {"maxzoom", "0"}});
+    const ServeProcess server(dir.file("pbf.mbtiles"), test_port(1));
+    auto client = server.client();
+
+    const auto gzip = client.Get("/tiles/0/0/0.pbf", {{"Accept-Encoding", "gzip, br"}});
+    REQUIRE(gzip);
+    CHECK(gzip->status == 200);
+    CHECK(gzip->get_header_value("Content-Encoding") == "gzip");
+    CHECK(gzip->get_header_value("Vary") == "Accept-Encoding");
+    CHECK(gzip->body == as_string(blob));
+
+    const auto identity = client.Get("/tiles/0/0/0.pbf");
+    REQUIRE(identity);
+    CHECK(identity->status == 200);
+    CHECK_FALSE(identity->has_header("Content-Encoding"));
+    CHECK(identity->get_header_value("Vary") == "Accept-Encoding");
+    CHECK(identity->body == body);
+    CHECK(identity->get_header_value("ETag") != gzip->get_header_value("ETag"));
+
+    const auto refused = client.Get("/tiles/0/0/0.pbf", {{"Accept-Encoding", "gzip;q=0"}});
+    REQUIRE(refused);
+    CHECK_FALSE(refused->has_header("Content-Encoding"));
+    CHECK(refused->body == body);
+}
+
+#endif  // _WIN32
@@ -0,0 +1,62 @@
+#include "doctest.h"
+#include "test_support.h"
+
+#include <algorithm>
+
+using namespace mbtiles_test;
+
+namespace {
+
+bool lists(const std::vector<std::string> &keys, const std::string &key) {
+    return std::find(keys.begin(), keys.end(), key) != keys.end();
+}
+
+}  // namespace
+
+TEST_CASE("stats counts tiles and detects stale metadata") {
+    TempDir dir;
+    const auto shared = make_image(1).encodePng();
+    std::vector<TileSpec> tiles = {
+        {1, 0, 0, shared},
+        {1, 0, 1, shared},
+        {1, 1, 0, make_image(2).encodePng()},
+        {1, 1, 1, make_image(3).encodePng()},
+        {2, 0, 0, make_image(4).encodePng()},
+        {2, 3, 3, make_image(5).encodePng()},
+    };
+    std::uint64_t bytes = 0;
+    for (const auto &tile : tiles) {
+        bytes += tile.data.size();
+    }
+    // maxzoom claims 1 while level 2 holds tiles.
+    const std::string path = dir.file("stats.mbtiles");
+    write_archive(path, tiles, {{"name", "test"}, {"format", "png"}, {"minzoom", "1"}, {"maxzoom", "1"}});
+
+    mbtiles::MBTiles archive(path);
+    mbtiles::StatsOptions options;
+    options.threads = 2;
+    const mbtiles::ArchiveStats stats = archive.stats(options);
+
+    CHECK(stats.tiles == 6);
+    CHECK(stats.bytes == bytes);
+    REQUIRE(stats.zooms.size() == 2);
+    CHECK(stats.zooms[0].zoom == 1);
+    CHECK(stats.zooms[0].tiles == 4);
+    CHECK(stats.zooms[1].zoom == 2);
+    CHECK(stats.zooms[1].tiles == 2);
+    CHECK(stats.zooms[1].min_x == 0);
+    CHECK(stats.zooms[1].max_x == 3);
+    REQUIRE(stats.unique_blobs.has_value());
+    CHECK(*stats.unique_blobs == 5);
+    CHECK(stats.duplicate_bytes == shared.size());
+    CHECK(stats.formats.at("png") == 6);
+    CHECK(stats.format_mismatches == 0);
+    CHECK(lists(stats.stale_metadata, "maxzoom"));
+    CHECK_FALSE(lists(stats.stale_metadata, "minzoom"));
+    CHECK(archive.metadata().at("maxzoom") == "1");
+
+    options.update_metadata = true;
+    archive.stats(options);
+    CHECK(archive.metadata().at("maxzoom") == "2");
+    CHECK(archive.stats().stale_metadata.empty());
+}
@@ -0,0 +1,134 @@
+#ifndef MBTILES_TEST_SUPPORT_H
+#define MBTILES_TEST_SUPPORT_H
+
+// Synthetic archives and comparison helpers shared by the test cases.
+
+#include "mbtiles.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+namespace mbtiles_test {
+
+namespace fs = std::filesystem;
+
+// Fresh directory below the system temp directory, removed with everything
+// in it when the object goes out of scope.
+class TempDir {
+  public:
+    TempDir() {
+        std::random_device seed;
+        _path = fs::temp_directory_path() / ("mbtiles-test-" + std::to_string(seed()) + std::to_string(seed()));
+        fs::create_directories(_path);
+    }
+    TempDir(const TempDir &) = delete;
+    TempDir &operator=(const TempDir &) = delete;
+    ~TempDir() {
+        std::error_code ec;
+        fs::remove_all(_path, ec);
+    }
+
+    const fs::path &path() const { return _path; }
+    std::string file(const std::string &name) const { return (_path / name).string(); }
+
+  private:
+    fs::path _path;
+};
+
+// Noisy gradient, so encoders and resamplers see detail rather than a fill.
+// Small tiles keep the encode-heavy cases quick.
+inline mbtiles::RGBAImage make_image(std::uint32_t seed, int size = 64) {
+    mbtiles::RGBAImage image;
+    image.width = size;
+    image.height = size;
+    image.pixels.resize(static_cast<std::size_t>(size) * size * 4);
+    std::minstd_rand rng(seed);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            unsigned char *px = &image.pixels[(static_cast<std::size_t>(y) * size + x) * 4];
+            const unsigned noise = rng() & 31;
+            px[0] = static_cast<unsigned char>((x * 255 / size + seed) & 0xff) ^ noise;
+            px[1] = static_cast<unsigned char>((y * 255 / size + seed * 7) & 0xff) ^ noise;
+            px[2] = static_cast<unsigned char>(((x + y) * 127 / size + seed * 13) & 0xff);
+            px[3] = 255;
+        }
+    }
+    return image;
+}
+
+inline mbtiles::RGBAImage make_solid(unsigned char r, unsigned char g, unsigned char b, unsigned char a,
+                                     int size = 64) {
+    mbtiles::RGBAImage image;
+    image.width = size;
+    image.height = size;
+    image.pixels.resize(static_cast<std::size_t>(size) * size * 4);
+    for (std::size_t i = 0; i < image.pixels.size(); i += 4) {
+        image.pixels[i] = r;
+        image.pixels[i + 1] = g;
+        image.pixels[i + 2] = b;
+        image.pixels[i + 3] = a;
+    }
+    return image;
+}
+
+struct TileSpec {
+    int zoom = 0;
+    int x = 0;
+    int y = 0;  // XYZ
+    std::vector<unsigned char> data;
+};
+
+// Creates the archive at `path` holding `tiles`, then stores `metadata`.
+inline void write_archive(const std::string &path, const std::vector<TileSpec> &tiles,
+                          const std::map<std::string, std::string> &metadata) {
+    fs::remove(path);
+    mbtiles::MBTiles archive(path);
+    mbtiles::TileWriter writer(archive);
+    for (const TileSpec &tile : tiles) {
+        writer.write(tile.zoom, tile.x, tile.y, tile.data);
+    }
+    writer.finish();
+    archive.setMetadata(metadata);
+}
+
+// A PNG archive with every tile of [min_zoom, max_zoom], each its own image.
+inline void write_png_archive(const std::string &path, int min_zoom, int max_zoom, std::uint32_t seed = 1) {
+    std::vector<TileSpec> tiles;
+    for (int z = min_zoom; z <= max_zoom; ++z) {
+        for (int x = 0; x < (1 << z); ++x) {
+            for (int y = 0; y < (1 << z); ++y) {
+                tiles.push_back({z, x, y, make_image(seed++).encodePng()});
+            }
+        }
+    }
+    write_archive(path, tiles,
+                  {{"name", "test"},
+                   {"format", "png"},
+                   {"minzoom", std::to_string(min_zoom)},
+                   {"maxzoom", std::to_string(max_zoom)}});
+}
+
+// Every tile of an archive by XYZ coordinate, for whole-archive comparisons.
+using TileContents = std::map<std::tuple<int, int, int>, std::string>;
+
+inline TileContents read_tiles(const mbtiles::MBTiles &archive) {
+    TileContents tiles;
+    archive.forEachTile([&tiles](const mbtiles::TileView &tile) {
+        tiles[{tile.zoom, tile.x, tile.y}].assign(reinterpret_cast<const char *>(tile.data), tile.size);
+    });
+    return tiles;
+}
+
+inline std::string as_string(const std::vector<unsigned char> &data) {
+    return std::string(data.begin(), data.end());
+}
+
+}  // namespace mbtiles_test
+
+#endif  // MBTILES_TEST_SUPPORT_H